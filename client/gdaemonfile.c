@@ -2575,7 +2575,6 @@ set_metadata_attribute (GFile *file,
   MetaTree *tree;
   int appended;
   gboolean res;
-  GVfsMetadata *proxy;
   GVariantBuilder *builder;
 
   daemon_file = G_DAEMON_FILE (file);
@@ -2584,46 +2583,37 @@ set_metadata_attribute (GFile *file,
   tree = meta_tree_lookup_by_name (treename, FALSE);
   g_free (treename);
   
-  res = FALSE;
-  proxy = _g_daemon_vfs_get_metadata_proxy (cancellable, error);
-
-  if (proxy)
-    {
-      builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
 
-      metatreefile = meta_tree_get_filename (tree);
+  metatreefile = meta_tree_get_filename (tree);
 
-      appended = _g_daemon_vfs_append_metadata_for_set (builder,
-                                                        tree,
-                                                        daemon_file->path,
-                                                        attribute,
-                                                        type,
-                                                        value);
-    
-      res = TRUE;
-      if (appended == -1)
-        {
-          res = FALSE;
-          g_set_error (error, G_IO_ERROR,
-                       G_IO_ERROR_INVALID_ARGUMENT,
-                       _("Error setting file metadata: %s"),
-                       _("values must be string or list of strings"));
-        }
-      else if (appended > 0 &&
-               !gvfs_metadata_call_set_sync (proxy,
-                                             metatreefile,
-                                             daemon_file->path,
-                                             g_variant_builder_end (builder),
-                                             cancellable,
-                                             error))
-        res = FALSE;
+  appended = _g_daemon_vfs_append_metadata_for_set (builder,
+                                                    tree,
+                                                    daemon_file->path,
+                                                    attribute,
+                                                    type,
+                                                    value);
 
-      g_variant_builder_unref (builder);
+  res = TRUE;
+  if (appended == -1)
+    {
+      res = FALSE;
+      g_set_error (error, G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   _("Error setting file metadata: %s"),
+                   _("values must be string or list of strings"));
     }
+  else if (appended > 0 &&
+           !_g_daemon_vfs_set_metadata (metatreefile,
+                                        daemon_file->path,
+                                        g_variant_builder_end (builder),
+                                        cancellable,
+                                        error))
+    res = FALSE;
+
+  g_variant_builder_unref (builder);
 
   meta_tree_unref (tree);
-  if (error && *error)
-    g_dbus_error_strip_remote_error (*error);
 
   return res;
 }
@@ -3621,8 +3611,74 @@ g_daemon_file_set_display_name_finish (GFile                      *file,
   return new_file;
 }
 
-#if 0
+typedef struct {
+  GFileInfo *info;
+  GFileQueryInfoFlags flags;
+  char **attributes;
+  GError *error;
+} AsyncCallSetAttributes;
+
+static void
+async_call_set_attributes_free (AsyncCallSetAttributes *data)
+{
+  g_object_unref (data->info);
+  g_strfreev (data->attributes);
+  g_clear_error (&data->error);
+  g_free (data);
+}
 
+static void
+set_attributes_async_thread (GSimpleAsyncResult *result,
+                             GObject *object,
+                             GCancellable *cancellable)
+{
+  AsyncCallSetAttributes *data;
+  GError *error;
+
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  error = NULL;
+  if (!g_file_set_attributes (G_FILE (object), data->info, data->flags,
+                              cancellable, &error))
+    g_simple_async_result_take_error (result, error);
+}
+
+static void
+set_attributes_async_metadata_cb (GObject *source_object,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
+{
+  GSimpleAsyncResult *result = user_data;
+  AsyncCallSetAttributes *data;
+  GError *error;
+  int i;
+
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  error = NULL;
+  if (!_g_daemon_vfs_set_metadata_finish (res, &error))
+    {
+      if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+      for (i = 0; data->attributes[i] != NULL; i++)
+        g_file_info_set_attribute_status (data->info, data->attributes[i],
+                                          G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+    }
+
+  if (data->error)
+    g_simple_async_result_set_from_error (result, data->error);
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+}
+
+/* Metadata keys go through the metadata writer thread, so many
+ * outstanding calls cost no thread each and end up batched into
+ * SetMany calls. Anything else is set from a thread, like the default
+ * implementation does.
+ */
 static void
 g_daemon_file_set_attributes_async (GFile                      *file,
                                     GFileInfo                  *info,
@@ -3632,7 +3688,95 @@ g_daemon_file_set_attributes_async (GFile                      *file,
                                     GAsyncReadyCallback         callback,
                                     gpointer                    user_data)
 {
-  /* TODO */
+  GDaemonFile *daemon_file;
+  AsyncCallSetAttributes *data;
+  GSimpleAsyncResult *result;
+  GFileAttributeType type;
+  GVariantBuilder *builder;
+  gpointer value;
+  char *treename;
+  MetaTree *tree;
+  int appended, num_set, i;
+
+  daemon_file = G_DAEMON_FILE (file);
+
+  data = g_new0 (AsyncCallSetAttributes, 1);
+  data->info = g_file_info_dup (info);
+  data->flags = flags;
+  data->attributes = g_file_info_list_attributes (info, NULL);
+
+  result = g_simple_async_result_new (G_OBJECT (file),
+                                      callback, user_data,
+                                      g_daemon_file_set_attributes_async);
+  g_simple_async_result_set_op_res_gpointer (result, data,
+                                             (GDestroyNotify) async_call_set_attributes_free);
+
+  for (i = 0; data->attributes[i] != NULL; i++)
+    if (!g_str_has_prefix (data->attributes[i], "metadata::"))
+      break;
+
+  if (i == 0 || data->attributes[i] != NULL)
+    {
+      g_simple_async_result_run_in_thread (result, set_attributes_async_thread,
+                                           io_priority, cancellable);
+      g_object_unref (result);
+      return;
+    }
+
+  g_simple_async_result_set_check_cancellable (result, cancellable);
+
+  treename = g_mount_spec_to_string (daemon_file->mount_spec);
+  tree = meta_tree_lookup_by_name (treename, FALSE);
+  g_free (treename);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+  num_set = 0;
+  for (i = 0; data->attributes[i] != NULL; i++)
+    {
+      if (!g_file_info_get_attribute_data (info, data->attributes[i], &type, &value, NULL))
+        continue;
+
+      appended = _g_daemon_vfs_append_metadata_for_set (builder,
+                                                        tree,
+                                                        daemon_file->path,
+                                                        data->attributes[i],
+                                                        type,
+                                                        value);
+      if (appended != -1)
+        {
+          num_set += appended;
+          g_file_info_set_attribute_status (data->info, data->attributes[i],
+                                            G_FILE_ATTRIBUTE_STATUS_SET);
+        }
+      else
+        {
+          if (data->error == NULL)
+            g_set_error (&data->error, G_IO_ERROR,
+                         G_IO_ERROR_INVALID_ARGUMENT,
+                         _("Error setting file metadata: %s"),
+                         _("values must be string or list of strings"));
+          g_file_info_set_attribute_status (data->info, data->attributes[i],
+                                            G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+        }
+    }
+
+  if (num_set > 0)
+    _g_daemon_vfs_set_metadata_async (meta_tree_get_filename (tree),
+                                      daemon_file->path,
+                                      g_variant_builder_end (builder),
+                                      cancellable,
+                                      set_attributes_async_metadata_cb,
+                                      result);
+  else
+    {
+      if (data->error)
+        g_simple_async_result_set_from_error (result, data->error);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+    }
+
+  g_variant_builder_unref (builder);
+  meta_tree_unref (tree);
 }
 
 static gboolean
@@ -3641,10 +3785,18 @@ g_daemon_file_set_attributes_finish (GFile                      *file,
                                      GFileInfo                 **info,
                                      GError                    **error)
 {
-  /* TODO */
-}
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  AsyncCallSetAttributes *data;
 
-#endif
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  if (info)
+    *info = g_object_ref (data->info);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+
+  return TRUE;
+}
 
 static void
 g_daemon_file_file_iface_init (GFileIface *iface)
@@ -3723,8 +3875,6 @@ g_daemon_file_file_iface_init (GFileIface *iface)
   iface->replace_finish = g_daemon_file_replace_finish;
   iface->set_display_name_async = g_daemon_file_set_display_name_async;
   iface->set_display_name_finish = g_daemon_file_set_display_name_finish;
-#if 0
   iface->set_attributes_async = g_daemon_file_set_attributes_async;
   iface->set_attributes_finish = g_daemon_file_set_attributes_finish;
-#endif
 }
@@ -63,6 +63,7 @@
 #include "gvfsdaemondbus.h"
 #include <gvfsdaemonprotocol.h>
 #include <gvfsfileinfo.h>
+#include <gvfspreadable.h>
 
 #define MAX_READ_SIZE (4*1024*1024)
 
@@ -129,6 +130,46 @@ typedef struct {
   guint32 seq_nr;
 } SeekOperation;
 
+typedef enum {
+  PREAD_STATE_INIT = 0,
+  PREAD_STATE_WROTE_REQUEST,
+  PREAD_STATE_HANDLE_INPUT,
+  PREAD_STATE_HANDLE_INPUT_BLOCK,
+  PREAD_STATE_SKIP_BLOCK,
+  PREAD_STATE_HANDLE_HEADER,
+  PREAD_STATE_READ_BLOCK
+} PreadState;
+
+/* One extent of a pread_v request */
+typedef struct {
+  goffset offset;
+  char *buffer;
+  guint32 size;
+  guint32 got;
+} PreadChunk;
+
+typedef struct {
+  PreadState state;
+
+  /* Input */
+  PreadChunk *chunks;
+  guint n_chunks;
+  goffset restore_offset;
+  /* Output, the got fields of the chunks */
+  GError *ret_error;
+  gboolean restore_failed;
+
+  /* Replies with our seq_nr seen so far, and the chunk the
+     current data block is for, or -1 */
+  guint n_replies;
+  int block_chunk;
+  
+  gboolean sent_cancel;
+  gboolean sent_request;
+  
+  guint32 seq_nr;
+} PreadOperation;
+
 typedef enum {
   CLOSE_STATE_INIT = 0,
   CLOSE_STATE_WROTE_REQUEST,
@@ -205,6 +246,10 @@ struct _GDaemonFileInputStream {
   GOutputStream *command_stream;
   GInputStream *data_stream;
   guint can_seek : 1;
+
+  /* The file itself, if the daemon passed it. Reads and seeks then
+     bypass the channel, see receive_file_fd */
+  int file_fd;
   
   int seek_generation;
   guint32 seq_nr;
@@ -279,11 +324,14 @@ static void       g_daemon_file_input_stream_query_info_async  (GFileInputStream
 static GFileInfo *g_daemon_file_input_stream_query_info_finish (GFileInputStream     *stream,
 								GAsyncResult         *result,
 								GError              **error);
+static void       g_daemon_file_input_stream_preadable_iface_init (GVfsPreadableIface *iface);
 
 
 
-G_DEFINE_TYPE (GDaemonFileInputStream, g_daemon_file_input_stream,
-	       G_TYPE_FILE_INPUT_STREAM)
+G_DEFINE_TYPE_WITH_CODE (GDaemonFileInputStream, g_daemon_file_input_stream,
+			 G_TYPE_FILE_INPUT_STREAM,
+			 G_IMPLEMENT_INTERFACE (G_VFS_TYPE_PREADABLE,
+						g_daemon_file_input_stream_preadable_iface_init))
 
 static void
 pre_read_free (PreRead *pre)
@@ -314,6 +362,8 @@ g_daemon_file_input_stream_finalize (GObject *object)
     g_object_unref (file->command_stream);
   if (file->data_stream)
     g_object_unref (file->data_stream);
+  if (file->file_fd != -1)
+    close (file->file_fd);
 
   while (file->pre_reads)
     {
@@ -368,6 +418,66 @@ g_daemon_file_input_stream_init (GDaemonFileInputStream *info)
   info->output_buffer = g_string_new ("");
   info->input_buffer = g_string_new ("");
   info->seq_nr = 1;
+  info->file_fd = -1;
+}
+
+/* Daemons that can give out the file queue a REPLY_FD message on the
+   channel before replying to the open call, so if it is not there
+   already it never will be. */
+static void
+receive_file_fd (GDaemonFileInputStream *file,
+		 int                     socket_fd)
+{
+  GVfsDaemonSocketProtocolReply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control;
+  ssize_t res;
+  int fd;
+
+  do
+    res = recv (socket_fd, &reply, G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE,
+		MSG_PEEK | MSG_DONTWAIT);
+  while (res == -1 && errno == EINTR);
+
+  if (res != G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE ||
+      g_ntohl (reply.type) != G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_FD)
+    return;
+
+  iov.iov_base = &reply;
+  iov.iov_len = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  do
+    res = recvmsg (socket_fd, &msg, MSG_DONTWAIT);
+  while (res == -1 && errno == EINTR);
+
+  if (res != G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE)
+    return;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+	  cmsg->cmsg_type == SCM_RIGHTS &&
+	  cmsg->cmsg_len >= CMSG_LEN (sizeof (int)))
+	{
+	  memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+	  fcntl (fd, F_SETFD, FD_CLOEXEC);
+	  if (file->file_fd == -1)
+	    file->file_fd = fd;
+	  else
+	    close (fd);
+	}
+    }
 }
 
 GFileInputStream *
@@ -381,6 +491,8 @@ g_daemon_file_input_stream_new (int fd,
   stream->command_stream = g_unix_output_stream_new (fd, FALSE);
   stream->data_stream = g_unix_input_stream_new (fd, TRUE);
   stream->can_seek = can_seek;
+
+  receive_file_fd (stream, fd);
   
   return G_FILE_INPUT_STREAM (stream);
 }
@@ -808,6 +920,32 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
     }
 }
 
+static gssize
+read_file_fd (GDaemonFileInputStream *file,
+	      void                   *buffer,
+	      gsize                   count,
+	      GError                **error)
+{
+  gssize res;
+  int errsv;
+
+  do
+    res = pread (file->file_fd, buffer, count, file->current_offset);
+  while (res == -1 && errno == EINTR);
+
+  if (res == -1)
+    {
+      errsv = errno;
+      g_set_error_literal (error, G_IO_ERROR,
+			   g_io_error_from_errno (errsv),
+			   g_strerror (errsv));
+      return -1;
+    }
+
+  file->current_offset += res;
+  return res;
+}
+
 static gssize
 g_daemon_file_input_stream_read (GInputStream *stream,
 				 void         *buffer,
@@ -827,6 +965,9 @@ g_daemon_file_input_stream_read (GInputStream *stream,
   if (count > MAX_READ_SIZE)
     count = MAX_READ_SIZE;
 
+  if (file->file_fd != -1)
+    return read_file_fd (file, buffer, count, error);
+
   memset (&op, 0, sizeof (op));
   op.state = READ_STATE_INIT;
   op.buffer = buffer;
@@ -1059,6 +1200,12 @@ g_daemon_file_input_stream_close (GInputStream *stream,
 
   file = G_DAEMON_FILE_INPUT_STREAM (stream);
 
+  if (file->file_fd != -1)
+    {
+      close (file->file_fd);
+      file->file_fd = -1;
+    }
+
   /* We need to do a full roundtrip to guarantee that the writes have
      reached the disk. */
 
@@ -1312,6 +1459,49 @@ iterate_seek_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
     }
 }
 
+/* The daemon side never reads when the client has the file, so
+   its position does not need to be kept in sync */
+static gboolean
+seek_file_fd (GDaemonFileInputStream *file,
+	      goffset                 offset,
+	      GSeekType               type,
+	      GError                **error)
+{
+  struct stat statbuf;
+  int errsv;
+
+  switch (type)
+    {
+    case G_SEEK_CUR:
+      offset += file->current_offset;
+      break;
+    case G_SEEK_END:
+      if (fstat (file->file_fd, &statbuf) == -1)
+	{
+	  errsv = errno;
+	  g_set_error_literal (error, G_IO_ERROR,
+			       g_io_error_from_errno (errsv),
+			       g_strerror (errsv));
+	  return FALSE;
+	}
+      offset += statbuf.st_size;
+      break;
+    default:
+      break;
+    }
+
+  if (offset < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR,
+			   G_IO_ERROR_INVALID_ARGUMENT,
+			   g_strerror (EINVAL));
+      return FALSE;
+    }
+
+  file->current_offset = offset;
+  return TRUE;
+}
+
 static gboolean
 g_daemon_file_input_stream_seek (GFileInputStream *stream,
 				 goffset offset,
@@ -1333,6 +1523,9 @@ g_daemon_file_input_stream_seek (GFileInputStream *stream,
   
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
+
+  if (file->file_fd != -1)
+    return seek_file_fd (file, offset, type, error);
   
   memset (&op, 0, sizeof (op));
   op.state = SEEK_STATE_INIT;
@@ -1351,6 +1544,502 @@ g_daemon_file_input_stream_seek (GFileInputStream *stream,
   return op.ret_val;
 }
 
+/* Counts a reply to the pread_v request, returns TRUE after the
+   last one */
+static gboolean
+pread_got_reply (PreadOperation *op)
+{
+  op->n_replies++;
+  return op->n_replies == 2 * op->n_chunks + 1;
+}
+
+/* pread_v cycle:
+
+   send the request with all extents and bump the seek generation
+   read replies, skipping data blocks of other requests
+   our replies come in order: a seek and a read per extent, then the
+    seek back to where the stream was
+   on cancel, send cancel command and keep going until all replies
+    are in, there is always one for each part of the request
+ */
+
+static StateOp
+iterate_pread_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op, PreadOperation *op)
+{
+  PreadChunk *chunk;
+  gsize len;
+  guint32 extent[3];
+  guint i;
+
+  while (TRUE)
+    {
+      switch (op->state)
+	{
+	  /* Initial state for pread op */
+	case PREAD_STATE_INIT:
+	  append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_PREAD_V,
+			  op->restore_offset & 0xffffffff,
+			  op->restore_offset >> 32,
+			  op->n_chunks * G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_EXTENT_SIZE,
+			  &op->seq_nr);
+	  for (i = 0; i < op->n_chunks; i++)
+	    {
+	      extent[0] = g_htonl (op->chunks[i].offset & 0xffffffff);
+	      extent[1] = g_htonl (op->chunks[i].offset >> 32);
+	      extent[2] = g_htonl (op->chunks[i].size);
+	      g_string_append_len (file->output_buffer,
+				   (char *)extent, sizeof (extent));
+	    }
+	  
+	  op->block_chunk = -1;
+	  op->state = PREAD_STATE_WROTE_REQUEST;
+	  io_op->io_buffer = file->output_buffer->str;
+	  io_op->io_size = file->output_buffer->len;
+	  io_op->io_allow_cancel = TRUE; /* Allow cancel before first byte of request sent */
+	  return STATE_OP_WRITE;
+
+	  /* wrote parts of output_buffer */
+	case PREAD_STATE_WROTE_REQUEST:
+	  if (io_op->io_cancelled)
+	    {
+	      g_set_error_literal (&op->ret_error,
+				   G_IO_ERROR,
+				   G_IO_ERROR_CANCELLED,
+				   _("Operation was cancelled"));
+	      return STATE_OP_DONE;
+	    }
+
+	  /* The request seeks on the daemon side, so earlier data is stale
+	   * just like after a seek */
+	  if (!op->sent_request)
+	    {
+	      file->seek_generation++;
+	      while (file->pre_reads)
+		{
+		  PreRead *pre = file->pre_reads->data;
+		  file->pre_reads = g_list_delete_link (file->pre_reads,
+							file->pre_reads);
+		  pre_read_free (pre);
+		}
+	    }
+	  op->sent_request = TRUE;
+	  
+	  if (io_op->io_res < file->output_buffer->len)
+	    {
+	      g_string_remove_in_front (file->output_buffer,
+					io_op->io_res);
+	      io_op->io_buffer = file->output_buffer->str;
+	      io_op->io_size = file->output_buffer->len;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+	  g_string_truncate (file->output_buffer, 0);
+
+	  op->state = PREAD_STATE_HANDLE_INPUT;
+	  break;
+
+	  /* No op */
+	case PREAD_STATE_HANDLE_INPUT:
+	  if (io_op->cancelled && !op->sent_cancel)
+	    {
+	      op->sent_cancel = TRUE;
+	      append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_CANCEL,
+			      op->seq_nr, 0, 0, NULL);
+	      op->state = PREAD_STATE_WROTE_REQUEST;
+	      io_op->io_buffer = file->output_buffer->str;
+	      io_op->io_size = file->output_buffer->len;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+	  
+	  if (file->input_state == INPUT_STATE_IN_BLOCK)
+	    {
+	      op->state = PREAD_STATE_HANDLE_INPUT_BLOCK;
+	      break;
+	    }
+	  else if (file->input_state == INPUT_STATE_IN_REPLY_HEADER)
+	    {
+	      op->state = PREAD_STATE_HANDLE_HEADER;
+	      break;
+	    }
+	  g_assert_not_reached ();
+	  break;
+
+	  /* No op */
+	case PREAD_STATE_HANDLE_INPUT_BLOCK:
+	  g_assert (file->input_state == INPUT_STATE_IN_BLOCK);
+
+	  if (op->block_chunk != -1)
+	    {
+	      chunk = &op->chunks[op->block_chunk];
+	      len = MIN (file->input_block_size, chunk->size - chunk->got);
+	      if (len > 0)
+		{
+		  op->state = PREAD_STATE_READ_BLOCK;
+		  io_op->io_buffer = chunk->buffer + chunk->got;
+		  io_op->io_size = len;
+		  io_op->io_allow_cancel = !op->sent_cancel;
+		  return STATE_OP_READ;
+		}
+	    }
+	  
+	  op->state = PREAD_STATE_SKIP_BLOCK;
+	  io_op->io_buffer = NULL;
+	  io_op->io_size = file->input_block_size;
+	  io_op->io_allow_cancel = !op->sent_cancel;
+	  return STATE_OP_SKIP;
+
+	  /* Skipped block data */
+	case PREAD_STATE_SKIP_BLOCK:
+	  if (io_op->io_cancelled)
+	    {
+	      op->state = PREAD_STATE_HANDLE_INPUT;
+	      break;
+	    }
+	  
+	  g_assert (io_op->io_res <= file->input_block_size);
+	  file->input_block_size -= io_op->io_res;
+	  
+	  if (file->input_block_size == 0)
+	    {
+	      file->input_state = INPUT_STATE_IN_REPLY_HEADER;
+	      if (op->block_chunk != -1)
+		{
+		  op->block_chunk = -1;
+		  if (pread_got_reply (op))
+		    return STATE_OP_DONE;
+		}
+	    }
+	  
+	  op->state = PREAD_STATE_HANDLE_INPUT;
+	  break;
+	  
+	  /* read header data, (or manual io_len/res = 0) */
+	case PREAD_STATE_HANDLE_HEADER:
+	  if (io_op->io_cancelled)
+	    {
+	      op->state = PREAD_STATE_HANDLE_INPUT;
+	      break;
+	    }
+
+	  if (io_op->io_res > 0)
+	    {
+	      gsize unread_size = io_op->io_size - io_op->io_res;
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - unread_size);
+	    }
+	  
+	  len = get_reply_header_missing_bytes (file->input_buffer);
+	  if (len > 0)
+	    {
+	      gsize current_len = file->input_buffer->len;
+	      g_string_set_size (file->input_buffer,
+				 current_len + len);
+	      io_op->io_buffer = file->input_buffer->str + current_len;
+	      io_op->io_size = len;
+	      io_op->io_allow_cancel = file->input_buffer->len == 0 && !op->sent_cancel;
+	      return STATE_OP_READ;
+	    }
+
+	  /* Got full header */
+
+	  {
+	    GVfsDaemonSocketProtocolReply reply;
+	    char *data;
+	    data = decode_reply (file->input_buffer, &reply);
+
+	    if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA)
+	      {
+		g_string_truncate (file->input_buffer, 0);
+		file->input_state = INPUT_STATE_IN_BLOCK;
+		file->input_block_size = reply.arg1;
+		file->input_block_seek_generation = reply.arg2;
+
+		/* Reads are the odd replies, after the seek for the chunk */
+		if (reply.seq_nr == op->seq_nr)
+		  op->block_chunk = op->n_replies / 2;
+
+		if (file->input_block_size == 0 && op->block_chunk != -1)
+		  {
+		    /* Nothing to read, at the end of the file */
+		    file->input_state = INPUT_STATE_IN_REPLY_HEADER;
+		    op->block_chunk = -1;
+		    if (pread_got_reply (op))
+		      return STATE_OP_DONE;
+		    op->state = PREAD_STATE_HANDLE_INPUT;
+		    break;
+		  }
+		
+		op->state = PREAD_STATE_HANDLE_INPUT_BLOCK;
+		break;
+	      }
+	    else if (reply.seq_nr == op->seq_nr &&
+		     (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR ||
+		      reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SEEK_POS))
+	      {
+		if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR)
+		  {
+		    if (op->n_replies == 2 * op->n_chunks)
+		      op->restore_failed = TRUE;
+		    else if (op->ret_error == NULL)
+		      decode_error (&reply, data, &op->ret_error);
+		  }
+		
+		g_string_truncate (file->input_buffer, 0);
+		if (pread_got_reply (op))
+		  return STATE_OP_DONE;
+		op->state = PREAD_STATE_HANDLE_INPUT;
+		break;
+	      }
+	    /* Ignore other reply types */
+	  }
+
+	  g_string_truncate (file->input_buffer, 0);
+	  
+	  /* This wasn't interesting, read next reply */
+	  op->state = PREAD_STATE_HANDLE_HEADER;
+	  break;
+
+	  /* Read block data */
+	case PREAD_STATE_READ_BLOCK:
+	  if (io_op->io_cancelled)
+	    {
+	      op->state = PREAD_STATE_HANDLE_INPUT;
+	      break;
+	    }
+
+	  g_assert (io_op->io_res <= file->input_block_size);
+	  file->input_block_size -= io_op->io_res;
+	  op->chunks[op->block_chunk].got += io_op->io_res;
+	  
+	  if (file->input_block_size == 0)
+	    {
+	      file->input_state = INPUT_STATE_IN_REPLY_HEADER;
+	      op->block_chunk = -1;
+	      if (pread_got_reply (op))
+		return STATE_OP_DONE;
+	    }
+	  
+	  op->state = PREAD_STATE_HANDLE_INPUT;
+	  break;
+
+	default:
+	  g_assert_not_reached ();
+	}
+      
+      /* Clear io_op between non-op state switches */
+      io_op->io_size = 0;
+      io_op->io_res = 0;
+      io_op->io_cancelled = FALSE;
+    }
+}
+
+static gboolean
+preadv_file_fd (GDaemonFileInputStream        *file,
+		GVfsPreadableExtent           *extents,
+		guint                          n_extents,
+		GError                       **error)
+{
+  GVfsPreadableExtent *extent;
+  gssize res;
+  guint i;
+  int errsv;
+
+  for (i = 0; i < n_extents; i++)
+    {
+      extent = &extents[i];
+      while (extent->bytes_read < extent->count)
+	{
+	  do
+	    res = pread (file->file_fd,
+			 (char *)extent->buffer + extent->bytes_read,
+			 extent->count - extent->bytes_read,
+			 extent->offset + extent->bytes_read);
+	  while (res == -1 && errno == EINTR);
+
+	  if (res == -1)
+	    {
+	      errsv = errno;
+	      g_set_error_literal (error, G_IO_ERROR,
+				   g_io_error_from_errno (errsv),
+				   g_strerror (errsv));
+	      return FALSE;
+	    }
+	  if (res == 0)
+	    break;
+	  
+	  extent->bytes_read += res;
+	}
+    }
+
+  return TRUE;
+}
+
+/* Sends one pread_v request for as many of the unfinished extents
+   as fit into it. Returns FALSE on error, with *done set when all
+   extents are finished. */
+static gboolean
+preadv_batch (GDaemonFileInputStream        *file,
+	      GVfsPreadableExtent           *extents,
+	      guint                          n_extents,
+	      gboolean                      *at_eof,
+	      gboolean                      *done,
+	      GCancellable                  *cancellable,
+	      GError                       **error)
+{
+  PreadChunk chunks[G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS];
+  guint owners[G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS];
+  PreadOperation op;
+  SeekOperation seek_op;
+  gsize pos;
+  guint i, n_chunks;
+  int stopped;
+
+  n_chunks = 0;
+  for (i = 0; i < n_extents &&
+	 n_chunks < G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS; i++)
+    {
+      if (at_eof[i])
+	continue;
+      
+      for (pos = extents[i].bytes_read;
+	   pos < extents[i].count &&
+	     n_chunks < G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS;
+	   pos += chunks[n_chunks++].size)
+	{
+	  chunks[n_chunks].offset = extents[i].offset + pos;
+	  chunks[n_chunks].buffer = (char *)extents[i].buffer + pos;
+	  chunks[n_chunks].size = MIN (extents[i].count - pos,
+				       G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_SIZE);
+	  chunks[n_chunks].got = 0;
+	  owners[n_chunks] = i;
+	}
+    }
+
+  *done = n_chunks == 0;
+  if (*done)
+    return TRUE;
+
+  memset (&op, 0, sizeof (op));
+  op.state = PREAD_STATE_INIT;
+  op.chunks = chunks;
+  op.n_chunks = n_chunks;
+  op.restore_offset = file->current_offset;
+  
+  if (!run_sync_state_machine (file, (state_machine_iterator)iterate_pread_state_machine,
+			       &op, cancellable, error))
+    {
+      g_clear_error (&op.ret_error);
+      return FALSE; /* IO Error */
+    }
+
+  if (op.restore_failed)
+    {
+      /* Don't leave the daemon side somewhere else than the stream */
+      memset (&seek_op, 0, sizeof (seek_op));
+      seek_op.state = SEEK_STATE_INIT;
+      seek_op.offset = file->current_offset;
+      seek_op.seek_type = G_SEEK_SET;
+      
+      if (!run_sync_state_machine (file, (state_machine_iterator)iterate_seek_state_machine,
+				   &seek_op, NULL, error))
+	{
+	  g_clear_error (&op.ret_error);
+	  return FALSE;
+	}
+      
+      if (!seek_op.ret_val && op.ret_error == NULL)
+	op.ret_error = seek_op.ret_error;
+      else
+	g_clear_error (&seek_op.ret_error);
+    }
+
+  if (op.ret_error != NULL)
+    {
+      g_propagate_error (error, op.ret_error);
+      return FALSE;
+    }
+
+  /* Data after a short chunk of an extent leaves a hole, so it is
+     not counted and asked for again */
+  stopped = -1;
+  for (i = 0; i < n_chunks; i++)
+    {
+      if ((int)owners[i] == stopped)
+	continue;
+      
+      extents[owners[i]].bytes_read += chunks[i].got;
+      if (chunks[i].got < chunks[i].size)
+	{
+	  stopped = owners[i];
+	  if (chunks[i].got == 0)
+	    at_eof[owners[i]] = TRUE;
+	}
+    }
+
+  return TRUE;
+}
+
+/* Implements g_vfs_preadable_preadv(). The extents go to the daemon
+   in as few pread_v requests as possible instead of a seek and read
+   round trip for each. */
+static gboolean
+g_daemon_file_input_stream_preadv (GVfsPreadable        *preadable,
+				   GVfsPreadableExtent  *extents,
+				   guint                 n_extents,
+				   GCancellable         *cancellable,
+				   GError              **error)
+{
+  GDaemonFileInputStream *file;
+  gboolean *at_eof;
+  gboolean done, res;
+  guint i;
+
+  file = G_DAEMON_FILE_INPUT_STREAM (preadable);
+
+  for (i = 0; i < n_extents; i++)
+    extents[i].bytes_read = 0;
+  
+  if (!file->can_seek)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			   _("Seek not supported on stream"));
+      return FALSE;
+    }
+
+  if (!g_input_stream_set_pending (G_INPUT_STREAM (file), error))
+    return FALSE;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_input_stream_clear_pending (G_INPUT_STREAM (file));
+      return FALSE;
+    }
+
+  if (file->file_fd != -1)
+    {
+      res = preadv_file_fd (file, extents, n_extents, error);
+      g_input_stream_clear_pending (G_INPUT_STREAM (file));
+      return res;
+    }
+
+  at_eof = g_new0 (gboolean, n_extents);
+  do
+    res = preadv_batch (file, extents, n_extents, at_eof, &done,
+			cancellable, error);
+  while (res && !done);
+  g_free (at_eof);
+  
+  g_input_stream_clear_pending (G_INPUT_STREAM (file));
+  return res;
+}
+
+static void
+g_daemon_file_input_stream_preadable_iface_init (GVfsPreadableIface *iface)
+{
+  iface->preadv = g_daemon_file_input_stream_preadv;
+}
+
 static StateOp
 iterate_query_state_machine (GDaemonFileInputStream *file,
 			     IOOperationData *io_op,
@@ -1888,6 +2577,30 @@ g_daemon_file_input_stream_read_async  (GInputStream        *stream,
   if (count > MAX_READ_SIZE)
     count = MAX_READ_SIZE;
 
+  if (file->file_fd != -1)
+    {
+      GSimpleAsyncResult *simple;
+      GError *error = NULL;
+      gssize res;
+
+      simple = g_simple_async_result_new (G_OBJECT (stream),
+					  callback, user_data,
+					  g_daemon_file_input_stream_read_async);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, &error))
+	res = -1;
+      else
+	res = read_file_fd (file, buffer, count, &error);
+
+      g_simple_async_result_set_op_res_gssize (simple, res);
+      if (res == -1)
+	g_simple_async_result_take_error (simple, error);
+
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+      return;
+    }
+
   op = g_new0 (ReadOperation, 1);
   op->state = READ_STATE_INIT;
   op->buffer = buffer;
@@ -2006,6 +2719,12 @@ g_daemon_file_input_stream_close_async (GInputStream       *stream,
   CloseOperation *op;
 
   file = G_DAEMON_FILE_INPUT_STREAM (stream);
+
+  if (file->file_fd != -1)
+    {
+      close (file->file_fd);
+      file->file_fd = -1;
+    }
   
   op = g_new0 (CloseOperation, 1);
   op->state = CLOSE_STATE_INIT;
@@ -44,6 +44,17 @@
 
 #define MAX_WRITE_SIZE (4*1024*1024)
 
+/* Write-behind: small writes are collected in a buffer of this size
+   (GVFS_WRITE_BUFFER_SIZE overrides it, 0 turns it off), which grows
+   up to WRITE_BUFFER_GROWTH times that for streaming writes. Data is
+   sent when the buffer is full, older than WRITE_BUFFER_MAX_AGE or on
+   flush, seek, query_info and close. */
+#define DEFAULT_WRITE_BUFFER_SIZE (64*1024)
+#define WRITE_BUFFER_GROWTH 16
+#define WRITE_BUFFER_MAX_AGE (200 * 1000)
+/* WRITE requests sent before waiting for their WRITTEN reply */
+#define MAX_PENDING_WRITES 4
+
 typedef enum {
   STATE_OP_DONE,
   STATE_OP_READ,
@@ -75,6 +86,40 @@ typedef struct {
   guint32 seq_nr;
 } WriteOperation;
 
+typedef enum {
+  FLUSH_STATE_INIT = 0,
+  FLUSH_STATE_WROTE_REQUEST,
+  FLUSH_STATE_SEND_DATA,
+  FLUSH_STATE_HANDLE_INPUT
+} FlushState;
+
+/* A WRITE request that was sent but not acknowledged yet. The data is
+   kept so that it can be sent again after a short write. */
+typedef struct {
+  guint32 seq_nr;
+  goffset offset;
+  char *data;
+  gsize size;
+  /* Being sent again, ignore the reply */
+  gboolean stale;
+} PendingWrite;
+
+typedef struct {
+  FlushState state;
+
+  /* Input */
+  gboolean wait_all;
+  
+  /* Output */
+  GError *ret_error;
+
+  PendingWrite *sending;
+  gsize data_pos;
+  gboolean waiting_for_seek;
+  
+  guint32 seek_seq_nr;
+} FlushOperation;
+
 typedef enum {
   SEEK_STATE_INIT = 0,
   SEEK_STATE_WROTE_REQUEST,
@@ -168,7 +213,20 @@ struct _GDaemonFileOutputStream {
   GString *output_buffer;
 
   char *etag;
-  
+
+  /* Write-behind, off when write_buffer_base is 0. write_offset is
+     where the next WRITE request lands, current_offset includes the
+     buffered data. */
+  GString *write_buffer;
+  gsize write_buffer_base;
+  gsize write_buffer_size;
+  gint64 write_buffer_time;
+  GQueue *pending_writes;
+  goffset write_offset;
+  gboolean resync_pending;
+  /* First error of a write that was already reported as done,
+     returned by all later calls */
+  GError *write_error;
 };
 
 static gssize     g_daemon_file_output_stream_write             (GOutputStream        *stream,
@@ -179,6 +237,9 @@ static gssize     g_daemon_file_output_stream_write             (GOutputStream
 static gboolean   g_daemon_file_output_stream_close             (GOutputStream        *stream,
 								 GCancellable         *cancellable,
 								 GError              **error);
+static gboolean   g_daemon_file_output_stream_flush             (GOutputStream        *stream,
+								 GCancellable         *cancellable,
+								 GError              **error);
 static GFileInfo *g_daemon_file_output_stream_query_info        (GFileOutputStream    *stream,
 								 const char           *attributes,
 								 GCancellable         *cancellable,
@@ -201,6 +262,14 @@ static void       g_daemon_file_output_stream_write_async       (GOutputStream
 static gssize     g_daemon_file_output_stream_write_finish      (GOutputStream        *stream,
 								 GAsyncResult         *result,
 								 GError              **error);
+static void       g_daemon_file_output_stream_flush_async       (GOutputStream        *stream,
+								 int                   io_priority,
+								 GCancellable         *cancellable,
+								 GAsyncReadyCallback   callback,
+								 gpointer              data);
+static gboolean   g_daemon_file_output_stream_flush_finish      (GOutputStream        *stream,
+								 GAsyncResult         *result,
+								 GError              **error);
 static void       g_daemon_file_output_stream_close_async       (GOutputStream        *stream,
 								 int                   io_priority,
 								 GCancellable         *cancellable,
@@ -235,6 +304,13 @@ g_string_remove_in_front (GString *string,
 		     string->len - bytes);
 }
 
+static void
+pending_write_free (PendingWrite *pending)
+{
+  g_free (pending->data);
+  g_free (pending);
+}
+
 static void
 g_daemon_file_output_stream_finalize (GObject *object)
 {
@@ -251,6 +327,11 @@ g_daemon_file_output_stream_finalize (GObject *object)
   g_string_free (file->output_buffer, TRUE);
 
   g_free (file->etag);
+
+  g_string_free (file->write_buffer, TRUE);
+  g_queue_free_full (file->pending_writes, (GDestroyNotify)pending_write_free);
+  if (file->write_error)
+    g_error_free (file->write_error);
   
   if (G_OBJECT_CLASS (g_daemon_file_output_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_daemon_file_output_stream_parent_class)->finalize) (object);
@@ -267,9 +348,12 @@ g_daemon_file_output_stream_class_init (GDaemonFileOutputStreamClass *klass)
 
   stream_class->write_fn = g_daemon_file_output_stream_write;
   stream_class->close_fn = g_daemon_file_output_stream_close;
+  stream_class->flush = g_daemon_file_output_stream_flush;
   
   stream_class->write_async = g_daemon_file_output_stream_write_async;
   stream_class->write_finish = g_daemon_file_output_stream_write_finish;
+  stream_class->flush_async = g_daemon_file_output_stream_flush_async;
+  stream_class->flush_finish = g_daemon_file_output_stream_flush_finish;
   stream_class->close_async = g_daemon_file_output_stream_close_async;
   stream_class->close_finish = g_daemon_file_output_stream_close_finish;
   
@@ -285,9 +369,20 @@ g_daemon_file_output_stream_class_init (GDaemonFileOutputStreamClass *klass)
 static void
 g_daemon_file_output_stream_init (GDaemonFileOutputStream *info)
 {
+  const char *env;
+
   info->output_buffer = g_string_new ("");
   info->input_buffer = g_string_new ("");
   info->seq_nr = 1;
+  info->pending_writes = g_queue_new ();
+
+  env = g_getenv ("GVFS_WRITE_BUFFER_SIZE");
+  if (env != NULL)
+    info->write_buffer_base = MIN (g_ascii_strtoull (env, NULL, 10), MAX_WRITE_SIZE);
+  else
+    info->write_buffer_base = DEFAULT_WRITE_BUFFER_SIZE;
+  info->write_buffer_size = info->write_buffer_base;
+  info->write_buffer = g_string_sized_new (info->write_buffer_size);
 }
 
 GFileOutputStream *
@@ -303,6 +398,7 @@ g_daemon_file_output_stream_new (int fd,
   stream->data_stream = g_unix_input_stream_new (fd, TRUE);
   stream->can_seek = can_seek;
   stream->current_offset = initial_offset;
+  stream->write_offset = initial_offset;
   
   return G_FILE_OUTPUT_STREAM (stream);
 }
@@ -615,6 +711,440 @@ iterate_write_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
     }
 }
 
+static guint
+max_pending_writes (GDaemonFileOutputStream *file)
+{
+  /* Recovering from a short write with later writes in flight
+     needs a seek */
+  return file->can_seek ? MAX_PENDING_WRITES : 1;
+}
+
+/* Moves the start of the write buffer to a new pending write */
+static PendingWrite *
+take_pending_write (GDaemonFileOutputStream *file)
+{
+  PendingWrite *pending;
+
+  pending = g_new0 (PendingWrite, 1);
+  pending->offset = file->write_offset;
+  pending->size = MIN (file->write_buffer->len, MAX_WRITE_SIZE);
+
+  if (pending->size == file->write_buffer->len)
+    {
+      pending->data = g_string_free (file->write_buffer, FALSE);
+      file->write_buffer = g_string_sized_new (file->write_buffer_size);
+    }
+  else
+    {
+      pending->data = g_memdup (file->write_buffer->str, pending->size);
+      g_string_remove_in_front (file->write_buffer, pending->size);
+    }
+
+  file->write_offset += pending->size;
+  return pending;
+}
+
+/* The backend wrote less than we sent. Everything from there on, also
+   what is still in flight, goes back in front of the write buffer.
+   If other writes were in flight the daemon side is somewhere else
+   now, so seek back before sending it again. */
+static void
+requeue_short_write (GDaemonFileOutputStream *file,
+		     PendingWrite *pending,
+		     gsize written)
+{
+  GString *resend;
+  PendingWrite *later;
+  GList *l;
+
+  resend = g_string_new_len (pending->data + written,
+			     pending->size - written);
+  
+  for (l = file->pending_writes->head; l != NULL; l = l->next)
+    {
+      later = l->data;
+      if (later->stale)
+	continue;
+      
+      g_string_append_len (resend, later->data, later->size);
+      later->stale = TRUE;
+      file->resync_pending = TRUE;
+    }
+
+  g_string_prepend_len (file->write_buffer, resend->str, resend->len);
+  g_string_free (resend, TRUE);
+  file->write_offset = pending->offset + written;
+}
+
+static void
+handle_write_reply (GDaemonFileOutputStream *file,
+		    GVfsDaemonSocketProtocolReply *reply,
+		    char *data)
+{
+  PendingWrite *pending;
+
+  pending = g_queue_pop_head (file->pending_writes);
+
+  if (!pending->stale)
+    {
+      if (reply->type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR)
+	{
+	  if (file->write_error == NULL)
+	    decode_error (reply, data, &file->write_error);
+	}
+      else if (reply->arg1 == 0)
+	{
+	  /* Sending it again would not get anywhere */
+	  if (file->write_error == NULL)
+	    g_set_error_literal (&file->write_error,
+				 G_IO_ERROR, G_IO_ERROR_FAILED,
+				 _("Error writing to file"));
+	}
+      else if (reply->arg1 < pending->size)
+	requeue_short_write (file, pending, reply->arg1);
+    }
+
+  pending_write_free (pending);
+}
+
+/* Whether a flush has anything to send or to wait for */
+static gboolean
+flush_needed (GDaemonFileOutputStream *file,
+	      gboolean wait_all)
+{
+  if (file->resync_pending)
+    return TRUE;
+
+  if (file->write_error == NULL &&
+      file->write_buffer->len > 0)
+    return TRUE;
+
+  return wait_all && !g_queue_is_empty (file->pending_writes);
+}
+
+/* flush cycle:
+
+   send the write buffer as WRITE requests, without waiting for
+    the WRITTEN replies while fewer than max_pending_writes are
+    in flight
+   read replies, matching them to the oldest pending write
+   after a short write wait for all pending writes, seek back and
+    send the rest again
+   with wait_all, go on until no write is pending
+ */
+static StateOp
+iterate_flush_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_op, FlushOperation *op)
+{
+  gsize len;
+  guint n_pending;
+
+  while (TRUE)
+    {
+      switch (op->state)
+	{
+	  /* Initial state for flush op, and after each step */
+	case FLUSH_STATE_INIT:
+	  n_pending = g_queue_get_length (file->pending_writes);
+	  
+	  if (file->resync_pending && n_pending == 0 && !op->waiting_for_seek)
+	    {
+	      file->resync_pending = FALSE;
+	      op->waiting_for_seek = TRUE;
+	      append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_SET,
+			      file->write_offset & 0xffffffff,
+			      file->write_offset >> 32,
+			      0,
+			      &op->seek_seq_nr);
+	      op->state = FLUSH_STATE_WROTE_REQUEST;
+	      io_op->io_buffer = file->output_buffer->str;
+	      io_op->io_size = file->output_buffer->len;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+
+	  if (!file->resync_pending && !op->waiting_for_seek &&
+	      file->write_error == NULL &&
+	      file->write_buffer->len > 0 &&
+	      n_pending < max_pending_writes (file))
+	    {
+	      op->sending = take_pending_write (file);
+	      append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_WRITE,
+			      op->sending->size, 0, op->sending->size,
+			      &op->sending->seq_nr);
+	      g_queue_push_tail (file->pending_writes, op->sending);
+	      op->state = FLUSH_STATE_WROTE_REQUEST;
+	      io_op->io_buffer = file->output_buffer->str;
+	      io_op->io_size = file->output_buffer->len;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+
+	  if (op->waiting_for_seek ||
+	      (n_pending > 0 && (op->wait_all || flush_needed (file, FALSE))))
+	    {
+	      /* Nothing was taken from the reply stream yet, so stopping
+		 here leaves it in a good state */
+	      if (io_op->cancelled)
+		{
+		  g_set_error_literal (&op->ret_error,
+				       G_IO_ERROR,
+				       G_IO_ERROR_CANCELLED,
+				       _("Operation was cancelled"));
+		  return STATE_OP_DONE;
+		}
+	      
+	      op->state = FLUSH_STATE_HANDLE_INPUT;
+	      break;
+	    }
+	  
+	  return STATE_OP_DONE;
+
+	  /* wrote parts of output_buffer */
+	case FLUSH_STATE_WROTE_REQUEST:
+	  if (io_op->io_res < file->output_buffer->len)
+	    {
+	      g_string_remove_in_front (file->output_buffer,
+					io_op->io_res);
+	      io_op->io_buffer = file->output_buffer->str;
+	      io_op->io_size = file->output_buffer->len;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+	  g_string_truncate (file->output_buffer, 0);
+
+	  op->data_pos = 0;
+	  if (op->sending)
+	    op->state = FLUSH_STATE_SEND_DATA;
+	  else
+	    op->state = FLUSH_STATE_INIT;
+	  break;
+
+	  /* No op */
+	case FLUSH_STATE_SEND_DATA:
+	  op->data_pos += io_op->io_res;
+	  
+	  if (op->data_pos < op->sending->size)
+	    {
+	      io_op->io_buffer = op->sending->data + op->data_pos;
+	      io_op->io_size = op->sending->size - op->data_pos;
+	      io_op->io_allow_cancel = FALSE;
+	      return STATE_OP_WRITE;
+	    }
+
+	  op->sending = NULL;
+	  op->state = FLUSH_STATE_INIT;
+	  break;
+
+	  /* No op */
+	case FLUSH_STATE_HANDLE_INPUT:
+	  if (io_op->io_cancelled)
+	    {
+	      g_set_error_literal (&op->ret_error,
+				   G_IO_ERROR,
+				   G_IO_ERROR_CANCELLED,
+				   _("Operation was cancelled"));
+	      return STATE_OP_DONE;
+	    }
+	  
+	  if (io_op->io_res > 0)
+	    {
+	      gsize unread_size = io_op->io_size - io_op->io_res;
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - unread_size);
+	    }
+	  
+	  len = get_reply_header_missing_bytes (file->input_buffer);
+	  if (len > 0)
+	    {
+	      gsize current_len = file->input_buffer->len;
+	      g_string_set_size (file->input_buffer,
+				 current_len + len);
+	      io_op->io_buffer = file->input_buffer->str + current_len;
+	      io_op->io_size = len;
+	      io_op->io_allow_cancel = current_len == 0;
+	      return STATE_OP_READ;
+	    }
+
+	  /* Got full header */
+
+	  {
+	    GVfsDaemonSocketProtocolReply reply;
+	    PendingWrite *pending;
+	    char *data;
+	    data = decode_reply (file->input_buffer, &reply);
+	    pending = g_queue_peek_head (file->pending_writes);
+
+	    if (op->waiting_for_seek &&
+		reply.seq_nr == op->seek_seq_nr &&
+		(reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR ||
+		 reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SEEK_POS))
+	      {
+		op->waiting_for_seek = FALSE;
+		if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR &&
+		    file->write_error == NULL)
+		  decode_error (&reply, data, &file->write_error);
+		g_string_truncate (file->input_buffer, 0);
+		op->state = FLUSH_STATE_INIT;
+		break;
+	      }
+	    else if (pending != NULL &&
+		     reply.seq_nr == pending->seq_nr &&
+		     (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR ||
+		      reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN))
+	      {
+		handle_write_reply (file, &reply, data);
+		g_string_truncate (file->input_buffer, 0);
+		op->state = FLUSH_STATE_INIT;
+		break;
+	      }
+	    /* Ignore other reply types */
+	  }
+
+	  g_string_truncate (file->input_buffer, 0);
+	  
+	  /* This wasn't interesting, read next reply */
+	  op->state = FLUSH_STATE_HANDLE_INPUT;
+	  break;
+	  
+	default:
+	  g_assert_not_reached ();
+	}
+      
+      /* Clear io_op between non-op state switches */
+      io_op->io_size = 0;
+      io_op->io_res = 0;
+      io_op->io_cancelled = FALSE;
+    }
+}
+
+/* Sends the write buffer. With wait_all this also waits for all
+   writes to be acknowledged, so any error shows up. Errors in the
+   stream protocol are kept in write_error, they make the stream
+   unusable. */
+static gboolean
+flush_write_buffer (GDaemonFileOutputStream *file,
+		    gboolean wait_all,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+  FlushOperation op;
+  GError *io_error;
+
+  if (!flush_needed (file, wait_all))
+    goto out;
+
+  memset (&op, 0, sizeof (op));
+  op.state = FLUSH_STATE_INIT;
+  op.wait_all = wait_all;
+
+  io_error = NULL;
+  if (!run_sync_state_machine (file, (state_machine_iterator)iterate_flush_state_machine,
+			       &op, cancellable, &io_error))
+    {
+      if (file->write_error == NULL)
+	file->write_error = io_error;
+      else
+	g_error_free (io_error);
+    }
+  else if (op.ret_error != NULL)
+    {
+      g_propagate_error (error, op.ret_error);
+      return FALSE;
+    }
+
+ out:
+  if (file->write_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (file->write_error));
+      return FALSE;
+    }
+  
+  return TRUE;
+}
+
+/* Grow the buffer while it keeps filling up, shrink it again when
+   data sits in it until it gets too old */
+static void
+adapt_write_buffer_size (GDaemonFileOutputStream *file,
+			 gboolean filled)
+{
+  if (filled)
+    file->write_buffer_size = MIN (file->write_buffer_size * 2,
+				   MIN (file->write_buffer_base * WRITE_BUFFER_GROWTH,
+					MAX_WRITE_SIZE));
+  else
+    file->write_buffer_size = MAX (file->write_buffer_size / 2,
+				   file->write_buffer_base);
+}
+
+/* Sends what is buffered if the new data does not fit or the buffer
+   is too old. Nothing of the new data is taken yet, so on error the
+   write can fail as a whole. */
+static gboolean
+write_buffer_needs_flush (GDaemonFileOutputStream *file,
+			  gsize count)
+{
+  if (file->write_buffer->len == 0)
+    return FALSE;
+
+  if (file->write_buffer->len + count > file->write_buffer_size)
+    {
+      adapt_write_buffer_size (file, TRUE);
+      return TRUE;
+    }
+
+  if (g_get_monotonic_time () - file->write_buffer_time > WRITE_BUFFER_MAX_AGE)
+    {
+      adapt_write_buffer_size (file, FALSE);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gsize
+append_write_buffer (GDaemonFileOutputStream *file,
+		     const void *buffer,
+		     gsize count)
+{
+  /* Large writes go out in one piece */
+  if (file->write_buffer->len == 0)
+    file->write_buffer_time = g_get_monotonic_time ();
+  else
+    count = MIN (count, file->write_buffer_size - file->write_buffer->len);
+
+  g_string_append_len (file->write_buffer, buffer, count);
+  file->current_offset += count;
+
+  return count;
+}
+
+static gssize
+write_behind (GDaemonFileOutputStream *file,
+	      const void *buffer,
+	      gsize count,
+	      GCancellable *cancellable,
+	      GError **error)
+{
+  if (file->write_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (file->write_error));
+      return -1;
+    }
+
+  if (write_buffer_needs_flush (file, count) &&
+      !flush_write_buffer (file, FALSE, cancellable, error))
+    return -1;
+
+  count = append_write_buffer (file, buffer, count);
+
+  /* The data is ours now, any error is reported by the next call */
+  if (file->write_buffer->len >= file->write_buffer_size)
+    flush_write_buffer (file, FALSE, NULL, NULL);
+  
+  return count;
+}
+
 static gssize
 g_daemon_file_output_stream_write (GOutputStream *stream,
 				   const void   *buffer,
@@ -634,6 +1164,9 @@ g_daemon_file_output_stream_write (GOutputStream *stream,
   if (count > MAX_WRITE_SIZE)
     count = MAX_WRITE_SIZE;
 
+  if (file->write_buffer_base > 0)
+    return write_behind (file, buffer, count, cancellable, error);
+
   memset (&op, 0, sizeof (op));
   op.state = WRITE_STATE_INIT;
   op.buffer = buffer;
@@ -651,6 +1184,18 @@ g_daemon_file_output_stream_write (GOutputStream *stream,
   return op.ret_val;
 }
 
+static gboolean
+g_daemon_file_output_stream_flush (GOutputStream *stream,
+				   GCancellable *cancellable,
+				   GError      **error)
+{
+  GDaemonFileOutputStream *file;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (stream);
+
+  return flush_write_buffer (file, TRUE, cancellable, error);
+}
+
 static StateOp
 iterate_close_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_op, CloseOperation *op)
 {
@@ -984,6 +1529,9 @@ g_daemon_file_output_stream_seek (GFileOutputStream *stream,
   
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
+
+  if (!flush_write_buffer (file, TRUE, cancellable, error))
+    return FALSE;
   
   memset (&op, 0, sizeof (op));
   op.state = SEEK_STATE_INIT;
@@ -997,7 +1545,10 @@ g_daemon_file_output_stream_seek (GFileOutputStream *stream,
   if (!op.ret_val)
     g_propagate_error (error, op.ret_error);
   else
-    file->current_offset = op.ret_offset;
+    {
+      file->current_offset = op.ret_offset;
+      file->write_offset = op.ret_offset;
+    }
   
   return op.ret_val;
 }
@@ -1155,6 +1706,9 @@ g_daemon_file_output_stream_query_info (GFileOutputStream    *stream,
 
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return NULL;
+
+  if (!flush_write_buffer (file, TRUE, cancellable, error))
+    return NULL;
   
   memset (&op, 0, sizeof (op));
   op.state = QUERY_STATE_INIT;
@@ -1422,6 +1976,222 @@ async_write_done (GOutputStream *stream,
   g_free (op);
 }
 
+static void
+async_flush_done (GOutputStream *stream,
+		  gpointer op_data,
+		  GAsyncReadyCallback callback,
+		  gpointer user_data,
+                  GCancellable *cancellable,
+		  GError *io_error)
+{
+  GDaemonFileOutputStream *file;
+  GSimpleAsyncResult *simple;
+  FlushOperation *op;
+  GError *error;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (stream);
+  op = op_data;
+
+  if (io_error)
+    {
+      /* The stream protocol is broken, nothing can be written anymore */
+      if (file->write_error == NULL)
+	file->write_error = g_error_copy (io_error);
+      error = file->write_error;
+    }
+  else if (op->ret_error)
+    error = op->ret_error;
+  else
+    error = file->write_error;
+
+  simple = g_simple_async_result_new (G_OBJECT (stream),
+				      callback, user_data,
+				      g_daemon_file_output_stream_flush_async);
+
+  if (error)
+    g_simple_async_result_set_from_error (simple, error);
+
+  /* Complete immediately, not in idle, since we're already in a mainloop callout */
+  _g_simple_async_result_complete_with_cancellable (simple, cancellable);
+  g_object_unref (simple);
+
+  if (op->ret_error)
+    g_error_free (op->ret_error);
+  g_free (op);
+}
+
+static void
+flush_write_buffer_async (GDaemonFileOutputStream *file,
+			  gboolean wait_all,
+			  int io_priority,
+			  GCancellable *cancellable,
+			  GAsyncReadyCallback callback,
+			  gpointer data)
+{
+  GSimpleAsyncResult *simple;
+  FlushOperation *op;
+
+  if (!flush_needed (file, wait_all))
+    {
+      simple = g_simple_async_result_new (G_OBJECT (file),
+					  callback, data,
+					  g_daemon_file_output_stream_flush_async);
+      if (file->write_error)
+	g_simple_async_result_set_from_error (simple, file->write_error);
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+      return;
+    }
+  
+  op = g_new0 (FlushOperation, 1);
+  op->state = FLUSH_STATE_INIT;
+  op->wait_all = wait_all;
+
+  run_async_state_machine (file,
+			   (state_machine_iterator)iterate_flush_state_machine,
+			   op,
+			   io_priority,
+			   callback, data,
+			   cancellable,
+			   async_flush_done);
+}
+
+static void
+g_daemon_file_output_stream_flush_async (GOutputStream      *stream,
+					 int                 io_priority,
+					 GCancellable       *cancellable,
+					 GAsyncReadyCallback callback,
+					 gpointer            data)
+{
+  flush_write_buffer_async (G_DAEMON_FILE_OUTPUT_STREAM (stream), TRUE,
+			    io_priority, cancellable, callback, data);
+}
+
+static gboolean
+g_daemon_file_output_stream_flush_finish (GOutputStream             *stream,
+					  GAsyncResult              *result,
+					  GError                   **error)
+{
+  /* Failures handled in generic flush_finish code */
+  return TRUE;
+}
+
+/* A write_async going to the write buffer */
+typedef struct {
+  const void *buffer;
+  gsize count;
+  int io_priority;
+  GCancellable *cancellable;
+  GAsyncReadyCallback callback;
+  gpointer callback_data;
+} WriteBehindData;
+
+static void
+write_behind_done (GDaemonFileOutputStream *file,
+		   WriteBehindData *data,
+		   GError *error,
+		   gboolean in_idle)
+{
+  GSimpleAsyncResult *simple;
+
+  simple = g_simple_async_result_new (G_OBJECT (file),
+				      data->callback, data->callback_data,
+				      g_daemon_file_output_stream_write_async);
+
+  if (error)
+    {
+      g_simple_async_result_set_op_res_gssize (simple, -1);
+      g_simple_async_result_set_from_error (simple, error);
+    }
+  else
+    g_simple_async_result_set_op_res_gssize (simple, data->count);
+
+  if (in_idle)
+    g_simple_async_result_complete_in_idle (simple);
+  else
+    _g_simple_async_result_complete_with_cancellable (simple, data->cancellable);
+  g_object_unref (simple);
+
+  if (data->cancellable)
+    g_object_unref (data->cancellable);
+  g_free (data);
+}
+
+static void
+write_behind_sent (GObject *source_object,
+		   GAsyncResult *res,
+		   gpointer user_data)
+{
+  /* The data was already taken, errors are in write_error for the
+     next call */
+  write_behind_done (G_DAEMON_FILE_OUTPUT_STREAM (source_object),
+		     user_data, NULL, FALSE);
+}
+
+static void
+write_behind_append (GDaemonFileOutputStream *file,
+		     WriteBehindData *data,
+		     gboolean in_idle)
+{
+  data->count = append_write_buffer (file, data->buffer, data->count);
+
+  if (file->write_buffer->len >= file->write_buffer_size)
+    flush_write_buffer_async (file, FALSE, data->io_priority, NULL,
+			      write_behind_sent, data);
+  else
+    write_behind_done (file, data, NULL, in_idle);
+}
+
+static void
+write_behind_flushed (GObject *source_object,
+		      GAsyncResult *res,
+		      gpointer user_data)
+{
+  GDaemonFileOutputStream *file;
+  GError *error;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (source_object);
+
+  error = NULL;
+  if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res), &error))
+    {
+      write_behind_done (file, user_data, error, FALSE);
+      g_error_free (error);
+      return;
+    }
+  
+  write_behind_append (file, user_data, FALSE);
+}
+
+static void
+write_behind_async (GDaemonFileOutputStream *file,
+		    const void *buffer,
+		    gsize count,
+		    int io_priority,
+		    GCancellable *cancellable,
+		    GAsyncReadyCallback callback,
+		    gpointer callback_data)
+{
+  WriteBehindData *data;
+
+  data = g_new0 (WriteBehindData, 1);
+  data->buffer = buffer;
+  data->count = count;
+  data->io_priority = io_priority;
+  if (cancellable)
+    data->cancellable = g_object_ref (cancellable);
+  data->callback = callback;
+  data->callback_data = callback_data;
+
+  if (file->write_error)
+    write_behind_done (file, data, file->write_error, TRUE);
+  else if (write_buffer_needs_flush (file, count))
+    flush_write_buffer_async (file, FALSE, io_priority, cancellable,
+			      write_behind_flushed, data);
+  else
+    write_behind_append (file, data, TRUE);
+}
+
 static void
 g_daemon_file_output_stream_write_async  (GOutputStream      *stream,
 					  const void         *buffer,
@@ -1440,6 +2210,13 @@ g_daemon_file_output_stream_write_async  (GOutputStream      *stream,
   if (count > MAX_WRITE_SIZE)
     count = MAX_WRITE_SIZE;
 
+  if (file->write_buffer_base > 0)
+    {
+      write_behind_async (file, buffer, count, io_priority,
+			  cancellable, callback, data);
+      return;
+    }
+
   op = g_new0 (WriteOperation, 1);
   op->state = WRITE_STATE_INIT;
   op->buffer = buffer;
@@ -1602,6 +2379,54 @@ async_query_done (GOutputStream *stream,
   g_free (op);
 }
 
+/* A query_info_async waiting for the write buffer to be flushed */
+typedef struct {
+  QueryOperation *op;
+  int io_priority;
+  GCancellable *cancellable;
+  GAsyncReadyCallback callback;
+  gpointer callback_data;
+} QueryFlushData;
+
+static void
+query_info_flushed (GObject *source_object,
+		    GAsyncResult *res,
+		    gpointer user_data)
+{
+  GDaemonFileOutputStream *file;
+  QueryFlushData *data;
+  GSimpleAsyncResult *simple;
+  GError *error;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (source_object);
+  data = user_data;
+
+  error = NULL;
+  if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res), &error))
+    {
+      simple = g_simple_async_result_new (G_OBJECT (file),
+					  data->callback, data->callback_data,
+					  g_daemon_file_output_stream_query_info_async);
+      g_simple_async_result_take_error (simple, error);
+      _g_simple_async_result_complete_with_cancellable (simple, data->cancellable);
+      g_object_unref (simple);
+
+      g_free (data->op->attributes);
+      g_free (data->op);
+    }
+  else
+    run_async_state_machine (file,
+			     (state_machine_iterator)iterate_query_state_machine,
+			     data->op, data->io_priority,
+			     data->callback, data->callback_data,
+			     data->cancellable,
+			     async_query_done);
+
+  if (data->cancellable)
+    g_object_unref (data->cancellable);
+  g_free (data);
+}
+
 static void
 g_daemon_file_output_stream_query_info_async  (GFileOutputStream    *stream,
 					       const char           *attributes,
@@ -1612,6 +2437,7 @@ g_daemon_file_output_stream_query_info_async  (GFileOutputStream    *stream,
 {
   GDaemonFileOutputStream *file;
   QueryOperation *op;
+  QueryFlushData *data;
 
   file = G_DAEMON_FILE_OUTPUT_STREAM (stream);
   
@@ -1622,6 +2448,22 @@ g_daemon_file_output_stream_query_info_async  (GFileOutputStream    *stream,
   else
     op->attributes = g_strdup ("");
 
+  /* The info should include what was written */
+  if (flush_needed (file, TRUE) || file->write_error)
+    {
+      data = g_new0 (QueryFlushData, 1);
+      data->op = op;
+      data->io_priority = io_priority;
+      if (cancellable)
+	data->cancellable = g_object_ref (cancellable);
+      data->callback = callback;
+      data->callback_data = user_data;
+      
+      flush_write_buffer_async (file, TRUE, io_priority, cancellable,
+				query_info_flushed, data);
+      return;
+    }
+
   run_async_state_machine (file,
 			   (state_machine_iterator)iterate_query_state_machine,
 			   op, io_priority,
@@ -25,6 +25,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include "gdaemonvfs.h"
 #include "gvfsuriutils.h"
 #include "gdaemonfile.h"
@@ -1255,6 +1256,369 @@ _g_daemon_vfs_get_metadata_proxy (GCancellable *cancellable, GError **error)
   return proxy;
 }
 
+/* Metadata sets are queued to a writer thread, which sends everything
+ * queued for the same tree file in a single SetMany call. While a call
+ * is in flight further sets pile up, so concurrent callers, and any
+ * number of outstanding async calls, get batched without any added
+ * latency for a lone caller.
+ */
+
+#define METADATA_SET_MAX_BATCH 1024
+
+typedef struct {
+  char *treefile;
+  char *path;
+  GVariant *data;
+  GError *error;
+  GSimpleAsyncResult *result; /* Only for async sets */
+  gboolean done;
+  gboolean abandoned;
+} MetadataSet;
+
+static GMutex metadata_set_lock;
+static GCond metadata_set_cond;
+static gboolean metadata_set_many_unsupported = FALSE;
+static pid_t metadata_set_writer_pid;
+
+static MetadataSet *
+metadata_set_new (const char *treefile,
+                  const char *path,
+                  GVariant *data)
+{
+  MetadataSet *set;
+
+  set = g_new0 (MetadataSet, 1);
+  set->treefile = g_strdup (treefile);
+  set->path = g_strdup (path);
+  set->data = g_variant_ref_sink (data);
+
+  return set;
+}
+
+static void
+metadata_set_free (MetadataSet *set)
+{
+  g_free (set->treefile);
+  g_free (set->path);
+  g_variant_unref (set->data);
+  g_clear_error (&set->error);
+  if (set->result)
+    g_object_unref (set->result);
+  g_free (set);
+}
+
+static void
+metadata_set_send_one (GVfsMetadata *proxy,
+                       MetadataSet *set)
+{
+  gvfs_metadata_call_set_sync (proxy,
+                               set->treefile,
+                               set->path,
+                               set->data,
+                               NULL,
+                               &set->error);
+}
+
+static void
+metadata_set_send (GPtrArray *sets)
+{
+  GVfsMetadata *proxy;
+  GVariantBuilder builder;
+  MetadataSet *set;
+  GError *error;
+  guint i;
+
+  error = NULL;
+  proxy = _g_daemon_vfs_get_metadata_proxy (NULL, &error);
+
+  if (proxy != NULL && !metadata_set_many_unsupported)
+    {
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(aya{sv})"));
+      for (i = 0; i < sets->len; i++)
+        {
+          set = g_ptr_array_index (sets, i);
+          g_variant_builder_add (&builder, "(^ay@a{sv})", set->path, set->data);
+        }
+
+      set = g_ptr_array_index (sets, 0);
+      if (gvfs_metadata_call_set_many_sync (proxy,
+                                            set->treefile,
+                                            g_variant_builder_end (&builder),
+                                            NULL,
+                                            &error))
+        return;
+
+      if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          /* Talking to an older daemon */
+          metadata_set_many_unsupported = TRUE;
+        }
+      else if (sets->len == 1)
+        {
+          set->error = error;
+          g_dbus_error_strip_remote_error (set->error);
+          return;
+        }
+
+      /* SetMany fails as a whole, so fall back to one Set per path to
+       * find out which of the callers the failure actually belongs to.
+       */
+      g_clear_error (&error);
+    }
+
+  for (i = 0; i < sets->len; i++)
+    {
+      set = g_ptr_array_index (sets, i);
+      if (proxy == NULL)
+        set->error = g_error_copy (error);
+      else
+        metadata_set_send_one (proxy, set);
+
+      if (set->error)
+        g_dbus_error_strip_remote_error (set->error);
+    }
+
+  g_clear_error (&error);
+}
+
+static gpointer
+metadata_set_writer_thread (gpointer data)
+{
+  GAsyncQueue *queue = data;
+  GHashTable *by_treefile;
+  GHashTableIter iter;
+  GPtrArray *sets;
+  MetadataSet *set;
+  guint n;
+
+  by_treefile = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       NULL, (GDestroyNotify)g_ptr_array_unref);
+  while (TRUE)
+    {
+      /* Take whatever has been queued up meanwhile, grouped by tree */
+      set = g_async_queue_pop (queue);
+      n = 0;
+      do
+        {
+          sets = g_hash_table_lookup (by_treefile, set->treefile);
+          if (sets == NULL)
+            {
+              sets = g_ptr_array_new ();
+              g_hash_table_insert (by_treefile, set->treefile, sets);
+            }
+          g_ptr_array_add (sets, set);
+          n++;
+        }
+      while (n < METADATA_SET_MAX_BATCH &&
+             (set = g_async_queue_try_pop (queue)) != NULL);
+
+      g_hash_table_iter_init (&iter, by_treefile);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&sets))
+        metadata_set_send (sets);
+
+      g_mutex_lock (&metadata_set_lock);
+      g_hash_table_iter_init (&iter, by_treefile);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&sets))
+        for (n = 0; n < sets->len; n++)
+          {
+            set = g_ptr_array_index (sets, n);
+            if (set->result)
+              {
+                if (set->error)
+                  g_simple_async_result_set_from_error (set->result, set->error);
+                g_simple_async_result_complete_in_idle (set->result);
+                metadata_set_free (set);
+              }
+            /* The caller gave up waiting, so it's ours to free */
+            else if (set->abandoned)
+              metadata_set_free (set);
+            else
+              set->done = TRUE;
+          }
+      g_cond_broadcast (&metadata_set_cond);
+      g_mutex_unlock (&metadata_set_lock);
+
+      g_hash_table_remove_all (by_treefile);
+    }
+
+  return NULL;
+}
+
+/* Returns NULL in a forked child, which inherited the queue but not
+ * the writer thread serving it.
+ */
+static GAsyncQueue *
+get_metadata_set_queue (void)
+{
+  static gsize queue = 0;
+
+  if (g_once_init_enter (&queue))
+    {
+      GAsyncQueue *q;
+
+      metadata_set_writer_pid = getpid ();
+      q = g_async_queue_new ();
+      g_thread_unref (g_thread_new ("gvfs-metadata-writer",
+                                    metadata_set_writer_thread,
+                                    q));
+      g_once_init_leave (&queue, (gsize) q);
+    }
+
+  if (metadata_set_writer_pid != getpid ())
+    return NULL;
+
+  return (GAsyncQueue *) queue;
+}
+
+static void
+metadata_set_send_direct (MetadataSet *set)
+{
+  GPtrArray *sets;
+
+  sets = g_ptr_array_new ();
+  g_ptr_array_add (sets, set);
+  metadata_set_send (sets);
+  g_ptr_array_unref (sets);
+}
+
+static void
+metadata_set_cancelled (GCancellable *cancellable,
+                        gpointer user_data)
+{
+  g_mutex_lock (&metadata_set_lock);
+  g_cond_broadcast (&metadata_set_cond);
+  g_mutex_unlock (&metadata_set_lock);
+}
+
+/* Sets the metadata keys in data (a{sv}, as built by
+ * _g_daemon_vfs_append_metadata_for_set()) on path, coalescing with
+ * the sets of other threads. Returns once the daemon has applied it,
+ * or as soon as cancellable is cancelled, in which case the set may
+ * still be applied later on.
+ */
+gboolean
+_g_daemon_vfs_set_metadata (const char *treefile,
+                            const char *path,
+                            GVariant *data,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  GAsyncQueue *queue;
+  MetadataSet *set;
+  gulong cancelled_tag;
+  gboolean done, res;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_variant_unref (g_variant_ref_sink (data));
+      return FALSE;
+    }
+
+  set = metadata_set_new (treefile, path, data);
+
+  queue = get_metadata_set_queue ();
+  if (queue == NULL)
+    metadata_set_send_direct (set);
+  else
+    {
+      g_async_queue_push (queue, set);
+
+      cancelled_tag = 0;
+      if (cancellable)
+        cancelled_tag = g_cancellable_connect (cancellable,
+                                              G_CALLBACK (metadata_set_cancelled),
+                                              NULL, NULL);
+
+      g_mutex_lock (&metadata_set_lock);
+      while (!set->done && !g_cancellable_is_cancelled (cancellable))
+        g_cond_wait (&metadata_set_cond, &metadata_set_lock);
+      done = set->done;
+      /* Once abandoned the writer thread owns the set */
+      if (!done)
+        set->abandoned = TRUE;
+      g_mutex_unlock (&metadata_set_lock);
+
+      g_cancellable_disconnect (cancellable, cancelled_tag);
+
+      if (!done)
+        {
+          g_cancellable_set_error_if_cancelled (cancellable, error);
+          return FALSE;
+        }
+    }
+
+  res = set->error == NULL;
+  if (set->error)
+    {
+      g_propagate_error (error, set->error);
+      set->error = NULL;
+    }
+
+  metadata_set_free (set);
+
+  return res;
+}
+
+/* Like _g_daemon_vfs_set_metadata(), but completes in the thread-default
+ * main context instead of tying up the calling thread.
+ */
+void
+_g_daemon_vfs_set_metadata_async (const char *treefile,
+                                  const char *path,
+                                  GVariant *data,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  GSimpleAsyncResult *result;
+  GAsyncQueue *queue;
+  MetadataSet *set;
+
+  result = g_simple_async_result_new (NULL, callback, user_data,
+                                      _g_daemon_vfs_set_metadata_async);
+  g_simple_async_result_set_check_cancellable (result, cancellable);
+
+  if (g_cancellable_is_cancelled (cancellable))
+    {
+      g_variant_unref (g_variant_ref_sink (data));
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
+  set = metadata_set_new (treefile, path, data);
+  set->result = result;
+
+  queue = get_metadata_set_queue ();
+  if (queue == NULL)
+    {
+      /* No thread to hand this to in a forked child, not even the
+       * ones of the GIO thread pool, so block instead.
+       */
+      metadata_set_send_direct (set);
+      if (set->error)
+        g_simple_async_result_set_from_error (result, set->error);
+      g_simple_async_result_complete_in_idle (result);
+      metadata_set_free (set);
+      return;
+    }
+
+  /* The writer thread completes and drops the result */
+  g_async_queue_push (queue, set);
+}
+
+gboolean
+_g_daemon_vfs_set_metadata_finish (GAsyncResult *result,
+                                   GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 static gboolean
 g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					const char *filename,
@@ -1275,7 +1639,6 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
   gboolean res;
   int appended;
   gpointer value;
-  GVfsMetadata *proxy;
   GVariantBuilder *builder;
 
   res = TRUE;
@@ -1307,69 +1670,59 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 						FALSE,
 						&tree_path);
 	  
-	  proxy = _g_daemon_vfs_get_metadata_proxy (NULL, error);
-	  if (proxy == NULL)
-	    {
-	      res = FALSE;
-              error = NULL; /* Don't set further errors */
-	    }
-	  else
-	    {
-              builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
-	      metatreefile = meta_tree_get_filename (tree);
-              num_set = 0;
+          builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+	  metatreefile = meta_tree_get_filename (tree);
+          num_set = 0;
 
-              for (i = 0; attributes[i] != NULL; i++)
+          for (i = 0; attributes[i] != NULL; i++)
+            {
+              if (g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
                 {
-                  if (g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
+                  appended = _g_daemon_vfs_append_metadata_for_set (builder,
+                                                                    tree,
+                                                                    tree_path,
+                                                                    attributes[i],
+                                                                    type,
+                                                                    value);
+                  if (appended != -1)
                     {
-                      appended = _g_daemon_vfs_append_metadata_for_set (builder,
-                                                                        tree,
-                                                                        tree_path,
-                                                                        attributes[i],
-                                                                        type,
-                                                                        value);
-                      if (appended != -1)
-                        {
-                          num_set += appended;
-                          g_file_info_set_attribute_status (info, attributes[i],
-                                                            G_FILE_ATTRIBUTE_STATUS_SET);
-                        }
-                      else
-                        {
-                          res = FALSE;
-                          g_set_error (error, G_IO_ERROR,
-                                       G_IO_ERROR_INVALID_ARGUMENT,
-                                       _("Error setting file metadata: %s"),
-                                       _("values must be string or list of strings"));
-                          error = NULL; /* Don't set further errors */
-                          g_file_info_set_attribute_status (info, attributes[i],
-                                                            G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
-                        }
+                      num_set += appended;
+                      g_file_info_set_attribute_status (info, attributes[i],
+                                                        G_FILE_ATTRIBUTE_STATUS_SET);
+                    }
+                  else
+                    {
+                      res = FALSE;
+                      g_set_error (error, G_IO_ERROR,
+                                   G_IO_ERROR_INVALID_ARGUMENT,
+                                   _("Error setting file metadata: %s"),
+                                   _("values must be string or list of strings"));
+                      error = NULL; /* Don't set further errors */
+                      g_file_info_set_attribute_status (info, attributes[i],
+                                                        G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
                     }
                 }
-	      
-	      if (num_set > 0 &&
-	          ! gvfs_metadata_call_set_sync (proxy,
-	                                         metatreefile,
-	                                         tree_path,
-	                                         g_variant_builder_end (builder),
-	                                         NULL,
-	                                         error))
-                {
-	          res = FALSE;
-                  error = NULL; /* Don't set further errors */
-                  for (i = 0; attributes[i] != NULL; i++)
-                    g_file_info_set_attribute_status (info, attributes[i],
-                                                      G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
-                }
+            }
 
-	      g_variant_builder_unref (builder);
-	      
-              meta_lookup_cache_free (cache);
-              meta_tree_unref (tree);
-              g_free (tree_path);
-	    }
+	  if (num_set > 0 &&
+	      ! _g_daemon_vfs_set_metadata (metatreefile,
+	                                    tree_path,
+	                                    g_variant_builder_end (builder),
+	                                    NULL,
+	                                    error))
+            {
+	      res = FALSE;
+              error = NULL; /* Don't set further errors */
+              for (i = 0; attributes[i] != NULL; i++)
+                g_file_info_set_attribute_status (info, attributes[i],
+                                                  G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+            }
+
+	  g_variant_builder_unref (builder);
+
+          meta_lookup_cache_free (cache);
+          meta_tree_unref (tree);
+          g_free (tree_path);
 	}
 
       g_strfreev (attributes);
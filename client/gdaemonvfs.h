@@ -78,6 +78,19 @@ int             _g_daemon_vfs_append_metadata_for_set  (GVariantBuilder *builder
 
 GVfsMetadata *  _g_daemon_vfs_get_metadata_proxy       (GCancellable             *cancellable,
                                                         GError                  **error);
+gboolean        _g_daemon_vfs_set_metadata             (const char               *treefile,
+                                                        const char               *path,
+                                                        GVariant                 *data,
+                                                        GCancellable             *cancellable,
+                                                        GError                  **error);
+void            _g_daemon_vfs_set_metadata_async       (const char               *treefile,
+                                                        const char               *path,
+                                                        GVariant                 *data,
+                                                        GCancellable             *cancellable,
+                                                        GAsyncReadyCallback       callback,
+                                                        gpointer                  user_data);
+gboolean        _g_daemon_vfs_set_metadata_finish      (GAsyncResult             *result,
+                                                        GError                  **error);
 
 
 
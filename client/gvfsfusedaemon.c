@@ -27,23 +27,29 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 /* stuff from common/ */
 #include <gvfsdaemonprotocol.h>
 #include <gvfsdbus.h>
+#include <gvfspreadable.h>
 
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #define DEBUG_ENABLED 0
 
@@ -62,6 +68,44 @@ typedef enum {
   FILE_OP_WRITE
 } FileOp;
 
+/* Reads go through a block cache shared by all opens of a path. It
+ * keeps a few streams at different offsets, so interleaved and
+ * backwards reads are served without reopening the file. */
+#define READ_BLOCK_SIZE          (128 * 1024)
+#define READ_AHEAD_MAX_BLOCKS    8
+#define READ_MAX_STREAMS         4
+#define READ_MAX_SKIP            (READ_AHEAD_MAX_BLOCKS * READ_BLOCK_SIZE)
+#define READ_CACHE_MAX_FILE_SIZE (16 * 1024 * 1024)
+#define READ_CACHE_MAX_SIZE      (64 * 1024 * 1024)
+
+typedef struct {
+  gint          refcount;
+  guint64       index;
+  gchar        *data;
+  gsize         len;      /* Short for the last block of the file */
+  GList         link;     /* In ReadCache.lru */
+} Block;
+
+typedef struct {
+  GInputStream *stream;   /* NULL until opened by its first fetch */
+  goffset       pos;
+  gboolean      busy;
+  guint64       first;    /* Blocks being fetched while busy */
+  guint64       last;
+  guint         window;   /* Blocks to read, grows while reads are sequential */
+  gint64        last_used;
+} ReadStream;
+
+typedef struct {
+  GMutex        mutex;
+  GCond         cond;
+  GHashTable   *blocks;   /* index => Block */
+  GQueue        lru;
+  gsize         size;
+  GPtrArray    *streams;  /* ReadStream */
+  guint         generation;
+} ReadCache;
+
 typedef struct {
   gint      refcount;
 
@@ -70,8 +114,38 @@ typedef struct {
   FileOp    op;
   gpointer  stream;
   goffset   pos;
+
+  ReadCache *read_cache;
+
+  /* With -o spool, files opened for writing are staged here */
+  gint      spool_fd;
+  gchar    *spool_path;
+  goffset   spool_size;
+  gboolean  spool_dirty;
 } FileHandle;
 
+/* The spool directory is bounded; writes wait this long for others to
+ * release space before failing with ENOSPC */
+#define SPOOL_DEFAULT_SIZE       1024  /* MiB */
+#define SPOOL_WAIT_TIMEOUT       30    /* seconds */
+#define SPOOL_COPY_BUFFER_SIZE   (64 * 1024)
+
+typedef struct {
+  gint      spool;
+  guint     spool_size;  /* MiB */
+  gchar    *spool_dir;
+} Options;
+
+static Options         options               = { 0, SPOOL_DEFAULT_SIZE, NULL };
+
+static struct fuse_opt vfs_opts [] =
+{
+  { "spool",           offsetof (Options, spool),      1 },
+  { "spool_size=%u",   offsetof (Options, spool_size), 0 },
+  { "spool_dir=%s",    offsetof (Options, spool_dir),  0 },
+  FUSE_OPT_END
+};
+
 static GThread        *subthread             = NULL;
 static GMainLoop      *subthread_main_loop   = NULL;
 static GVfs           *gvfs                  = NULL;
@@ -87,12 +161,94 @@ static uid_t           daemon_uid;
 static gid_t           daemon_gid;
 
 static GMutex          global_mutex          = {NULL};
+static gint            read_cache_total_size = 0;
+
+static GMutex          spool_mutex           = {NULL};
+static GCond           spool_cond;
+static goffset         spool_used            = 0;
 static GHashTable     *global_path_to_fh_map = NULL;
 static GHashTable     *global_active_fh_map  = NULL;
 
 static GDBusConnection *dbus_conn            = NULL;
 static guint            daemon_name_watcher;
 
+/* Stats of files are kept for this many seconds, so the getattr calls
+ * following a readdir (like in 'ls -l') don't each query the backend.
+ * The kernel gets the same value as entry and attribute timeout. */
+#define STAT_CACHE_TTL          2
+#define STAT_CACHE_MAX_ENTRIES  65536
+/* Directories that had their stat cached get monitored for changes */
+#define MAX_DIR_MONITORS        64
+
+typedef struct {
+  struct stat stat;
+  gint64      expires;
+} StatCacheEntry;
+
+typedef struct {
+  GFileMonitor *monitor;
+  gint64        last_used;
+} DirMonitor;
+
+typedef struct {
+  gchar        *path;
+  GFile        *file;
+} MonitoredDir;
+
+static GMutex          stat_cache_mutex      = {NULL};
+static GHashTable     *stat_cache            = NULL;  /* path => StatCacheEntry */
+static guint64         stat_cache_generation = 0;     /* Bumped by every invalidation */
+static GHashTable     *dir_monitors          = NULL;  /* path => DirMonitor */
+
+/* The kernel refers to files by inode number. Each inode it knows about
+ * has a Node, which lives until the kernel forgets all its lookups. */
+typedef struct {
+  fuse_ino_t    ino;
+  gchar        *path;     /* NULL once another file was renamed over it */
+  guint64       nlookup;
+  GFile        *file;     /* Resolved on first use */
+
+  /* Attributes at the last open, to tell if the kernel's pages are
+   * still good */
+  gboolean      opened;
+  time_t        open_mtime;
+  off_t         open_size;
+} Node;
+
+static GMutex          node_mutex            = {NULL};
+static GHashTable     *node_by_ino           = NULL;  /* ino => Node */
+static GHashTable     *node_by_path          = NULL;  /* path => Node */
+static fuse_ino_t      next_ino              = FUSE_ROOT_ID + 1;
+
+/* Directory listings are read in one go when the kernel reads from
+ * offset 0, and handed out in pieces from there. */
+typedef struct {
+  gchar        *name;
+  struct stat   stat;
+} DirEntry;
+
+typedef struct {
+  GArray       *entries;
+} DirHandle;
+
+/* Requests are received on the main thread and processed by a pool
+ * of workers, each with its own request buffer */
+#define WORKERS_PER_PROCESSOR   4
+#define MIN_WORKERS             8
+#define MAX_WORKERS             64
+
+#define UNKNOWN_INO             0xffffffff
+
+typedef struct {
+  gchar        *buf;
+  gsize         len;
+  struct fuse_chan *ch;
+} Request;
+
+static struct fuse_session *session          = NULL;
+static GAsyncQueue    *free_request_bufs     = NULL;
+static GPrivate        current_request;
+
 /* ------- *
  * Helpers *
  * ------- */
@@ -189,1755 +345,2073 @@ errno_from_error (GError *error)
 static void
 set_pid_for_file (GFile *file)
 {
-  struct fuse_context *context;
+  const struct fuse_ctx *context;
+  fuse_req_t             req;
 
   if (file == NULL)
     goto out;
 
-  context = fuse_get_context ();
-  if (context == NULL)
+  req = g_private_get (&current_request);
+  if (req == NULL)
     goto out;
 
+  context = fuse_req_ctx (req);
+
   g_object_set_data (G_OBJECT (file), "gvfs-fuse-client-pid", GUINT_TO_POINTER (context->pid));
 
  out:
   ;
 }
 
-static FileHandle *
-file_handle_new (const gchar *path)
-{
-  FileHandle *file_handle;
-
-  file_handle = g_new0 (FileHandle, 1);
-  file_handle->refcount = 1;
-  g_mutex_init (&file_handle->mutex);
-  file_handle->op = FILE_OP_NONE;
-  file_handle->path = g_strdup (path);
-
-  g_hash_table_insert (global_active_fh_map, file_handle, file_handle);
-
-  return file_handle;
-}
+/* ---------------- *
+ * Read block cache *
+ * ---------------- */
 
-static FileHandle *
-file_handle_ref (FileHandle *file_handle)
+static void
+block_unref (Block *block)
 {
-  g_atomic_int_inc (&file_handle->refcount);
-  return file_handle;
+  if (g_atomic_int_dec_and_test (&block->refcount))
+    {
+      g_free (block->data);
+      g_slice_free (Block, block);
+    }
 }
 
 static void
-file_handle_unref (FileHandle *file_handle)
+read_stream_free (ReadStream *rs)
 {
-  if (g_atomic_int_dec_and_test (&file_handle->refcount))
+  if (rs->stream)
     {
-      gint refs;
-
-      g_mutex_lock (&global_mutex);
-
-      /* Test again, since e.g. get_file_handle_for_path() might have
-       * snatched the global mutex and revived the file handle between
-       * g_atomic_int_dec_and_test() and us obtaining the global lock. */
+      g_input_stream_close (rs->stream, NULL, NULL);
+      g_object_unref (rs->stream);
+    }
+  g_slice_free (ReadStream, rs);
+}
 
-      refs = g_atomic_int_get (&file_handle->refcount);
+static ReadCache *
+read_cache_new (void)
+{
+  ReadCache *cache;
 
-      if (refs == 0)
-        g_hash_table_remove (global_path_to_fh_map, file_handle->path);
+  cache = g_slice_new0 (ReadCache);
+  g_mutex_init (&cache->mutex);
+  g_cond_init (&cache->cond);
+  cache->blocks = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                         NULL, (GDestroyNotify) block_unref);
+  g_queue_init (&cache->lru);
+  cache->streams = g_ptr_array_new ();
 
-      g_mutex_unlock (&global_mutex);
-    }
+  return cache;
 }
 
+/* The functions below up to read_cache_clear() are called with the
+ * cache locked */
+
 static void
-file_handle_close_stream (FileHandle *file_handle)
+read_cache_remove_block (ReadCache *cache, Block *block)
 {
-  debug_print ("file_handle_close_stream\n");
-  if (file_handle->stream)
-    {
-      switch (file_handle->op)
-        {
-        case FILE_OP_READ:
-          g_input_stream_close (file_handle->stream, NULL, NULL);
-          break;
-          
-        case FILE_OP_WRITE:
-          g_output_stream_close (file_handle->stream, NULL, NULL);
-          break;
-          
-        default:
-          g_assert_not_reached ();
-        }
-      
-      g_object_unref (file_handle->stream);
-      file_handle->stream = NULL;
-      file_handle->op = FILE_OP_NONE;
-    }
+  g_queue_unlink (&cache->lru, &block->link);
+  cache->size -= block->len;
+  g_atomic_int_add (&read_cache_total_size, - (gint) block->len);
+  g_hash_table_remove (cache->blocks, &block->index);
 }
 
-/* Called on hash table removal */
 static void
-file_handle_free (FileHandle *file_handle)
+read_cache_insert_block (ReadCache *cache, Block *block)
 {
-  g_hash_table_remove (global_active_fh_map, file_handle);
-
-  file_handle_close_stream (file_handle);
-  g_mutex_clear (&file_handle->mutex);
-  g_free (file_handle->path);
-  g_free (file_handle);
+  Block *old;
+
+  old = g_hash_table_lookup (cache->blocks, &block->index);
+  if (old)
+    read_cache_remove_block (cache, old);
+
+  g_atomic_int_inc (&block->refcount);
+  block->link.data = block;
+  g_queue_push_head_link (&cache->lru, &block->link);
+  g_hash_table_insert (cache->blocks, &block->index, block);
+  cache->size += block->len;
+  g_atomic_int_add (&read_cache_total_size, block->len);
+
+  while (cache->lru.tail != NULL &&
+         (cache->size > READ_CACHE_MAX_FILE_SIZE ||
+          g_atomic_int_get (&read_cache_total_size) > READ_CACHE_MAX_SIZE))
+    read_cache_remove_block (cache, cache->lru.tail->data);
 }
 
-static FileHandle *
-get_file_handle_for_path (const gchar *path)
+static Block *
+read_cache_lookup (ReadCache *cache, guint64 index)
 {
-  FileHandle *fh;
-
-  g_mutex_lock (&global_mutex);
-
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  Block *block;
 
-  if (fh)
-    file_handle_ref (fh);
+  block = g_hash_table_lookup (cache->blocks, &index);
+  if (block)
+    {
+      g_queue_unlink (&cache->lru, &block->link);
+      g_queue_push_head_link (&cache->lru, &block->link);
+      g_atomic_int_inc (&block->refcount);
+    }
 
-  g_mutex_unlock (&global_mutex);
-  return fh;
+  return block;
 }
 
-static FileHandle *
-get_or_create_file_handle_for_path (const gchar *path)
+static gboolean
+read_cache_is_fetching (ReadCache *cache, guint64 index)
 {
-  FileHandle *fh;
-
-  g_mutex_lock (&global_mutex);
-
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  guint i;
 
-  if (fh)
+  for (i = 0; i < cache->streams->len; i++)
     {
-      file_handle_ref (fh);
-    }
-  else
-    {
-      fh = file_handle_new (path);
-      g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+      ReadStream *rs = g_ptr_array_index (cache->streams, i);
+
+      if (rs->busy && rs->first <= index && index <= rs->last)
+        return TRUE;
     }
 
-  g_mutex_unlock (&global_mutex);
-  return fh;
+  return FALSE;
 }
 
-static FileHandle *
-get_file_handle_from_info (struct fuse_file_info *fi)
+/* Picks an idle stream to read from @offset: one that is there
+ * already, one a short skip before it, a new one, or the least
+ * recently used one. Returns NULL if all are busy. */
+static ReadStream *
+read_cache_pick_stream (ReadCache *cache, goffset offset)
 {
-  FileHandle *fh;
+  ReadStream *best = NULL;
+  guint       i;
 
-  g_mutex_lock (&global_mutex);
+  for (i = 0; i < cache->streams->len; i++)
+    {
+      ReadStream *rs = g_ptr_array_index (cache->streams, i);
+
+      if (rs->busy || rs->stream == NULL)
+        continue;
+      if (rs->pos == offset)
+        return rs;
+      if (rs->pos < offset && offset - rs->pos <= READ_MAX_SKIP &&
+          (best == NULL || rs->pos > best->pos))
+        best = rs;
+    }
 
-  fh = GET_FILE_HANDLE (fi);
+  if (best)
+    return best;
 
-  /* If the file handle is still valid, its value won't change. If
-   * invalid, it's set to NULL. */
-  fh = g_hash_table_lookup (global_active_fh_map, fh);
+  if (cache->streams->len < READ_MAX_STREAMS)
+    {
+      best = g_slice_new0 (ReadStream);
+      best->window = 1;
+      g_ptr_array_add (cache->streams, best);
+      return best;
+    }
 
-  if (fh)
-    file_handle_ref (fh);
+  for (i = 0; i < cache->streams->len; i++)
+    {
+      ReadStream *rs = g_ptr_array_index (cache->streams, i);
 
-  g_mutex_unlock (&global_mutex);
-  return fh;
+      if (!rs->busy && (best == NULL || rs->last_used < best->last_used))
+        best = rs;
+    }
+
+  return best;
 }
 
 static void
-reindex_file_handle_for_path (const gchar *old_path, const gchar *new_path)
+read_cache_clear_locked (ReadCache *cache)
 {
-  gchar      *old_path_internal;
-  FileHandle *fh;
-
-  g_mutex_lock (&global_mutex);
-
-  if (!g_hash_table_lookup_extended (global_path_to_fh_map, old_path,
-                                     (gpointer *) &old_path_internal,
-                                     (gpointer *) &fh))
-      goto out;
-
-  g_hash_table_steal (global_path_to_fh_map, old_path);
+  guint i;
 
-  g_free (fh->path);
-  fh->path = g_strdup (new_path);
-
-  g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+  cache->generation++;
 
- out:
-  g_mutex_unlock (&global_mutex);
-}
+  while (cache->lru.tail != NULL)
+    read_cache_remove_block (cache, cache->lru.tail->data);
 
-static MountRecord *
-mount_record_new (GMount *mount)
-{
-  MountRecord *mount_record;
-  char *name;
+  /* Busy streams are dropped when their fetch is done */
+  for (i = cache->streams->len; i > 0; i--)
+    {
+      ReadStream *rs = g_ptr_array_index (cache->streams, i - 1);
 
-  mount_record = g_new (MountRecord, 1);
-  
-  mount_record->root = g_mount_get_root (mount);
-  mount_record->name = g_object_get_data (G_OBJECT (mount), "g-stable-name");
-  mount_record->creation_time = time (NULL);
-  
-  return mount_record;
+      if (!rs->busy)
+        {
+          g_ptr_array_remove_index_fast (cache->streams, i - 1);
+          read_stream_free (rs);
+        }
+    }
 }
 
+/* Drops everything read so far, after the file was changed */
 static void
-mount_record_free (MountRecord *mount_record)
+read_cache_clear (ReadCache *cache)
 {
-  g_object_unref (mount_record->root);
-  g_free (mount_record->name);
-  g_free (mount_record);
+  g_mutex_lock (&cache->mutex);
+  read_cache_clear_locked (cache);
+  g_mutex_unlock (&cache->mutex);
 }
 
 static void
-mount_list_lock (void)
+read_cache_free (ReadCache *cache)
 {
-  g_mutex_lock (&mount_list_mutex);
-}
+  read_cache_clear_locked (cache);
 
-static void
-mount_list_unlock (void)
-{
-  g_mutex_unlock (&mount_list_mutex);
+  g_ptr_array_free (cache->streams, TRUE);
+  g_hash_table_destroy (cache->blocks);
+  g_cond_clear (&cache->cond);
+  g_mutex_clear (&cache->mutex);
+  g_slice_free (ReadCache, cache);
 }
 
-static void
-mount_list_free (void)
+/* Opens the first stream, so open() fails for unreadable files */
+static gint
+read_cache_open (ReadCache *cache, GFile *file)
 {
-  g_list_foreach (mount_list, (GFunc) mount_record_free, NULL);
-  g_list_free (mount_list);
-  mount_list = NULL;
-}
+  ReadStream *rs;
+  GError     *error = NULL;
+  gboolean    have_stream;
 
-static gboolean
-mount_record_for_mount_exists (GMount *mount)
-{
-  GList *l;
-  GFile *root;
-  gboolean res;
+  g_mutex_lock (&cache->mutex);
+  have_stream = cache->streams->len > 0;
+  g_mutex_unlock (&cache->mutex);
 
-  g_assert (mount != NULL);
+  if (have_stream)
+    return 0;
 
-  root = g_mount_get_root (mount);
+  rs = g_slice_new0 (ReadStream);
+  rs->window = 1;
+  rs->last_used = g_get_monotonic_time ();
+  rs->stream = G_INPUT_STREAM (g_file_read (file, NULL, &error));
 
-  res = FALSE;
-  
-  mount_list_lock ();
+  if (rs->stream == NULL)
+    {
+      gint result = -errno_from_error (error);
 
-  for (l = mount_list; l != NULL; l = l->next)
+      g_error_free (error);
+      g_slice_free (ReadStream, rs);
+      return result;
+    }
+
+  g_mutex_lock (&cache->mutex);
+  if (cache->streams->len < READ_MAX_STREAMS)
     {
-      MountRecord *this_mount_record = l->data;
-      
-      if (g_file_equal (root, this_mount_record->root))
-        {
-          res = TRUE;
-          break;
-        }
+      g_ptr_array_add (cache->streams, rs);
+      rs = NULL;
     }
+  g_mutex_unlock (&cache->mutex);
 
-  mount_list_unlock ();
+  if (rs)
+    read_stream_free (rs);
 
-  g_object_unref (root);
-  
-  return res;
+  return 0;
 }
 
-static GFile *
-mount_record_find_root_by_mount_name (const gchar *mount_name)
+static gboolean
+read_stream_seek (ReadStream *rs, GFile *file, goffset offset, GError **error)
 {
-  GList       *l;
-  GFile *root;
-
-  g_assert (mount_name != NULL);
-
-  root = NULL;
-  
-  mount_list_lock ();
+  gboolean can_seek;
 
-  for (l = mount_list; l != NULL; l = l->next)
+  if (rs->stream)
     {
-      MountRecord *mount_record = l->data;
+      can_seek = g_seekable_can_seek (G_SEEKABLE (rs->stream));
 
-      if (strcmp (mount_name, mount_record->name) == 0)
+      if (offset < rs->pos && !can_seek)
         {
-          root = g_object_ref (mount_record->root);
-          break;
+          /* Can't go back, start over */
+          g_input_stream_close (rs->stream, NULL, NULL);
+          g_clear_object (&rs->stream);
+        }
+      else if (can_seek && (offset < rs->pos || offset - rs->pos > READ_MAX_SKIP))
+        {
+          if (!g_seekable_seek (G_SEEKABLE (rs->stream), offset, G_SEEK_SET, NULL, error))
+            return FALSE;
+          rs->pos = offset;
         }
     }
 
-  mount_list_unlock ();
+  if (rs->stream == NULL)
+    {
+      rs->stream = G_INPUT_STREAM (g_file_read (file, NULL, error));
+      if (rs->stream == NULL)
+        return FALSE;
+      rs->pos = 0;
+      rs->window = 1;
 
-  return root;
+      if (offset > 0 && g_seekable_can_seek (G_SEEKABLE (rs->stream)))
+        {
+          if (!g_seekable_seek (G_SEEKABLE (rs->stream), offset, G_SEEK_SET, NULL, error))
+            return FALSE;
+          rs->pos = offset;
+        }
+    }
+
+  while (rs->pos < offset)
+    {
+      gssize skipped;
+
+      skipped = g_input_stream_skip (rs->stream, offset - rs->pos, NULL, error);
+      if (skipped < 0)
+        return FALSE;
+      if (skipped == 0)
+        break;  /* End of file */
+      rs->pos += skipped;
+    }
+
+  return TRUE;
 }
 
-static void
-mount_list_update (void)
+static Block *
+block_new (guint64 index)
 {
-  GList *mounts;
-  GList *l;
-
-  mounts = g_volume_monitor_get_mounts (volume_monitor);
+  Block *block;
 
-  for (l = mounts; l != NULL; l = l->next)
-    {
-      GMount *mount = l->data;
+  block = g_slice_new0 (Block);
+  block->refcount = 1;
+  block->index = index;
+  block->data = g_malloc (READ_BLOCK_SIZE);
 
-      if (!mount_record_for_mount_exists (mount))
-        {
-          mount_list_lock ();
-          mount_list = g_list_prepend (mount_list, mount_record_new (mount));
-          mount_list_unlock ();
-        }
-      
-      g_object_unref (mount);
-    }
-  
-  g_list_free (mounts);
+  return block;
 }
 
-#if 0
+/* Streams of gvfs mounts can read at an offset, in a single request
+ * for all the blocks. @rs->pos then only tracks where the last fetch
+ * ended, the stream itself is never moved. */
+static gboolean
+read_stream_can_preadv (ReadStream *rs)
+{
+  return G_VFS_IS_PREADABLE (rs->stream) &&
+    g_seekable_can_seek (G_SEEKABLE (rs->stream));
+}
 
-static gint
-file_info_get_attribute_as_int (GFileInfo *file_info, const gchar *attribute)
+static GPtrArray *
+read_stream_fetch_preadv (ReadStream *rs, guint64 index, guint n_blocks, GError **error)
 {
-  GFileAttributeType attribute_type;
-  gint               int_result;
+  GVfsPreadableExtent *extents;
+  GPtrArray           *blocks;
+  Block               *block;
+  guint                i;
 
-  attribute_type = g_file_info_get_attribute_type (file_info, attribute);
+  blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) block_unref);
+  extents = g_new0 (GVfsPreadableExtent, n_blocks);
 
-  switch (attribute_type)
+  for (i = 0; i < n_blocks; i++)
     {
-      case G_FILE_ATTRIBUTE_TYPE_UINT32:
-        int_result = g_file_info_get_attribute_uint32 (file_info, attribute);
-        break;
+      block = block_new (index + i);
+      g_ptr_array_add (blocks, block);
 
-      case G_FILE_ATTRIBUTE_TYPE_INT32:
-        int_result = g_file_info_get_attribute_int32 (file_info, attribute);
-        break;
+      extents[i].offset = block->index * READ_BLOCK_SIZE;
+      extents[i].buffer = block->data;
+      extents[i].count = READ_BLOCK_SIZE;
+    }
 
-      case G_FILE_ATTRIBUTE_TYPE_UINT64:
-        int_result = g_file_info_get_attribute_uint64 (file_info, attribute);
-        break;
+  if (!g_vfs_preadable_preadv (G_VFS_PREADABLE (rs->stream), extents, n_blocks, NULL, error))
+    {
+      g_free (extents);
+      g_ptr_array_free (blocks, TRUE);
+      return NULL;
+    }
 
-      case G_FILE_ATTRIBUTE_TYPE_INT64:
-        int_result = g_file_info_get_attribute_int64 (file_info, attribute);
-        break;
+  /* Only the blocks up to the end of the file are kept */
+  for (i = 0; i < n_blocks; i++)
+    {
+      block = g_ptr_array_index (blocks, i);
+      block->len = extents[i].bytes_read;
+      rs->pos = extents[i].offset + extents[i].bytes_read;
 
-      default:
-        int_result = 0;
-        g_assert_not_reached ();
-        break;
+      if (block->len < READ_BLOCK_SIZE)
+        {
+          block->data = g_realloc (block->data, block->len);
+          g_ptr_array_set_size (blocks, i + 1);
+          break;
+        }
     }
 
-  return int_result;
-}
+  g_free (extents);
 
-#endif
+  return blocks;
+}
 
-static guint
-file_info_get_attribute_as_uint (GFileInfo *file_info, const gchar *attribute)
+/* Reads @n_blocks blocks from @index on. Called unlocked, with @rs
+ * marked busy. */
+static GPtrArray *
+read_stream_fetch (ReadStream *rs, GFile *file, guint64 index, guint n_blocks, GError **error)
 {
-  GFileAttributeType attribute_type;
-  guint              uint_result;
+  GPtrArray *blocks;
+  goffset    offset = index * READ_BLOCK_SIZE;
+  guint      i;
 
-  attribute_type = g_file_info_get_attribute_type (file_info, attribute);
+  debug_print ("read_stream_fetch: %u blocks at offset %" G_GINT64_FORMAT ".\n", n_blocks, offset);
 
-  switch (attribute_type)
+  if (rs->stream == NULL)
     {
-      case G_FILE_ATTRIBUTE_TYPE_UINT32:
-        uint_result = g_file_info_get_attribute_uint32 (file_info, attribute);
-        break;
+      rs->stream = G_INPUT_STREAM (g_file_read (file, NULL, error));
+      if (rs->stream == NULL)
+        return NULL;
+      rs->pos = 0;
+      rs->window = 1;
+    }
 
-      case G_FILE_ATTRIBUTE_TYPE_INT32:
-        uint_result = g_file_info_get_attribute_int32 (file_info, attribute);
-        break;
+  if (read_stream_can_preadv (rs))
+    return read_stream_fetch_preadv (rs, index, n_blocks, error);
 
-      case G_FILE_ATTRIBUTE_TYPE_UINT64:
-        uint_result = g_file_info_get_attribute_uint64 (file_info, attribute);
-        break;
+  if (!read_stream_seek (rs, file, offset, error))
+    return NULL;
 
-      case G_FILE_ATTRIBUTE_TYPE_INT64:
-        uint_result = g_file_info_get_attribute_int64 (file_info, attribute);
-        break;
+  blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) block_unref);
 
-      default:
-        uint_result = 0;
-        g_assert_not_reached ();
-        break;
-    }
+  for (i = 0; i < n_blocks; i++)
+    {
+      Block *block;
 
-  return uint_result;
-}
+      block = block_new (index + i);
+      g_ptr_array_add (blocks, block);
 
-static gboolean
-path_is_mount_list (const gchar *path)
-{
-  while (*path == '/')
-    path++;
+      if (rs->pos == offset + (goffset) i * READ_BLOCK_SIZE)
+        {
+          if (!g_input_stream_read_all (rs->stream, block->data, READ_BLOCK_SIZE,
+                                        &block->len, NULL, error))
+            {
+              g_ptr_array_free (blocks, TRUE);
+              return NULL;
+            }
+          rs->pos += block->len;
+        }
 
-  return *path == 0;
-}
+      if (block->len < READ_BLOCK_SIZE)
+        {
+          block->data = g_realloc (block->data, block->len);
+          break;
+        }
+    }
 
+  return blocks;
+}
 
-static GFile *
-file_from_full_path (const gchar *path)
+/* Returns a reference to the block at @index, reading it if needed */
+static Block *
+read_cache_get_block (ReadCache *cache, GFile *file, guint64 index, gint *result)
 {
-  gchar *mount_name;
-  GFile *file = NULL;
-  const gchar *s1, *s2;
-  GFile *root;
-
-  file = NULL;
-  
-  s1 = path;
-  while (*s1 == '/')
-    s1++;
-  
-  if (*s1)
+  ReadStream *rs;
+  Block      *block;
+  GPtrArray  *blocks;
+  GError     *error = NULL;
+  goffset     offset = index * READ_BLOCK_SIZE;
+  guint64     key;
+  guint       generation;
+  guint       n_blocks;
+  guint       i;
+
+  g_mutex_lock (&cache->mutex);
+
+  for (;;)
     {
-      s2 = strchr (s1, '/');
-      if (s2 == NULL)
-        s2 = s1 + strlen (s1);
-      
-      mount_name = g_strndup (s1, s2 - s1);
-      root = mount_record_find_root_by_mount_name (mount_name);
-      g_free (mount_name);
-      
-      if (root)
+      block = read_cache_lookup (cache, index);
+      if (block)
         {
-          while (*s2 == '/')
-            s2++;
-          file = g_file_resolve_relative_path (root, s2);
-          g_object_unref (root);
+          g_mutex_unlock (&cache->mutex);
+          return block;
         }
-    }
 
-  return file;
-}
+      if (!read_cache_is_fetching (cache, index) &&
+          (rs = read_cache_pick_stream (cache, offset)) != NULL)
+        break;
 
-/* ------------- *
- * VFS functions *
- * ------------- */
+      g_cond_wait (&cache->cond, &cache->mutex);
+    }
 
-static gint
-vfs_statfs (const gchar *path, struct statvfs *stbuf)
-{
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
+  /* Read ahead while the stream is read sequentially, up to the next
+   * block that is there already */
+  if (rs->stream && rs->pos == offset)
+    rs->window = MIN (rs->window * 2, READ_AHEAD_MAX_BLOCKS);
+  else
+    rs->window = 1;
 
-  debug_print ("vfs_statfs: %s\n", path);
+  for (n_blocks = 1; n_blocks < rs->window; n_blocks++)
+    {
+      key = index + n_blocks;
+      if (g_hash_table_contains (cache->blocks, &key))
+        break;
+    }
 
-  memset (stbuf, 0, sizeof (*stbuf));
+  rs->busy = TRUE;
+  rs->first = index;
+  rs->last = index + n_blocks - 1;
+  generation = cache->generation;
 
-  /* Fallback case */
-  stbuf->f_bsize = 4096;
-  stbuf->f_frsize = 4096;  /* Ignored by FUSE */
-  stbuf->f_blocks = 0;
-  stbuf->f_bfree = 0;
-  stbuf->f_bavail = 0;
-  stbuf->f_files = 0;
-  stbuf->f_ffree = 0;
-  stbuf->f_favail = 0;  /* Ignored by FUSE */
-  stbuf->f_fsid = 1;  /* Ignored by FUSE */
-  stbuf->f_flag = 0;  /* Ignored by FUSE */
-  stbuf->f_namemax = 1024;
+  g_mutex_unlock (&cache->mutex);
 
-  if ((file = file_from_full_path (path)))
-    {
-      GFileInfo *file_info;
+  blocks = read_stream_fetch (rs, file, index, n_blocks, &error);
 
-      file_info = g_file_query_filesystem_info (file, "filesystem::*", NULL, &error);
+  g_mutex_lock (&cache->mutex);
 
-      if (file_info)
-        {
-          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE))
-            stbuf->f_blocks = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE) / 4096;
-          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE))
-            stbuf->f_bfree = stbuf->f_bavail = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE) / 4096;
+  rs->busy = FALSE;
+  rs->last_used = g_get_monotonic_time ();
 
-          g_object_unref (file_info);
-        }
-      else if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-      else
+  if (blocks)
+    {
+      block = g_ptr_array_index (blocks, 0);
+      g_atomic_int_inc (&block->refcount);
+
+      if (generation == cache->generation)
         {
-          result = -EIO;
+          for (i = 0; i < blocks->len; i++)
+            read_cache_insert_block (cache, g_ptr_array_index (blocks, i));
         }
+    }
 
-      g_object_unref (file);
+  if (blocks == NULL || generation != cache->generation)
+    {
+      g_ptr_array_remove_fast (cache->streams, rs);
+      read_stream_free (rs);
     }
 
-  debug_print ("vfs_statfs: -> %s\n", g_strerror (-result));
+  g_cond_broadcast (&cache->cond);
+  g_mutex_unlock (&cache->mutex);
 
-  return result;
+  if (blocks)
+    g_ptr_array_free (blocks, TRUE);
+
+  if (error)
+    {
+      *result = -errno_from_error (error);
+      g_error_free (error);
+    }
+
+  return block;
 }
 
-static mode_t
-file_info_get_stat_mode (GFileInfo *file_info)
+static gint
+read_cache_read (ReadCache *cache, GFile *file, gchar *buf, gsize size, goffset offset)
 {
-  GFileType         file_type;
-  mode_t            unix_mode;
-
-  file_type = g_file_info_get_file_type (file_info);
+  gsize n_bytes_read = 0;
+  gint  result       = 0;
 
-  switch (file_type)
+  while (n_bytes_read < size)
     {
-      case G_FILE_TYPE_REGULAR:
-        unix_mode = S_IFREG;
+      goffset  pos          = offset + n_bytes_read;
+      gsize    block_offset = pos % READ_BLOCK_SIZE;
+      Block   *block;
+      gsize    len          = 0;
+      gboolean eof;
+
+      block = read_cache_get_block (cache, file, pos / READ_BLOCK_SIZE, &result);
+      if (block == NULL)
         break;
 
-      case G_FILE_TYPE_DIRECTORY:
-      case G_FILE_TYPE_MOUNTABLE:
-        unix_mode = S_IFDIR;
-        break;
+      if (block->len > block_offset)
+        {
+          len = MIN (block->len - block_offset, size - n_bytes_read);
+          memcpy (buf + n_bytes_read, block->data + block_offset, len);
+        }
+      n_bytes_read += len;
+      eof = block->len < READ_BLOCK_SIZE;
 
-      case G_FILE_TYPE_SYMBOLIC_LINK:
-      case G_FILE_TYPE_SHORTCUT:
-        unix_mode = S_IFLNK;
-        break;
+      block_unref (block);
 
-      case G_FILE_TYPE_SPECIAL:
-      default:
-        unix_mode = 0;
+      if (eof)
         break;
     }
 
-  if (file_type == G_FILE_TYPE_DIRECTORY ||
-      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) ||
-      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))
-    unix_mode |= S_IRUSR;
-  if (!g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) ||
-      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))
-    unix_mode |= S_IWUSR;
-  if (file_type == G_FILE_TYPE_DIRECTORY ||
-      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) ||
-      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))
-    unix_mode |= S_IXUSR;
-  
-  return unix_mode;
+  if (n_bytes_read > 0)
+    return n_bytes_read;
+
+  return result;
 }
 
-static gint
-getattr_for_file (GFile *file, struct stat *sbuf)
+static FileHandle *
+file_handle_new (const gchar *path)
 {
-  GFileInfo *file_info;
-  GError    *error  = NULL;
-  gint       result = 0;
+  FileHandle *file_handle;
 
-  file_info = g_file_query_info (file, 
-                                 G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                 G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                 G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
-                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_MODE ","
-                                 G_FILE_ATTRIBUTE_TIME_CHANGED ","
-                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                 G_FILE_ATTRIBUTE_TIME_ACCESS ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCKS ","
-				 "access::*",
-                                 0, NULL, &error);
+  file_handle = g_new0 (FileHandle, 1);
+  file_handle->refcount = 1;
+  g_mutex_init (&file_handle->mutex);
+  file_handle->op = FILE_OP_NONE;
+  file_handle->path = g_strdup (path);
+  file_handle->read_cache = read_cache_new ();
+  file_handle->spool_fd = -1;
 
-  if (file_info)
-    {
-      GTimeVal mod_time;
+  g_hash_table_insert (global_active_fh_map, file_handle, file_handle);
 
-      sbuf->st_mode = file_info_get_stat_mode (file_info);
-      sbuf->st_size = g_file_info_get_size (file_info);
-      sbuf->st_uid = daemon_uid;
-      sbuf->st_gid = daemon_gid;
+  return file_handle;
+}
+
+static FileHandle *
+file_handle_ref (FileHandle *file_handle)
+{
+  g_atomic_int_inc (&file_handle->refcount);
+  return file_handle;
+}
+
+static void
+file_handle_unref (FileHandle *file_handle)
+{
+  if (g_atomic_int_dec_and_test (&file_handle->refcount))
+    {
+      gint refs;
 
-      g_file_info_get_modification_time (file_info, &mod_time);
-      sbuf->st_mtime = mod_time.tv_sec;
-      sbuf->st_ctime = mod_time.tv_sec;
-      sbuf->st_atime = mod_time.tv_sec;
+      g_mutex_lock (&global_mutex);
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
-        sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
-        sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+      /* Test again, since e.g. get_file_handle_for_path() might have
+       * snatched the global mutex and revived the file handle between
+       * g_atomic_int_dec_and_test() and us obtaining the global lock. */
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
-	sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
-	sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
-      else /* fake it to make 'du' work like 'du --apparent'. */
-	sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+      refs = g_atomic_int_get (&file_handle->refcount);
 
-      /* Setting st_nlink to 1 for directories makes 'find' work */
-      sbuf->st_nlink = 1;
+      if (refs == 0)
+        g_hash_table_remove (global_path_to_fh_map, file_handle->path);
 
-      g_object_unref (file_info);
+      g_mutex_unlock (&global_mutex);
     }
-  else
+}
+
+static void
+file_handle_close_stream (FileHandle *file_handle)
+{
+  debug_print ("file_handle_close_stream\n");
+  if (file_handle->stream)
     {
-      if (error)
+      switch (file_handle->op)
         {
-          debug_print ("Error from GVFS: %s\n", error->message);
-          result = -errno_from_error (error);
-          g_error_free (error);
+        case FILE_OP_READ:
+          g_input_stream_close (file_handle->stream, NULL, NULL);
+          break;
+          
+        case FILE_OP_WRITE:
+          g_output_stream_close (file_handle->stream, NULL, NULL);
+          break;
+          
+        default:
+          g_assert_not_reached ();
         }
-      else
+      
+      g_object_unref (file_handle->stream);
+      file_handle->stream = NULL;
+      file_handle->op = FILE_OP_NONE;
+    }
+}
+
+/* ---------------- *
+ * Write-back spool *
+ * ---------------- */
+
+/* Accounts @size more bytes of spool. If @wait, waits for space if
+ * needed, which must not be done with a fh->mutex held */
+static gboolean
+spool_reserve (goffset size, gboolean wait)
+{
+  goffset  max_size = (goffset) options.spool_size * 1024 * 1024;
+  gint64   end_time;
+  gboolean res = TRUE;
+
+  if (size <= 0)
+    return TRUE;
+
+  end_time = g_get_monotonic_time () + SPOOL_WAIT_TIMEOUT * G_TIME_SPAN_SECOND;
+
+  g_mutex_lock (&spool_mutex);
+
+  while (spool_used + size > max_size)
+    {
+      if (size > max_size || !wait ||
+          !g_cond_wait_until (&spool_cond, &spool_mutex, end_time))
         {
-          debug_print ("No file info, but no error from GVFS.\n");
-          result = -EIO;
+          res = FALSE;
+          break;
         }
     }
 
-  return result;
+  if (res)
+    spool_used += size;
+
+  g_mutex_unlock (&spool_mutex);
+
+  return res;
 }
 
 static void
-getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
+spool_release (goffset size)
 {
-  sbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IXUSR;
-  sbuf->st_uid = daemon_uid;
-  sbuf->st_gid = daemon_gid;
-  sbuf->st_nlink = 1;
-  sbuf->st_size = fh->pos;
-  sbuf->st_blksize = 512;
-  sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+  if (size <= 0)
+    return;
+
+  g_mutex_lock (&spool_mutex);
+  spool_used -= size;
+  g_cond_broadcast (&spool_cond);
+  g_mutex_unlock (&spool_mutex);
 }
 
 static gint
-vfs_getattr (const gchar *path, struct stat *sbuf)
+spool_pwrite_all (gint fd, const gchar *buf, gsize len, goffset offset)
 {
-  GFile      *file;
-  gint        result = 0;
-
-  debug_print ("vfs_getattr: %s\n", path);
+  while (len > 0)
+    {
+      gssize res;
 
-  memset (sbuf, 0, sizeof (*sbuf));
+      res = pwrite (fd, buf, len, offset);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -errno;
+        }
 
-  sbuf->st_dev = 0;                     /* dev_t     ID of device containing file */
-  sbuf->st_ino = 0;                     /* ino_t     inode number */
-  sbuf->st_uid = 0;                     /* uid_t     user ID of owner */
-  sbuf->st_gid = 0;                     /* gid_t     group ID of owner */
-  sbuf->st_rdev = 0;                    /* dev_t     device ID (if special file) */
-  sbuf->st_size = 0;                    /* off_t     total size, in bytes */
-  sbuf->st_blocks = 0;                  /* blkcnt_t  number of blocks allocated */
-  sbuf->st_atime = 0;                   /* time_t    time of last access */
-  sbuf->st_mtime = 0;                   /* time_t    time of last modification */
-  sbuf->st_ctime = 0;                   /* time_t    time of last status change */
-  sbuf->st_blksize = 4096;              /* blksize_t blocksize for filesystem I/O */
+      buf += res;
+      len -= res;
+      offset += res;
+    }
 
-  if (path_is_mount_list (path))
-    {
-      /* Mount list */
+  return 0;
+}
 
-      sbuf->st_mode = S_IFDIR | 0500;                   /* mode_t    protection */
-      sbuf->st_nlink = 2 + g_list_length (mount_list);  /* nlink_t   number of hard links */
-      sbuf->st_atime = daemon_creation_time;
-      sbuf->st_mtime = daemon_creation_time;
-      sbuf->st_ctime = daemon_creation_time;
-      sbuf->st_uid   = daemon_uid;
-      sbuf->st_gid   = daemon_gid;
-    }
-  else if ((file = file_from_full_path (path)))
-    {
-      /* Submount */
+/* The file_handle_spool functions are called with fh->mutex held */
 
-      result = getattr_for_file (file, sbuf);
+static void
+file_handle_spool_drop (FileHandle *fh)
+{
+  if (fh->spool_fd < 0)
+    return;
 
-      if (result != 0)
-        {
-          FileHandle *fh = get_file_handle_for_path (path);
+  close (fh->spool_fd);
+  g_unlink (fh->spool_path);
+  g_free (fh->spool_path);
+  spool_release (fh->spool_size);
 
-          /* Some backends don't create new files until their stream has
-           * been closed. So, if the path doesn't exist, but we have a stream
-           * associated with it, pretend it's there. */
+  fh->spool_fd = -1;
+  fh->spool_path = NULL;
+  fh->spool_size = 0;
+  fh->spool_dirty = FALSE;
+}
 
-          if (fh != NULL)
-            {
-              g_mutex_lock (&fh->mutex);
-              getattr_for_file_handle (fh, sbuf);
-              g_mutex_unlock (&fh->mutex);
+/* Takes over @reserved bytes of spool the caller already accounted for;
+ * fails with ENOSPC right away if the write needs more than that and
+ * there is no space left */
+static gint
+file_handle_spool_write (FileHandle *fh, const gchar *buf, gsize len, goffset offset,
+                         goffset reserved)
+{
+  goffset grow = offset + len - fh->spool_size;
+  gint    result;
 
-              file_handle_unref (fh);
-              result = 0;
-            }
+  if (grow > reserved)
+    {
+      if (!spool_reserve (grow - reserved, FALSE))
+        {
+          spool_release (reserved);
+          return -ENOSPC;
         }
-
-      g_object_unref (file);
     }
   else
     {
-      result = -ENOENT;
+      spool_release (reserved - MAX (grow, 0));
     }
 
-  debug_print ("vfs_getattr: -> %s\n", g_strerror (-result));
+  result = spool_pwrite_all (fh->spool_fd, buf, len, offset);
+  if (result < 0)
+    {
+      spool_release (grow);
+      return result;
+    }
 
-  return result;
+  if (grow > 0)
+    fh->spool_size += grow;
+  fh->spool_dirty = TRUE;
+
+  return len;
 }
 
+/* Like file_handle_spool_write(), but waits for spool space if needed.
+ * That is done without fh->mutex, so operations on the same file, like
+ * the flush or release that may free the space, aren't held up. */
 static gint
-vfs_readlink (const gchar *path, gchar *target, size_t size)
+file_handle_spool_write_wait (FileHandle *fh, const gchar *buf, gsize len, goffset offset)
 {
-  debug_print ("vfs_readlink: %s\n", path);
+  goffset  needed;
+  gboolean reserved;
+  gint     result;
 
-  /* This is not implemented because it would allow remote servers to launch
-   * symlink attacks on the local machine.  There's not much of a use for
-   * "readlink" anyway since we don't pass G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-   * so non-broken symlinks will be followed transparently. */
+  result = file_handle_spool_write (fh, buf, len, offset, 0);
+  if (result != -ENOSPC)
+    return result;
 
-  return -ENOSYS;
+  /* Or the spool directory's disk itself is full */
+  needed = offset + len - fh->spool_size;
+  if (needed <= 0)
+    return result;
+
+  g_mutex_unlock (&fh->mutex);
+  reserved = spool_reserve (needed, TRUE);
+  g_mutex_lock (&fh->mutex);
+
+  if (!reserved)
+    return -ENOSPC;
+
+  if (fh->spool_fd < 0)
+    {
+      spool_release (needed);
+      return -EIO;
+    }
+
+  return file_handle_spool_write (fh, buf, len, offset, needed);
 }
 
 static gint
-setup_input_stream (GFile *file, FileHandle *fh)
+file_handle_spool_read (FileHandle *fh, gchar *buf, gsize size, goffset offset)
 {
-  GError *error  = NULL;
-  gint    result = 0;
+  gsize n_bytes_read = 0;
 
-  if (fh->stream)
+  while (n_bytes_read < size)
     {
-      debug_print ("setup_input_stream: have stream\n");
+      gssize res;
 
-      if (fh->op == FILE_OP_READ)
-        {
-          debug_print ("setup_input_stream: doing read\n");
-        }
-      else
-        {
-          debug_print ("setup_input_stream: doing write\n");
+      res = pread (fh->spool_fd, buf + n_bytes_read, size - n_bytes_read,
+                   offset + n_bytes_read);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return -errno;
+      if (res == 0)
+        break;
 
-          g_output_stream_close (fh->stream, NULL, NULL);
-          g_object_unref (fh->stream);
-          fh->stream = NULL;
-        }
+      n_bytes_read += res;
     }
 
-  if (!fh->stream)
-    {
-      debug_print ("setup_input_stream: no stream\n");
-      fh->stream = g_file_read (file, NULL, &error);
-      fh->pos = 0;
-    }
+  return n_bytes_read;
+}
 
-  if (fh->stream)
-    fh->op = FILE_OP_READ;
-  else
-    fh->op = FILE_OP_NONE;
+static gint
+file_handle_spool_truncate (FileHandle *fh, goffset size)
+{
+  goffset grow = size - fh->spool_size;
 
-  if (error)
+  if (grow > 0 && !spool_reserve (grow, FALSE))
+    return -ENOSPC;
+
+  /* Growing just makes the spool file sparse */
+  if (ftruncate (fh->spool_fd, size) != 0)
     {
-      debug_print ("setup_input_stream: error\n");
-      result = -errno_from_error (error);
-      g_error_free (error);
+      gint result = -errno;
+
+      spool_release (grow);
+      return result;
     }
 
-  return result;
+  spool_release (-grow);
+  fh->spool_size = size;
+  fh->spool_dirty = TRUE;
+
+  return 0;
 }
 
 static gint
-setup_output_stream (GFile *file, FileHandle *fh, int flags)
+spool_fill (FileHandle *fh, GInputStream *stream)
 {
+  gchar  *buf;
   GError *error  = NULL;
   gint    result = 0;
 
-  if (fh->stream)
+  buf = g_malloc (SPOOL_COPY_BUFFER_SIZE);
+
+  for (;;)
     {
-      if (fh->op == FILE_OP_WRITE)
-        {
-        }
-      else
+      gssize n_bytes_read;
+
+      n_bytes_read = g_input_stream_read (stream, buf, SPOOL_COPY_BUFFER_SIZE, NULL, &error);
+      if (n_bytes_read < 0)
         {
-          g_input_stream_close (fh->stream, NULL, NULL);
-          g_object_unref (fh->stream);
-          fh->stream = NULL;
+          result = -errno_from_error (error);
+          g_error_free (error);
+          break;
         }
+      if (n_bytes_read == 0)
+        break;
+
+      result = file_handle_spool_write (fh, buf, n_bytes_read, fh->spool_size, 0);
+      if (result < 0)
+        break;
+      result = 0;
     }
 
-  if (!fh->stream)
+  g_free (buf);
+
+  return result;
+}
+
+/* Stages the file in a local spool file, which takes writes and
+ * truncates at any offset. It's uploaded by file_handle_spool_upload(). */
+static gint
+file_handle_spool_open (FileHandle *fh, GFile *file, gint flags)
+{
+  GFileInputStream *stream;
+  GError           *error  = NULL;
+  gchar            *template;
+  gint              result = 0;
+
+  if (fh->spool_fd >= 0)
     {
       if (flags & O_TRUNC)
-        fh->stream = g_file_replace (file, NULL, FALSE, 0, NULL, &error);
-      else
-        fh->stream = g_file_append_to (file, 0, NULL, &error);
-      if (fh->stream)
-        fh->pos = g_seekable_tell (G_SEEKABLE (fh->stream));
+        result = file_handle_spool_truncate (fh, 0);
+      return result;
     }
 
-  if (fh->stream)
-    fh->op = FILE_OP_WRITE;
-  else
-    fh->op = FILE_OP_NONE;
+  file_handle_close_stream (fh);
+  read_cache_clear (fh->read_cache);
 
-  if (error)
+  template = g_build_filename (options.spool_dir, "spool-XXXXXX", NULL);
+  fh->spool_fd = g_mkstemp_full (template, O_RDWR, 0600);
+  if (fh->spool_fd < 0)
     {
-      result = -errno_from_error (error);
+      result = -errno;
+      g_free (template);
+      return result;
+    }
+
+  fh->spool_path = template;
+  fh->spool_size = 0;
+  fh->spool_dirty = (flags & O_TRUNC) != 0;
+
+  if (flags & O_TRUNC)
+    return 0;
+
+  stream = g_file_read (file, NULL, &error);
+  if (stream)
+    {
+      result = spool_fill (fh, G_INPUT_STREAM (stream));
+      g_input_stream_close (G_INPUT_STREAM (stream), NULL, NULL);
+      g_object_unref (stream);
+    }
+  else
+    {
+      /* Nothing to fill in for a file that doesn't exist yet */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        result = -errno_from_error (error);
       g_error_free (error);
     }
 
+  if (result != 0)
+    file_handle_spool_drop (fh);
+
   return result;
 }
 
+/* Uploads the spool file in one go; g_file_copy() lets the backend
+ * pull it in with its push operation where it has one. */
 static gint
-open_common (const gchar *path, struct fuse_file_info *fi, GFile *file, int output_flags)
+file_handle_spool_upload (FileHandle *fh, GFile *file)
 {
-  gint        result;
-  FileHandle *fh = get_or_create_file_handle_for_path (path);
+  GFile  *spool_file;
+  GError *error  = NULL;
+  gint    result = 0;
 
-  g_mutex_lock (&fh->mutex);
+  if (fh->spool_fd < 0 || !fh->spool_dirty)
+    return 0;
 
-  SET_FILE_HANDLE (fi, fh);
+  debug_print ("file_handle_spool_upload: %s, %" G_GINT64_FORMAT " bytes\n",
+               fh->path, fh->spool_size);
 
-  debug_print ("open_common: flags=%o\n", fi->flags);
+  spool_file = g_file_new_for_path (fh->spool_path);
 
-  /* Set up a stream here, so we can check for errors */
-  set_pid_for_file (file);
-
-  if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
-    result = setup_output_stream (file, fh, fi->flags | output_flags);
+  if (g_file_copy (spool_file, file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error))
+    {
+      fh->spool_dirty = FALSE;
+    }
   else
-    result = setup_input_stream (file, fh);
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
 
-  g_mutex_unlock (&fh->mutex);
+  g_object_unref (spool_file);
 
-  /* The added reference to the file handle is released in vfs_release() */
   return result;
 }
 
-static gint
-vfs_open (const gchar *path, struct fuse_file_info *fi)
+/* Called on hash table removal */
+static void
+file_handle_free (FileHandle *file_handle)
 {
-  GFile *file;
-  gint   result = 0;
+  g_hash_table_remove (global_active_fh_map, file_handle);
 
-  debug_print ("vfs_open: %s\n", path);
+  file_handle_close_stream (file_handle);
+  read_cache_free (file_handle->read_cache);
+  file_handle_spool_drop (file_handle);
+  g_mutex_clear (&file_handle->mutex);
+  g_free (file_handle->path);
+  g_free (file_handle);
+}
 
-  if (path_is_mount_list (path))
-    result = -EISDIR;
-  else if ((file = file_from_full_path (path)))
-    {
-      GFileInfo *file_info;
-      GError    *error = NULL;
+static FileHandle *
+get_file_handle_for_path (const gchar *path)
+{
+  FileHandle *fh;
 
-      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+  g_mutex_lock (&global_mutex);
 
-      if (file_info)
-        {
-          GFileType file_type = g_file_info_get_file_type (file_info);
+  fh = g_hash_table_lookup (global_path_to_fh_map, path);
 
-          if (file_type == G_FILE_TYPE_REGULAR)
-            {
-              result = open_common (path, fi, file, 0);
-            }
-          else if (file_type == G_FILE_TYPE_DIRECTORY)
-            {
-              /* EISDIR is supposedly only for attempts to write to directory handles,
-               * but outside readdir(), we don't support reading them either. */
-              result = -EISDIR;
-            }
-          else
-            {
-              result = -EACCES;
-            }
+  if (fh)
+    file_handle_ref (fh);
 
-          g_object_unref (file_info);
-        }
-      else
-        {
-          if (error)
-            {
-              debug_print ("Error from GVFS: %s\n", error->message);
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-          else
-            {
-              debug_print ("No file info, but no error from GVFS.\n");
-              result = -EIO;
-            }
-        }
+  g_mutex_unlock (&global_mutex);
+  return fh;
+}
 
-      g_object_unref (file);
+static FileHandle *
+get_or_create_file_handle_for_path (const gchar *path)
+{
+  FileHandle *fh;
+
+  g_mutex_lock (&global_mutex);
+
+  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+
+  if (fh)
+    {
+      file_handle_ref (fh);
     }
   else
     {
-      result = -ENOENT;
+      fh = file_handle_new (path);
+      g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
     }
 
-  debug_print ("vfs_open: -> %s\n", g_strerror (-result));
-
-  return result;
+  g_mutex_unlock (&global_mutex);
+  return fh;
 }
 
-static gint
-vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
+static FileHandle *
+get_file_handle_from_info (struct fuse_file_info *fi)
 {
-  GFile *file;
-  gint   result = 0;
-
-  debug_print ("vfs_create: %s\n", path);
-
-  if (path_is_mount_list (path))
-    result = -EEXIST;
-  if ((file = file_from_full_path (path)))
-    {
-      GFileInfo *file_info;
-      GError    *error = NULL;
+  FileHandle *fh;
 
-      set_pid_for_file (file);
+  g_mutex_lock (&global_mutex);
 
-      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+  fh = GET_FILE_HANDLE (fi);
 
-      if (file_info)
-        {
-          result = -EEXIST;
-          g_object_unref (file_info);
-        }
-      else
-        {
-          GFileOutputStream *file_output_stream;
+  /* If the file handle is still valid, its value won't change. If
+   * invalid, it's set to NULL. */
+  fh = g_hash_table_lookup (global_active_fh_map, fh);
 
-          if (error)
-            {
-              g_error_free (error);
-              error = NULL;
-            }
+  if (fh)
+    file_handle_ref (fh);
 
-          file_output_stream = g_file_create (file, 0, NULL, &error);
-          if (file_output_stream)
-            {
-              FileHandle *fh = get_or_create_file_handle_for_path (path);
+  g_mutex_unlock (&global_mutex);
+  return fh;
+}
 
-              /* Success */
+static void
+reindex_file_handle_for_path (const gchar *old_path, const gchar *new_path)
+{
+  gchar      *old_path_internal;
+  FileHandle *fh;
 
-              g_mutex_lock (&fh->mutex);
+  g_mutex_lock (&global_mutex);
 
-              SET_FILE_HANDLE (fi, fh);
+  if (!g_hash_table_lookup_extended (global_path_to_fh_map, old_path,
+                                     (gpointer *) &old_path_internal,
+                                     (gpointer *) &fh))
+      goto out;
 
-              file_handle_close_stream (fh);
-              fh->stream = file_output_stream;
-              fh->op = FILE_OP_WRITE;
+  g_hash_table_steal (global_path_to_fh_map, old_path);
 
-              g_mutex_unlock (&fh->mutex);
+  g_free (fh->path);
+  fh->path = g_strdup (new_path);
 
-              /* The reference added to the file handle is released in vfs_release() */
-            }
-          else
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
+  g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
 
-      g_object_unref (file);
-    }
-  else
-    {
-      result = -ENOENT;
-    }
+ out:
+  g_mutex_unlock (&global_mutex);
+}
 
-  debug_print ("vfs_create: -> %s\n", g_strerror (-result));
+static MountRecord *
+mount_record_new (GMount *mount)
+{
+  MountRecord *mount_record;
+  char *name;
 
-  return result;
+  mount_record = g_new (MountRecord, 1);
+  
+  mount_record->root = g_mount_get_root (mount);
+  mount_record->name = g_object_get_data (G_OBJECT (mount), "g-stable-name");
+  mount_record->creation_time = time (NULL);
+  
+  return mount_record;
 }
 
-static gint
-vfs_release (const gchar *path, struct fuse_file_info *fi)
+static void
+mount_record_free (MountRecord *mount_record)
 {
-  FileHandle *fh = get_file_handle_from_info (fi);
+  g_object_unref (mount_record->root);
+  g_free (mount_record->name);
+  g_free (mount_record);
+}
 
-  debug_print ("vfs_release: %s\n", path);
+static void
+mount_list_lock (void)
+{
+  g_mutex_lock (&mount_list_mutex);
+}
 
-  if (fh)
-    {
-      /* get_file_handle_from_info () adds a "working ref", so unref twice. */
-      file_handle_unref (fh);
-      file_handle_unref (fh);
-    }
+static void
+mount_list_unlock (void)
+{
+  g_mutex_unlock (&mount_list_mutex);
+}
 
-  return 0;
+static void
+mount_list_free (void)
+{
+  g_list_foreach (mount_list, (GFunc) mount_record_free, NULL);
+  g_list_free (mount_list);
+  mount_list = NULL;
 }
 
-static gint
-read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+static gboolean
+mount_record_for_mount_exists (GMount *mount)
 {
-  GInputStream *input_stream;
-  gint          n_bytes_skipped = 0;
-  gint          n_bytes_read    = 0;
-  gint          result          = 0;
-  GError       *error           = NULL;
+  GList *l;
+  GFile *root;
+  gboolean res;
 
-  input_stream = fh->stream;
+  g_assert (mount != NULL);
 
-  if (offset != fh->pos)
+  root = g_mount_get_root (mount);
+
+  res = FALSE;
+  
+  mount_list_lock ();
+
+  for (l = mount_list; l != NULL; l = l->next)
     {
-      if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
+      MountRecord *this_mount_record = l->data;
+      
+      if (g_file_equal (root, this_mount_record->root))
         {
-          /* Can seek */
+          res = TRUE;
+          break;
+        }
+    }
 
-          debug_print ("read_stream: seeking to offset %d.\n", offset);
+  mount_list_unlock ();
 
-          if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
-            {
-              fh->pos = offset;
-            }
-          else
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
-      else if (offset > fh->pos)
-        {
-          /* Can skip ahead */
-
-          debug_print ("read_stream: skipping to offset %d.\n", offset);
+  g_object_unref (root);
+  
+  return res;
+}
 
-          n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+static GFile *
+mount_record_find_root_by_mount_name (const gchar *mount_name)
+{
+  GList       *l;
+  GFile *root;
 
-          if (n_bytes_skipped > 0)
-            fh->pos += n_bytes_skipped;
+  g_assert (mount_name != NULL);
 
-          if (n_bytes_skipped != offset - fh->pos)
-            {
-              if (error)
-                {
-                  result = -errno_from_error (error);
-                  g_error_free (error);
-                }
-              else
-                {
-                  result = -EIO;
-                }
-            }
-        }
-      else
-        {
-          /* Can't seek, can't skip backwards */
+  root = NULL;
+  
+  mount_list_lock ();
 
-          debug_print ("read_stream: can't seek nor skip to offset %d!\n", offset);
+  for (l = mount_list; l != NULL; l = l->next)
+    {
+      MountRecord *mount_record = l->data;
 
-          result = -ENOTSUP;
+      if (strcmp (mount_name, mount_record->name) == 0)
+        {
+          root = g_object_ref (mount_record->root);
+          break;
         }
     }
 
-  if (result == 0)
-    {
-      while (n_bytes_read < output_buf_size)
-        {
-          gboolean part_result;
-          gsize    part_bytes_read = 0;
+  mount_list_unlock ();
 
-          part_result = g_input_stream_read_all (input_stream,
-                                                 output_buf + n_bytes_read,
-                                                 output_buf_size - n_bytes_read,
-                                                 &part_bytes_read,
-                                                 NULL,
-                                                 &error);
+  return root;
+}
 
-          n_bytes_read += part_bytes_read;
-          fh->pos += part_bytes_read;
+static void
+mount_list_update (void)
+{
+  GList *mounts;
+  GList *l;
 
-          if (!part_result || part_bytes_read == 0)
-            break;
-        }
+  mounts = g_volume_monitor_get_mounts (volume_monitor);
 
-      result = n_bytes_read;
+  for (l = mounts; l != NULL; l = l->next)
+    {
+      GMount *mount = l->data;
 
-      if (n_bytes_read < output_buf_size)
+      if (!mount_record_for_mount_exists (mount))
         {
-          debug_print ("read_stream: wanted %d bytes, but got %d.\n", output_buf_size, n_bytes_read);
-
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
+          mount_list_lock ();
+          mount_list = g_list_prepend (mount_list, mount_record_new (mount));
+          mount_list_unlock ();
         }
+      
+      g_object_unref (mount);
     }
-
-  return result;
+  
+  g_list_free (mounts);
 }
 
+#if 0
+
 static gint
-vfs_read (const gchar *path, gchar *buf, size_t size,
-          off_t offset, struct fuse_file_info *fi)
+file_info_get_attribute_as_int (GFileInfo *file_info, const gchar *attribute)
 {
-  GFile *file;
-  gint   result = 0;
+  GFileAttributeType attribute_type;
+  gint               int_result;
 
-  debug_print ("vfs_read: %s\n", path);
+  attribute_type = g_file_info_get_attribute_type (file_info, attribute);
 
-  if ((file = file_from_full_path (path)))
+  switch (attribute_type)
     {
-      FileHandle *fh = get_file_handle_from_info (fi);
-
-      if (fh)
-        {
-          g_mutex_lock (&fh->mutex);
+      case G_FILE_ATTRIBUTE_TYPE_UINT32:
+        int_result = g_file_info_get_attribute_uint32 (file_info, attribute);
+        break;
 
-          result = setup_input_stream (file, fh);
+      case G_FILE_ATTRIBUTE_TYPE_INT32:
+        int_result = g_file_info_get_attribute_int32 (file_info, attribute);
+        break;
 
-          if (result == 0)
-            {
-              result = read_stream (fh, buf, size, offset);
-            }
-          else
-            {
-              debug_print ("vfs_read: failed to setup input_stream!\n");
-            }
+      case G_FILE_ATTRIBUTE_TYPE_UINT64:
+        int_result = g_file_info_get_attribute_uint64 (file_info, attribute);
+        break;
 
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
-        }
-      else
-        {
-          result = -EINVAL;
-        }
+      case G_FILE_ATTRIBUTE_TYPE_INT64:
+        int_result = g_file_info_get_attribute_int64 (file_info, attribute);
+        break;
 
-      g_object_unref (file);
-    }
-  else
-    {
-      result = -EIO;
+      default:
+        int_result = 0;
+        g_assert_not_reached ();
+        break;
     }
 
-  if (result < 0)
-    debug_print ("vfs_read: -> %s\n", g_strerror (-result));
-  else
-    debug_print ("vfs_read: -> %d bytes read.\n", result);
-
-  return result;
+  return int_result;
 }
 
-static gint
-write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
-{
-  GOutputStream *output_stream;
-  gint           n_bytes_written = 0;
-  gint           result          = 0;
-  GError        *error           = NULL;
-
-  debug_print ("write_stream: %d bytes at offset %d.\n", input_buf_size, offset);
-
-  output_stream = fh->stream;
-
-  if (offset != fh->pos)
-    {
-      if (g_seekable_can_seek (G_SEEKABLE (output_stream)))
-        {
-          /* Can seek */
+#endif
 
-          if (g_seekable_seek (G_SEEKABLE (output_stream), offset, G_SEEK_SET, NULL, &error))
-            {
-              fh->pos = offset;
-            }
-          else
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
-      else
-        {
-          /* Can't seek, and output streams can't skip */
+static guint
+file_info_get_attribute_as_uint (GFileInfo *file_info, const gchar *attribute)
+{
+  GFileAttributeType attribute_type;
+  guint              uint_result;
 
-          result = -ENOTSUP;
-        }
-    }
+  attribute_type = g_file_info_get_attribute_type (file_info, attribute);
 
-  if (result == 0)
+  switch (attribute_type)
     {
-      while (n_bytes_written < input_buf_size)
-        {
-          gboolean part_result;
-          gsize    part_bytes_written = 0;
-
-          part_result = g_output_stream_write_all (output_stream,
-                                                   (void *) (input_buf + n_bytes_written),
-                                                   input_buf_size - n_bytes_written,
-                                                   &part_bytes_written,
-                                                   NULL,
-                                                   &error);
+      case G_FILE_ATTRIBUTE_TYPE_UINT32:
+        uint_result = g_file_info_get_attribute_uint32 (file_info, attribute);
+        break;
 
-          n_bytes_written += part_bytes_written;
-          fh->pos += part_bytes_written;
+      case G_FILE_ATTRIBUTE_TYPE_INT32:
+        uint_result = g_file_info_get_attribute_int32 (file_info, attribute);
+        break;
 
-          if (!part_result)
-            break;
-        }
+      case G_FILE_ATTRIBUTE_TYPE_UINT64:
+        uint_result = g_file_info_get_attribute_uint64 (file_info, attribute);
+        break;
 
-      result = n_bytes_written;
+      case G_FILE_ATTRIBUTE_TYPE_INT64:
+        uint_result = g_file_info_get_attribute_int64 (file_info, attribute);
+        break;
 
-      if (n_bytes_written < input_buf_size)
-        {
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
-      else if (!g_output_stream_flush (output_stream, NULL, &error))
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
+      default:
+        uint_result = 0;
+        g_assert_not_reached ();
+        break;
     }
 
-  return result;
+  return uint_result;
 }
 
-static gint
-vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
-           struct fuse_file_info *fi)
+static gboolean
+path_is_mount_list (const gchar *path)
 {
-  GFile *file;
-  gint   result = 0;
+  while (*path == '/')
+    path++;
 
-  debug_print ("vfs_write: %s\n", path);
+  return *path == 0;
+}
 
-  if ((file = file_from_full_path (path)))
-    {
-      FileHandle *fh = get_file_handle_from_info (fi);
 
-      if (fh)
-        {
-          g_mutex_lock (&fh->mutex);
+static gboolean
+path_is_below (gpointer key, gpointer value, gpointer path)
+{
+  gsize len = strlen (path);
 
-          result = setup_output_stream (file, fh, 0);
-          if (result == 0)
-            {
-              result = write_stream (fh, buf, len, offset);
-            }
+  return strncmp (key, path, len) == 0 &&
+    (((gchar *) key)[len] == '\0' || ((gchar *) key)[len] == '/');
+}
 
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
-        }
-      else
-        {
-          result = -EINVAL;
-        }
+static GFile *
+file_resolve_full_path (const gchar *path)
+{
+  gchar *mount_name;
+  GFile *file = NULL;
+  const gchar *s1, *s2;
+  GFile *root;
 
-      g_object_unref (file);
-    }
-  else
+  file = NULL;
+  
+  s1 = path;
+  while (*s1 == '/')
+    s1++;
+  
+  if (*s1)
     {
-      result = -EIO;
+      s2 = strchr (s1, '/');
+      if (s2 == NULL)
+        s2 = s1 + strlen (s1);
+      
+      mount_name = g_strndup (s1, s2 - s1);
+      root = mount_record_find_root_by_mount_name (mount_name);
+      g_free (mount_name);
+      
+      if (root)
+        {
+          while (*s2 == '/')
+            s2++;
+          file = g_file_resolve_relative_path (root, s2);
+          g_object_unref (root);
+        }
     }
 
-  if (result < 0)
-    debug_print ("vfs_write: -> %s\n", g_strerror (-result));
-  else
-    debug_print ("vfs_write: -> %d bytes written.\n", result);
+  return file;
+}
 
-  return result;
+/* ----- *
+ * Nodes *
+ * ----- */
+
+static Node *
+node_new (fuse_ino_t ino, const gchar *path)
+{
+  Node *node;
+
+  node = g_slice_new0 (Node);
+  node->ino = ino;
+  node->path = g_strdup (path);
+
+  g_hash_table_insert (node_by_ino, GSIZE_TO_POINTER (ino), node);
+  g_hash_table_insert (node_by_path, node->path, node);
+
+  return node;
 }
 
-static gint
-vfs_flush (const gchar *path, struct fuse_file_info *fi)
+static void
+node_free (Node *node)
 {
-  FileHandle *fh = get_file_handle_from_info (fi);
+  if (node->path)
+    g_hash_table_remove (node_by_path, node->path);
+  g_hash_table_remove (node_by_ino, GSIZE_TO_POINTER (node->ino));
 
-  debug_print ("vfs_flush: %s\n", path);
+  g_clear_object (&node->file);
+  g_free (node->path);
+  g_slice_free (Node, node);
+}
 
-  if (fh)
-    {
-      g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
-      g_mutex_unlock (&fh->mutex);
+/* Counts a lookup of @path by the kernel and returns its inode */
+static fuse_ino_t
+node_lookup (const gchar *path)
+{
+  Node       *node;
+  fuse_ino_t  ino;
 
-      /* get_file_handle_from_info () adds a "working ref", so release that. */
-      file_handle_unref (fh);
-    }
+  g_mutex_lock (&node_mutex);
 
-  /* TODO: Error handling. */
-  return 0;
+  node = g_hash_table_lookup (node_by_path, path);
+  if (node == NULL)
+    node = node_new (next_ino++, path);
+
+  node->nlookup++;
+  ino = node->ino;
+
+  g_mutex_unlock (&node_mutex);
+
+  return ino;
 }
 
-static gint
-vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
+static void
+node_forget (fuse_ino_t ino, guint64 nlookup)
 {
-  FileHandle *fh = get_file_handle_from_info (fi);
+  Node *node;
 
-  debug_print ("vfs_flush: %s\n", path);
+  g_mutex_lock (&node_mutex);
 
-  if (fh)
+  node = g_hash_table_lookup (node_by_ino, GSIZE_TO_POINTER (ino));
+  if (node)
     {
-      g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
-      g_mutex_unlock (&fh->mutex);
-
-      /* get_file_handle_from_info () adds a "working ref", so release that. */
-      file_handle_unref (fh);
+      node->nlookup -= MIN (node->nlookup, nlookup);
+      if (node->nlookup == 0 && ino != FUSE_ROOT_ID)
+        node_free (node);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  g_mutex_unlock (&node_mutex);
 }
 
-static gint
-vfs_opendir (const gchar *path, struct fuse_file_info *fi)
+/* Returns whether the file is unchanged since it was last opened,
+ * so the kernel may keep the pages it cached for it */
+static gboolean
+node_check_page_cache (fuse_ino_t ino, const struct stat *sbuf)
 {
-  GFile *file;
-  gint result = 0;
+  Node     *node;
+  gboolean  unchanged = FALSE;
 
-  debug_print ("vfs_opendir: %s\n", path);
+  g_mutex_lock (&node_mutex);
 
-  if (path_is_mount_list (path))
+  node = g_hash_table_lookup (node_by_ino, GSIZE_TO_POINTER (ino));
+  if (node)
     {
-      /* Mount list */
+      unchanged = node->opened &&
+                  node->open_mtime == sbuf->st_mtime &&
+                  node->open_size == sbuf->st_size;
+
+      node->opened = TRUE;
+      node->open_mtime = sbuf->st_mtime;
+      node->open_size = sbuf->st_size;
     }
-  else if ((file = file_from_full_path (path)) != NULL)
-    {
-      /* Submount */
 
-      /* TODO: Check that path exists */
+  g_mutex_unlock (&node_mutex);
 
-      g_object_unref (file);
-    }
+  return unchanged;
+}
+
+static gchar *
+node_get_path (fuse_ino_t ino)
+{
+  Node  *node;
+  gchar *path = NULL;
+
+  g_mutex_lock (&node_mutex);
+
+  node = g_hash_table_lookup (node_by_ino, GSIZE_TO_POINTER (ino));
+  if (node)
+    path = g_strdup (node->path);
+
+  g_mutex_unlock (&node_mutex);
+
+  return path;
+}
+
+static gchar *
+node_get_child_path (fuse_ino_t parent, const gchar *name)
+{
+  gchar *parent_path;
+  gchar *path;
+
+  parent_path = node_get_path (parent);
+  if (parent_path == NULL)
+    return NULL;
+
+  if (path_is_mount_list (parent_path))
+    path = g_strconcat ("/", name, NULL);
   else
-    {
-      /* Not found */
+    path = g_strconcat (parent_path, "/", name, NULL);
 
-      result = -ENOENT;
-    }
+  g_free (parent_path);
 
-  return result;
+  return path;
 }
 
-static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+/* Moves the nodes at and below @old_path over to @new_path. A node
+ * that was at @new_path before is cut loose; operations on it fail
+ * with ESTALE from here on. */
+static void
+node_rename (const gchar *old_path, const gchar *new_path)
 {
-  GFileEnumerator *enumerator;
-  GFileInfo       *file_info;
-  GError          *error = NULL;
+  GHashTableIter iter;
+  Node          *node;
+  GList         *moved = NULL;
+  GList         *l;
+  gsize          len = strlen (old_path);
 
-  g_assert (base_file != NULL);
+  g_mutex_lock (&node_mutex);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
-  if (!enumerator)
+  node = g_hash_table_lookup (node_by_path, new_path);
+  if (node)
     {
-      gint result;
+      g_hash_table_remove (node_by_path, node->path);
+      g_free (node->path);
+      node->path = NULL;
+      g_clear_object (&node->file);
+    }
 
-      if (error)
-        {
-          debug_print ("Error from GVFS: %s\n", error->message);
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-      else
+  g_hash_table_iter_init (&iter, node_by_path);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &node))
+    {
+      if (path_is_below (node->path, NULL, (gpointer) old_path))
         {
-          debug_print ("No file info, but no error from GVFS.\n");
-          result = -EIO;
+          g_hash_table_iter_steal (&iter);
+          moved = g_list_prepend (moved, node);
         }
-
-      return result;
     }
 
-  filler (buf, ".", NULL, 0);
-  filler (buf, "..", NULL, 0);
-
-  while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+  for (l = moved; l != NULL; l = l->next)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
-      g_object_unref (file_info);
+      gchar *path;
+
+      node = l->data;
+      path = g_strconcat (new_path, node->path + len, NULL);
+      g_free (node->path);
+      node->path = path;
+      g_clear_object (&node->file);
+      g_hash_table_insert (node_by_path, node->path, node);
     }
 
-  g_object_unref (enumerator);
+  g_list_free (moved);
 
-  return 0;
+  g_mutex_unlock (&node_mutex);
 }
 
-static gint
-vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offset,
-             struct fuse_file_info *fi)
+/* Drops the files resolved for nodes of a mount that went away */
+static void
+node_invalidate_files (const gchar *mount_name)
 {
-  GFile       *base_file;
-  gint         result = 0;
+  GHashTableIter iter;
+  Node          *node;
+  gchar         *path;
 
-  debug_print ("vfs_readdir: %s\n", path);
-
-  if (path_is_mount_list (path))
-    {
-      GList *l; 
+  path = g_strconcat ("/", mount_name, NULL);
 
-      /* Mount list */
+  g_mutex_lock (&node_mutex);
 
-      filler (buf, ".", NULL, 0);
-      filler (buf, "..", NULL, 0);
+  g_hash_table_iter_init (&iter, node_by_path);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &node))
+    {
+      if (path_is_below (node->path, NULL, path))
+        g_clear_object (&node->file);
+    }
 
-      mount_list_lock ();
+  g_mutex_unlock (&node_mutex);
 
-      for (l = mount_list; l; l = g_list_next (l))
-        {
-          MountRecord *mount_record = l->data;
+  g_free (path);
+}
 
-          filler (buf, mount_record->name, NULL, 0);
-        }
+/* Returns the file for @path, using the one cached on its node if
+ * there is one. Callers get their own copy, since set_pid_for_file()
+ * tags the object. */
+static GFile *
+file_from_full_path (const gchar *path)
+{
+  Node  *node;
+  GFile *file = NULL;
 
-      mount_list_unlock ();
-    }
-  else if ((base_file = file_from_full_path (path)))
-    {
-      /* Submount */
+  g_mutex_lock (&node_mutex);
+  node = g_hash_table_lookup (node_by_path, path);
+  if (node && node->file)
+    file = g_file_dup (node->file);
+  g_mutex_unlock (&node_mutex);
 
-      result = readdir_for_file (base_file, buf, filler);
+  if (file)
+    return file;
 
-      g_object_unref (base_file);
-    }
-  else
-    {
-      /* Not found */
+  file = file_resolve_full_path (path);
+  if (file == NULL)
+    return NULL;
 
-      result = -ENOENT;
-    }
+  g_mutex_lock (&node_mutex);
+  node = g_hash_table_lookup (node_by_path, path);
+  if (node && node->file == NULL)
+    node->file = g_file_dup (file);
+  g_mutex_unlock (&node_mutex);
 
-  return result;
+  return file;
 }
 
+/* ------------- *
+ * VFS functions *
+ * ------------- */
+
 static gint
-vfs_rename (const gchar *old_path, const gchar *new_path)
+vfs_statfs (const gchar *path, struct statvfs *stbuf)
 {
-  GFile  *old_file;
-  GFile  *new_file;
+  GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
 
-  debug_print ("vfs_rename: %s -> %s\n", old_path, new_path);
+  debug_print ("vfs_statfs: %s\n", path);
 
-  old_file = file_from_full_path (old_path);
-  new_file = file_from_full_path (new_path);
+  memset (stbuf, 0, sizeof (*stbuf));
 
-  if (old_file && new_file)
-    {
-      FileHandle *fh = get_file_handle_for_path (old_path);
+  /* Fallback case */
+  stbuf->f_bsize = 4096;
+  stbuf->f_frsize = 4096;  /* Ignored by FUSE */
+  stbuf->f_blocks = 0;
+  stbuf->f_bfree = 0;
+  stbuf->f_bavail = 0;
+  stbuf->f_files = 0;
+  stbuf->f_ffree = 0;
+  stbuf->f_favail = 0;  /* Ignored by FUSE */
+  stbuf->f_fsid = 1;  /* Ignored by FUSE */
+  stbuf->f_flag = 0;  /* Ignored by FUSE */
+  stbuf->f_namemax = 1024;
 
-      if (fh)
-        {
-          g_mutex_lock (&fh->mutex);
-          file_handle_close_stream (fh);
-        }
+  if ((file = file_from_full_path (path)))
+    {
+      GFileInfo *file_info;
 
-      g_file_move (old_file, new_file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error);
+      file_info = g_file_query_filesystem_info (file, "filesystem::*", NULL, &error);
 
-      if (error)
+      if (file_info)
         {
-          debug_print ("vfs_rename failed: %s\n", error->message);
+          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE))
+            stbuf->f_blocks = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE) / 4096;
+          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE))
+            stbuf->f_bfree = stbuf->f_bavail = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE) / 4096;
 
+          g_object_unref (file_info);
+        }
+      else if (error)
+        {
           result = -errno_from_error (error);
           g_error_free (error);
         }
       else
         {
-          reindex_file_handle_for_path (old_path, new_path);
-        }
-
-      if (fh)
-        {
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
+          result = -EIO;
         }
 
-      if (result == -EISDIR)
-        {
-          /* This makes e.g. 'mv' fall back to a recursive copy + delete operation */
-          result = -EXDEV;
-        }
-    }
-  else
-    {
-      result = -ENOENT;
+      g_object_unref (file);
     }
 
-  if (old_file)
-    g_object_unref (old_file);
-  if (new_file)
-    g_object_unref (new_file);
-
-  debug_print ("vfs_rename: -> %s\n", g_strerror (-result));
+  debug_print ("vfs_statfs: -> %s\n", g_strerror (-result));
 
   return result;
 }
 
-static gint
-vfs_unlink (const gchar *path)
+static mode_t
+file_info_get_stat_mode (GFileInfo *file_info)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
-
-  debug_print ("vfs_unlink: %s\n", path);
+  GFileType         file_type;
+  mode_t            unix_mode;
 
-  file = file_from_full_path (path);
+  file_type = g_file_info_get_file_type (file_info);
 
-  if (file)
+  switch (file_type)
     {
-      FileHandle *fh = get_file_handle_for_path (path);
+      case G_FILE_TYPE_REGULAR:
+        unix_mode = S_IFREG;
+        break;
 
-      if (fh)
-        {
-          g_mutex_lock (&fh->mutex);
-          file_handle_close_stream (fh);
-        }
+      case G_FILE_TYPE_DIRECTORY:
+      case G_FILE_TYPE_MOUNTABLE:
+        unix_mode = S_IFDIR;
+        break;
 
-      g_file_delete (file, NULL, &error);
+      case G_FILE_TYPE_SYMBOLIC_LINK:
+      case G_FILE_TYPE_SHORTCUT:
+        unix_mode = S_IFLNK;
+        break;
 
-      if (fh)
-        {
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
-        }
+      case G_FILE_TYPE_SPECIAL:
+      default:
+        unix_mode = 0;
+        break;
+    }
 
-      if (error)
-        {
-          debug_print ("vfs_unlink failed: %s (%s)\n", path, error->message);
+  if (file_type == G_FILE_TYPE_DIRECTORY ||
+      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) ||
+      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))
+    unix_mode |= S_IRUSR;
+  if (!g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) ||
+      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))
+    unix_mode |= S_IWUSR;
+  if (file_type == G_FILE_TYPE_DIRECTORY ||
+      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) ||
+      g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))
+    unix_mode |= S_IXUSR;
+  
+  return unix_mode;
+}
 
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
+#define STAT_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK "," \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+  G_FILE_ATTRIBUTE_UNIX_MODE "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+  G_FILE_ATTRIBUTE_TIME_ACCESS "," \
+  G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE "," \
+  G_FILE_ATTRIBUTE_UNIX_BLOCKS "," \
+  "access::*"
 
-      g_object_unref (file);
-    }
-  else
-    {
-      result = -ENOENT;
-    }
+static void
+file_info_to_stat (GFileInfo *file_info, struct stat *sbuf)
+{
+  GTimeVal mod_time;
 
-  debug_print ("vfs_unlink: -> %s\n", g_strerror (-result));
+  sbuf->st_mode = file_info_get_stat_mode (file_info);
+  sbuf->st_size = g_file_info_get_size (file_info);
+  sbuf->st_uid = daemon_uid;
+  sbuf->st_gid = daemon_gid;
 
-  return result;
+  g_file_info_get_modification_time (file_info, &mod_time);
+  sbuf->st_mtime = mod_time.tv_sec;
+  sbuf->st_ctime = mod_time.tv_sec;
+  sbuf->st_atime = mod_time.tv_sec;
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
+    sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
+    sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
+    sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
+    sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
+  else /* fake it to make 'du' work like 'du --apparent'. */
+    sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+
+  /* Setting st_nlink to 1 for directories makes 'find' work */
+  sbuf->st_nlink = 1;
 }
 
 static gint
-vfs_mkdir (const gchar *path, mode_t mode)
+getattr_for_file (GFile *file, struct stat *sbuf)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
-
-  debug_print ("vfs_mkdir: %s\n", path);
+  GFileInfo *file_info;
+  GError    *error  = NULL;
+  gint       result = 0;
 
-  file = file_from_full_path (path);
+  file_info = g_file_query_info (file, STAT_ATTRIBUTES, 0, NULL, &error);
 
-  if (file)
+  if (file_info)
+    {
+      file_info_to_stat (file_info, sbuf);
+      g_object_unref (file_info);
+    }
+  else
     {
-      if (g_file_make_directory (file, NULL, &error))
-        {
-          /* Ignore errors setting the mode. We already created the directory, and that's
-           * good enough. */
-          g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, NULL);
-        }
-
       if (error)
         {
+          debug_print ("Error from GVFS: %s\n", error->message);
           result = -errno_from_error (error);
           g_error_free (error);
         }
-
-      g_object_unref (file);
-    }
-  else
-    {
-      result = -ENOENT;
+      else
+        {
+          debug_print ("No file info, but no error from GVFS.\n");
+          result = -EIO;
+        }
     }
 
-  debug_print ("vfs_mkdir: -> %s\n", g_strerror (-result));
-
   return result;
 }
 
-static gint
-vfs_rmdir (const gchar *path)
+/* ---------- *
+ * Stat cache *
+ * ---------- */
+
+static void
+stat_cache_entry_free (StatCacheEntry *entry)
 {
-  GFile  *file;
-  GError *error = NULL;
-  gint   result = 0;
+  g_slice_free (StatCacheEntry, entry);
+}
 
-  debug_print ("vfs_rmdir: %s\n", path);
+static void
+dir_monitor_free (DirMonitor *dir_monitor)
+{
+  g_file_monitor_cancel (dir_monitor->monitor);
+  g_object_unref (dir_monitor->monitor);
+  g_slice_free (DirMonitor, dir_monitor);
+}
 
-  file = file_from_full_path (path);
+static void
+monitored_dir_free (gpointer data, GClosure *closure)
+{
+  MonitoredDir *monitored_dir = data;
 
-  if (file)
-    {
-      GFileInfo *file_info;
+  g_free (monitored_dir->path);
+  g_object_unref (monitored_dir->file);
+  g_slice_free (MonitoredDir, monitored_dir);
+}
 
-      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
-      if (file_info)
-        {
-          if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
-            {
-              g_file_delete (file, NULL, &error);
+static gboolean
+stat_cache_lookup (const gchar *path, struct stat *sbuf)
+{
+  StatCacheEntry *entry;
+  gboolean        found = FALSE;
 
-              if (error)
-                {
-                  result = -errno_from_error (error);
-                  g_error_free (error);
-                }
-            }
-          else
-            {
-              result = -ENOTDIR;
-            }
-        }
-      else
-        {
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-          else
-            {
-              result = -ENOENT;
-            }
-        }
+  g_mutex_lock (&stat_cache_mutex);
+
+  entry = g_hash_table_lookup (stat_cache, path);
+  if (entry && entry->expires > g_get_monotonic_time ())
+    {
+      *sbuf = entry->stat;
+      found = TRUE;
     }
-  else
+  else if (entry)
     {
-      result = -ENOENT;
+      g_hash_table_remove (stat_cache, path);
     }
 
-  debug_print ("vfs_rmdir: -> %s\n", g_strerror (-result));
+  g_mutex_unlock (&stat_cache_mutex);
 
-  return result;
+  return found;
+}
+
+/* Take this before querying the backend, and pass it to stat_cache_insert() */
+static guint64
+stat_cache_get_generation (void)
+{
+  guint64 generation;
+
+  g_mutex_lock (&stat_cache_mutex);
+  generation = stat_cache_generation;
+  g_mutex_unlock (&stat_cache_mutex);
+
+  return generation;
 }
 
 static gboolean
-file_handle_get_size (FileHandle *fh,
-		      goffset *size)
+stat_cache_entry_is_expired (gpointer key, gpointer value, gpointer now)
 {
-  GFileInfo *info;
-  gboolean res;
+  return ((StatCacheEntry *) value)->expires <= *(gint64 *) now;
+}
 
-  if (fh->stream == NULL)
-    return FALSE;
-  
-  info = NULL;
-  if (fh->op == FILE_OP_READ)
-    info = g_file_input_stream_query_info (fh->stream,
-					   G_FILE_ATTRIBUTE_STANDARD_SIZE,
-					   NULL, NULL);
-  else if (fh->op == FILE_OP_WRITE)
-    info = g_file_output_stream_query_info (fh->stream,
-					    G_FILE_ATTRIBUTE_STANDARD_SIZE,
-					    NULL, NULL);
+/* Drops the stat if anything got invalidated since @generation was taken,
+ * as it may have been read before a change that invalidation was for */
+static void
+stat_cache_insert (const gchar *path, const struct stat *sbuf, guint64 generation)
+{
+  StatCacheEntry *entry;
+  gint64          now = g_get_monotonic_time ();
 
-  res = FALSE;
-  if (info)
+  g_mutex_lock (&stat_cache_mutex);
+
+  if (generation != stat_cache_generation)
     {
-      if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
-	{
-	  *size = g_file_info_get_size (info);
-	  res = TRUE;
-	}
-      g_object_unref (info);
+      g_mutex_unlock (&stat_cache_mutex);
+      return;
     }
-  return res;
+
+  entry = g_slice_new (StatCacheEntry);
+  entry->stat = *sbuf;
+  entry->expires = now + STAT_CACHE_TTL * G_USEC_PER_SEC;
+
+  if (g_hash_table_size (stat_cache) >= STAT_CACHE_MAX_ENTRIES)
+    {
+      g_hash_table_foreach_remove (stat_cache, stat_cache_entry_is_expired, &now);
+      if (g_hash_table_size (stat_cache) >= STAT_CACHE_MAX_ENTRIES)
+        g_hash_table_remove_all (stat_cache);
+    }
+  g_hash_table_insert (stat_cache, g_strdup (path), entry);
+
+  g_mutex_unlock (&stat_cache_mutex);
 }
 
-#define PAD_BLOCK_SIZE 65536
+static void
+stat_cache_invalidate (const gchar *path)
+{
+  g_mutex_lock (&stat_cache_mutex);
+  stat_cache_generation++;
+  g_hash_table_remove (stat_cache, path);
+  g_mutex_unlock (&stat_cache_mutex);
+}
 
-static gint
-pad_file (FileHandle *fh, gsize num, goffset current_size)
+/* Also drops everything below @path, for directories */
+static void
+stat_cache_invalidate_tree (const gchar *path)
 {
-  gpointer buf;
-  gsize written;
-  gint res;
+  g_mutex_lock (&stat_cache_mutex);
+  stat_cache_generation++;
+  g_hash_table_foreach_remove (stat_cache, path_is_below, (gpointer) path);
+  g_mutex_unlock (&stat_cache_mutex);
+}
 
-  res = 0;
-  buf = g_malloc0 (PAD_BLOCK_SIZE);
-  for (written = 0; written < num; written += PAD_BLOCK_SIZE)
+static void
+dir_monitor_changed (GFileMonitor      *monitor,
+                     GFile             *file,
+                     GFile             *other_file,
+                     GFileMonitorEvent  event_type,
+                     MonitoredDir      *monitored_dir)
+{
+  GFile *changed[2] = { file, other_file };
+  gint   i;
+
+  for (i = 0; i < 2 && changed[i] != NULL; i++)
     {
-      res = write_stream (fh, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
-      if (res < 0)
-        break;
+      gchar *relative_path, *path;
+
+      if (g_file_equal (changed[i], monitored_dir->file))
+        {
+          stat_cache_invalidate_tree (monitored_dir->path);
+          continue;
+        }
+
+      relative_path = g_file_get_relative_path (monitored_dir->file, changed[i]);
+      if (relative_path == NULL)
+        continue;
+
+      path = g_build_filename (monitored_dir->path, relative_path, NULL);
+      stat_cache_invalidate_tree (path);
+      g_free (path);
+      g_free (relative_path);
     }
-  g_free (buf);
+}
 
-  return (res < 0 ? res : 0);
+static gboolean
+dir_monitor_exists (const gchar *path)
+{
+  DirMonitor *dir_monitor;
+
+  dir_monitor = g_hash_table_lookup (dir_monitors, path);
+  if (dir_monitor)
+    dir_monitor->last_used = g_get_monotonic_time ();
+
+  return dir_monitor != NULL;
 }
 
-static gint
-vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
+/* Watches the directory at @path, so stats cached for its children can
+ * be dropped when they change. Not all backends support monitoring, for
+ * those the cache just relies on its timeout. */
+static void
+dir_monitor_add (const gchar *path, GFile *file)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
-  goffset current_size;
+  GFileMonitor  *monitor;
+  MonitoredDir  *monitored_dir;
+  DirMonitor    *dir_monitor;
+  GHashTableIter iter;
+  gpointer       key, value;
+  gchar         *oldest = NULL;
+  DirMonitor    *evicted = NULL;
+  gint64         oldest_time = G_MAXINT64;
+  gboolean       exists;
+
+  g_mutex_lock (&stat_cache_mutex);
+  exists = dir_monitor_exists (path);
+  g_mutex_unlock (&stat_cache_mutex);
+  if (exists)
+    return;
 
-  debug_print ("vfs_ftruncate: %s\n", path);
+  monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, NULL);
+  if (!monitor)
+    return;
 
-  file = file_from_full_path (path);
+  monitored_dir = g_slice_new (MonitoredDir);
+  monitored_dir->path = g_strdup (path);
+  monitored_dir->file = g_object_ref (file);
+  g_signal_connect_data (monitor, "changed", G_CALLBACK (dir_monitor_changed),
+                         monitored_dir, monitored_dir_free, 0);
 
-  if (file)
+  g_mutex_lock (&stat_cache_mutex);
+
+  if (dir_monitor_exists (path))
     {
-      FileHandle *fh = get_file_handle_from_info (fi);
+      g_mutex_unlock (&stat_cache_mutex);
+      g_file_monitor_cancel (monitor);
+      g_object_unref (monitor);
+      return;
+    }
 
-      if (fh)
+  if (g_hash_table_size (dir_monitors) >= MAX_DIR_MONITORS)
+    {
+      g_hash_table_iter_init (&iter, dir_monitors);
+      while (g_hash_table_iter_next (&iter, &key, &value))
         {
-          g_mutex_lock (&fh->mutex);
+          if (((DirMonitor *) value)->last_used < oldest_time)
+            {
+              oldest = key;
+              oldest_time = ((DirMonitor *) value)->last_used;
+            }
+        }
+      /* freed outside the lock, cancelling talks to the daemon */
+      evicted = g_hash_table_lookup (dir_monitors, oldest);
+      g_hash_table_steal (dir_monitors, oldest);
+    }
 
-          result = setup_output_stream (file, fh, 0);
+  dir_monitor = g_slice_new (DirMonitor);
+  dir_monitor->monitor = monitor;
+  dir_monitor->last_used = g_get_monotonic_time ();
+  g_hash_table_insert (dir_monitors, g_strdup (path), dir_monitor);
 
-          if (result == 0)
-            {
-              if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
-                {
-                  g_seekable_truncate (fh->stream, size, NULL, &error);
-                }
-              else if (size == 0)
-                {
-                  g_output_stream_close (fh->stream, NULL, NULL);
-                  g_object_unref (fh->stream);
-                  fh->stream = NULL;
+  g_mutex_unlock (&stat_cache_mutex);
 
-                  fh->stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
+  if (evicted)
+    {
+      g_free (oldest);
+      dir_monitor_free (evicted);
+    }
+}
 
-                  if (fh->stream != NULL)
-                    {
-                      /* The stream created by g_file_replace() won't always replace
-                       * the file until it's been closed. So close it now to make
-                       * future operations consistent. */
-                      g_output_stream_close (fh->stream, NULL, NULL);
-                      g_object_unref (fh->stream);
-                      fh->stream = NULL;
-                    }
-                }
-              else if (file_handle_get_size (fh, &current_size))
-                {
-                  if (current_size == size)
-                    {
-                      /* Don't have to do anything to succeed */
-                    }
-                  else if ((current_size < size) && g_seekable_can_seek (G_SEEKABLE (fh->stream)))
-                    {
-                      /* If the truncated size is larger than the current size
-                       * then we need to pad out the difference with 0's */
-                     goffset orig_pos = g_seekable_tell (G_SEEKABLE (fh->stream));
-                     result = pad_file (fh, size - current_size, current_size);
-                     g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, NULL);
-                    }
-		}
-	      else
-		{
-		  result = -ENOTSUP;
-                }
+static void
+getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
+{
+  sbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IXUSR;
+  sbuf->st_uid = daemon_uid;
+  sbuf->st_gid = daemon_gid;
+  sbuf->st_nlink = 1;
+  sbuf->st_size = fh->pos;
+  sbuf->st_blksize = 512;
+  sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+}
 
-              if (error)
-                {
-                  result = -errno_from_error (error);
-                  g_error_free (error);
-                }
-            }
+static gint
+vfs_getattr (const gchar *path, struct stat *sbuf)
+{
+  GFile      *file;
+  guint64     generation;
+  gint        result = 0;
 
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
+  debug_print ("vfs_getattr: %s\n", path);
+
+  memset (sbuf, 0, sizeof (*sbuf));
+
+  sbuf->st_dev = 0;                     /* dev_t     ID of device containing file */
+  sbuf->st_ino = 0;                     /* ino_t     inode number */
+  sbuf->st_uid = 0;                     /* uid_t     user ID of owner */
+  sbuf->st_gid = 0;                     /* gid_t     group ID of owner */
+  sbuf->st_rdev = 0;                    /* dev_t     device ID (if special file) */
+  sbuf->st_size = 0;                    /* off_t     total size, in bytes */
+  sbuf->st_blocks = 0;                  /* blkcnt_t  number of blocks allocated */
+  sbuf->st_atime = 0;                   /* time_t    time of last access */
+  sbuf->st_mtime = 0;                   /* time_t    time of last modification */
+  sbuf->st_ctime = 0;                   /* time_t    time of last status change */
+  sbuf->st_blksize = 4096;              /* blksize_t blocksize for filesystem I/O */
+
+  if (path_is_mount_list (path))
+    {
+      /* Mount list */
+
+      sbuf->st_mode = S_IFDIR | 0500;                   /* mode_t    protection */
+      sbuf->st_nlink = 2 + g_list_length (mount_list);  /* nlink_t   number of hard links */
+      sbuf->st_atime = daemon_creation_time;
+      sbuf->st_mtime = daemon_creation_time;
+      sbuf->st_ctime = daemon_creation_time;
+      sbuf->st_uid   = daemon_uid;
+      sbuf->st_gid   = daemon_gid;
+    }
+  else if (stat_cache_lookup (path, sbuf))
+    {
+      /* Cached by readdir or an earlier getattr */
+    }
+  else if ((file = file_from_full_path (path)))
+    {
+      /* Submount */
+
+      generation = stat_cache_get_generation ();
+      result = getattr_for_file (file, sbuf);
+
+      if (result == 0)
+        {
+          stat_cache_insert (path, sbuf, generation);
         }
       else
         {
-          result = -EINVAL;
+          FileHandle *fh = get_file_handle_for_path (path);
+
+          /* Some backends don't create new files until their stream has
+           * been closed. So, if the path doesn't exist, but we have a stream
+           * associated with it, pretend it's there. */
+
+          if (fh != NULL)
+            {
+              g_mutex_lock (&fh->mutex);
+              getattr_for_file_handle (fh, sbuf);
+              g_mutex_unlock (&fh->mutex);
+
+              file_handle_unref (fh);
+              result = 0;
+            }
         }
 
       g_object_unref (file);
@@ -1947,514 +2421,2305 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
-  debug_print ("vfs_ftruncate: -> %s\n", g_strerror (-result));
+  if (options.spool && !path_is_mount_list (path))
+    {
+      FileHandle *fh = get_file_handle_for_path (path);
+
+      /* Spooled writes aren't uploaded yet, the size is ours */
+      if (fh != NULL)
+        {
+          g_mutex_lock (&fh->mutex);
+          if (fh->spool_fd >= 0)
+            {
+              if (result != 0)
+                getattr_for_file_handle (fh, sbuf);
+              sbuf->st_size = fh->spool_size;
+              sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+              result = 0;
+            }
+          g_mutex_unlock (&fh->mutex);
+
+          file_handle_unref (fh);
+        }
+    }
+
+  debug_print ("vfs_getattr: -> %s\n", g_strerror (-result));
 
   return result;
 }
 
 static gint
-vfs_truncate (const gchar *path, off_t size)
+vfs_readlink (const gchar *path, gchar *target, size_t size)
+{
+  debug_print ("vfs_readlink: %s\n", path);
+
+  /* This is not implemented because it would allow remote servers to launch
+   * symlink attacks on the local machine.  There's not much of a use for
+   * "readlink" anyway since we don't pass G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+   * so non-broken symlinks will be followed transparently. */
+
+  return -ENOSYS;
+}
+
+/* Uploads what was spooled for @fh. Called with fh->mutex held. */
+static gint
+file_handle_spool_sync (FileHandle *fh)
+{
+  GFile *file;
+  gint   result;
+
+  if (fh->spool_fd < 0 || !fh->spool_dirty)
+    return 0;
+
+  file = file_from_full_path (fh->path);
+  if (file == NULL)
+    return -ENOENT;
+
+  result = file_handle_spool_upload (fh, file);
+  g_object_unref (file);
+
+  stat_cache_invalidate (fh->path);
+
+  return result;
+}
+
+static gint
+setup_output_stream (GFile *file, FileHandle *fh, int flags)
 {
-  GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
 
-  debug_print ("vfs_truncate: %s\n", path);
+  if (fh->stream)
+    {
+      if (fh->op == FILE_OP_WRITE)
+        {
+        }
+      else
+        {
+          g_input_stream_close (fh->stream, NULL, NULL);
+          g_object_unref (fh->stream);
+          fh->stream = NULL;
+        }
+    }
+
+  if (!fh->stream)
+    {
+      read_cache_clear (fh->read_cache);
+
+      if (flags & O_TRUNC)
+        fh->stream = g_file_replace (file, NULL, FALSE, 0, NULL, &error);
+      else
+        fh->stream = g_file_append_to (file, 0, NULL, &error);
+      if (fh->stream)
+        fh->pos = g_seekable_tell (G_SEEKABLE (fh->stream));
+    }
+
+  if (fh->stream)
+    fh->op = FILE_OP_WRITE;
+  else
+    fh->op = FILE_OP_NONE;
+
+  if (error)
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
+
+  return result;
+}
+
+static gint
+open_common (const gchar *path, struct fuse_file_info *fi, GFile *file, int output_flags)
+{
+  gint        result = 0;
+  FileHandle *fh = get_or_create_file_handle_for_path (path);
+
+  g_mutex_lock (&fh->mutex);
+
+  SET_FILE_HANDLE (fi, fh);
+
+  debug_print ("open_common: flags=%o\n", fi->flags);
+
+  /* Set up a stream here, so we can check for errors */
+  set_pid_for_file (file);
+
+  if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
+    {
+      if (options.spool)
+        result = file_handle_spool_open (fh, file, fi->flags | output_flags);
+      else
+        result = setup_output_stream (file, fh, fi->flags | output_flags);
+    }
+  else if (fh->spool_fd < 0)
+    {
+      if (fh->op == FILE_OP_WRITE)
+        file_handle_close_stream (fh);
+      result = read_cache_open (fh->read_cache, file);
+    }
+
+  g_mutex_unlock (&fh->mutex);
+
+  /* The added reference to the file handle is released in vfs_release() */
+  return result;
+}
+
+static gint
+vfs_open (const gchar *path, struct fuse_file_info *fi)
+{
+  GFile *file;
+  gint   result = 0;
+
+  debug_print ("vfs_open: %s\n", path);
+
+  if (path_is_mount_list (path))
+    result = -EISDIR;
+  else if ((file = file_from_full_path (path)))
+    {
+      GFileInfo *file_info;
+      GError    *error = NULL;
+
+      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+
+      if (file_info)
+        {
+          GFileType file_type = g_file_info_get_file_type (file_info);
+
+          if (file_type == G_FILE_TYPE_REGULAR)
+            {
+              result = open_common (path, fi, file, 0);
+            }
+          else if (file_type == G_FILE_TYPE_DIRECTORY)
+            {
+              /* EISDIR is supposedly only for attempts to write to directory handles,
+               * but outside readdir(), we don't support reading them either. */
+              result = -EISDIR;
+            }
+          else
+            {
+              result = -EACCES;
+            }
+
+          g_object_unref (file_info);
+        }
+      else
+        {
+          if (error)
+            {
+              debug_print ("Error from GVFS: %s\n", error->message);
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+          else
+            {
+              debug_print ("No file info, but no error from GVFS.\n");
+              result = -EIO;
+            }
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  debug_print ("vfs_open: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
+{
+  GFile *file;
+  gint   result = 0;
+
+  debug_print ("vfs_create: %s\n", path);
+
+  if (path_is_mount_list (path))
+    result = -EEXIST;
+  if ((file = file_from_full_path (path)))
+    {
+      GFileInfo *file_info;
+      GError    *error = NULL;
+
+      set_pid_for_file (file);
+
+      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+
+      if (file_info)
+        {
+          result = -EEXIST;
+          g_object_unref (file_info);
+        }
+      else
+        {
+          GFileOutputStream *file_output_stream;
+
+          if (error)
+            {
+              g_error_free (error);
+              error = NULL;
+            }
+
+          file_output_stream = g_file_create (file, 0, NULL, &error);
+          if (file_output_stream)
+            {
+              FileHandle *fh = get_or_create_file_handle_for_path (path);
+
+              /* Success */
+
+              g_mutex_lock (&fh->mutex);
+
+              SET_FILE_HANDLE (fi, fh);
+
+              file_handle_close_stream (fh);
+              read_cache_clear (fh->read_cache);
+              fh->stream = file_output_stream;
+              fh->op = FILE_OP_WRITE;
+
+              if (options.spool)
+                {
+                  /* Closing makes the empty file exist, its data
+                   * comes with the upload */
+                  file_handle_close_stream (fh);
+                  result = file_handle_spool_open (fh, file, O_TRUNC);
+                }
+
+              g_mutex_unlock (&fh->mutex);
+
+              /* The reference added to the file handle is released in vfs_release() */
+              if (result != 0)
+                file_handle_unref (fh);
+            }
+          else
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_create: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_release (const gchar *path, struct fuse_file_info *fi)
+{
+  FileHandle *fh = get_file_handle_from_info (fi);
+
+  debug_print ("vfs_release: %s\n", path);
+
+  if (fh)
+    {
+      /* Normally done by the flush before, unless that failed */
+      g_mutex_lock (&fh->mutex);
+      file_handle_spool_sync (fh);
+      g_mutex_unlock (&fh->mutex);
+
+      /* get_file_handle_from_info () adds a "working ref", so unref twice. */
+      file_handle_unref (fh);
+      file_handle_unref (fh);
+    }
+
+  stat_cache_invalidate (path);
+
+  return 0;
+}
+
+static gint
+vfs_read (const gchar *path, gchar *buf, size_t size,
+          off_t offset, struct fuse_file_info *fi)
+{
+  GFile *file;
+  gint   result = 0;
+
+  debug_print ("vfs_read: %s\n", path);
+
+  if ((file = file_from_full_path (path)))
+    {
+      FileHandle *fh = get_file_handle_from_info (fi);
+
+      if (fh)
+        {
+          gboolean spooled;
+
+          /* Pending writes have to show up in what is read */
+          g_mutex_lock (&fh->mutex);
+          spooled = fh->spool_fd >= 0;
+          if (spooled)
+            result = file_handle_spool_read (fh, buf, size, offset);
+          else if (fh->op == FILE_OP_WRITE)
+            file_handle_close_stream (fh);
+          g_mutex_unlock (&fh->mutex);
+
+          /* Not under fh->mutex, so reads of the same file run in parallel */
+          if (!spooled)
+            result = read_cache_read (fh->read_cache, file, buf, size, offset);
+
+          file_handle_unref (fh);
+        }
+      else
+        {
+          result = -EINVAL;
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -EIO;
+    }
+
+  if (result < 0)
+    debug_print ("vfs_read: -> %s\n", g_strerror (-result));
+  else
+    debug_print ("vfs_read: -> %d bytes read.\n", result);
+
+  return result;
+}
+
+static gint
+write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
+{
+  GOutputStream *output_stream;
+  gint           n_bytes_written = 0;
+  gint           result          = 0;
+  GError        *error           = NULL;
+
+  debug_print ("write_stream: %d bytes at offset %d.\n", input_buf_size, offset);
+
+  output_stream = fh->stream;
+
+  if (offset != fh->pos)
+    {
+      if (g_seekable_can_seek (G_SEEKABLE (output_stream)))
+        {
+          /* Can seek */
+
+          if (g_seekable_seek (G_SEEKABLE (output_stream), offset, G_SEEK_SET, NULL, &error))
+            {
+              fh->pos = offset;
+            }
+          else
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+        }
+      else
+        {
+          /* Can't seek, and output streams can't skip */
+
+          result = -ENOTSUP;
+        }
+    }
+
+  if (result == 0)
+    {
+      while (n_bytes_written < input_buf_size)
+        {
+          gboolean part_result;
+          gsize    part_bytes_written = 0;
+
+          part_result = g_output_stream_write_all (output_stream,
+                                                   (void *) (input_buf + n_bytes_written),
+                                                   input_buf_size - n_bytes_written,
+                                                   &part_bytes_written,
+                                                   NULL,
+                                                   &error);
+
+          n_bytes_written += part_bytes_written;
+          fh->pos += part_bytes_written;
+
+          if (!part_result)
+            break;
+        }
+
+      result = n_bytes_written;
+
+      if (n_bytes_written < input_buf_size)
+        {
+          if (error)
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+        }
+      else if (!g_output_stream_flush (output_stream, NULL, &error))
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+    }
+
+  return result;
+}
+
+static gint
+vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
+           struct fuse_file_info *fi)
+{
+  GFile *file;
+  gint   result = 0;
+
+  debug_print ("vfs_write: %s\n", path);
+
+  if ((file = file_from_full_path (path)))
+    {
+      FileHandle *fh = get_file_handle_from_info (fi);
+
+      if (fh)
+        {
+          g_mutex_lock (&fh->mutex);
+
+          if (fh->spool_fd >= 0)
+            {
+              result = file_handle_spool_write_wait (fh, buf, len, offset);
+            }
+          else
+            {
+              result = setup_output_stream (file, fh, 0);
+              if (result == 0)
+                result = write_stream (fh, buf, len, offset);
+            }
+
+          /* Also drops what concurrent reads brought in meanwhile */
+          read_cache_clear (fh->read_cache);
+
+          g_mutex_unlock (&fh->mutex);
+          file_handle_unref (fh);
+        }
+      else
+        {
+          result = -EINVAL;
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -EIO;
+    }
+
+  stat_cache_invalidate (path);
+
+  if (result < 0)
+    debug_print ("vfs_write: -> %s\n", g_strerror (-result));
+  else
+    debug_print ("vfs_write: -> %d bytes written.\n", result);
+
+  return result;
+}
+
+static gint
+vfs_flush (const gchar *path, struct fuse_file_info *fi)
+{
+  FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
+
+  debug_print ("vfs_flush: %s\n", path);
+
+  if (fh)
+    {
+      g_mutex_lock (&fh->mutex);
+      file_handle_close_stream (fh);
+      result = file_handle_spool_sync (fh);
+      g_mutex_unlock (&fh->mutex);
+
+      /* get_file_handle_from_info () adds a "working ref", so release that. */
+      file_handle_unref (fh);
+    }
+
+  stat_cache_invalidate (path);
+
+  /* TODO: Error handling for the non-spooled case. */
+  return result;
+}
+
+static gint
+vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
+{
+  FileHandle *fh = get_file_handle_from_info (fi);
+
+  gint        result = 0;
+
+  debug_print ("vfs_flush: %s\n", path);
+
+  if (fh)
+    {
+      g_mutex_lock (&fh->mutex);
+      file_handle_close_stream (fh);
+      result = file_handle_spool_sync (fh);
+      g_mutex_unlock (&fh->mutex);
+
+      /* get_file_handle_from_info () adds a "working ref", so release that. */
+      file_handle_unref (fh);
+    }
+
+  /* TODO: Error handling for the non-spooled case. */
+  return result;
+}
+
+static gint
+vfs_opendir (const gchar *path, struct fuse_file_info *fi)
+{
+  GFile *file;
+  gint result = 0;
+
+  debug_print ("vfs_opendir: %s\n", path);
+
+  if (path_is_mount_list (path))
+    {
+      /* Mount list */
+    }
+  else if ((file = file_from_full_path (path)) != NULL)
+    {
+      /* Submount */
+
+      /* TODO: Check that path exists */
+
+      g_object_unref (file);
+    }
+  else
+    {
+      /* Not found */
+
+      result = -ENOENT;
+    }
+
+  return result;
+}
+
+static void
+dir_handle_add (DirHandle *dh, const gchar *name, const struct stat *sbuf)
+{
+  DirEntry entry;
+
+  memset (&entry.stat, 0, sizeof (entry.stat));
+  if (sbuf)
+    entry.stat = *sbuf;
+  entry.stat.st_ino = UNKNOWN_INO;
+  entry.name = g_strdup (name);
+
+  g_array_append_val (dh->entries, entry);
+}
+
+static void
+dir_handle_clear (DirHandle *dh)
+{
+  guint i;
+
+  for (i = 0; i < dh->entries->len; i++)
+    g_free (g_array_index (dh->entries, DirEntry, i).name);
+  g_array_set_size (dh->entries, 0);
+}
+
+static void
+dir_handle_free (DirHandle *dh)
+{
+  dir_handle_clear (dh);
+  g_array_free (dh->entries, TRUE);
+  g_slice_free (DirHandle, dh);
+}
+
+static gint
+readdir_for_file (const gchar *path, GFile *base_file, DirHandle *dh)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *file_info;
+  GError          *error = NULL;
+  guint64          generation;
+
+  g_assert (base_file != NULL);
+
+  /* Get everything getattr needs in the same go */
+  generation = stat_cache_get_generation ();
+  enumerator = g_file_enumerate_children (base_file, STAT_ATTRIBUTES, 0, NULL, &error);
+  if (!enumerator)
+    {
+      gint result;
+
+      if (error)
+        {
+          debug_print ("Error from GVFS: %s\n", error->message);
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+      else
+        {
+          debug_print ("No file info, but no error from GVFS.\n");
+          result = -EIO;
+        }
+
+      return result;
+    }
+
+  dir_monitor_add (path, base_file);
+
+  dir_handle_add (dh, ".", NULL);
+  dir_handle_add (dh, "..", NULL);
+
+  while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+    {
+      const gchar *name = g_file_info_get_name (file_info);
+      struct stat  sbuf;
+      gchar       *child_path;
+
+      memset (&sbuf, 0, sizeof (sbuf));
+      sbuf.st_blksize = 4096;
+      file_info_to_stat (file_info, &sbuf);
+
+      child_path = g_strconcat (path, "/", name, NULL);
+      stat_cache_insert (child_path, &sbuf, generation);
+      g_free (child_path);
+
+      dir_handle_add (dh, name, &sbuf);
+      g_object_unref (file_info);
+    }
+
+  g_object_unref (enumerator);
+
+  return 0;
+}
+
+static gint
+vfs_readdir (const gchar *path, DirHandle *dh)
+{
+  GFile       *base_file;
+  gint         result = 0;
+
+  debug_print ("vfs_readdir: %s\n", path);
+
+  if (path_is_mount_list (path))
+    {
+      GList *l; 
+
+      /* Mount list */
+
+      struct stat sbuf;
+
+      memset (&sbuf, 0, sizeof (sbuf));
+      sbuf.st_mode = S_IFDIR;
+
+      dir_handle_add (dh, ".", NULL);
+      dir_handle_add (dh, "..", NULL);
+
+      mount_list_lock ();
+
+      for (l = mount_list; l; l = g_list_next (l))
+        {
+          MountRecord *mount_record = l->data;
+
+          dir_handle_add (dh, mount_record->name, &sbuf);
+        }
+
+      mount_list_unlock ();
+    }
+  else if ((base_file = file_from_full_path (path)))
+    {
+      /* Submount */
+
+      result = readdir_for_file (path, base_file, dh);
+
+      g_object_unref (base_file);
+    }
+  else
+    {
+      /* Not found */
+
+      result = -ENOENT;
+    }
+
+  return result;
+}
+
+static gint
+vfs_rename (const gchar *old_path, const gchar *new_path)
+{
+  GFile  *old_file;
+  GFile  *new_file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_rename: %s -> %s\n", old_path, new_path);
+
+  old_file = file_from_full_path (old_path);
+  new_file = file_from_full_path (new_path);
+
+  if (old_file && new_file)
+    {
+      FileHandle *fh = get_file_handle_for_path (old_path);
+
+      if (fh)
+        {
+          g_mutex_lock (&fh->mutex);
+          file_handle_close_stream (fh);
+        }
+
+      g_file_move (old_file, new_file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error);
+
+      if (error)
+        {
+          debug_print ("vfs_rename failed: %s\n", error->message);
+
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+      else
+        {
+          reindex_file_handle_for_path (old_path, new_path);
+        }
+
+      if (fh)
+        {
+          g_mutex_unlock (&fh->mutex);
+          file_handle_unref (fh);
+        }
+
+      if (result == -EISDIR)
+        {
+          /* This makes e.g. 'mv' fall back to a recursive copy + delete operation */
+          result = -EXDEV;
+        }
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  if (old_file)
+    g_object_unref (old_file);
+  if (new_file)
+    g_object_unref (new_file);
+
+  stat_cache_invalidate_tree (old_path);
+  stat_cache_invalidate_tree (new_path);
+
+  debug_print ("vfs_rename: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_unlink (const gchar *path)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_unlink: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      FileHandle *fh = get_file_handle_for_path (path);
+
+      if (fh)
+        {
+          g_mutex_lock (&fh->mutex);
+          file_handle_close_stream (fh);
+        }
+
+      g_file_delete (file, NULL, &error);
+
+      if (fh)
+        {
+          read_cache_clear (fh->read_cache);
+          if (!error)
+            file_handle_spool_drop (fh);
+          g_mutex_unlock (&fh->mutex);
+          file_handle_unref (fh);
+        }
+
+      if (error)
+        {
+          debug_print ("vfs_unlink failed: %s (%s)\n", path, error->message);
+
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_unlink: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_mkdir (const gchar *path, mode_t mode)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_mkdir: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      if (g_file_make_directory (file, NULL, &error))
+        {
+          /* Ignore errors setting the mode. We already created the directory, and that's
+           * good enough. */
+          g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, NULL);
+        }
+
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_mkdir: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_rmdir (const gchar *path)
+{
+  GFile  *file;
+  GError *error = NULL;
+  gint   result = 0;
+
+  debug_print ("vfs_rmdir: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      GFileInfo *file_info;
+
+      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+      if (file_info)
+        {
+          if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+            {
+              g_file_delete (file, NULL, &error);
+
+              if (error)
+                {
+                  result = -errno_from_error (error);
+                  g_error_free (error);
+                }
+            }
+          else
+            {
+              result = -ENOTDIR;
+            }
+        }
+      else
+        {
+          if (error)
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+          else
+            {
+              result = -ENOENT;
+            }
+        }
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate_tree (path);
+
+  debug_print ("vfs_rmdir: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gboolean
+file_handle_get_size (FileHandle *fh,
+		      goffset *size)
+{
+  GFileInfo *info;
+  gboolean res;
+
+  if (fh->stream == NULL)
+    return FALSE;
+  
+  info = NULL;
+  if (fh->op == FILE_OP_READ)
+    info = g_file_input_stream_query_info (fh->stream,
+					   G_FILE_ATTRIBUTE_STANDARD_SIZE,
+					   NULL, NULL);
+  else if (fh->op == FILE_OP_WRITE)
+    info = g_file_output_stream_query_info (fh->stream,
+					    G_FILE_ATTRIBUTE_STANDARD_SIZE,
+					    NULL, NULL);
+
+  res = FALSE;
+  if (info)
+    {
+      if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+	{
+	  *size = g_file_info_get_size (info);
+	  res = TRUE;
+	}
+      g_object_unref (info);
+    }
+  return res;
+}
+
+#define PAD_BLOCK_SIZE 65536
+
+static gint
+pad_file (FileHandle *fh, gsize num, goffset current_size)
+{
+  gpointer buf;
+  gsize written;
+  gint res;
+
+  res = 0;
+  buf = g_malloc0 (PAD_BLOCK_SIZE);
+  for (written = 0; written < num; written += PAD_BLOCK_SIZE)
+    {
+      res = write_stream (fh, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
+      if (res < 0)
+        break;
+    }
+  g_free (buf);
+
+  return (res < 0 ? res : 0);
+}
+
+static gint
+vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+  goffset current_size;
+
+  debug_print ("vfs_ftruncate: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      FileHandle *fh = get_file_handle_from_info (fi);
+
+      if (fh)
+        {
+          g_mutex_lock (&fh->mutex);
+
+          if (fh->spool_fd >= 0)
+            result = file_handle_spool_truncate (fh, size);
+          else
+            result = setup_output_stream (file, fh, 0);
+
+          if (result == 0 && fh->spool_fd < 0)
+            {
+              if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
+                {
+                  g_seekable_truncate (fh->stream, size, NULL, &error);
+                }
+              else if (size == 0)
+                {
+                  g_output_stream_close (fh->stream, NULL, NULL);
+                  g_object_unref (fh->stream);
+                  fh->stream = NULL;
+
+                  fh->stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
+
+                  if (fh->stream != NULL)
+                    {
+                      /* The stream created by g_file_replace() won't always replace
+                       * the file until it's been closed. So close it now to make
+                       * future operations consistent. */
+                      g_output_stream_close (fh->stream, NULL, NULL);
+                      g_object_unref (fh->stream);
+                      fh->stream = NULL;
+                    }
+                }
+              else if (file_handle_get_size (fh, &current_size))
+                {
+                  if (current_size == size)
+                    {
+                      /* Don't have to do anything to succeed */
+                    }
+                  else if ((current_size < size) && g_seekable_can_seek (G_SEEKABLE (fh->stream)))
+                    {
+                      /* If the truncated size is larger than the current size
+                       * then we need to pad out the difference with 0's */
+                     goffset orig_pos = g_seekable_tell (G_SEEKABLE (fh->stream));
+                     result = pad_file (fh, size - current_size, current_size);
+                     g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, NULL);
+                    }
+		}
+	      else
+		{
+		  result = -ENOTSUP;
+                }
+
+              if (error)
+                {
+                  result = -errno_from_error (error);
+                  g_error_free (error);
+                }
+            }
+
+          read_cache_clear (fh->read_cache);
+          g_mutex_unlock (&fh->mutex);
+          file_handle_unref (fh);
+        }
+      else
+        {
+          result = -EINVAL;
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_ftruncate: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_truncate (const gchar *path, off_t size)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_truncate: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      GFileOutputStream *file_output_stream = NULL;
+      FileHandle        *fh;
+
+      /* Get a file handle just to lock the path while we're working */
+      fh = get_file_handle_for_path (path);
+      if (fh)
+        g_mutex_lock (&fh->mutex);
+
+      if (fh && fh->spool_fd >= 0)
+        {
+          result = file_handle_spool_truncate (fh, size);
+        }
+      else if (size == 0)
+        {
+          file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
+        }
+      else
+        {
+          file_output_stream = g_file_append_to (file, 0, NULL, &error);
+          if (file_output_stream)
+              g_seekable_truncate (G_SEEKABLE (file_output_stream), size, NULL, &error);
+        }
+
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+
+      if (file_output_stream)
+        {
+          g_output_stream_close (G_OUTPUT_STREAM (file_output_stream), NULL, NULL);
+          g_object_unref (file_output_stream);
+        }
+
+      if (fh)
+        {
+          read_cache_clear (fh->read_cache);
+          g_mutex_unlock (&fh->mutex);
+          file_handle_unref (fh);
+        }
+
+      g_object_unref (file);
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_truncate: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_symlink (const gchar *path_old, const gchar *path_new)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_symlink: %s -> %s\n", path_new, path_old);
+
+  file = file_from_full_path (path_new);
+
+  if (file)
+    {
+      g_file_make_symbolic_link (file, path_old, NULL, &error);
+
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path_new);
+
+  debug_print ("vfs_symlink: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_access (const gchar *path, gint mode)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_access: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      GFileInfo *file_info;
+
+      file_info = g_file_query_info (file,
+                                     G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
+                                     G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
+                                     G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
+                                     0, NULL, &error);
+      if (file_info)
+        {
+          if ((mode & R_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
+                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))) ||
+              (mode & W_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
+                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))) ||
+              (mode & X_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
+                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))))
+            result = -EACCES;
+
+          g_object_unref (file_info);
+        }
+      else if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+      else
+        {
+          result = -EIO;
+        }
+
+      if (result != 0)
+        {
+          FileHandle *fh = get_file_handle_for_path (path);
+
+          /* Some backends don't create new files until their stream has
+           * been closed. So, if the path doesn't exist, but we have a stream
+           * associated with it, pretend it's there. */
+
+          if (fh != NULL)
+            {
+              file_handle_unref (fh);
+
+              /* The file was presumably created by us, so indicate full access. */
+              result = 0;
+            }
+        }
+
+      g_object_unref (file);
+    }
+  else if (path_is_mount_list (path))
+    {
+      result = 0;
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  debug_print ("vfs_access: -> %s\n", g_strerror (-result));
+  return result;
+}
+
+static gint
+vfs_utimens (const gchar *path, const struct timespec tv [2])
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  debug_print ("vfs_utimens: %s\n", path);
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      guint64 atime;
+      guint32 atime_usec;
+      guint64 mtime;
+      guint32 mtime_usec;
+      GFileInfo *info;
+
+      if (tv)
+        {
+          atime = (guint64) tv [0].tv_sec;
+          atime_usec = (guint32) tv [0].tv_nsec / (guint32) 1000;
+          mtime = (guint64) tv [1].tv_sec;
+          mtime_usec = (guint32) tv [1].tv_nsec / (guint32) 1000;
+        }
+      else
+        {
+          struct timeval tiv;
+
+          gettimeofday (&tiv, NULL);
+          atime = (guint64) tiv.tv_sec;
+          atime_usec = (guint32) tiv.tv_usec;
+          mtime = atime;
+          mtime_usec = atime_usec;
+        }
+
+      info = g_file_info_new ();
+      g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime);
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC, mtime_usec);
+      g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS, atime);
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_ACCESS_USEC, atime_usec);
+
+      g_file_set_attributes_from_info (file, info, 0, NULL, &error);
+
+      if (error)
+        {
+          /* As long as not all backends support all attributes we set,
+             report failure only if neither mtime and atime have been set. */
+          if (g_file_info_get_attribute_status (info, G_FILE_ATTRIBUTE_TIME_ACCESS) == G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING &&
+              g_file_info_get_attribute_status (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) == G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING)
+            {
+              /* Note: we only get first error from the attributes we try to set,  might not be accurate
+                       (a limitation of g_file_set_attributes_from_info()). */
+              result = -errno_from_error (error);
+            }
+          g_error_free (error);
+        }
+
+      g_object_unref (file);
+      g_object_unref (info);
+    }
+  else if (path_is_mount_list (path))
+    {
+      /* */
+    }
+  else
+    {
+      result = -ENOENT;
+    }
+
+  stat_cache_invalidate (path);
+
+  debug_print ("vfs_utimens: -> %s\n", g_strerror (-result));
+  return result;
+}
+
+static gint
+vfs_chmod (const gchar *path, mode_t mode)
+{
+  GFile  *file;
+  GError *error  = NULL;
+  gint    result = 0;
+
+  file = file_from_full_path (path);
+
+  if (file)
+    {
+      g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, &error);
+
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+
+      g_object_unref (file);
+    }
+
+  stat_cache_invalidate (path);
+
+  return result;
+}
+
+static void
+mount_tracker_mounted_cb (GVolumeMonitor *volume_monitor,
+                          GMount         *mount)
+{
+  MountRecord *mount_record;
+
+  if (mount_record_for_mount_exists (mount))
+    return;
+
+  mount_record = mount_record_new (mount);
+
+  mount_list_lock ();
+  mount_list = g_list_prepend (mount_list, mount_record);
+  mount_list_unlock ();
+}
+
+static void
+mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
+                            GMount         *mount)
+{
+  GFile *root;
+  GList *l;
+
+  root = g_mount_get_root (mount);
+
+  mount_list_lock ();
+
+  for (l = mount_list; l != NULL; l = l->next)
+    {
+      MountRecord *mount_record = l->data;
+
+      if (g_file_equal (root, mount_record->root))
+        {
+          mount_list = g_list_delete_link (mount_list, l);
+          node_invalidate_files (mount_record->name);
+          mount_record_free (mount_record);
+          break;
+        }
+    }
+
+  mount_list_unlock ();
+
+  g_object_unref (root);
+}
+
+static gpointer
+subthread_main (gpointer data)
+{
+  
+  mount_list_update ();
+  
+  g_signal_connect (volume_monitor, "mount_added", (GCallback) mount_tracker_mounted_cb, NULL);
+  g_signal_connect (volume_monitor, "mount_removed", (GCallback) mount_tracker_unmounted_cb, NULL);
+
+  g_main_loop_run (subthread_main_loop);
+
+  g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_mounted_cb, NULL);
+  g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_unmounted_cb, NULL);
+
+  g_main_loop_unref (subthread_main_loop);
+  subthread_main_loop = NULL;
+
+  g_object_unref (volume_monitor);
+  volume_monitor = NULL;
+
+  /* Tell the main thread to unmount. Using kill() is necessary according to FUSE maintainers. */
+  kill (getpid (), SIGHUP);
+
+  return NULL;
+}
+
+static void 
+name_vanished_handler (GDBusConnection *connection,
+                       const gchar *name,
+                       gpointer user_data)
+{
+  /* The daemon died, unmount */
+  g_main_loop_quit (subthread_main_loop);
+}
+
+static void
+dbus_connection_closed (GDBusConnection *connection,
+                        gboolean         remote_peer_vanished,
+                        GError          *error,
+                        gpointer user_data)
+{
+  /* Session bus died, unmount */
+  g_main_loop_quit (subthread_main_loop);
+}
+
+static void
+register_fuse_cb (GVfsDBusMountTracker *proxy,
+                  GAsyncResult  *res,
+                  gpointer user_data)
+{
+  GError *error = NULL;
+
+  if (! gvfs_dbus_mount_tracker_call_register_fuse_finish (proxy, res, &error))
+    {
+      g_printerr ("register_fuse_cb: Error sending a message: %s (%s, %d)\n",
+                  error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+    }
+}
+
+static void
+vfs_init (gpointer userdata, struct fuse_conn_info *conn)
+{
+  GVfsDBusMountTracker *proxy;
+  GError *error;
+  
+  daemon_creation_time = time (NULL);
+  daemon_uid = getuid ();
+  daemon_gid = getgid ();
+
+  global_path_to_fh_map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 NULL, (GDestroyNotify) file_handle_free);
+  global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                NULL, NULL);
+  stat_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free, (GDestroyNotify) stat_cache_entry_free);
+  dir_monitors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, (GDestroyNotify) dir_monitor_free);
+  node_by_ino = g_hash_table_new (g_direct_hash, g_direct_equal);
+  node_by_path = g_hash_table_new (g_str_hash, g_str_equal);
+  node_new (FUSE_ROOT_ID, "/")->nlookup = 1;
+
+  
+  error = NULL;
+  dbus_conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (! dbus_conn)
+    {
+      g_warning ("Failed to connect to the D-BUS daemon: %s (%s, %d)",
+                 error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+      return;
+    }
+  
+  g_dbus_connection_set_exit_on_close (dbus_conn, FALSE);
+  g_signal_connect (dbus_conn, "closed", G_CALLBACK (dbus_connection_closed), NULL);
+
+  proxy = gvfs_dbus_mount_tracker_proxy_new_sync (dbus_conn,
+                                                  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                  G_VFS_DBUS_DAEMON_NAME,
+                                                  G_VFS_DBUS_MOUNTTRACKER_PATH,
+                                                  NULL,
+                                                  &error);
+  if (proxy == NULL)
+    {
+      g_printerr ("vfs_init(): Error creating proxy: %s (%s, %d)\n",
+                  error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+      return;
+    }
+
+  /* Allow the gvfs daemon autostart */
+  daemon_name_watcher = g_bus_watch_name_on_connection (dbus_conn,
+                                                        G_VFS_DBUS_DAEMON_NAME,
+                                                        G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+                                                        NULL,
+                                                        name_vanished_handler,
+                                                        NULL,
+                                                        NULL);
+  
+  gvfs_dbus_mount_tracker_call_register_fuse (proxy,
+                                              NULL,
+                                              (GAsyncReadyCallback) register_fuse_cb,
+                                              NULL);
+  g_object_unref (proxy);
+
+  
+  gvfs = g_vfs_get_default ();
+  
+  volume_monitor = g_object_new (g_type_from_name ("GDaemonVolumeMonitor"), NULL);
+  
+  subthread_main_loop = g_main_loop_new (NULL, FALSE);
+  subthread = g_thread_new ("gvfs-fuse-sub", (GThreadFunc) subthread_main, NULL);
+
+  /* Indicate O_TRUNC support for open() */
+  conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+  /* Let the kernel send concurrent reads, read ahead as far as the read
+   * cache does and write more than a page at a time */
+  conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES);
+  conn->max_readahead = MIN (conn->max_readahead, READ_AHEAD_MAX_BLOCKS * READ_BLOCK_SIZE);
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+  /* Drop cached pages when a file changes while it is open */
+  conn->want |= conn->capable & FUSE_CAP_AUTO_INVAL_DATA;
+#endif
+}
+
+static void
+vfs_destroy (gpointer userdata)
+{
+  if (daemon_name_watcher)
+    g_bus_unwatch_name (daemon_name_watcher);
+  g_clear_object (&dbus_conn);
+  
+  mount_list_free ();
+  if (subthread_main_loop != NULL) 
+    g_main_loop_quit (subthread_main_loop);
+  g_object_unref (gvfs);
+}
+
+/* ------------------ *
+ * Low-level frontend *
+ * ------------------ */
+
+/* Replies ESTALE itself if @ino is gone */
+static gchar *
+request_get_path (fuse_req_t req, fuse_ino_t ino)
+{
+  gchar *path;
+
+  g_private_set (&current_request, req);
+
+  path = node_get_path (ino);
+  if (path == NULL)
+    fuse_reply_err (req, ESTALE);
+
+  return path;
+}
+
+static gchar *
+request_get_child_path (fuse_req_t req, fuse_ino_t parent, const gchar *name)
+{
+  gchar *path;
+
+  g_private_set (&current_request, req);
+
+  path = node_get_child_path (parent, name);
+  if (path == NULL)
+    fuse_reply_err (req, ESTALE);
+
+  return path;
+}
+
+static gint
+lookup_entry (const gchar *path, struct fuse_entry_param *e)
+{
+  gint result;
 
-  file = file_from_full_path (path);
+  memset (e, 0, sizeof (*e));
 
-  if (file)
+  result = vfs_getattr (path, &e->attr);
+  if (result == 0)
     {
-      GFileOutputStream *file_output_stream = NULL;
-      FileHandle        *fh;
+      e->ino = node_lookup (path);
+      e->attr.st_ino = e->ino;
+      e->attr_timeout = STAT_CACHE_TTL;
+      e->entry_timeout = STAT_CACHE_TTL;
+    }
 
-      /* Get a file handle just to lock the path while we're working */
-      fh = get_file_handle_for_path (path);
-      if (fh)
-        g_mutex_lock (&fh->mutex);
+  return result;
+}
 
-      if (size == 0)
-        {
-          file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
-        }
-      else
-        {
-          file_output_stream = g_file_append_to (file, 0, NULL, &error);
-          if (file_output_stream)
-              g_seekable_truncate (G_SEEKABLE (file_output_stream), size, NULL, &error);
-        }
+static void
+reply_entry (fuse_req_t req, const gchar *path)
+{
+  struct fuse_entry_param e;
+  gint                    result;
 
-      if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
+  result = lookup_entry (path, &e);
 
-      if (file_output_stream)
-        {
-          g_output_stream_close (G_OUTPUT_STREAM (file_output_stream), NULL, NULL);
-          g_object_unref (file_output_stream);
-        }
+  if (result != 0)
+    fuse_reply_err (req, -result);
+  else if (fuse_reply_entry (req, &e) == -ENOENT)
+    node_forget (e.ino, 1);  /* Interrupted, the kernel didn't get it */
+}
 
-      if (fh)
-        {
-          g_mutex_unlock (&fh->mutex);
-          file_handle_unref (fh);
-        }
+static void
+ll_lookup (fuse_req_t req, fuse_ino_t parent, const gchar *name)
+{
+  gchar *path;
 
-      g_object_unref (file);
-    }
-  else
-    {
-      result = -ENOENT;
-    }
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-  debug_print ("vfs_truncate: -> %s\n", g_strerror (-result));
+  reply_entry (req, path);
+  g_free (path);
+}
 
-  return result;
+static void
+ll_forget (fuse_req_t req, fuse_ino_t ino, gulong nlookup)
+{
+  node_forget (ino, nlookup);
+  fuse_reply_none (req);
 }
 
-static gint
-vfs_symlink (const gchar *path_old, const gchar *path_new)
+#if FUSE_VERSION >= 29
+static void
+ll_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
+  size_t i;
 
-  debug_print ("vfs_symlink: %s -> %s\n", path_new, path_old);
+  for (i = 0; i < count; i++)
+    node_forget (forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none (req);
+}
+#endif
 
-  file = file_from_full_path (path_new);
+static void
+ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat sbuf;
+  gchar      *path;
+  gint        result;
 
-  if (file)
-    {
-      g_file_make_symbolic_link (file, path_old, NULL, &error);
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
 
-      if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
+  result = vfs_getattr (path, &sbuf);
+  if (result == 0)
+    {
+      sbuf.st_ino = ino;
+      fuse_reply_attr (req, &sbuf, STAT_CACHE_TTL);
     }
   else
     {
-      result = -ENOENT;
+      fuse_reply_err (req, -result);
     }
 
-  debug_print ("vfs_symlink: -> %s\n", g_strerror (-result));
-
-  return result;
+  g_free (path);
 }
 
-static gint
-vfs_access (const gchar *path, gint mode)
+static void
+ll_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+            gint to_set, struct fuse_file_info *fi)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
+  gchar *path;
+  gint   result = 0;
 
-  debug_print ("vfs_access: %s\n", path);
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
 
-  file = file_from_full_path (path);
+  if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    result = -ENOSYS;
 
-  if (file)
+  if (result == 0 && (to_set & FUSE_SET_ATTR_MODE))
+    result = vfs_chmod (path, attr->st_mode);
+
+  if (result == 0 && (to_set & FUSE_SET_ATTR_SIZE))
     {
-      GFileInfo *file_info;
+      if (fi)
+        result = vfs_ftruncate (path, attr->st_size, fi);
+      else
+        result = vfs_truncate (path, attr->st_size);
+    }
 
-      file_info = g_file_query_info (file,
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
-                                     0, NULL, &error);
-      if (file_info)
-        {
-          if ((mode & R_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))) ||
-              (mode & W_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))) ||
-              (mode & X_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))))
-            result = -EACCES;
+  if (result == 0 && (to_set & (FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)))
+    {
+      result = vfs_utimens (path, NULL);
+    }
+  else if (result == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    {
+      struct timespec tv [2];
 
-          g_object_unref (file_info);
-        }
-      else if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-      else
+      memset (tv, 0, sizeof (tv));
+      tv [0].tv_sec = attr->st_atime;
+      tv [1].tv_sec = attr->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_ATIM_TV_NSEC
+      tv [0].tv_nsec = attr->st_atim.tv_nsec;
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+      tv [1].tv_nsec = attr->st_mtim.tv_nsec;
+#endif
+
+      result = vfs_utimens (path, tv);
+    }
+
+  if (result == 0)
+    {
+      struct stat sbuf;
+
+      result = vfs_getattr (path, &sbuf);
+      if (result == 0)
         {
-          result = -EIO;
+          sbuf.st_ino = ino;
+          fuse_reply_attr (req, &sbuf, STAT_CACHE_TTL);
         }
+    }
 
-      if (result != 0)
-        {
-          FileHandle *fh = get_file_handle_for_path (path);
+  if (result != 0)
+    fuse_reply_err (req, -result);
 
-          /* Some backends don't create new files until their stream has
-           * been closed. So, if the path doesn't exist, but we have a stream
-           * associated with it, pretend it's there. */
+  g_free (path);
+}
 
-          if (fh != NULL)
-            {
-              file_handle_unref (fh);
+static void
+ll_readlink (fuse_req_t req, fuse_ino_t ino)
+{
+  gchar  target [PATH_MAX];
+  gchar *path;
+  gint   result;
 
-              /* The file was presumably created by us, so indicate full access. */
-              result = 0;
-            }
-        }
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
 
-      g_object_unref (file);
-    }
-  else if (path_is_mount_list (path))
-    {
-      result = 0;
-    }
+  result = vfs_readlink (path, target, sizeof (target));
+  if (result == 0)
+    fuse_reply_readlink (req, target);
   else
-    {
-      result = -ENOENT;
-    }
+    fuse_reply_err (req, -result);
 
-  debug_print ("vfs_access: -> %s\n", g_strerror (-result));
-  return result;
+  g_free (path);
 }
 
-static gint
-vfs_utimens (const gchar *path, const struct timespec tv [2])
+static void
+ll_mkdir (fuse_req_t req, fuse_ino_t parent, const gchar *name, mode_t mode)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
-
-  debug_print ("vfs_utimens: %s\n", path);
+  gchar *path;
+  gint   result;
 
-  file = file_from_full_path (path);
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-  if (file)
-    {
-      guint64 atime;
-      guint32 atime_usec;
-      guint64 mtime;
-      guint32 mtime_usec;
-      GFileInfo *info;
+  result = vfs_mkdir (path, mode);
+  if (result == 0)
+    reply_entry (req, path);
+  else
+    fuse_reply_err (req, -result);
 
-      if (tv)
-        {
-          atime = (guint64) tv [0].tv_sec;
-          atime_usec = (guint32) tv [0].tv_nsec / (guint32) 1000;
-          mtime = (guint64) tv [1].tv_sec;
-          mtime_usec = (guint32) tv [1].tv_nsec / (guint32) 1000;
-        }
-      else
-        {
-          struct timeval tiv;
+  g_free (path);
+}
 
-          gettimeofday (&tiv, NULL);
-          atime = (guint64) tiv.tv_sec;
-          atime_usec = (guint32) tiv.tv_usec;
-          mtime = atime;
-          mtime_usec = atime_usec;
-        }
+static void
+ll_unlink (fuse_req_t req, fuse_ino_t parent, const gchar *name)
+{
+  gchar *path;
 
-      info = g_file_info_new ();
-      g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime);
-      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC, mtime_usec);
-      g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS, atime);
-      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_ACCESS_USEC, atime_usec);
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-      g_file_set_attributes_from_info (file, info, 0, NULL, &error);
+  fuse_reply_err (req, -vfs_unlink (path));
+  g_free (path);
+}
 
-      if (error)
-        {
-          /* As long as not all backends support all attributes we set,
-             report failure only if neither mtime and atime have been set. */
-          if (g_file_info_get_attribute_status (info, G_FILE_ATTRIBUTE_TIME_ACCESS) == G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING &&
-              g_file_info_get_attribute_status (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) == G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING)
-            {
-              /* Note: we only get first error from the attributes we try to set,  might not be accurate
-                       (a limitation of g_file_set_attributes_from_info()). */
-              result = -errno_from_error (error);
-            }
-          g_error_free (error);
-        }
+static void
+ll_rmdir (fuse_req_t req, fuse_ino_t parent, const gchar *name)
+{
+  gchar *path;
 
-      g_object_unref (file);
-      g_object_unref (info);
-    }
-  else if (path_is_mount_list (path))
-    {
-      /* */
-    }
-  else
-    {
-      result = -ENOENT;
-    }
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-  debug_print ("vfs_utimens: -> %s\n", g_strerror (-result));
-  return result;
+  fuse_reply_err (req, -vfs_rmdir (path));
+  g_free (path);
 }
 
-static gint
-vfs_chmod (const gchar *path, mode_t mode)
+static void
+ll_symlink (fuse_req_t req, const gchar *link, fuse_ino_t parent, const gchar *name)
 {
-  GFile  *file;
-  GError *error  = NULL;
-  gint    result = 0;
+  gchar *path;
+  gint   result;
 
-  file = file_from_full_path (path);
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-  if (file)
-    {
-      g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, &error);
+  result = vfs_symlink (link, path);
+  if (result == 0)
+    reply_entry (req, path);
+  else
+    fuse_reply_err (req, -result);
 
-      if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
+  g_free (path);
+}
+
+static void
+ll_rename (fuse_req_t req, fuse_ino_t parent, const gchar *name,
+           fuse_ino_t newparent, const gchar *newname)
+{
+  gchar *old_path;
+  gchar *new_path;
+  gint   result;
 
-      g_object_unref (file);
+  if ((old_path = request_get_child_path (req, parent, name)) == NULL)
+    return;
+  if ((new_path = request_get_child_path (req, newparent, newname)) == NULL)
+    {
+      g_free (old_path);
+      return;
     }
 
-  return result;
+  result = vfs_rename (old_path, new_path);
+  if (result == 0)
+    node_rename (old_path, new_path);
+
+  fuse_reply_err (req, -result);
+
+  g_free (old_path);
+  g_free (new_path);
 }
 
 static void
-mount_tracker_mounted_cb (GVolumeMonitor *volume_monitor,
-                          GMount         *mount)
+ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  MountRecord *mount_record;
+  struct stat sbuf;
+  gchar      *path;
+  gint        result;
 
-  if (mount_record_for_mount_exists (mount))
+  if ((path = request_get_path (req, ino)) == NULL)
     return;
 
-  mount_record = mount_record_new (mount);
+  result = vfs_open (path, fi);
 
-  mount_list_lock ();
-  mount_list = g_list_prepend (mount_list, mount_record);
-  mount_list_unlock ();
+  /* Validated against the stat cache, like the kernel's attributes */
+  if (result == 0 && vfs_getattr (path, &sbuf) == 0)
+    fi->keep_cache = node_check_page_cache (ino, &sbuf);
+
+  if (result != 0)
+    fuse_reply_err (req, -result);
+  else if (fuse_reply_open (req, fi) == -ENOENT)
+    vfs_release (path, fi);
+
+  g_free (path);
 }
 
 static void
-mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
-                            GMount         *mount)
+ll_create (fuse_req_t req, fuse_ino_t parent, const gchar *name,
+           mode_t mode, struct fuse_file_info *fi)
 {
-  GFile *root;
-  GList *l;
-
-  root = g_mount_get_root (mount);
+  struct fuse_entry_param e;
+  gchar                  *path;
+  gint                    result;
 
-  mount_list_lock ();
+  if ((path = request_get_child_path (req, parent, name)) == NULL)
+    return;
 
-  for (l = mount_list; l != NULL; l = l->next)
+  result = vfs_create (path, mode, fi);
+  if (result == 0)
     {
-      MountRecord *mount_record = l->data;
+      result = lookup_entry (path, &e);
 
-      if (g_file_equal (root, mount_record->root))
+      if (result != 0)
         {
-          mount_list = g_list_delete_link (mount_list, l);
-          mount_record_free (mount_record);
-          break;
+          vfs_release (path, fi);
+        }
+      else if (fuse_reply_create (req, &e, fi) == -ENOENT)
+        {
+          vfs_release (path, fi);
+          node_forget (e.ino, 1);
         }
     }
 
-  mount_list_unlock ();
+  if (result != 0)
+    fuse_reply_err (req, -result);
 
-  g_object_unref (root);
+  g_free (path);
 }
 
-static gpointer
-subthread_main (gpointer data)
+static void
+ll_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+         struct fuse_file_info *fi)
 {
-  
-  mount_list_update ();
-  
-  g_signal_connect (volume_monitor, "mount_added", (GCallback) mount_tracker_mounted_cb, NULL);
-  g_signal_connect (volume_monitor, "mount_removed", (GCallback) mount_tracker_unmounted_cb, NULL);
+  gchar *path;
+  gchar *buf;
+  gint   result;
 
-  g_main_loop_run (subthread_main_loop);
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
 
-  g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_mounted_cb, NULL);
-  g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_unmounted_cb, NULL);
+  buf = g_malloc (size);
 
-  g_main_loop_unref (subthread_main_loop);
-  subthread_main_loop = NULL;
+  result = vfs_read (path, buf, size, offset, fi);
+  if (result >= 0)
+    fuse_reply_buf (req, buf, result);
+  else
+    fuse_reply_err (req, -result);
 
-  g_object_unref (volume_monitor);
-  volume_monitor = NULL;
+  g_free (buf);
+  g_free (path);
+}
 
-  /* Tell the main thread to unmount. Using kill() is necessary according to FUSE maintainers. */
-  kill (getpid (), SIGHUP);
+static void
+ll_write (fuse_req_t req, fuse_ino_t ino, const gchar *buf, size_t size,
+          off_t offset, struct fuse_file_info *fi)
+{
+  gchar *path;
+  gint   result;
 
-  return NULL;
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  result = vfs_write (path, buf, size, offset, fi);
+  if (result >= 0)
+    fuse_reply_write (req, result);
+  else
+    fuse_reply_err (req, -result);
+
+  g_free (path);
 }
 
-static void 
-name_vanished_handler (GDBusConnection *connection,
-                       const gchar *name,
-                       gpointer user_data)
+static void
+ll_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  /* The daemon died, unmount */
-  g_main_loop_quit (subthread_main_loop);
+  gchar *path;
+
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  fuse_reply_err (req, -vfs_flush (path, fi));
+  g_free (path);
 }
 
 static void
-dbus_connection_closed (GDBusConnection *connection,
-                        gboolean         remote_peer_vanished,
-                        GError          *error,
-                        gpointer user_data)
+ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  /* Session bus died, unmount */
-  g_main_loop_quit (subthread_main_loop);
+  gchar *path;
+
+  /* The handle has to go even if a rename cut the node loose */
+  g_private_set (&current_request, req);
+  path = node_get_path (ino);
+
+  fuse_reply_err (req, -vfs_release (path ? path : "", fi));
+  g_free (path);
 }
 
 static void
-register_fuse_cb (GVfsDBusMountTracker *proxy,
-                  GAsyncResult  *res,
-                  gpointer user_data)
+ll_fsync (fuse_req_t req, fuse_ino_t ino, gint datasync, struct fuse_file_info *fi)
 {
-  GError *error = NULL;
+  gchar *path;
 
-  if (! gvfs_dbus_mount_tracker_call_register_fuse_finish (proxy, res, &error))
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  fuse_reply_err (req, -vfs_fsync (path, datasync, fi));
+  g_free (path);
+}
+
+static void
+ll_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  DirHandle *dh;
+  gchar     *path;
+  gint       result;
+
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  result = vfs_opendir (path, fi);
+  if (result == 0)
     {
-      g_printerr ("register_fuse_cb: Error sending a message: %s (%s, %d)\n",
-                  error->message, g_quark_to_string (error->domain), error->code);
-      g_error_free (error);
+      dh = g_slice_new (DirHandle);
+      dh->entries = g_array_new (FALSE, FALSE, sizeof (DirEntry));
+      SET_FILE_HANDLE (fi, dh);
+
+      if (fuse_reply_open (req, fi) == -ENOENT)
+        dir_handle_free (dh);
+    }
+  else
+    {
+      fuse_reply_err (req, -result);
     }
+
+  g_free (path);
 }
 
-static gpointer
-vfs_init (struct fuse_conn_info *conn)
+static void
+ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+            struct fuse_file_info *fi)
 {
-  GVfsDBusMountTracker *proxy;
-  GError *error;
-  
-  daemon_creation_time = time (NULL);
-  daemon_uid = getuid ();
-  daemon_gid = getgid ();
+  DirHandle *dh = GET_FILE_HANDLE (fi);
+  gchar     *path;
+  gchar     *buf;
+  gsize      len = 0;
+  guint      i;
 
-  global_path_to_fh_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                 NULL, (GDestroyNotify) file_handle_free);
-  global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                                NULL, NULL);
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
 
-  
-  error = NULL;
-  dbus_conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-  if (! dbus_conn)
+  if (offset == 0)
     {
-      g_warning ("Failed to connect to the D-BUS daemon: %s (%s, %d)",
-                 error->message, g_quark_to_string (error->domain), error->code);
-      g_error_free (error);
-      return NULL;
+      gint result;
+
+      dir_handle_clear (dh);
+
+      result = vfs_readdir (path, dh);
+      if (result != 0)
+        {
+          fuse_reply_err (req, -result);
+          g_free (path);
+          return;
+        }
     }
-  
-  g_dbus_connection_set_exit_on_close (dbus_conn, FALSE);
-  g_signal_connect (dbus_conn, "closed", G_CALLBACK (dbus_connection_closed), NULL);
 
-  proxy = gvfs_dbus_mount_tracker_proxy_new_sync (dbus_conn,
-                                                  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                                                  G_VFS_DBUS_DAEMON_NAME,
-                                                  G_VFS_DBUS_MOUNTTRACKER_PATH,
-                                                  NULL,
-                                                  &error);
-  if (proxy == NULL)
+  buf = g_malloc (size);
+
+  for (i = offset; i < dh->entries->len; i++)
     {
-      g_printerr ("vfs_init(): Error creating proxy: %s (%s, %d)\n",
-                  error->message, g_quark_to_string (error->domain), error->code);
-      g_error_free (error);
-      return NULL;
+      DirEntry *entry = &g_array_index (dh->entries, DirEntry, i);
+      gsize     entry_size;
+
+      entry_size = fuse_add_direntry (req, buf + len, size - len,
+                                      entry->name, &entry->stat, i + 1);
+      if (entry_size > size - len)
+        break;
+      len += entry_size;
     }
 
-  /* Allow the gvfs daemon autostart */
-  daemon_name_watcher = g_bus_watch_name_on_connection (dbus_conn,
-                                                        G_VFS_DBUS_DAEMON_NAME,
-                                                        G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
-                                                        NULL,
-                                                        name_vanished_handler,
-                                                        NULL,
-                                                        NULL);
-  
-  gvfs_dbus_mount_tracker_call_register_fuse (proxy,
-                                              NULL,
-                                              (GAsyncReadyCallback) register_fuse_cb,
-                                              NULL);
-  g_object_unref (proxy);
+  fuse_reply_buf (req, buf, len);
 
-  
-  gvfs = g_vfs_get_default ();
-  
-  volume_monitor = g_object_new (g_type_from_name ("GDaemonVolumeMonitor"), NULL);
-  
-  subthread_main_loop = g_main_loop_new (NULL, FALSE);
-  subthread = g_thread_new ("gvfs-fuse-sub", (GThreadFunc) subthread_main, NULL);
+  g_free (buf);
+  g_free (path);
+}
 
-  /* Indicate O_TRUNC support for open() */
-  conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+static void
+ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  dir_handle_free (GET_FILE_HANDLE (fi));
+  fuse_reply_err (req, 0);
+}
 
-  return NULL;
+static void
+ll_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+  struct statvfs stbuf;
+  gchar         *path;
+  gint           result;
+
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  result = vfs_statfs (path, &stbuf);
+  if (result == 0)
+    fuse_reply_statfs (req, &stbuf);
+  else
+    fuse_reply_err (req, -result);
+
+  g_free (path);
 }
 
 static void
-vfs_destroy (gpointer param)
+ll_access (fuse_req_t req, fuse_ino_t ino, gint mask)
 {
-  if (daemon_name_watcher)
-    g_bus_unwatch_name (daemon_name_watcher);
-  g_clear_object (&dbus_conn);
-  
-  mount_list_free ();
-  if (subthread_main_loop != NULL) 
-    g_main_loop_quit (subthread_main_loop);
-  g_object_unref (gvfs);
+  gchar *path;
+
+  if ((path = request_get_path (req, ino)) == NULL)
+    return;
+
+  fuse_reply_err (req, -vfs_access (path, mask));
+  g_free (path);
 }
 
-static struct fuse_operations vfs_oper =
+static struct fuse_lowlevel_ops vfs_oper =
 {
   .init        = vfs_init,
   .destroy     = vfs_destroy,
 
-  .getattr     = vfs_getattr,
-  .readdir     = vfs_readdir,
+  .lookup      = ll_lookup,
+  .forget      = ll_forget,
+#if FUSE_VERSION >= 29
+  .forget_multi = ll_forget_multi,
+#endif
+  .getattr     = ll_getattr,
+  .setattr     = ll_setattr,
+
+  .statfs      = ll_statfs,
+
+  .opendir     = ll_opendir,
+  .readdir     = ll_readdir,
+  .releasedir  = ll_releasedir,
+  .readlink    = ll_readlink,
+
+  .open        = ll_open,
+  .create      = ll_create,
+  .release     = ll_release,
+  .flush       = ll_flush,
+  .fsync       = ll_fsync,
+
+  .read        = ll_read,
+  .write       = ll_write,
+
+  .rename      = ll_rename,
+  .unlink      = ll_unlink,
+  .mkdir       = ll_mkdir,
+  .rmdir       = ll_rmdir,
+  .symlink     = ll_symlink,
+  .access      = ll_access,
+};
+
+static void
+request_process (Request *request, gpointer user_data)
+{
+  fuse_session_process (session, request->buf, request->len, request->ch);
+  g_private_set (&current_request, NULL);
+
+  g_async_queue_push (free_request_bufs, request);
+}
+
+/* Like fuse_session_loop(), but hands the requests to @n_workers
+ * threads. Each worker owns a buffer, so the loop stalls rather than
+ * allocating once they are all busy. */
+static gint
+session_loop (struct fuse_chan *ch, gint n_workers)
+{
+  GThreadPool *pool;
+  Request     *request;
+  sigset_t     signals, old_signals;
+  gsize        bufsize;
+  gint         result = 0;
+  gint         i;
+
+  bufsize = fuse_chan_bufsize (ch);
+
+  free_request_bufs = g_async_queue_new ();
+  for (i = 0; i < n_workers; i++)
+    {
+      request = g_slice_new0 (Request);
+      request->buf = g_malloc (bufsize);
+      g_async_queue_push (free_request_bufs, request);
+    }
 
-  .statfs      = vfs_statfs,
+  /* Keep the exit signals for this thread, so they interrupt the
+   * receive below. The workers are started right away and inherit
+   * the mask. */
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGHUP);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &signals, &old_signals);
+  pool = g_thread_pool_new ((GFunc) request_process, NULL, n_workers, TRUE, NULL);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  while (!fuse_session_exited (session))
+    {
+      struct fuse_chan *tmpch = ch;
+      gint              res;
 
-  .opendir     = vfs_opendir,
-  .readdir     = vfs_readdir,
-  .readlink    = vfs_readlink,
+      request = g_async_queue_pop (free_request_bufs);
 
-  .open        = vfs_open,
-  .create      = vfs_create,
-  .release     = vfs_release,
-  .flush       = vfs_flush,
-  .fsync       = vfs_fsync,
+      res = fuse_chan_recv (&tmpch, request->buf, bufsize);
+      if (res <= 0)
+        {
+          g_async_queue_push (free_request_bufs, request);
+          if (res == -EINTR)
+            continue;
+          if (res < 0)
+            result = -1;
+          break;
+        }
 
-  .read        = vfs_read,
-  .write       = vfs_write,
+      request->len = res;
+      request->ch = tmpch;
+      g_thread_pool_push (pool, request, NULL);
+    }
 
-  .rename      = vfs_rename,
-  .unlink      = vfs_unlink,
-  .mkdir       = vfs_mkdir,
-  .rmdir       = vfs_rmdir,
-  .ftruncate   = vfs_ftruncate,
-  .truncate    = vfs_truncate,
-  .symlink     = vfs_symlink,
-  .access      = vfs_access,
-  .utimens     = vfs_utimens,
-  .chmod       = vfs_chmod,
+  /* Let the requests in progress finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-#if 0
-  .chown       = vfs_chown,
-  .setxattr    = vfs_setxattr,
-  .getxattr    = vfs_getxattr,
-  .listxattr   = vfs_listxattr,
-  .removexattr = vfs_removexattr,
-#endif
-};
+  while ((request = g_async_queue_try_pop (free_request_bufs)) != NULL)
+    {
+      g_free (request->buf);
+      g_slice_free (Request, request);
+    }
+  g_async_queue_unref (free_request_bufs);
+
+  fuse_session_reset (session);
+
+  return result;
+}
 
 gint
 main (gint argc, gchar *argv [])
 {
+  struct fuse_args  args = FUSE_ARGS_INIT (argc, argv);
+  struct fuse_chan *ch;
+  gchar            *mountpoint = NULL;
+  gint              multithreaded;
+  gint              foreground;
+  gint              n_workers = 1;
+  gint              result = 1;
+
   g_type_init ();
 
-  return fuse_main (argc, argv, &vfs_oper, NULL /* user data */);
+  if (fuse_opt_parse (&args, &options, vfs_opts, NULL) == -1)
+    goto out;
+
+  if (fuse_parse_cmdline (&args, &mountpoint, &multithreaded, &foreground) == -1)
+    goto out;
+
+  if (options.spool)
+    {
+      if (options.spool_dir == NULL)
+        options.spool_dir = g_build_filename (g_get_user_cache_dir (), "gvfs-fuse", NULL);
+
+      if (g_mkdir_with_parents (options.spool_dir, 0700) != 0)
+        {
+          g_printerr ("Can't create spool directory %s: %s\n",
+                      options.spool_dir, g_strerror (errno));
+          goto out;
+        }
+    }
+
+  if (multithreaded)
+    n_workers = CLAMP (sysconf (_SC_NPROCESSORS_ONLN) * WORKERS_PER_PROCESSOR,
+                       MIN_WORKERS, MAX_WORKERS);
+
+  ch = fuse_mount (mountpoint, &args);
+  if (ch == NULL)
+    goto out;
+
+  session = fuse_lowlevel_new (&args, &vfs_oper, sizeof (vfs_oper), NULL);
+  if (session != NULL)
+    {
+      if (fuse_set_signal_handlers (session) != -1)
+        {
+          fuse_session_add_chan (session, ch);
+
+          if (fuse_daemonize (foreground) != -1)
+            result = session_loop (ch, n_workers) == 0 ? 0 : 1;
+
+          fuse_remove_signal_handlers (session);
+          fuse_session_remove_chan (ch);
+        }
+
+      fuse_session_destroy (session);
+    }
+
+  fuse_unmount (mountpoint, ch);
+
+ out:
+  free (mountpoint);
+  fuse_opt_free_args (&args);
+
+  return result;
 }
@@ -36,11 +36,35 @@ typedef struct {
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_SET 4
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_END 5
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_QUERY_INFO 6
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_PREAD_V 7
+
+/*
+pread_v request:
+command, restore_pos (64), size, data
+
+Reads several extents in one round trip. The data is an array of
+extents, each three guint32s in network order: offset low, offset
+high, size. The read channel runs them in order as a seek and a read
+each, and finally seeks back to restore_pos, all under the seq_nr of
+the request. So the client gets exactly 2 * n_extents + 1 replies with
+that seq_nr: a seek or error reply, then a data or error reply for
+every extent, and a last seek or error reply. Data replies can be
+shorter than asked for, like pread. The request counts as a seek for
+the seek_generation of later data.
+*/
+
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_EXTENT_SIZE 12
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS 64
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_SIZE (512 * 1024)
 
 /*
 read, readahead reply:
 type, seek_generation, size, data
 
+readahead replies have seq_nr 0. Backends that support a readahead
+window can send several of them in a row, always in stream order.
+Data with a seek_generation older than the last seek is stale.
+
 seek reply:
 type, pos (64),
 
@@ -50,6 +74,12 @@ type, code, size, data (size bytes, 2 strings: domain, message)
 info:
 type,    0, size, data 
 
+fd:
+type,    0, 0, 0
+Sent with a file descriptor attached (SCM_RIGHTS), before any other
+reply. It is an fd of the file itself that clients can read from
+directly instead of sending read requests.
+
 */
 
 typedef struct {
@@ -67,6 +97,7 @@ typedef struct {
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN  3
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_CLOSED   4
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_INFO     5
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_FD       6
 
 
 typedef union {
@@ -0,0 +1,57 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include "gvfspreadable.h"
+
+G_DEFINE_INTERFACE (GVfsPreadable, g_vfs_preadable, G_TYPE_INPUT_STREAM)
+
+static void
+g_vfs_preadable_default_init (GVfsPreadableIface *iface)
+{
+}
+
+/**
+ * g_vfs_preadable_preadv:
+ * @preadable: a #GVfsPreadable.
+ * @extents: the extents to read, their bytes_read is set on return
+ * @n_extents: number of @extents
+ * @cancellable: optional #GCancellable object, %NULL to ignore.
+ * @error: a #GError location to store the error occurring, or %NULL to ignore.
+ *
+ * Reads several extents of the file, like pread(), without moving the
+ * stream position. bytes_read of an extent is less than its count only
+ * at the end of the file.
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error.
+ */
+gboolean
+g_vfs_preadable_preadv (GVfsPreadable        *preadable,
+                        GVfsPreadableExtent  *extents,
+                        guint                 n_extents,
+                        GCancellable         *cancellable,
+                        GError              **error)
+{
+  g_return_val_if_fail (G_VFS_IS_PREADABLE (preadable), FALSE);
+
+  return G_VFS_PREADABLE_GET_IFACE (preadable)->preadv (preadable, extents, n_extents,
+                                                        cancellable, error);
+}
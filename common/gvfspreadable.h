@@ -0,0 +1,74 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __G_VFS_PREADABLE_H__
+#define __G_VFS_PREADABLE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define G_VFS_TYPE_PREADABLE            (g_vfs_preadable_get_type ())
+#define G_VFS_PREADABLE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), G_VFS_TYPE_PREADABLE, GVfsPreadable))
+#define G_VFS_IS_PREADABLE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), G_VFS_TYPE_PREADABLE))
+#define G_VFS_PREADABLE_GET_IFACE(obj)  (G_TYPE_INSTANCE_GET_INTERFACE ((obj), G_VFS_TYPE_PREADABLE, GVfsPreadableIface))
+
+/**
+ * GVfsPreadable:
+ *
+ * Implemented by the input streams of the gvfs client module that can
+ * read at an offset without moving the stream position. This is how
+ * gvfsd-fuse, which only sees the streams through GIO, reaches the
+ * pread_v request of the read channel protocol.
+ */
+typedef struct _GVfsPreadable         GVfsPreadable;
+typedef struct _GVfsPreadableIface    GVfsPreadableIface;
+
+typedef struct {
+  goffset offset;
+  void *buffer;
+  gsize count;
+  gsize bytes_read;
+} GVfsPreadableExtent;
+
+struct _GVfsPreadableIface
+{
+  GTypeInterface g_iface;
+
+  /* Virtual Table: */
+
+  gboolean (*preadv) (GVfsPreadable        *preadable,
+                      GVfsPreadableExtent  *extents,
+                      guint                 n_extents,
+                      GCancellable         *cancellable,
+                      GError              **error);
+};
+
+GType    g_vfs_preadable_get_type (void) G_GNUC_CONST;
+
+gboolean g_vfs_preadable_preadv   (GVfsPreadable        *preadable,
+                                   GVfsPreadableExtent  *extents,
+                                   guint                 n_extents,
+                                   GCancellable         *cancellable,
+                                   GError              **error);
+
+G_END_DECLS
+
+#endif /* __G_VFS_PREADABLE_H__ */
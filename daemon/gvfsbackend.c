@@ -80,6 +80,8 @@ struct _GVfsBackendPrivate
   char *default_location;
   GMountSpec *mount_spec;
   gboolean block_requests;
+  int max_threads;
+  guint readahead_window;
 };
 
 
@@ -590,6 +592,59 @@ g_vfs_backend_get_block_requests (GVfsBackend *backend)
   return backend->priv->block_requests;
 }
 
+/**
+ * g_vfs_backend_set_max_threads:
+ * @backend: A #GVfsBackend.
+ * @max_threads: maximum number of worker threads, or 0 for no limit
+ *
+ * Limits how many of the non-try_ jobs of @backend the daemon will run
+ * concurrently in its worker threads. Backends whose blocking calls are
+ * not thread safe should set this to 1 in their init function, backends
+ * with a connection pool set it to the number of jobs the pool can serve.
+ * Jobs over the limit are held back by the daemon until a thread of
+ * @backend frees up.
+ *
+ * The limit declared in the init function is the most the "max-threads"
+ * mount option can raise the number of worker threads of the mount to.
+ */
+void
+g_vfs_backend_set_max_threads (GVfsBackend *backend,
+                               int          max_threads)
+{
+  backend->priv->max_threads = MAX (max_threads, 0);
+}
+
+int
+g_vfs_backend_get_max_threads (GVfsBackend *backend)
+{
+  return backend->priv->max_threads;
+}
+
+/**
+ * g_vfs_backend_set_readahead_window:
+ * @backend: A #GVfsBackend.
+ * @max_jobs: maximum number of read jobs in flight per read channel
+ *
+ * Lets read channels of @backend keep up to @max_jobs readahead jobs
+ * outstanding at the same time instead of one, which hides the round
+ * trip time of high latency backends. Only set this if the backend
+ * processes the reads of a handle in the order they were started and
+ * each read continues where the previously started one will end, even
+ * before that one completed. Short reads must not leave holes.
+ */
+void
+g_vfs_backend_set_readahead_window (GVfsBackend *backend,
+                                    guint        max_jobs)
+{
+  backend->priv->readahead_window = max_jobs;
+}
+
+guint
+g_vfs_backend_get_readahead_window (GVfsBackend *backend)
+{
+  return MAX (backend->priv->readahead_window, 1);
+}
+
 gboolean
 g_vfs_backend_invocation_first_handler (GVfsDBusMount *object,
                                         GDBusMethodInvocation *invocation,
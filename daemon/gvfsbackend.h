@@ -503,6 +503,12 @@ void        g_vfs_backend_add_auto_info                  (GVfsBackend
 
 void        g_vfs_backend_set_block_requests             (GVfsBackend           *backend);
 gboolean    g_vfs_backend_get_block_requests             (GVfsBackend           *backend);
+void        g_vfs_backend_set_max_threads                (GVfsBackend           *backend,
+                                                          int                    max_threads);
+int         g_vfs_backend_get_max_threads                (GVfsBackend           *backend);
+void        g_vfs_backend_set_readahead_window           (GVfsBackend           *backend,
+                                                          guint                  max_jobs);
+guint       g_vfs_backend_get_readahead_window           (GVfsBackend           *backend);
 
 gboolean    g_vfs_backend_has_blocking_processes         (GVfsBackend           *backend);
 
@@ -66,6 +66,10 @@
 #include "gvfsdnssdresolver.h"
 #endif
 
+/* Most requests a mount has in flight at once. The executable runs one
+ * job at a time, the "max-threads" mount option can raise it up to this. */
+#define DAV_MAX_CONNECTIONS 4
+
 typedef struct _MountAuthData MountAuthData;
 
 static void mount_auth_info_free (MountAuthData *info);
@@ -135,6 +139,13 @@ static void
 g_vfs_backend_dav_init (GVfsBackendDav *backend)
 {
   g_vfs_backend_set_user_visible (G_VFS_BACKEND (backend), TRUE);
+
+  /* The sync session can be used from several threads, each request
+   * takes a connection of its own */
+  g_object_set (G_VFS_BACKEND_HTTP (backend)->session,
+                SOUP_SESSION_MAX_CONNS_PER_HOST, DAV_MAX_CONNECTIONS,
+                NULL);
+  g_vfs_backend_set_max_threads (G_VFS_BACKEND (backend), DAV_MAX_CONNECTIONS);
 }
 
 /* ************************************************************************* */
@@ -26,10 +26,13 @@
 #include <config.h>
 
 #include <errno.h> /* for strerror (EAGAIN) */
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "gvfsbackendftp.h"
@@ -39,6 +42,7 @@
 #include "gvfsjobopenforwrite.h"
 #include "gvfsjobwrite.h"
 #include "gvfsjobseekwrite.h"
+#include "gvfsjobpush.h"
 #include "gvfsjobsetdisplayname.h"
 #include "gvfsjobqueryinfo.h"
 #include "gvfsjobqueryfsinfo.h"
@@ -87,6 +91,36 @@
 
 /** CODE ***/
 
+/* Defaults for the "cache-size" (in kB) and "cache-ttl" (in seconds)
+ * mount options, 0 means unlimited */
+#define DIR_CACHE_SIZE (16 * 1024)
+#define DIR_CACHE_TTL 60
+
+/* Most jobs a mount runs at once, each on a connection of its own. The
+ * executable starts with fewer worker threads, the "max-threads" mount
+ * option can raise them up to this. */
+#define MAX_JOB_CONNECTIONS 16
+
+/* Default for the "min-connections" mount option: how many logged-in
+ * connections are kept open. Idle ones are pinged after KEEPALIVE_INTERVAL
+ * seconds so the server doesn't close them. More than the connection of
+ * the mount itself are only opened when asked for, as servers often limit
+ * the connections per address. */
+#define MIN_CONNECTIONS 1
+#define KEEPALIVE_INTERVAL 60
+
+/* Transfers that did not finish are kept in a file next to the
+ * destination, named after the source's size and mtime and ending in
+ * this suffix, and resumed from there */
+#define PARTIAL_SUFFIX ".gvfs-partial"
+
+typedef struct {
+  GVfsFtpConnection *   conn;           /* connection with the running RETR */
+  GVfsFtpFile *         file;           /* the file being read */
+  goffset               offset;         /* position in the file */
+  gboolean              no_transfer;    /* a seek failed to restart the RETR */
+} GVfsFtpReadHandle;
+
 G_DEFINE_TYPE (GVfsBackendFtp, g_vfs_backend_ftp, G_VFS_TYPE_BACKEND)
 
 static gboolean
@@ -104,6 +138,8 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
     { "UTF8", G_VFS_FTP_FEATURE_UTF8 },
     { "AUTH TLS", G_VFS_FTP_FEATURE_AUTH_TLS },
     { "AUTH SSL", G_VFS_FTP_FEATURE_AUTH_SSL },
+    { "REST STREAM", G_VFS_FTP_FEATURE_REST },
+    { "MLST", G_VFS_FTP_FEATURE_MLST },
   };
   guint i, j;
   char **reply;
@@ -128,7 +164,12 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
 
       for (j = 0; j < G_N_ELEMENTS (features); j++)
         {
-          if (g_ascii_strcasecmp (feature, features[j].name) == 0)
+          gsize len = strlen (features[j].name);
+
+          /* some features list their options after a space, like
+           * "MLST type*;size*;modify*;" */
+          if (g_ascii_strncasecmp (feature, features[j].name, len) == 0 &&
+              (feature[len] == '\0' || feature[len] == ' '))
             {
               g_debug ("# feature %s supported\n", features[j].name);
               task->backend->features |= 1 << features[j].enable;
@@ -240,12 +281,16 @@ gvfs_backend_ftp_determine_system (GVfsFtpTask *task)
 static void
 gvfs_backend_ftp_setup_directory_cache (GVfsBackendFtp *ftp)
 {
-  if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
+  if (g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_MLST))
+    ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_mlsd;
+  else if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_unix;
   else
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_default;
 
-  ftp->dir_cache = g_vfs_ftp_dir_cache_new (ftp->dir_funcs);
+  ftp->dir_cache = g_vfs_ftp_dir_cache_new (ftp->dir_funcs,
+                                            ftp->dir_cache_size,
+                                            ftp->dir_cache_ttl);
 }
 
 /* This parses a file according to RFC 959 Appendix II:
@@ -382,12 +427,17 @@ g_vfs_backend_ftp_finalize (GObject *object)
 
   /* has been cleared on unmount */
   g_assert (ftp->queue == NULL);
+  g_assert (ftp->keepalive_thread == NULL);
+  g_cond_clear (&ftp->keepalive_cond);
   g_cond_clear (&ftp->cond);
   g_mutex_clear (&ftp->mutex);
 
   g_free (ftp->user);
   g_free (ftp->password);
 
+  if (ftp->dir_cache)
+    g_vfs_ftp_dir_cache_free (ftp->dir_cache);
+
   if (G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize) (object);
 }
@@ -397,6 +447,36 @@ g_vfs_backend_ftp_init (GVfsBackendFtp *ftp)
 {
   g_mutex_init (&ftp->mutex);
   g_cond_init (&ftp->cond);
+  g_cond_init (&ftp->keepalive_cond);
+
+  ftp->dir_cache_size = DIR_CACHE_SIZE * 1024;
+  ftp->dir_cache_ttl = DIR_CACHE_TTL;
+  ftp->min_connections = MIN_CONNECTIONS;
+
+  g_vfs_backend_set_max_threads (G_VFS_BACKEND (ftp), MAX_JOB_CONNECTIONS);
+}
+
+static gpointer
+keepalive_thread (gpointer data)
+{
+  GVfsBackendFtp *ftp = data;
+  gint64 end_time;
+
+  g_mutex_lock (&ftp->mutex);
+  while (!ftp->keepalive_quit)
+    {
+      g_mutex_unlock (&ftp->mutex);
+      g_vfs_ftp_task_keep_alive (ftp, KEEPALIVE_INTERVAL * G_TIME_SPAN_SECOND);
+      g_mutex_lock (&ftp->mutex);
+
+      end_time = g_get_monotonic_time () + KEEPALIVE_INTERVAL * G_TIME_SPAN_SECOND;
+      while (!ftp->keepalive_quit &&
+             g_cond_wait_until (&ftp->keepalive_cond, &ftp->mutex, end_time))
+        ;
+    }
+  g_mutex_unlock (&ftp->mutex);
+
+  return NULL;
 }
 
 static void
@@ -645,6 +725,8 @@ try_login:
   ftp->max_connections = G_MAXUINT;
   ftp->queue = g_queue_new ();
  
+  ftp->keepalive_thread = g_thread_new ("ftp keepalive", keepalive_thread, ftp);
+
   g_object_unref (addr);
   g_vfs_ftp_task_done (&task);
 }
@@ -657,7 +739,7 @@ try_mount (GVfsBackend *backend,
           gboolean is_automount)
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  const char *host, *port_str;
+  const char *host, *port_str, *cache_size, *cache_ttl, *min_connections;
   guint port;
 
   host = g_mount_spec_get (mount_spec, "host");
@@ -682,6 +764,16 @@ try_mount (GVfsBackend *backend,
   ftp->addr = g_network_address_new (host, port);
   ftp->user = g_strdup (g_mount_spec_get (mount_spec, "user"));
   ftp->has_initial_user = ftp->user != NULL;
+
+  cache_size = g_mount_spec_get (mount_spec, "cache-size");
+  if (cache_size != NULL)
+    ftp->dir_cache_size = (gsize) strtoul (cache_size, NULL, 10) * 1024;
+  cache_ttl = g_mount_spec_get (mount_spec, "cache-ttl");
+  if (cache_ttl != NULL)
+    ftp->dir_cache_ttl = strtoul (cache_ttl, NULL, 10);
+  min_connections = g_mount_spec_get (mount_spec, "min-connections");
+  if (min_connections != NULL)
+    ftp->min_connections = strtoul (min_connections, NULL, 10);
   if (port == 21)
     ftp->host_display_name = g_strdup (host);
   else
@@ -699,6 +791,16 @@ do_unmount (GVfsBackend *   backend,
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpConnection *conn;
 
+  if (ftp->keepalive_thread)
+    {
+      g_mutex_lock (&ftp->mutex);
+      ftp->keepalive_quit = TRUE;
+      g_cond_signal (&ftp->keepalive_cond);
+      g_mutex_unlock (&ftp->mutex);
+      g_thread_join (ftp->keepalive_thread);
+      ftp->keepalive_thread = NULL;
+    }
+
   g_mutex_lock (&ftp->mutex);
   while ((conn = g_queue_pop_head (ftp->queue)))
     {
@@ -797,39 +899,58 @@ error_550_parent_not_found (GVfsFtpTask *task, gpointer file)
   g_vfs_ftp_file_free (dir);
 }
 
+/* Starts downloading @file from @offset on a new data connection */
 static void
-do_open_for_read (GVfsBackend *backend,
-                  GVfsJobOpenForRead *job,
-                  const char *filename)
+start_retr (GVfsFtpTask *task, GVfsFtpFile *file, goffset offset)
 {
-  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpFile *file;
   static const GVfsFtpErrorFunc open_read_handlers[] = { error_550_is_directory, 
                                                          error_550_permission_or_not_found, 
                                                          NULL };
 
-  g_vfs_ftp_task_setup_data_connection (&task);
-  file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+  g_vfs_ftp_task_setup_data_connection (task);
 
-  g_vfs_ftp_task_send_and_check (&task,
+  /* REST must come right before the RETR it applies to */
+  if (offset > 0)
+    g_vfs_ftp_task_send (task,
+                         G_VFS_FTP_PASS_300 | G_VFS_FTP_FAIL_200,
+                         "REST %" G_GOFFSET_FORMAT, offset);
+
+  g_vfs_ftp_task_send_and_check (task,
                                  G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
                                  open_read_handlers,
                                  file,
                                  NULL,
                                  "RETR %s", g_vfs_ftp_file_get_ftp_path (file));
-  g_vfs_ftp_file_free (file);
 
-  g_vfs_ftp_task_open_data_connection (&task);
+  g_vfs_ftp_task_open_data_connection (task);
+}
+
+static void
+do_open_for_read (GVfsBackend *backend,
+                  GVfsJobOpenForRead *job,
+                  const char *filename)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpFile *file;
+
+  file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+  start_retr (&task, file, 0);
 
   if (!g_vfs_ftp_task_is_in_error (&task))
     {
+      GVfsFtpReadHandle *handle = g_new0 (GVfsFtpReadHandle, 1);
+
       /* don't push the connection back, it's our handle now */
-      GVfsFtpConnection *conn = g_vfs_ftp_task_take_connection (&task);
+      handle->conn = g_vfs_ftp_task_take_connection (&task);
+      handle->file = file;
 
-      g_vfs_job_open_for_read_set_handle (job, conn);
-      g_vfs_job_open_for_read_set_can_seek (job, FALSE);
+      g_vfs_job_open_for_read_set_handle (job, handle);
+      g_vfs_job_open_for_read_set_can_seek (job,
+                                            g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST));
     }
+  else
+    g_vfs_ftp_file_free (file);
 
   g_vfs_ftp_task_done (&task);
 }
@@ -841,11 +962,94 @@ do_close_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
 
-  g_vfs_ftp_task_give_connection (&task, conn);
+  g_vfs_ftp_task_give_connection (&task, read_handle->conn);
   g_vfs_ftp_task_close_data_connection (&task);
-  g_vfs_ftp_task_receive (&task, 0, NULL);
+  if (!read_handle->no_transfer)
+    g_vfs_ftp_task_receive (&task, 0, NULL);
+
+  g_vfs_ftp_file_free (read_handle->file);
+  g_free (read_handle);
+
+  g_vfs_ftp_task_done (&task);
+}
+
+static void
+do_seek_on_read (GVfsBackend *     backend,
+                 GVfsJobSeekRead * job,
+                 GVfsBackendHandle handle,
+                 goffset           offset,
+                 GSeekType         type)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpReadHandle *read_handle = handle;
+  GFileInfo *info;
+
+  switch (type)
+    {
+      case G_SEEK_CUR:
+        offset += read_handle->offset;
+        break;
+      case G_SEEK_END:
+        {
+          /* the handle's connection is busy, so look up on another one */
+          GVfsFtpTask lookup = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+
+          lookup.job = NULL;
+          info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &lookup, read_handle->file, TRUE);
+          if (info)
+            {
+              offset += g_file_info_get_size (info);
+              g_object_unref (info);
+            }
+          else if (g_vfs_ftp_task_is_in_error (&lookup))
+            {
+              task.error = lookup.error;
+              lookup.error = NULL;
+            }
+          else
+            g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                 _("No such file or directory"));
+          g_vfs_ftp_task_done (&lookup);
+        }
+        break;
+      default:
+        break;
+    }
+
+  if (!g_vfs_ftp_task_is_in_error (&task) && offset < 0)
+    g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                         _("Invalid seek offset"));
+
+  if (!g_vfs_ftp_task_is_in_error (&task) && offset != read_handle->offset)
+    {
+      g_vfs_ftp_task_give_connection (&task, read_handle->conn);
+
+      /* Abort the running transfer. The server answers with 426, or with
+       * 226 if it was done already. */
+      g_vfs_ftp_task_close_data_connection (&task);
+      if (!read_handle->no_transfer)
+        {
+          g_vfs_ftp_task_receive (&task, G_VFS_FTP_PASS_500, NULL);
+          g_vfs_ftp_task_clear_error (&task);
+        }
+
+      start_retr (&task, read_handle->file, offset);
+      read_handle->no_transfer = g_vfs_ftp_task_is_in_error (&task);
+      if (!read_handle->no_transfer)
+        read_handle->offset = offset;
+      else
+        g_vfs_ftp_task_close_data_connection (&task);
+
+      /* the handle keeps the connection even on errors, it's closed
+       * with the handle */
+      read_handle->conn = g_vfs_ftp_task_take_connection (&task);
+    }
+
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    g_vfs_job_seek_read_set_offset (job, offset);
 
   g_vfs_ftp_task_done (&task);
 }
@@ -859,19 +1063,36 @@ do_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
   GInputStream *input;
   gssize n_bytes;
 
-  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (conn));
-  n_bytes = g_input_stream_read (input,
-                                 buffer,
-                                 bytes_requested,
-                                 task.cancellable,
-                                 &task.error);
+  if (read_handle->no_transfer)
+    {
+      /* Pick up where the reading stopped before the failed seek */
+      g_vfs_ftp_task_give_connection (&task, read_handle->conn);
+      start_retr (&task, read_handle->file, read_handle->offset);
+      read_handle->no_transfer = g_vfs_ftp_task_is_in_error (&task);
+      if (read_handle->no_transfer)
+        g_vfs_ftp_task_close_data_connection (&task);
+      read_handle->conn = g_vfs_ftp_task_take_connection (&task);
+    }
 
-  if (n_bytes >= 0)
-    g_vfs_job_read_set_size (job, n_bytes);
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    {
+      input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (read_handle->conn));
+      n_bytes = g_input_stream_read (input,
+                                     buffer,
+                                     bytes_requested,
+                                     task.cancellable,
+                                     &task.error);
+
+      if (n_bytes >= 0)
+        {
+          read_handle->offset += n_bytes;
+          g_vfs_job_read_set_size (job, n_bytes);
+        }
+    }
 
   g_vfs_ftp_task_done (&task);
 }
@@ -1407,6 +1628,7 @@ cancel_cancellable (gpointer cancellable)
 static gssize
 ftp_output_stream_splice (GOutputStream *output,
                           GInputStream *input,
+                          goffset start_offset,
                           goffset total_size,
                           GFileProgressCallback progress_callback,
                           gpointer progress_callback_data,
@@ -1444,7 +1666,7 @@ ftp_output_stream_splice (GOutputStream *output,
               current = cancellable;
               g_clear_error (error);
               if (progress_callback)
-                progress_callback (bytes_copied, total_size, progress_callback_data);
+                progress_callback (start_offset + bytes_copied, total_size, progress_callback_data);
               continue;
             }
           else
@@ -1470,7 +1692,7 @@ ftp_output_stream_splice (GOutputStream *output,
                   current = cancellable;
                   g_clear_error (error);
                   if (progress_callback)
-                    progress_callback (bytes_copied, total_size, progress_callback_data);
+                    progress_callback (start_offset + bytes_copied, total_size, progress_callback_data);
                   continue;
                 }
               else
@@ -1505,7 +1727,7 @@ ftp_output_stream_splice (GOutputStream *output,
       g_object_unref (timer_cancel);
     }
   if (bytes_copied >= 0 && progress_callback)
-    progress_callback (bytes_copied, total_size, progress_callback_data);
+    progress_callback (start_offset + bytes_copied, total_size, progress_callback_data);
 
   return bytes_copied;
 }
@@ -1569,6 +1791,259 @@ do_pull_improve_error_message (GVfsFtpTask *task,
     }
 }
 
+/* Returns the name of the partial file for transferring the source
+ * described by @source_info to @path, or NULL if the source's size or
+ * mtime is unknown. The name identifies the source, so only a transfer
+ * of the same source picks the file up again, and a file of that name
+ * is one this backend created. */
+static char *
+get_partial_path (const char *path, GFileInfo *source_info)
+{
+  if (source_info == NULL ||
+      g_file_info_get_file_type (source_info) != G_FILE_TYPE_REGULAR ||
+      !g_file_info_has_attribute (source_info, G_FILE_ATTRIBUTE_STANDARD_SIZE) ||
+      !g_file_info_has_attribute (source_info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    return NULL;
+
+  return g_strdup_printf ("%s.%" G_GOFFSET_FORMAT "-%" G_GUINT64_FORMAT PARTIAL_SUFFIX,
+                          path,
+                          g_file_info_get_size (source_info),
+                          g_file_info_get_attribute_uint64 (source_info,
+                                                            G_FILE_ATTRIBUTE_TIME_MODIFIED));
+}
+
+/* Returns where a transfer into the partial file described by
+ * @partial_info can go on, or 0 if it has to start over. */
+static goffset
+get_resume_offset (GFileInfo *source_info, GFileInfo *partial_info)
+{
+  goffset size;
+
+  if (source_info == NULL || partial_info == NULL ||
+      g_file_info_get_file_type (partial_info) != G_FILE_TYPE_REGULAR)
+    return 0;
+
+  size = g_file_info_get_size (partial_info);
+  if (size <= 0 || size >= g_file_info_get_size (source_info))
+    return 0;
+
+  return size;
+}
+
+/* Large files are pulled in ranges on several connections at once */
+#define PULL_MAX_SEGMENTS 4
+#define PULL_MIN_SEGMENT_SIZE (8 * 1024 * 1024)
+#define PULL_BUFFER_SIZE (64 * 1024)
+
+typedef struct _PullState PullState;
+
+typedef struct {
+  PullState *           state;          /* the download this range belongs to */
+  goffset               start;          /* offset of the range in the file */
+  goffset               size;           /* size of the range */
+  goffset               done;           /* bytes of the range already written */
+  GThread *             thread;         /* thread fetching the range or NULL */
+} PullSegment;
+
+struct _PullState {
+  GVfsBackendFtp *      ftp;
+  GVfsFtpFile *         file;           /* file that is downloaded */
+  goffset               size;           /* size of the file */
+  int                   fd;             /* destination, written with pwrite() */
+  GCancellable *        cancellable;    /* cancellable of the job */
+  GFileProgressCallback progress_callback;
+  gpointer              progress_callback_data;
+
+  GMutex                lock;           /* protects done in the segments and bytes_done */
+  goffset               bytes_done;     /* sum of all segments' done */
+};
+
+/* Returns into how many ranges a file of @size should be split. Only
+ * idle connections and ones that may still be opened are counted, the
+ * calling task has one already. */
+static guint
+get_n_pull_segments (GVfsBackendFtp *ftp, goffset size)
+{
+  guint n, available;
+
+  n = MIN (size / PULL_MIN_SEGMENT_SIZE, PULL_MAX_SEGMENTS);
+  if (n < 2)
+    return 1;
+
+  g_mutex_lock (&ftp->mutex);
+  available = ftp->queue ? g_queue_get_length (ftp->queue) : 0;
+  if (ftp->max_connections > ftp->connections)
+    available += MIN (ftp->max_connections - ftp->connections, PULL_MAX_SEGMENTS);
+  g_mutex_unlock (&ftp->mutex);
+
+  return MIN (n, available + 1);
+}
+
+static gboolean
+pwrite_all (int fd, const char *buffer, gsize count, goffset offset, GError **error)
+{
+  gssize res;
+
+  while (count > 0)
+    {
+      res = pwrite (fd, buffer, count, offset);
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+          g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+          return FALSE;
+        }
+      buffer += res;
+      count -= res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+/* Fetches the rest of @segment using @task's connection. Only the
+ * task bound to the job reports progress. */
+static void
+pull_segment (GVfsFtpTask *task, PullSegment *segment)
+{
+  PullState *state = segment->state;
+  GInputStream *input;
+  gboolean last;
+  gssize n_read;
+  goffset bytes_done;
+  char *buffer;
+
+  last = segment->start + segment->size >= state->size;
+  start_retr (task, state->file, segment->start + segment->done);
+  if (g_vfs_ftp_task_is_in_error (task))
+    return;
+
+  buffer = g_malloc (PULL_BUFFER_SIZE);
+  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task->conn));
+  while (segment->done < segment->size)
+    {
+      n_read = g_input_stream_read (input,
+                                    buffer,
+                                    MIN (PULL_BUFFER_SIZE, segment->size - segment->done),
+                                    task->cancellable,
+                                    &task->error);
+      if (n_read <= 0)
+        {
+          if (n_read == 0)
+            g_set_error_literal (&task->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 _("Unexpected end of stream"));
+          break;
+        }
+      if (!pwrite_all (state->fd, buffer, n_read, segment->start + segment->done, &task->error))
+        break;
+
+      g_mutex_lock (&state->lock);
+      segment->done += n_read;
+      state->bytes_done += n_read;
+      bytes_done = state->bytes_done;
+      g_mutex_unlock (&state->lock);
+
+      if (task->job && state->progress_callback)
+        state->progress_callback (bytes_done, state->size, state->progress_callback_data);
+    }
+  g_free (buffer);
+
+  g_vfs_ftp_task_close_data_connection (task);
+  if (!g_vfs_ftp_task_is_in_error (task))
+    {
+      /* all but the last range stop early, so the server answers 426 */
+      g_vfs_ftp_task_receive (task, last ? 0 : G_VFS_FTP_PASS_500, NULL);
+      if (!last)
+        g_vfs_ftp_task_clear_error (task);
+    }
+}
+
+static gpointer
+pull_segment_thread (gpointer data)
+{
+  PullSegment *segment = data;
+  GVfsFtpTask task = { segment->state->ftp, NULL, segment->state->cancellable, };
+
+  pull_segment (&task, segment);
+  if (g_vfs_ftp_task_is_in_error (&task))
+    g_debug ("# range at %" G_GOFFSET_FORMAT " failed: %s\n",
+             segment->start, task.error->message);
+  g_vfs_ftp_task_done (&task);
+
+  return NULL;
+}
+
+/* Downloads @file into @fd in @n_segments ranges at once. The first
+ * range is fetched on @task's connection, and ranges that failed on the
+ * other connections are retried on it afterwards.
+ * Returns how much of the file has been written without gaps. */
+static goffset
+pull_segmented (GVfsFtpTask *         task,
+                GVfsFtpFile *         file,
+                int                   fd,
+                goffset               size,
+                guint                 n_segments,
+                GFileProgressCallback progress_callback,
+                gpointer              progress_callback_data)
+{
+  PullState state = { 0, };
+  PullSegment *segments;
+  goffset segment_size, written;
+  guint i;
+
+  state.ftp = task->backend;
+  state.file = file;
+  state.size = size;
+  state.fd = fd;
+  state.cancellable = task->cancellable;
+  state.progress_callback = progress_callback;
+  state.progress_callback_data = progress_callback_data;
+  g_mutex_init (&state.lock);
+
+  segments = g_new0 (PullSegment, n_segments);
+  segment_size = size / n_segments;
+  for (i = 0; i < n_segments; i++)
+    {
+      segments[i].state = &state;
+      segments[i].start = i * segment_size;
+      segments[i].size = i + 1 < n_segments ? segment_size : size - segments[i].start;
+    }
+
+  for (i = 1; i < n_segments; i++)
+    segments[i].thread = g_thread_new ("ftp pull", pull_segment_thread, &segments[i]);
+
+  pull_segment (task, &segments[0]);
+
+  for (i = 1; i < n_segments; i++)
+    g_thread_join (segments[i].thread);
+
+  for (i = 1; i < n_segments && !g_vfs_ftp_task_is_in_error (task); i++)
+    {
+      if (segments[i].done < segments[i].size)
+        pull_segment (task, &segments[i]);
+    }
+
+  if (progress_callback)
+    progress_callback (state.bytes_done, size, progress_callback_data);
+
+  written = 0;
+  for (i = 0; i < n_segments; i++)
+    {
+      written = segments[i].start + segments[i].done;
+      if (segments[i].done < segments[i].size)
+        break;
+    }
+
+  g_free (segments);
+  g_mutex_clear (&state.lock);
+
+  return written;
+}
+
 static void
 do_pull (GVfsBackend *         backend,
          GVfsJobPull *         job,
@@ -1579,45 +2054,148 @@ do_pull (GVfsBackend *         backend,
          GFileProgressCallback progress_callback,
          gpointer              progress_callback_data)
 {
-  static const GVfsFtpErrorFunc open_read_handlers[] = { error_550_is_directory,
-                                                         error_550_permission_or_not_found, 
-                                                         NULL };
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
   GVfsFtpFile *src;
-  GFile *dest;
+  GFile *dest, *partial;
+  GFileInfo *info;
   GInputStream *input;
   GOutputStream *output;
+  GFileType file_type = G_FILE_TYPE_UNKNOWN;
   goffset total_size = 0;
+  goffset offset = 0;
+  gboolean resume;
+  guint n_segments;
+  char *partial_path;
   
   src = g_vfs_ftp_file_new_from_gvfs (ftp, source);
   dest = g_file_new_for_path (local_path);
+  partial_path = NULL;
+  partial = NULL;
+
+  /* Download into a partial file that survives errors, so a later
+   * pull can pick up where this one stopped. Needs REST, and backups
+   * only work with g_file_replace(). */
+  resume = g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST) &&
+           !(flags & G_FILE_COPY_BACKUP);
+
+  info = NULL;
+  if (progress_callback || resume)
+    info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, src, TRUE);
+  if (info)
+    {
+      total_size = g_file_info_get_size (info);
+      file_type = g_file_info_get_file_type (info);
+    }
 
-  if (progress_callback)
+  if (resume)
     {
-      GFileInfo *info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, src, TRUE);
-      if (info)
+      partial_path = get_partial_path (local_path, info);
+      resume = partial_path != NULL;
+    }
+
+  if (resume)
+    {
+      GFileInfo *partial_info;
+      
+      partial = g_file_new_for_path (partial_path);
+      partial_info = g_file_query_info (partial,
+                                        G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                        G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        task.cancellable,
+                                        NULL);
+      /* something that isn't ours is in the way, leave it alone */
+      if (partial_info &&
+          g_file_info_get_file_type (partial_info) != G_FILE_TYPE_REGULAR)
+        resume = FALSE;
+      else
+        offset = get_resume_offset (info, partial_info);
+      if (partial_info)
+        g_object_unref (partial_info);
+      if (offset > 0)
+        g_debug ("# resuming download of %s at %" G_GOFFSET_FORMAT "\n", source, offset);
+    }
+  if (info)
+    g_object_unref (info);
+
+  if (resume && offset == 0 && file_type == G_FILE_TYPE_REGULAR &&
+      (n_segments = get_n_pull_segments (ftp, total_size)) > 1)
+    {
+      int fd;
+
+      if (!(flags & G_FILE_COPY_OVERWRITE) &&
+          g_file_query_exists (dest, task.cancellable))
         {
-          total_size = g_file_info_get_size (info);
-          g_object_unref (info);
+          g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                               _("Target file already exists"));
+          goto out;
         }
+
+      g_unlink (partial_path);
+      fd = g_open (partial_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (fd < 0)
+        {
+          int errsv = errno;
+
+          g_set_error_literal (&task.error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+          goto out;
+        }
+
+      g_debug ("# pulling %s in %u ranges\n", source, n_segments);
+      offset = pull_segmented (&task,
+                               src,
+                               fd,
+                               total_size,
+                               n_segments,
+                               progress_callback,
+                               progress_callback_data);
+      /* cut off everything after the first gap, so the next pull resumes there */
+      if (g_vfs_ftp_task_is_in_error (&task) && ftruncate (fd, offset) < 0)
+        g_unlink (partial_path);
+      if (close (fd) < 0 && !g_vfs_ftp_task_is_in_error (&task))
+        {
+          int errsv = errno;
+
+          g_set_error_literal (&task.error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+        }
+      goto finish;
     }
 
-  g_vfs_ftp_task_setup_data_connection (&task);
-  g_vfs_ftp_task_send_and_check (&task,
-                                 G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
-                                 open_read_handlers,
-                                 src,
-                                 NULL,
-                                 "RETR %s", g_vfs_ftp_file_get_ftp_path (src));
-  g_vfs_ftp_task_open_data_connection (&task);
+  start_retr (&task, src, offset);
   if (g_vfs_ftp_task_is_in_error (&task))
     {
       do_pull_improve_error_message (&task, dest, flags & G_FILE_COPY_OVERWRITE);
       goto out;
     }
 
-  if (flags & G_FILE_COPY_OVERWRITE)
+  if (resume)
+    {
+      if (!(flags & G_FILE_COPY_OVERWRITE) &&
+          g_file_query_exists (dest, task.cancellable))
+        {
+          g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                               _("Target file already exists"));
+          output = NULL;
+        }
+      else if (offset > 0)
+        output = G_OUTPUT_STREAM (g_file_append_to (partial,
+                                                    0,
+                                                    task.cancellable,
+                                                    &task.error));
+      else
+        {
+          /* not g_file_replace(), it removes what it wrote on errors */
+          g_file_delete (partial, task.cancellable, NULL);
+          output = G_OUTPUT_STREAM (g_file_create (partial,
+                                                   0,
+                                                   task.cancellable,
+                                                   &task.error));
+        }
+    }
+  else if (flags & G_FILE_COPY_OVERWRITE)
     output = G_OUTPUT_STREAM (g_file_replace (dest,
                                               NULL,
                                               flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
@@ -1639,6 +2217,7 @@ do_pull (GVfsBackend *         backend,
   input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
   ftp_output_stream_splice (output,
                             input,
+                            offset,
                             total_size,
                             progress_callback,
                             progress_callback_data,
@@ -1646,8 +2225,19 @@ do_pull (GVfsBackend *         backend,
                             &task.error);
   g_vfs_ftp_task_close_data_connection (&task);
   g_vfs_ftp_task_receive (&task, 0, NULL);
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    g_output_stream_close (output, task.cancellable, &task.error);
   g_object_unref (output);
 
+finish:
+  if (resume && !g_vfs_ftp_task_is_in_error (&task))
+    g_file_move (partial,
+                 dest,
+                 flags & G_FILE_COPY_OVERWRITE,
+                 task.cancellable,
+                 NULL, NULL,
+                 &task.error);
+
   if (remove_source)
     {
       g_vfs_ftp_task_send (&task,
@@ -1657,10 +2247,168 @@ do_pull (GVfsBackend *         backend,
 
 out:
   g_object_unref (dest);
+  if (partial)
+    g_object_unref (partial);
+  g_free (partial_path);
   g_vfs_ftp_file_free (src);
   g_vfs_ftp_task_done (&task);
 }
 
+static void
+do_push (GVfsBackend *         backend,
+         GVfsJobPush *         job,
+         const char *          destination,
+         const char *          local_path,
+         GFileCopyFlags        flags,
+         gboolean              remove_source,
+         GFileProgressCallback progress_callback,
+         gpointer              progress_callback_data)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpFile *dest, *partial;
+  GFile *source;
+  GFileInfo *local_info, *info;
+  GFileInputStream *input;
+  GOutputStream *output;
+  goffset offset = 0;
+  char *partial_path;
+
+  source = g_file_new_for_path (local_path);
+  dest = g_vfs_ftp_file_new_from_gvfs (ftp, destination);
+  partial_path = NULL;
+  partial = NULL;
+  input = NULL;
+
+  local_info = g_file_query_info (source,
+                                  G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                  G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                  (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS : 0,
+                                  task.cancellable,
+                                  &task.error);
+  if (local_info == NULL)
+    goto out;
+
+  /* Let gio handle backups, directories and special files */
+  if ((flags & G_FILE_COPY_BACKUP) ||
+      g_file_info_get_file_type (local_info) != G_FILE_TYPE_REGULAR)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation not supported"));
+      goto out;
+    }
+
+  if (!(flags & G_FILE_COPY_OVERWRITE))
+    {
+      info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, dest, FALSE);
+      if (info)
+        {
+          g_object_unref (info);
+          g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                               _("Target file already exists"));
+          goto out;
+        }
+    }
+
+  /* Upload into a partial file and rename it when done. What an
+   * earlier push of the same file left there gets appended to. The
+   * name carries the local size and mtime, so the server's clock
+   * doesn't matter. */
+  partial_path = get_partial_path (destination, local_info);
+  if (partial_path == NULL)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation not supported"));
+      goto out;
+    }
+  partial = g_vfs_ftp_file_new_from_gvfs (ftp, partial_path);
+  info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, partial, FALSE);
+  if (info && g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR)
+    {
+      /* something that isn't ours is in the way */
+      g_object_unref (info);
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                           _("Target file already exists"));
+      goto out;
+    }
+  offset = get_resume_offset (local_info, info);
+  if (info)
+    g_object_unref (info);
+  g_vfs_ftp_task_clear_error (&task);
+
+  input = g_file_read (source, task.cancellable, &task.error);
+  if (input == NULL)
+    goto out;
+  if (offset > 0 &&
+      !g_seekable_seek (G_SEEKABLE (input), offset, G_SEEK_SET, task.cancellable, NULL))
+    offset = 0;
+  if (offset > 0)
+    g_debug ("# resuming upload of %s at %" G_GOFFSET_FORMAT "\n", destination, offset);
+
+  g_vfs_ftp_task_setup_data_connection (&task);
+  if (offset > 0)
+    g_vfs_ftp_task_send (&task,
+                         G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
+                         "APPE %s", g_vfs_ftp_file_get_ftp_path (partial));
+  else
+    g_vfs_ftp_task_send (&task,
+                         G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
+                         "STOR %s", g_vfs_ftp_file_get_ftp_path (partial));
+  g_vfs_ftp_task_open_data_connection (&task);
+  if (g_vfs_ftp_task_is_in_error (&task))
+    goto out;
+
+  output = g_io_stream_get_output_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
+  ftp_output_stream_splice (output,
+                            G_INPUT_STREAM (input),
+                            offset,
+                            g_file_info_get_size (local_info),
+                            progress_callback,
+                            progress_callback_data,
+                            task.cancellable,
+                            &task.error);
+  g_vfs_ftp_task_close_data_connection (&task);
+  g_vfs_ftp_task_receive (&task, 0, NULL);
+  g_vfs_ftp_dir_cache_purge_file (ftp->dir_cache, partial);
+
+  g_vfs_ftp_task_send (&task,
+                       G_VFS_FTP_PASS_300 | G_VFS_FTP_FAIL_200,
+                       "RNFR %s", g_vfs_ftp_file_get_ftp_path (partial));
+  if (g_vfs_ftp_task_send (&task,
+                           (flags & G_FILE_COPY_OVERWRITE) ? G_VFS_FTP_PASS_550 : 0,
+                           "RNTO %s", g_vfs_ftp_file_get_ftp_path (dest)) == 550)
+    {
+      /* some servers refuse to rename over existing files */
+      g_vfs_ftp_task_send (&task,
+                           0,
+                           "DELE %s", g_vfs_ftp_file_get_ftp_path (dest));
+      g_vfs_ftp_task_send (&task,
+                           G_VFS_FTP_PASS_300 | G_VFS_FTP_FAIL_200,
+                           "RNFR %s", g_vfs_ftp_file_get_ftp_path (partial));
+      g_vfs_ftp_task_send (&task,
+                           0,
+                           "RNTO %s", g_vfs_ftp_file_get_ftp_path (dest));
+    }
+  g_vfs_ftp_dir_cache_purge_file (ftp->dir_cache, dest);
+
+  if (remove_source && !g_vfs_ftp_task_is_in_error (&task))
+    g_file_delete (source, task.cancellable, &task.error);
+
+out:
+  if (input)
+    g_object_unref (input);
+  if (local_info)
+    g_object_unref (local_info);
+  g_object_unref (source);
+  g_vfs_ftp_file_free (dest);
+  if (partial)
+    g_vfs_ftp_file_free (partial);
+  g_free (partial_path);
+  g_vfs_ftp_task_done (&task);
+}
+
 static void
 g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
 {
@@ -1675,6 +2423,7 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->open_for_read = do_open_for_read;
   backend_class->close_read = do_close_read;
   backend_class->read = do_read;
+  backend_class->seek_on_read = do_seek_on_read;
   backend_class->create = do_create;
   backend_class->append_to = do_append;
   backend_class->replace = do_replace;
@@ -1689,6 +2438,7 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->try_query_settable_attributes = try_query_settable_attributes;
   backend_class->set_attribute = do_set_attribute;
   backend_class->pull = do_pull;
+  backend_class->push = do_push;
 }
 
 /*** PUBLIC API ***/
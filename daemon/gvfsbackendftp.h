@@ -40,7 +40,9 @@ typedef enum {
   G_VFS_FTP_FEATURE_AUTH_TLS,
   G_VFS_FTP_FEATURE_AUTH_SSL,
   G_VFS_FTP_FEATURE_CHMOD,
-  G_VFS_FTP_FEATURE_CHGRP
+  G_VFS_FTP_FEATURE_CHGRP,
+  G_VFS_FTP_FEATURE_REST,
+  G_VFS_FTP_FEATURE_MLST
 } GVfsFtpFeature;
 #define G_VFS_FTP_FEATURES_DEFAULT (0)
 
@@ -98,6 +100,8 @@ struct _GVfsBackendFtp
   /* directory cache */
   const GVfsFtpDirFuncs *dir_funcs;             /* functions used in directory cache */
   GVfsFtpDirCache *     dir_cache;              /* directory cache */
+  gsize                 dir_cache_size;         /* memory budget of the directory cache in bytes */
+  guint                 dir_cache_ttl;          /* seconds until cached directories are listed again */
 
   /* connection collection - accessed from gvfsftptask.c */
   GMutex                mutex;                  /* mutex protecting the following variables */
@@ -106,6 +110,14 @@ struct _GVfsBackendFtp
   guint                	connections;            /* current number of connections */
   guint                 busy_connections;       /* current number of connections being used for reads/writes */
   guint                	max_connections;        /* upper server limit for number of connections - dynamically generated */
+  guint                 min_connections;        /* number of logged-in connections to keep open */
+  guint                 n_connection_setups;    /* number of connections opened so far */
+  gint64                connection_setup_time;  /* total time spent opening them in microseconds */
+
+  /* keepalive thread - uses mutex above */
+  GThread *             keepalive_thread;       /* thread pinging idle connections or NULL */
+  GCond                 keepalive_cond;         /* cond to wake up the keepalive thread */
+  gboolean              keepalive_quit;         /* TRUE when the keepalive thread should exit */
 };
 
 struct _GVfsBackendFtpClass
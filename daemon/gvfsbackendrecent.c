@@ -12,6 +12,7 @@
 #include "gvfsbackendrecent.h"
 
 #include <glib/gi18n.h> /* _() */
+#include <gio/gfiledescriptorbased.h>
 #include <gtk/gtk.h>
 #include <string.h>
 
@@ -137,6 +138,8 @@ recent_backend_open_for_read (GVfsBackend        *vfs_backend,
             {
               g_vfs_job_open_for_read_set_handle (job, stream);
               g_vfs_job_open_for_read_set_can_seek (job, TRUE);
+              if (G_IS_FILE_DESCRIPTOR_BASED (stream))
+                g_vfs_job_open_for_read_set_file_fd (job, g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream)));
               g_vfs_job_succeeded (G_VFS_JOB (job));
 
               return TRUE;
@@ -56,11 +56,16 @@
 #include "gvfsjobqueryinforead.h"
 #include "gvfsjobqueryinfowrite.h"
 #include "gvfsjobmove.h"
+#include "gvfsjobcopy.h"
+#include "gvfsjobpull.h"
+#include "gvfsjobpush.h"
 #include "gvfsjobdelete.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
 #include "gvfsjobmakedirectory.h"
+#include "gvfsjobmakesymlink.h"
+#include "gvfsjobsetattribute.h"
 #include "gvfsjobprogress.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfskeyring.h"
@@ -79,6 +84,28 @@
 
 #define SFTP_READ_TIMEOUT 40   /* seconds */
 
+/* Number of read jobs a read channel may have in flight at once */
+#define SFTP_READAHEAD_WINDOW 8
+
+/* Size of each SSH_FXP_READ request, and the maximum number of
+   read and write requests kept in flight on a single handle */
+#define SFTP_READ_CHUNK_SIZE (32 * 1024)
+#define SFTP_MAX_READ_REQUESTS 64
+#define SFTP_MAX_WRITE_REQUESTS 64
+
+/* Default lifetime of cached file attributes, can be changed with the
+   "cache-ttl" mount option (in seconds, 0 disables the cache) */
+#define SFTP_CACHE_TTL 10
+#define SFTP_CACHE_MAX_ENTRIES 20000
+
+/* Maximum number of sftp sessions per mount, set with the "sessions"
+   mount option. Sessions beyond the first one carry bulk transfers and
+   reuse the authentication of the first one through ssh connection
+   sharing. Reads of files smaller than SFTP_BULK_READ_SIZE stay on the
+   first session. */
+#define SFTP_MAX_SESSIONS 4
+#define SFTP_BULK_READ_SIZE (256 * 1024)
+
 static GQuark id_q;
 
 typedef enum {
@@ -127,13 +154,75 @@ typedef struct {
 } DataBuffer;
 
 typedef struct {
+  GVfsBackendSftp *backend;
+
+  GOutputStream *command_stream;
+  GInputStream *reply_stream;
+  GDataInputStream *error_stream;
+
+  GCancellable *reply_stream_cancellable;
+
+  /* Output Queue */
+  
+  gsize command_bytes_written;
+  GList *command_queue;
+
+  /* Reply reading: */
+  guint32 reply_size;
+  guint32 reply_size_read;
+  guint8 *reply;
+
+  /* Kept open for the lifetime of the session, -1 if not spawned
+     on a pty or owned elsewhere */
+  int tty_fd;
+
+  /* Statistics */
+  guint queue_depth;
+  guint max_queue_depth;
+  guint64 n_requests;
+} SftpConnection;
+
+typedef struct _SftpHandle SftpHandle;
+
+typedef void (*WritesDoneCallback) (GVfsBackendSftp *backend,
+                                    GVfsJob *job,
+                                    SftpHandle *handle);
+
+struct _SftpHandle {
+  SftpConnection *connection;
   DataBuffer *raw_handle;
   goffset offset;
   char *filename;
   char *tempname;
   guint32 permissions;
   gboolean make_backup;
-} SftpHandle;
+
+  /* Read pipelining, see fill_read_window */
+  GQueue read_chunks;
+  GQueue read_jobs;
+  goffset read_ahead_offset;
+  guint read_window;
+  gboolean read_eof;
+
+  /* Write pipelining, see try_write */
+  guint outstanding_writes;
+  GError *write_error;
+  GVfsJob *writes_done_job;
+  guint writes_done_limit;
+  WritesDoneCallback writes_done_callback;
+};
+
+typedef struct {
+  SftpHandle *handle; /* NULL once dropped from the handle */
+  goffset offset;
+  gsize size;
+  gsize len;
+  gsize pos;
+  guchar *data;
+  gboolean done;
+  gboolean eof;
+  GError *error;
+} ReadChunk;
 
 
 typedef struct {
@@ -159,25 +248,25 @@ struct _GVfsBackendSftp
   guint32 my_gid;
   
   int protocol_version;
+  gboolean has_copy_data;
   
-  GOutputStream *command_stream;
-  GInputStream *reply_stream;
-  GDataInputStream *error_stream;
-
-  GCancellable *reply_stream_cancellable;
+  /* Metadata operations and small reads go over command_connection,
+     bulk transfers are spread over data_connections if there are any */
+  SftpConnection command_connection;
+  GPtrArray *data_connections;
+  int n_sessions;
+  char *control_path;
 
   guint32 current_id;
   
-  /* Output Queue */
-  
-  gsize command_bytes_written;
-  GList *command_queue;
-  
+  /* Attribute cache, see attr_cache_lookup */
+  GHashTable *attr_cache;
+  GHashTable *dir_cache;
+  GFileAttributeMatcher *cache_matcher;
+  gint64 cache_ttl;
+
   /* Reply reading: */
   GHashTable *expected_replies;
-  guint32 reply_size;
-  guint32 reply_size_read;
-  guint8 *reply;
   
   GMountSource *mount_source; /* Only used/set during mount */
   int mount_try;
@@ -243,6 +332,34 @@ get_sftp_client_vendor (void)
   return res;
 }
 
+static void
+sftp_connection_clear (SftpConnection *connection)
+{
+  if (connection->command_stream)
+    g_object_unref (connection->command_stream);
+  
+  if (connection->reply_stream_cancellable)
+    g_object_unref (connection->reply_stream_cancellable);
+
+  if (connection->reply_stream)
+    g_object_unref (connection->reply_stream);
+  
+  if (connection->error_stream)
+    g_object_unref (connection->error_stream);
+
+  g_free (connection->reply);
+
+  if (connection->tty_fd != -1)
+    close (connection->tty_fd);
+}
+
+static void
+sftp_connection_free (SftpConnection *connection)
+{
+  sftp_connection_clear (connection);
+  g_slice_free (SftpConnection, connection);
+}
+
 static void
 g_vfs_backend_sftp_finalize (GObject *object)
 {
@@ -251,18 +368,13 @@ g_vfs_backend_sftp_finalize (GObject *object)
   backend = G_VFS_BACKEND_SFTP (object);
 
   g_hash_table_destroy (backend->expected_replies);
+  g_hash_table_destroy (backend->attr_cache);
+  g_hash_table_destroy (backend->dir_cache);
+  g_file_attribute_matcher_unref (backend->cache_matcher);
   
-  if (backend->command_stream)
-    g_object_unref (backend->command_stream);
-  
-  if (backend->reply_stream_cancellable)
-    g_object_unref (backend->reply_stream_cancellable);
-
-  if (backend->reply_stream)
-    g_object_unref (backend->reply_stream);
-  
-  if (backend->error_stream)
-    g_object_unref (backend->error_stream);
+  sftp_connection_clear (&backend->command_connection);
+  g_ptr_array_free (backend->data_connections, TRUE);
+  g_free (backend->control_path);
   
   if (G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize) (object);
@@ -271,14 +383,63 @@ g_vfs_backend_sftp_finalize (GObject *object)
 static void
 expected_reply_free (ExpectedReply *reply)
 {
-  g_object_unref (reply->job);
+  if (reply->job)
+    g_object_unref (reply->job);
   g_slice_free (ExpectedReply, reply);
 }
 
+/* Both cache entry types start with their expiry time */
+typedef struct {
+  gint64 expires;
+  GFileInfo *info;        /* From lstat */
+  GFileInfo *follow_info; /* From stat, NULL if not known */
+} AttrCacheEntry;
+
+typedef struct {
+  gint64 expires;
+  GPtrArray *names;
+} DirCacheEntry;
+
+static void
+attr_cache_entry_free (AttrCacheEntry *entry)
+{
+  g_object_unref (entry->info);
+  if (entry->follow_info)
+    g_object_unref (entry->follow_info);
+  g_slice_free (AttrCacheEntry, entry);
+}
+
+static void
+dir_cache_entry_free (DirCacheEntry *entry)
+{
+  g_ptr_array_free (entry->names, TRUE);
+  g_slice_free (DirCacheEntry, entry);
+}
+
 static void
 g_vfs_backend_sftp_init (GVfsBackendSftp *backend)
 {
   backend->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+
+  backend->attr_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)attr_cache_entry_free);
+  backend->dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)dir_cache_entry_free);
+  backend->cache_matcher = g_file_attribute_matcher_new ("*");
+  backend->cache_ttl = SFTP_CACHE_TTL * G_USEC_PER_SEC;
+
+  backend->command_connection.backend = backend;
+  backend->command_connection.tty_fd = -1;
+  backend->data_connections = g_ptr_array_new_with_free_func ((GDestroyNotify)sftp_connection_free);
+  backend->n_sessions = 1;
+
+  /* try_read serves jobs in order from the read window of the
+     handle, so several can be queued at once */
+  g_vfs_backend_set_readahead_window (G_VFS_BACKEND (backend), SFTP_READAHEAD_WINDOW);
+
+  /* Jobs are multiplexed over the sessions and mostly run as try_ jobs,
+     the ones that need a thread can use one per session */
+  g_vfs_backend_set_max_threads (G_VFS_BACKEND (backend), SFTP_MAX_SESSIONS);
 }
 
 static void
@@ -289,7 +450,7 @@ look_for_stderr_errors (GVfsBackend *backend, GError **error)
 
   while (1)
     {
-      line = g_data_input_stream_read_line (op_backend->error_stream, NULL, NULL, NULL);
+      line = g_data_input_stream_read_line (op_backend->command_connection.error_stream, NULL, NULL, NULL);
       
       if (line == NULL)
         {
@@ -418,13 +579,13 @@ setup_ssh_environment (void)
 }
 
 static char **
-setup_ssh_commandline (GVfsBackend *backend)
+setup_ssh_commandline (GVfsBackend *backend, gboolean control_client)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   guint last_arg;
   gchar **args;
 
-  args = g_new0 (gchar *, 20); /* 20 is enought for now, bump size if code below changes */
+  args = g_new0 (gchar *, 24); /* 24 is enought for now, bump size if code below changes */
 
   /* Fill in the first few args */
   last_arg = 0;
@@ -440,7 +601,18 @@ setup_ssh_commandline (GVfsBackend *backend)
 #ifndef USE_PTY
       args[last_arg++] = g_strdup ("-oBatchMode yes");
 #endif
-    
+
+      /* Additional sessions are multiplexed over the connection of the
+         first one, so they never need to authenticate */
+      if (op_backend->control_path != NULL)
+        {
+          args[last_arg++] = g_strdup (control_client ? "-oControlMaster no" : "-oControlMaster yes");
+          args[last_arg++] = g_strdup_printf ("-oControlPath %s", op_backend->control_path);
+#ifdef USE_PTY
+          if (control_client)
+            args[last_arg++] = g_strdup ("-oBatchMode yes");
+#endif
+        }
     }
   else if (op_backend->client_vendor == SFTP_VENDOR_SSH)
     args[last_arg++] = g_strdup ("-x");
@@ -568,7 +740,7 @@ get_data_from_command_stream (GDataOutputStream *command_stream, gsize *len)
 }
 
 static gboolean
-send_command_sync_and_unref_command (GVfsBackendSftp *backend,
+send_command_sync_and_unref_command (SftpConnection *connection,
                                      GDataOutputStream *command_stream,
                                      GCancellable *cancellable,
                                      GError **error)
@@ -580,7 +752,7 @@ send_command_sync_and_unref_command (GVfsBackendSftp *backend,
   
   data = get_data_from_command_stream (command_stream, &len);
 
-  res = g_output_stream_write_all (backend->command_stream,
+  res = g_output_stream_write_all (connection->command_stream,
                                    data, len,
                                    &bytes_written,
                                    cancellable, error);
@@ -633,14 +805,14 @@ make_reply_stream (guint8 *data, gsize len)
 }
 
 static GDataInputStream *
-read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
+read_reply_sync (SftpConnection *connection, gsize *len_out, GError **error)
 {
   guint32 len;
   gsize bytes_read;
   GByteArray *array;
   guint8 *data;
   
-  if (!g_input_stream_read_all (backend->reply_stream,
+  if (!g_input_stream_read_all (connection->reply_stream,
 				&len, 4,
 				&bytes_read, NULL, error))
     return NULL;
@@ -659,7 +831,7 @@ read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
   
   array = g_byte_array_sized_new (len);
 
-  if (!g_input_stream_read_all (backend->reply_stream,
+  if (!g_input_stream_read_all (connection->reply_stream,
 				array->data, len,
 				&bytes_read, NULL, error))
     {
@@ -1138,7 +1310,8 @@ fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
   while (g_hash_table_iter_next (&iter, &key, &value))
     {
       ExpectedReply *expected_reply = (ExpectedReply *) value;
-      g_vfs_job_failed_from_error (expected_reply->job, error);
+      if (expected_reply->job)
+        g_vfs_job_failed_from_error (expected_reply->job, error);
     }
 
   g_error_free (error);
@@ -1163,14 +1336,15 @@ check_input_stream_read_result (GVfsBackendSftp *backend, gssize res, GError *er
     }
 }
 
-static void read_reply_async (GVfsBackendSftp *backend);
+static void read_reply_async (SftpConnection *connection);
 
 static void
 read_reply_async_got_data  (GObject *source_object,
                             GAsyncResult *result,
                             gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
+  GVfsBackendSftp *backend = connection->backend;
   gssize res;
   GDataInputStream *reply;
   ExpectedReply *expected_reply;
@@ -1183,18 +1357,18 @@ read_reply_async_got_data  (GObject *source_object,
 
   check_input_stream_read_result (backend, res, error);
 
-  backend->reply_size_read += res;
+  connection->reply_size_read += res;
 
-  if (backend->reply_size_read < backend->reply_size)
+  if (connection->reply_size_read < connection->reply_size)
     {
-      g_input_stream_read_async (backend->reply_stream,
-				 backend->reply + backend->reply_size_read, backend->reply_size - backend->reply_size_read,
-				 0, NULL, read_reply_async_got_data, backend);
+      g_input_stream_read_async (connection->reply_stream,
+				 connection->reply + connection->reply_size_read, connection->reply_size - connection->reply_size_read,
+				 0, NULL, read_reply_async_got_data, connection);
       return;
     }
 
-  reply = make_reply_stream (backend->reply, backend->reply_size);
-  backend->reply = NULL;
+  reply = make_reply_stream (connection->reply, connection->reply_size);
+  connection->reply = NULL;
 
   type = g_data_input_stream_read_byte (reply, NULL, NULL);
   id = g_data_input_stream_read_uint32 (reply, NULL, NULL);
@@ -1202,17 +1376,18 @@ read_reply_async_got_data  (GObject *source_object,
   expected_reply = g_hash_table_lookup (backend->expected_replies, GINT_TO_POINTER (id));
   if (expected_reply)
     {
+      connection->queue_depth--;
       if (expected_reply->callback != NULL)
-        (expected_reply->callback) (backend, type, reply, backend->reply_size,
+        (expected_reply->callback) (backend, type, reply, connection->reply_size,
                                     expected_reply->job, expected_reply->user_data);
       g_hash_table_remove (backend->expected_replies, GINT_TO_POINTER (id));
     }
   else
-    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", backend->reply_size, id);
+    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", connection->reply_size, id);
 
   g_object_unref (reply);
 
-  read_reply_async (backend);
+  read_reply_async (connection);
   
 }
 
@@ -1221,7 +1396,8 @@ read_reply_async_got_len  (GObject *source_object,
                            GAsyncResult *result,
                            gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
+  GVfsBackendSftp *backend = connection->backend;
   gssize res;
   GError *error;
 
@@ -1231,50 +1407,52 @@ read_reply_async_got_len  (GObject *source_object,
   /* Bail out if cancelled */
   if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
+      g_error_free (error);
       g_object_unref (backend);
       return;
     }
 
   check_input_stream_read_result (backend, res, error);
 
-  backend->reply_size_read += res;
+  connection->reply_size_read += res;
 
-  if (backend->reply_size_read < 4)
+  if (connection->reply_size_read < 4)
     {
-      g_input_stream_read_async (backend->reply_stream,
-				 &backend->reply_size + backend->reply_size_read, 4 - backend->reply_size_read,
-				 0, backend->reply_stream_cancellable, read_reply_async_got_len,
-				 backend);
+      g_input_stream_read_async (connection->reply_stream,
+				 (guint8 *)&connection->reply_size + connection->reply_size_read, 4 - connection->reply_size_read,
+				 0, connection->reply_stream_cancellable, read_reply_async_got_len,
+				 connection);
       return;
     }
-  backend->reply_size = GUINT32_FROM_BE (backend->reply_size);
+  connection->reply_size = GUINT32_FROM_BE (connection->reply_size);
 
-  backend->reply_size_read = 0;
-  backend->reply = g_malloc (backend->reply_size);
-  g_input_stream_read_async (backend->reply_stream,
-			     backend->reply, backend->reply_size,
-			     0, NULL, read_reply_async_got_data, backend);
+  connection->reply_size_read = 0;
+  connection->reply = g_malloc (connection->reply_size);
+  g_input_stream_read_async (connection->reply_stream,
+			     connection->reply, connection->reply_size,
+			     0, NULL, read_reply_async_got_data, connection);
 }
 
+/* The read loop keeps a reference on the backend until it is cancelled */
 static void
-read_reply_async (GVfsBackendSftp *backend)
+read_reply_async (SftpConnection *connection)
 {
-  backend->reply_size_read = 0;
-  g_input_stream_read_async (backend->reply_stream,
-                             &backend->reply_size, 4,
-                             0, backend->reply_stream_cancellable,
+  connection->reply_size_read = 0;
+  g_input_stream_read_async (connection->reply_stream,
+                             &connection->reply_size, 4,
+                             0, connection->reply_stream_cancellable,
                              read_reply_async_got_len,
-                             backend);
+                             connection);
 }
 
-static void send_command (GVfsBackendSftp *backend);
+static void send_command (SftpConnection *connection);
 
 static void
 send_command_data (GObject *source_object,
                    GAsyncResult *result,
                    gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
   gssize res;
   DataBuffer *buffer;
 
@@ -1287,45 +1465,45 @@ send_command_data (GObject *source_object,
       return;
     }
 
-  buffer = backend->command_queue->data;
+  buffer = connection->command_queue->data;
   
-  backend->command_bytes_written += res;
+  connection->command_bytes_written += res;
 
-  if (backend->command_bytes_written < buffer->size)
+  if (connection->command_bytes_written < buffer->size)
     {
-      g_output_stream_write_async (backend->command_stream,
-                                   buffer->data + backend->command_bytes_written,
-                                   buffer->size - backend->command_bytes_written,
+      g_output_stream_write_async (connection->command_stream,
+                                   buffer->data + connection->command_bytes_written,
+                                   buffer->size - connection->command_bytes_written,
                                    0,
                                    NULL,
                                    send_command_data,
-                                   backend);
+                                   connection);
       return;
     }
 
   data_buffer_free (buffer);
 
-  backend->command_queue = g_list_delete_link (backend->command_queue, backend->command_queue);
+  connection->command_queue = g_list_delete_link (connection->command_queue, connection->command_queue);
 
-  if (backend->command_queue != NULL)
-    send_command (backend);
+  if (connection->command_queue != NULL)
+    send_command (connection);
 }
 
 static void
-send_command (GVfsBackendSftp *backend)
+send_command (SftpConnection *connection)
 {
   DataBuffer *buffer;
 
-  buffer = backend->command_queue->data;
+  buffer = connection->command_queue->data;
   
-  backend->command_bytes_written = 0;
-  g_output_stream_write_async (backend->command_stream,
+  connection->command_bytes_written = 0;
+  g_output_stream_write_async (connection->command_stream,
                                buffer->data,
                                buffer->size,
                                0,
                                NULL,
                                send_command_data,
-                               backend);
+                               connection);
 }
 
 static void
@@ -1339,7 +1517,7 @@ expect_reply (GVfsBackendSftp *backend,
 
   expected = g_slice_new (ExpectedReply);
   expected->callback = callback;
-  expected->job = g_object_ref (job);
+  expected->job = job ? g_object_ref (job) : NULL;
   expected->user_data = user_data;
 
   g_hash_table_replace (backend->expected_replies, GINT_TO_POINTER (id), expected);
@@ -1358,25 +1536,26 @@ data_buffer_new (guchar *data, gsize len)
 }
 
 static void
-queue_command_buffer (GVfsBackendSftp *backend,
+queue_command_buffer (SftpConnection *connection,
                       DataBuffer *buffer)
 {
   gboolean first;
   
-  first = backend->command_queue == NULL;
+  first = connection->command_queue == NULL;
 
-  backend->command_queue = g_list_append (backend->command_queue, buffer);
+  connection->command_queue = g_list_append (connection->command_queue, buffer);
   
   if (first)
-    send_command (backend);
+    send_command (connection);
 }
 
 static void
-queue_command_stream_and_free (GVfsBackendSftp *backend,
-                               GDataOutputStream *command_stream,
-                               ReplyCallback callback,
-                               GVfsJob *job,
-                               gpointer user_data)
+queue_command_stream_and_free_on (GVfsBackendSftp *backend,
+                                  SftpConnection *connection,
+                                  GDataOutputStream *command_stream,
+                                  ReplyCallback callback,
+                                  GVfsJob *job,
+                                  gpointer user_data)
 {
   gpointer data;
   gsize len;
@@ -1389,8 +1568,43 @@ queue_command_stream_and_free (GVfsBackendSftp *backend,
   buffer = data_buffer_new (data, len);
   g_object_unref (command_stream);
 
+  connection->n_requests++;
+  connection->queue_depth++;
+  connection->max_queue_depth = MAX (connection->max_queue_depth, connection->queue_depth);
+
   expect_reply (backend, id, callback, job, user_data);
-  queue_command_buffer (backend, buffer);
+  queue_command_buffer (connection, buffer);
+}
+
+static void
+queue_command_stream_and_free (GVfsBackendSftp *backend,
+                               GDataOutputStream *command_stream,
+                               ReplyCallback callback,
+                               GVfsJob *job,
+                               gpointer user_data)
+{
+  queue_command_stream_and_free_on (backend, &backend->command_connection,
+                                    command_stream, callback, job, user_data);
+}
+
+/* Picks the data session with the fewest requests in flight for a
+   bulk transfer, or the command session if there are no others */
+static SftpConnection *
+choose_data_connection (GVfsBackendSftp *backend)
+{
+  SftpConnection *best, *connection;
+  guint i;
+
+  best = &backend->command_connection;
+  for (i = 0; i < backend->data_connections->len; i++)
+    {
+      connection = g_ptr_array_index (backend->data_connections, i);
+      if (best == &backend->command_connection ||
+          connection->queue_depth < best->queue_depth)
+        best = connection;
+    }
+
+  return best;
 }
 
 
@@ -1480,9 +1694,9 @@ get_uid_sync (GVfsBackendSftp *backend)
   
   command = new_command_stream (backend, SSH_FXP_STAT);
   put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (&backend->command_connection, command, NULL, NULL);
 
-  reply = read_reply_sync (backend, NULL, NULL);
+  reply = read_reply_sync (&backend->command_connection, NULL, NULL);
   if (reply == NULL)
     return FALSE;
   
@@ -1525,9 +1739,9 @@ get_home_sync (GVfsBackendSftp *backend)
 
   command = new_command_stream (backend, SSH_FXP_REALPATH);
   put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (&backend->command_connection, command, NULL, NULL);
 
-  reply = read_reply_sync (backend, NULL, NULL);
+  reply = read_reply_sync (&backend->command_connection, NULL, NULL);
   if (reply == NULL)
     return FALSE;
 
@@ -1549,6 +1763,71 @@ get_home_sync (GVfsBackendSftp *backend)
   return TRUE;
 }
 
+/* Opens an additional sftp session for bulk transfers. It is spawned
+   with -oControlMaster no, so it is multiplexed over the already
+   authenticated connection of the command session. */
+static SftpConnection *
+open_data_connection (GVfsBackendSftp *backend, GError **error)
+{
+  SftpConnection *connection;
+  gchar **args;
+  pid_t pid;
+  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
+  GInputStream *is;
+  GDataOutputStream *command;
+  GDataInputStream *reply;
+  gboolean res;
+
+  args = setup_ssh_commandline (G_VFS_BACKEND (backend), TRUE);
+  res = spawn_ssh (G_VFS_BACKEND (backend),
+                   args, &pid,
+                   &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
+                   error);
+  g_strfreev (args);
+
+  if (!res)
+    return NULL;
+
+  connection = g_slice_new0 (SftpConnection);
+  connection->backend = backend;
+  connection->tty_fd = tty_fd;
+  connection->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
+  connection->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  connection->reply_stream_cancellable = g_cancellable_new ();
+
+  make_fd_nonblocking (stderr_fd);
+  is = g_unix_input_stream_new (stderr_fd, TRUE);
+  connection->error_stream = g_data_input_stream_new (is);
+  g_object_unref (is);
+
+  command = new_command_stream (backend, SSH_FXP_INIT);
+  g_data_output_stream_put_int32 (command,
+                                  SSH_FILEXFER_VERSION, NULL, NULL);
+
+  reply = NULL;
+  if (send_command_sync_and_unref_command (connection, command, NULL, error) &&
+      wait_for_reply (G_VFS_BACKEND (backend), stdout_fd, error))
+    reply = read_reply_sync (connection, NULL, error);
+
+  if (reply == NULL)
+    {
+      sftp_connection_free (connection);
+      return NULL;
+    }
+
+  if (g_data_input_stream_read_byte (reply, NULL, NULL) != SSH_FXP_VERSION)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Protocol error"));
+      g_object_unref (reply);
+      sftp_connection_free (connection);
+      return NULL;
+    }
+
+  g_object_unref (reply);
+
+  return connection;
+}
+
 static void
 do_mount (GVfsBackend *backend,
           GVfsJobMount *job,
@@ -1568,8 +1847,10 @@ do_mount (GVfsBackend *backend,
   GMountSpec *sftp_mount_spec;
   char *extension_name, *extension_data;
   char *display_name;
+  SftpConnection *connection;
+  int i;
 
-  args = setup_ssh_commandline (backend);
+  args = setup_ssh_commandline (backend, FALSE);
 
   error = NULL;
   if (!spawn_ssh (backend,
@@ -1585,12 +1866,13 @@ do_mount (GVfsBackend *backend,
 
   g_strfreev (args);
 
-  op_backend->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
+  connection = &op_backend->command_connection;
+  connection->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
 
   command = new_command_stream (op_backend, SSH_FXP_INIT);
   g_data_output_stream_put_int32 (command,
                                   SSH_FILEXFER_VERSION, NULL, NULL);
-  send_command_sync_and_unref_command (op_backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (connection, command, NULL, NULL);
 
   if (tty_fd == -1)
     res = wait_for_reply (backend, stdout_fd, &error);
@@ -1616,15 +1898,15 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  op_backend->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
-  op_backend->reply_stream_cancellable = g_cancellable_new ();
+  connection->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  connection->reply_stream_cancellable = g_cancellable_new ();
 
   make_fd_nonblocking (stderr_fd);
   is = g_unix_input_stream_new (stderr_fd, TRUE);
-  op_backend->error_stream = g_data_input_stream_new (is);
+  connection->error_stream = g_data_input_stream_new (is);
   g_object_unref (is);
   
-  reply = read_reply_sync (op_backend, NULL, NULL);
+  reply = read_reply_sync (connection, NULL, NULL);
   if (reply == NULL)
     {
       look_for_stderr_errors (backend, &error);
@@ -1648,7 +1930,8 @@ do_mount (GVfsBackend *backend,
       extension_data = read_string (reply, NULL);
       if (extension_data)
         {
-          /* TODO: Do something with this */
+          if (strcmp (extension_name, "copy-data") == 0)
+            op_backend->has_copy_data = TRUE;
         }
       g_free (extension_name);
       g_free (extension_data);
@@ -1664,7 +1947,24 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  read_reply_async (g_object_ref (op_backend));
+  g_object_ref (op_backend);
+  read_reply_async (connection);
+
+  for (i = 1; i < op_backend->n_sessions; i++)
+    {
+      connection = open_data_connection (op_backend, &error);
+      if (connection == NULL)
+        {
+          /* Not fatal, bulk transfers just share the first session */
+          g_debug ("sftp: unable to open session %d: %s\n", i, error->message);
+          g_clear_error (&error);
+          break;
+        }
+
+      g_ptr_array_add (op_backend->data_connections, connection);
+      g_object_ref (op_backend);
+      read_reply_async (connection);
+    }
 
   sftp_mount_spec = g_mount_spec_new ("sftp");
   if (op_backend->user_specified_in_uri)
@@ -1717,7 +2017,7 @@ try_mount (GVfsBackend *backend,
            gboolean is_automount)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  const char *user, *host, *port;
+  const char *user, *host, *port, *cache_ttl, *sessions;
 
   op_backend->client_vendor = get_sftp_client_vendor ();
 
@@ -1750,6 +2050,21 @@ try_mount (GVfsBackend *backend,
   
   user = g_mount_spec_get (mount_spec, "user");
 
+  cache_ttl = g_mount_spec_get (mount_spec, "cache-ttl");
+  if (cache_ttl != NULL)
+    op_backend->cache_ttl = MAX (atoi (cache_ttl), 0) * G_USEC_PER_SEC;
+
+  /* Sessions are shared through an OpenSSH control socket, other
+     clients always get a single session */
+  sessions = g_mount_spec_get (mount_spec, "sessions");
+  if (sessions != NULL && op_backend->client_vendor == SFTP_VENDOR_OPENSSH)
+    op_backend->n_sessions = CLAMP (atoi (sessions), 1, SFTP_MAX_SESSIONS);
+
+  if (op_backend->n_sessions > 1)
+    op_backend->control_path = g_strdup_printf ("%s/gvfsd-sftp-%d",
+                                                g_get_user_runtime_dir (),
+                                                (int) getpid ());
+
   op_backend->host = g_strdup (host);
   op_backend->user = g_strdup (user);
   if (op_backend->user)
@@ -1769,9 +2084,22 @@ try_unmount (GVfsBackend *backend,
              GMountSource *mount_source)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
+  guint i;
 
-  if (op_backend->reply_stream && op_backend->reply_stream_cancellable)
-    g_cancellable_cancel (op_backend->reply_stream_cancellable);
+  for (i = 0; i <= op_backend->data_connections->len; i++)
+    {
+      if (i == 0)
+        connection = &op_backend->command_connection;
+      else
+        connection = g_ptr_array_index (op_backend->data_connections, i - 1);
+
+      g_debug ("sftp: session %d: %"G_GUINT64_FORMAT" requests, max queue depth %u\n",
+               i, connection->n_requests, connection->max_queue_depth);
+
+      if (connection->reply_stream && connection->reply_stream_cancellable)
+        g_cancellable_cancel (connection->reply_stream_cancellable);
+    }
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
   return TRUE;
@@ -2288,21 +2616,210 @@ parse_attributes (GVfsBackendSftp *backend,
     }
 }
 
+static gboolean
+cache_entry_expired (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+  return *(gint64 *)user_data > *(gint64 *)value;
+}
+
+static gboolean
+cache_entry_has_prefix (gpointer key,
+                        gpointer value,
+                        gpointer user_data)
+{
+  return g_str_has_prefix (key, user_data);
+}
+
+static void
+cache_prune (GHashTable *cache)
+{
+  gint64 now;
+
+  if (g_hash_table_size (cache) < SFTP_CACHE_MAX_ENTRIES)
+    return;
+
+  now = g_get_monotonic_time ();
+  g_hash_table_foreach_remove (cache, cache_entry_expired, &now);
+
+  if (g_hash_table_size (cache) >= SFTP_CACHE_MAX_ENTRIES)
+    g_hash_table_remove_all (cache);
+}
+
+/* Stores the attributes of path, info must have been parsed with
+ * backend->cache_matcher. follow_info is NULL when the target of a
+ * symlink is not known. */
+static void
+attr_cache_insert (GVfsBackendSftp *backend,
+                   const char *path,
+                   GFileInfo *info,
+                   GFileInfo *follow_info)
+{
+  AttrCacheEntry *entry;
+
+  if (backend->cache_ttl == 0)
+    return;
+
+  cache_prune (backend->attr_cache);
+
+  entry = g_slice_new (AttrCacheEntry);
+  entry->info = g_object_ref (info);
+  entry->follow_info = follow_info ? g_object_ref (follow_info) : NULL;
+  entry->expires = g_get_monotonic_time () + backend->cache_ttl;
+
+  g_hash_table_replace (backend->attr_cache, g_strdup (path), entry);
+}
+
+/* Returns the cached info of path if it has everything a query with
+ * these flags and matcher needs, or NULL. */
+static GFileInfo *
+attr_cache_lookup (GVfsBackendSftp *backend,
+                   const char *path,
+                   GFileQueryInfoFlags flags,
+                   GFileAttributeMatcher *matcher)
+{
+  AttrCacheEntry *entry;
+
+  entry = g_hash_table_lookup (backend->attr_cache, path);
+  if (entry == NULL)
+    return NULL;
+
+  if (g_get_monotonic_time () > entry->expires)
+    {
+      g_hash_table_remove (backend->attr_cache, path);
+      return NULL;
+    }
+
+  if (g_file_info_get_is_symlink (entry->info) &&
+      g_file_attribute_matcher_matches (matcher,
+                                        G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET) &&
+      !g_file_info_has_attribute (entry->info,
+                                  G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+    return NULL;
+
+  if (flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
+    return entry->info;
+  else
+    return entry->follow_info;
+}
+
+static void
+dir_cache_insert (GVfsBackendSftp *backend,
+                  const char *path,
+                  GPtrArray *names)
+{
+  DirCacheEntry *entry;
+
+  if (backend->cache_ttl == 0)
+    return;
+
+  cache_prune (backend->dir_cache);
+
+  entry = g_slice_new (DirCacheEntry);
+  entry->expires = g_get_monotonic_time () + backend->cache_ttl;
+  entry->names = names;
+
+  g_hash_table_replace (backend->dir_cache, g_strdup (path), entry);
+}
+
+static GPtrArray *
+dir_cache_lookup (GVfsBackendSftp *backend,
+                  const char *path)
+{
+  DirCacheEntry *entry;
+
+  entry = g_hash_table_lookup (backend->dir_cache, path);
+  if (entry == NULL)
+    return NULL;
+
+  if (g_get_monotonic_time () > entry->expires)
+    {
+      g_hash_table_remove (backend->dir_cache, path);
+      return NULL;
+    }
+
+  return entry->names;
+}
+
+/* Called for every change this backend makes to path. Changes done
+ * by others are only picked up once the entries expire. */
+static void
+attr_cache_invalidate (GVfsBackendSftp *backend,
+                       const char *path,
+                       gboolean recursive)
+{
+  char *parent;
+  char *prefix;
+
+  g_hash_table_remove (backend->attr_cache, path);
+  g_hash_table_remove (backend->dir_cache, path);
+
+  parent = g_path_get_dirname (path);
+  g_hash_table_remove (backend->dir_cache, parent);
+  g_free (parent);
+
+  if (recursive)
+    {
+      prefix = g_strconcat (path, "/", NULL);
+      g_hash_table_foreach_remove (backend->attr_cache, cache_entry_has_prefix, prefix);
+      g_hash_table_foreach_remove (backend->dir_cache, cache_entry_has_prefix, prefix);
+      g_free (prefix);
+    }
+}
+
 static SftpHandle *
-sftp_handle_new (GDataInputStream *reply)
+sftp_handle_new (SftpConnection *connection, GDataInputStream *reply)
 {
   SftpHandle *handle;
 
   handle = g_slice_new0 (SftpHandle);
+  handle->connection = connection;
   handle->raw_handle = read_data_buffer (reply);
   handle->offset = 0;
+  handle->read_window = 1;
 
   return handle;
 }
 
+static void
+read_chunk_free (ReadChunk *chunk)
+{
+  g_free (chunk->data);
+  if (chunk->error)
+    g_error_free (chunk->error);
+  g_slice_free (ReadChunk, chunk);
+}
+
+static void
+read_chunk_drop (ReadChunk *chunk)
+{
+  /* Chunks still waiting for their reply are freed by read_chunk_reply */
+  if (chunk->done)
+    read_chunk_free (chunk);
+  else
+    chunk->handle = NULL;
+}
+
+static void
+reset_read_window (SftpHandle *handle)
+{
+  ReadChunk *chunk;
+
+  while ((chunk = g_queue_pop_head (&handle->read_chunks)) != NULL)
+    read_chunk_drop (chunk);
+
+  handle->read_ahead_offset = handle->offset;
+  handle->read_window = 1;
+  handle->read_eof = FALSE;
+}
+
 static void
 sftp_handle_free (SftpHandle *handle)
 {
+  reset_read_window (handle);
+  if (handle->write_error)
+    g_error_free (handle->write_error);
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
@@ -2375,7 +2892,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
           
           command = new_command_stream (backend, SSH_FXP_CLOSE);
           put_data_buffer (command, bhandle);
-          queue_command_stream_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
+          queue_command_stream_and_free_on (backend, user_data, command, NULL, G_VFS_JOB (job), NULL);
 
           data_buffer_free (bhandle);
         }
@@ -2405,7 +2922,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (user_data, reply);
   
   g_vfs_job_open_for_read_set_handle (G_VFS_JOB_OPEN_FOR_READ (job), handle);
   g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), TRUE);
@@ -2418,14 +2935,27 @@ try_open_for_read (GVfsBackend *backend,
                    const char *filename)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
   GDataOutputStream *command;
+  GFileInfo *info;
 
   G_VFS_JOB(job)->backend_data = GINT_TO_POINTER (0);
+
+  /* Files not known to be small are read over a bulk session. The stat
+     goes to the same session, open_for_read_reply relies on getting
+     its reply first. */
+  info = attr_cache_lookup (op_backend, filename, 0, op_backend->cache_matcher);
+  if (info != NULL &&
+      g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE) &&
+      g_file_info_get_size (info) < SFTP_BULK_READ_SIZE)
+    connection = &op_backend->command_connection;
+  else
+    connection = choose_data_connection (op_backend);
   
   command = new_command_stream (op_backend,
                                 SSH_FXP_STAT);
   put_string (command, filename);
-  queue_command_stream_and_free (op_backend, command, open_stat_reply, G_VFS_JOB (job), NULL);
+  queue_command_stream_and_free_on (op_backend, connection, command, open_stat_reply, G_VFS_JOB (job), NULL);
 
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
@@ -2433,52 +2963,210 @@ try_open_for_read (GVfsBackend *backend,
   g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, open_for_read_reply, G_VFS_JOB (job), NULL);
+  queue_command_stream_and_free_on (op_backend, connection, command, open_for_read_reply, G_VFS_JOB (job), connection);
 
   return TRUE;
 }
 
+static void fill_read_window (GVfsBackendSftp *backend,
+                              SftpHandle *handle);
+
 static void
-read_reply (GVfsBackendSftp *backend,
-            int reply_type,
-            GDataInputStream *reply,
-            guint32 len,
-            GVfsJob *job,
-            gpointer user_data)
+serve_read_jobs (GVfsBackendSftp *backend,
+                 SftpHandle *handle)
+{
+  GVfsJobRead *job;
+  ReadChunk *chunk;
+  gsize n, copy;
+  gboolean eof;
+
+  while ((job = g_queue_peek_head (&handle->read_jobs)) != NULL)
+    {
+      chunk = g_queue_peek_head (&handle->read_chunks);
+
+      if (chunk == NULL && handle->read_eof)
+        {
+          g_queue_pop_head (&handle->read_jobs);
+          g_vfs_job_read_set_size (job, 0);
+          g_vfs_job_succeeded (G_VFS_JOB (job));
+          /* Ask again on the next read, the file may have grown */
+          reset_read_window (handle);
+          continue;
+        }
+      
+      if (chunk == NULL || !chunk->done)
+        break;
+
+      if (chunk->error)
+        {
+          g_queue_pop_head (&handle->read_jobs);
+          g_vfs_job_failed_from_error (G_VFS_JOB (job), chunk->error);
+          /* Start over at the current offset on the next read */
+          reset_read_window (handle);
+          continue;
+        }
+
+      /* Hand out what is available, a short read is fine */
+      n = 0;
+      while (chunk != NULL && chunk->done && chunk->error == NULL &&
+             n < job->bytes_requested)
+        {
+          copy = MIN (job->bytes_requested - n, chunk->len - chunk->pos);
+          memcpy (job->buffer + n, chunk->data + chunk->pos, copy);
+          n += copy;
+          chunk->pos += copy;
+
+          if (chunk->pos < chunk->len)
+            break;
+
+          g_queue_pop_head (&handle->read_chunks);
+          eof = chunk->eof;
+          read_chunk_free (chunk);
+
+          /* Grow the window as long as the data gets consumed */
+          if (handle->read_window < SFTP_MAX_READ_REQUESTS)
+            handle->read_window++;
+
+          if (eof)
+            break;
+          
+          chunk = g_queue_peek_head (&handle->read_chunks);
+        }
+
+      handle->offset += n;
+      g_queue_pop_head (&handle->read_jobs);
+      g_vfs_job_read_set_size (job, n);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+    }
+
+  fill_read_window (backend, handle);
+}
+
+static void
+read_chunk_set_eof (SftpHandle *handle,
+                    ReadChunk *chunk)
+{
+  ReadChunk *last;
+
+  chunk->eof = TRUE;
+  handle->read_eof = TRUE;
+
+  /* Nothing can follow the end of the file */
+  while ((last = g_queue_peek_tail (&handle->read_chunks)) != chunk)
+    {
+      g_queue_pop_tail (&handle->read_chunks);
+      read_chunk_drop (last);
+    }
+  handle->read_ahead_offset = chunk->offset + chunk->len;
+}
+
+static void send_read_chunk_request (GVfsBackendSftp *backend,
+                                     SftpHandle *handle,
+                                     ReadChunk *chunk);
+
+static void
+read_chunk_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
 {
   SftpHandle *handle;
+  ReadChunk *chunk;
   guint32 count;
-  
-  handle = user_data;
+  guint32 code;
+
+  chunk = user_data;
+  handle = chunk->handle;
+
+  if (handle == NULL)
+    {
+      /* Dropped by a seek or close while in flight */
+      read_chunk_free (chunk);
+      return;
+    }
   
   if (reply_type == SSH_FXP_STATUS)
     {
-      result_from_status (job, reply, -1, SSH_FX_EOF);
-      return;
+      code = read_status_code (reply);
+      if (code == SSH_FX_EOF)
+        read_chunk_set_eof (handle, chunk);
+      else if (error_from_status_code (NULL, code, -1, -1, &chunk->error))
+        g_set_error_literal (&chunk->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
     }
-
-  if (reply_type != SSH_FXP_DATA)
+  else if (reply_type == SSH_FXP_DATA)
     {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
-      return;
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+
+      if (count > chunk->size - chunk->len ||
+          !g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                    chunk->data + chunk->len, count,
+                                    NULL, NULL, NULL))
+        g_set_error_literal (&chunk->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+      else if (count == 0)
+        read_chunk_set_eof (handle, chunk);
+      else
+        {
+          chunk->len += count;
+
+          /* The following chunks are already requested, so a short
+             read must be completed rather than leave a hole */
+          if (chunk->len < chunk->size)
+            {
+              send_read_chunk_request (backend, handle, chunk);
+              return;
+            }
+        }
     }
+  else
+    g_set_error_literal (&chunk->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  chunk->done = TRUE;
+  serve_read_jobs (backend, handle);
+}
+
+static void
+send_read_chunk_request (GVfsBackendSftp *backend,
+                         SftpHandle *handle,
+                         ReadChunk *chunk)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend,
+                                SSH_FXP_READ);
+  put_data_buffer (command, handle->raw_handle);
+  g_data_output_stream_put_uint64 (command, chunk->offset + chunk->len, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, chunk->size - chunk->len, NULL, NULL);
   
-  count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  queue_command_stream_and_free_on (backend, handle->connection, command, read_chunk_reply, NULL, chunk);
+}
+
+/* Keeps up to read_window SSH_FXP_READ requests in flight ahead of
+ * the current offset. The window starts at one request and grows
+ * while the data gets consumed, a seek or an error resets it. */
+static void
+fill_read_window (GVfsBackendSftp *backend,
+                  SftpHandle *handle)
+{
+  ReadChunk *chunk;
 
-  if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
-                                G_VFS_JOB_READ (job)->buffer, count,
-                                NULL, NULL, NULL))
+  while (!handle->read_eof &&
+         g_queue_get_length (&handle->read_chunks) < handle->read_window)
     {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
-      return;
-    }
-  
-  handle->offset += count;
+      chunk = g_slice_new0 (ReadChunk);
+      chunk->handle = handle;
+      chunk->offset = handle->read_ahead_offset;
+      chunk->size = SFTP_READ_CHUNK_SIZE;
+      chunk->data = g_malloc (chunk->size);
+      handle->read_ahead_offset += chunk->size;
 
-  g_vfs_job_read_set_size (G_VFS_JOB_READ (job), count);
-  g_vfs_job_succeeded (job);
+      g_queue_push_tail (&handle->read_chunks, chunk);
+      send_read_chunk_request (backend, handle, chunk);
+    }
 }
 
 static gboolean
@@ -2490,15 +3178,9 @@ try_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+  g_queue_push_tail (&handle->read_jobs, job);
+  serve_read_jobs (op_backend, handle);
 
   return TRUE;
 }
@@ -2556,6 +3238,8 @@ seek_read_fstat_reply (GVfsBackendSftp *backend,
     handle->offset = 0;
   if (handle->offset > file_size)
     handle->offset = file_size;
+
+  reset_read_window (handle);
   
   g_vfs_job_seek_read_set_offset (op_job, handle->offset);
   g_vfs_job_succeeded (job);
@@ -2576,7 +3260,7 @@ try_seek_on_read (GVfsBackend *backend,
                                 SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
   
-  queue_command_stream_and_free (op_backend, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
+  queue_command_stream_and_free_on (op_backend, handle->connection, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -2597,6 +3281,15 @@ delete_temp_file (GVfsBackendSftp *backend,
     }
 }
 
+static void
+close_write_free_handle (GVfsBackendSftp *backend,
+                         SftpHandle *handle)
+{
+  /* The file and its temporary file live in the same directory */
+  attr_cache_invalidate (backend, handle->filename, FALSE);
+  sftp_handle_free (handle);
+}
+
 static void
 close_moved_tempfile (GVfsBackendSftp *backend,
                       int reply_type,
@@ -2616,7 +3309,7 @@ close_moved_tempfile (GVfsBackendSftp *backend,
                       _("Invalid reply received"));
 
   /* On failure, don't remove tempfile, since we removed the new original file */
-  sftp_handle_free (handle);
+  close_write_free_handle (backend, handle);
 }
   
 static void
@@ -2684,7 +3377,7 @@ close_deleted_file (GVfsBackendSftp *backend,
       
       g_vfs_job_failed_from_error (job, error);
       g_error_free (error);
-      sftp_handle_free (handle);
+      close_write_free_handle (backend, handle);
     }
 }
 
@@ -2731,7 +3424,7 @@ close_moved_file (GVfsBackendSftp *backend,
       g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_CANT_CREATE_BACKUP,
                         _("Error creating backup file: %s"), error->message);
       g_error_free (error);
-      sftp_handle_free (handle);
+      close_write_free_handle (backend, handle);
     }
 }
 
@@ -2786,6 +3479,14 @@ close_write_reply (GVfsBackendSftp *backend,
     g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
 	                 _("Invalid reply received"));
 
+  if (res && handle->write_error)
+    {
+      /* One of the pipelined writes failed */
+      res = FALSE;
+      error = handle->write_error;
+      handle->write_error = NULL;
+    }
+
   if (res)
     {
       if (handle->tempname)
@@ -2810,7 +3511,7 @@ close_write_reply (GVfsBackendSftp *backend,
       else
         {
           g_vfs_job_succeeded (job);
-          sftp_handle_free (handle);
+          close_write_free_handle (backend, handle);
         }
     }
   else
@@ -2823,7 +3524,7 @@ close_write_reply (GVfsBackendSftp *backend,
       g_vfs_job_failed_from_error (job, error);
       g_error_free (error);
       
-      sftp_handle_free (handle);
+      close_write_free_handle (backend, handle);
     }
 }
 
@@ -2854,7 +3555,20 @@ close_write_fstat_reply (GVfsBackendSftp *backend,
   command = new_command_stream (backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (backend, command, close_write_reply, G_VFS_JOB (job), handle);
+  queue_command_stream_and_free_on (backend, handle->connection, command, close_write_reply, G_VFS_JOB (job), handle);
+}
+
+static void
+close_write_writes_done (GVfsBackendSftp *backend,
+                         GVfsJob *job,
+                         SftpHandle *handle)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+
+  queue_command_stream_and_free_on (backend, handle->connection, command, close_write_fstat_reply, job, handle);
 }
 
 static gboolean
@@ -2864,12 +3578,8 @@ try_close_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
-
-  command = new_command_stream (op_backend, SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (op_backend, command, close_write_fstat_reply, G_VFS_JOB (job), handle);
+  wait_for_writes (op_backend, G_VFS_JOB (job), handle, 0, close_write_writes_done);
 
   return TRUE;
 }
@@ -2904,10 +3614,13 @@ try_close_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  /* Replies to reads still in flight arrive before the close reply */
+  reset_read_window (handle);
+
   command = new_command_stream (op_backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (op_backend, command, close_read_reply, G_VFS_JOB (job), handle);
+  queue_command_stream_and_free_on (op_backend, handle->connection, command, close_read_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -3012,7 +3725,9 @@ create_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (&backend->command_connection, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
+  attr_cache_invalidate (backend, handle->filename, FALSE);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3093,7 +3808,9 @@ append_to_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (&backend->command_connection, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
+  attr_cache_invalidate (backend, handle->filename, FALSE);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), FALSE);
@@ -3177,9 +3894,10 @@ replace_truncate_original_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (&backend->command_connection, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = NULL;
+  attr_cache_invalidate (backend, handle->filename, FALSE);
   handle->permissions = data->permissions;
   handle->make_backup = op_job->make_backup;
   
@@ -3275,9 +3993,10 @@ replace_create_temp_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (&backend->command_connection, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = g_strdup (data->tempname);
+  attr_cache_invalidate (backend, handle->tempname, FALSE);
   handle->permissions = data->permissions;
   handle->make_backup = op_job->make_backup;
   
@@ -3492,7 +4211,9 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
       return;
     }
   
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (&backend->command_connection, reply);
+  handle->filename = g_strdup (op_job->filename);
+  attr_cache_invalidate (backend, handle->filename, FALSE);
   
   g_vfs_job_open_for_write_set_handle (op_job, handle);
   g_vfs_job_open_for_write_set_can_seek (op_job, TRUE);
@@ -3522,6 +4243,41 @@ try_replace (GVfsBackend *backend,
   return TRUE;
 }
 
+/* Runs callback once at most limit writes are outstanding on the handle */
+static void
+wait_for_writes (GVfsBackendSftp *backend,
+                 GVfsJob *job,
+                 SftpHandle *handle,
+                 guint limit,
+                 WritesDoneCallback callback)
+{
+  g_assert (handle->writes_done_job == NULL);
+  
+  if (handle->outstanding_writes <= limit)
+    {
+      callback (backend, job, handle);
+      return;
+    }
+
+  handle->writes_done_job = job;
+  handle->writes_done_limit = limit;
+  handle->writes_done_callback = callback;
+}
+
+/* Reports the first error of earlier writes, if any */
+static gboolean
+failure_from_write_error (GVfsJob *job,
+                          SftpHandle *handle)
+{
+  if (handle->write_error == NULL)
+    return TRUE;
+
+  g_vfs_job_failed_from_error (job, handle->write_error);
+  g_error_free (handle->write_error);
+  handle->write_error = NULL;
+  return FALSE;
+}
+
 static void
 write_reply (GVfsBackendSftp *backend,
              int reply_type,
@@ -3531,19 +4287,38 @@ write_reply (GVfsBackendSftp *backend,
              gpointer user_data)
 {
   SftpHandle *handle;
+  WritesDoneCallback callback;
   
   handle = user_data;
+  handle->outstanding_writes--;
 
-  if (reply_type == SSH_FXP_STATUS)
+  if (handle->write_error == NULL)
     {
-      if (result_from_status (job, reply, -1, -1))
-        {
-          handle->offset += G_VFS_JOB_WRITE (job)->data_size;
-        }
+      if (reply_type == SSH_FXP_STATUS)
+        error_from_status (NULL, reply, -1, -1, &handle->write_error);
+      else
+        g_set_error_literal (&handle->write_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
     }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+
+  if (handle->writes_done_job != NULL &&
+      handle->outstanding_writes <= handle->writes_done_limit)
+    {
+      job = handle->writes_done_job;
+      callback = handle->writes_done_callback;
+      handle->writes_done_job = NULL;
+      handle->writes_done_callback = NULL;
+      callback (backend, job, handle);
+    }
+}
+
+static void
+write_done (GVfsBackendSftp *backend,
+            GVfsJob *job,
+            SftpHandle *handle)
+{
+  if (failure_from_write_error (job, handle))
+    g_vfs_job_succeeded (job);
 }
 
 static gboolean
@@ -3557,6 +4332,9 @@ try_write (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  if (!failure_from_write_error (G_VFS_JOB (job), handle))
+    return TRUE;
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_WRITE);
   put_data_buffer (command, handle->raw_handle);
@@ -3567,12 +4345,20 @@ try_write (GVfsBackend *backend,
   g_output_stream_write_all (G_OUTPUT_STREAM (command),
                              buffer, buffer_size,
                              NULL, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, write_reply, G_VFS_JOB (job), handle);
+
+  /* The job completes without waiting for the status, so that several
+     writes are in flight. A failure is reported by a later write, seek
+     or close of the handle. */
+  queue_command_stream_and_free_on (op_backend, handle->connection, command, write_reply, NULL, handle);
+  handle->outstanding_writes++;
+  handle->offset += buffer_size;
 
   /* We always write the full size (on success) */
   g_vfs_job_write_set_written_size (job, buffer_size);
 
+  wait_for_writes (op_backend, G_VFS_JOB (job), handle,
+                   SFTP_MAX_WRITE_REQUESTS - 1, write_done);
+
   return TRUE;
 }
 
@@ -3634,6 +4420,23 @@ seek_write_fstat_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (job);
 }
 
+static void
+seek_write_writes_done (GVfsBackendSftp *backend,
+                        GVfsJob *job,
+                        SftpHandle *handle)
+{
+  GDataOutputStream *command;
+
+  if (!failure_from_write_error (job, handle))
+    return;
+
+  command = new_command_stream (backend,
+                                SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+  
+  queue_command_stream_and_free_on (backend, handle->connection, command, seek_write_fstat_reply, job, handle);
+}
+
 static gboolean
 try_seek_on_write (GVfsBackend *backend,
                    GVfsJobSeekWrite *job,
@@ -3643,13 +4446,8 @@ try_seek_on_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
-  
-  queue_command_stream_and_free (op_backend, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
+  wait_for_writes (op_backend, G_VFS_JOB (job), handle, 0, seek_write_writes_done);
 
   return TRUE;
 }
@@ -3657,6 +4455,7 @@ try_seek_on_write (GVfsBackend *backend,
 typedef struct {
   DataBuffer *handle;
   int outstanding_requests;
+  GPtrArray *names;
 } ReadDirData;
 
 static
@@ -3664,108 +4463,102 @@ void
 read_dir_data_free (ReadDirData *data)
 {
   data_buffer_free (data->handle);
+  if (data->names)
+    g_ptr_array_free (data->names, TRUE);
   g_slice_free (ReadDirData, data);
 }
 
 static void
-read_dir_readlink_reply (GVfsBackendSftp *backend,
-                         int reply_type,
-                         GDataInputStream *reply,
-                         guint32 len,
-                         GVfsJob *job,
-                         gpointer user_data)
-{
-  ReadDirData *data;
-  GFileInfo *info = user_data;
-  char *target;
-
-  data = job->backend_data;
-
-  if (reply_type == SSH_FXP_NAME)
-    {
-      /* count = */ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
-      
-      target = read_string (reply, NULL);
-      if (target)
-        {
-          g_file_info_set_symlink_target (info, target);
-          g_free (target);
-        }
-    }
-
-  g_vfs_job_enumerate_add_info (G_VFS_JOB_ENUMERATE (job), info);
-  g_object_unref (info);
-  
-  if (--data->outstanding_requests == 0)
-    g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
-}
-
-static void
-read_dir_got_stat_info (GVfsBackendSftp *backend,
-                        GVfsJob *job,
-                        GFileInfo *info)
+read_dir_add_info (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   GFileInfo *info,
+                   GFileInfo *follow_info)
 {
   GVfsJobEnumerate *enum_job;
-  GDataOutputStream *command;
-  ReadDirData *data;
+  GFileInfo *copy;
   char *abs_name;
-  
-  data = job->backend_data;
-  
+
   enum_job = G_VFS_JOB_ENUMERATE (job);
 
-  if (g_file_attribute_matcher_matches (enum_job->attribute_matcher,
-                                        G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
-    {
-      data->outstanding_requests++;
-      command = new_command_stream (backend,
-                                    SSH_FXP_READLINK);
-      abs_name = g_build_filename (enum_job->filename, g_file_info_get_name (info), NULL);
-      put_string (command, abs_name);
-      g_free (abs_name);
-      queue_command_stream_and_free (backend, command, read_dir_readlink_reply, G_VFS_JOB (job), g_object_ref (info));
-    }
-  else
-    g_vfs_job_enumerate_add_info (enum_job, info);
-}
+  abs_name = g_build_filename (enum_job->filename, g_file_info_get_name (info), NULL);
+  attr_cache_insert (backend, abs_name, info, follow_info);
+  g_free (abs_name);
 
+  if (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
+    follow_info = info;
+
+  /* Adding the info applies the attribute mask to it */
+  copy = g_file_info_dup (follow_info);
+  g_vfs_job_enumerate_add_info (enum_job, copy);
+  g_object_unref (copy);
+}
 
 static void
 read_dir_symlink_reply (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
+                        MultiReply *replies,
+                        int n_replies,
                         GVfsJob *job,
                         gpointer user_data)
 {
-  const char *name;
-  GFileInfo *info;
+  GVfsJobEnumerate *enum_job;
   GFileInfo *lstat_info;
+  GFileInfo *follow_info;
+  MultiReply *reply;
   ReadDirData *data;
+  const char *name;
+  char *target;
+  int i;
 
+  enum_job = G_VFS_JOB_ENUMERATE (job);
   lstat_info = user_data;
   name = g_file_info_get_name (lstat_info);
   data = job->backend_data;
-  
-  if (reply_type == SSH_FXP_ATTRS)
+
+  i = 0;
+  follow_info = NULL;
+  if (!(enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
     {
-      info = g_file_info_new ();
-      g_file_info_set_name (info, name);
-      g_file_info_set_is_symlink (info, TRUE);
-      
-      parse_attributes (backend, info, name, reply, G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
+      /* Default (at least for openssh) is for readdir to not follow symlinks.
+         This was a symlink, and follow links was requested, so we need to manually follow it */
+      reply = &replies[i++];
+      if (reply->type == SSH_FXP_ATTRS)
+        {
+          follow_info = g_file_info_new ();
+          g_file_info_set_name (follow_info, name);
+          g_file_info_set_is_symlink (follow_info, TRUE);
+          parse_attributes (backend, follow_info, name, reply->data,
+                            backend->cache_ttl ? backend->cache_matcher : enum_job->attribute_matcher);
+        }
+      else
+        /* Broken symlink, use lstat data */
+        follow_info = g_object_ref (lstat_info);
+    }
 
-      read_dir_got_stat_info (backend, job, info);
-      
-      g_object_unref (info);
+  if (i < n_replies)
+    {
+      reply = &replies[i++];
+      if (reply->type == SSH_FXP_NAME)
+        {
+          /* count = */ (void) g_data_input_stream_read_uint32 (reply->data, NULL, NULL);
+          target = read_string (reply->data, NULL);
+          if (target)
+            {
+              g_file_info_set_symlink_target (lstat_info, target);
+              if (follow_info != NULL && follow_info != lstat_info)
+                g_file_info_set_symlink_target (follow_info, target);
+              g_free (target);
+            }
+        }
     }
-  else
-    read_dir_got_stat_info (backend, job, lstat_info);
 
+  read_dir_add_info (backend, job, lstat_info, follow_info);
+
+  if (follow_info)
+    g_object_unref (follow_info);
   g_object_unref (lstat_info);
   
   if (--data->outstanding_requests == 0)
-    g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
+    g_vfs_job_enumerate_done (enum_job);
 }
 
 static void
@@ -3777,9 +4570,12 @@ read_dir_reply (GVfsBackendSftp *backend,
                 gpointer user_data)
 {
   GVfsJobEnumerate *enum_job;
+  GFileAttributeMatcher *matcher;
   guint32 count;
   int i;
   GDataOutputStream *command;
+  GDataOutputStream *commands[2];
+  int n_commands;
   ReadDirData *data;
 
   data = job->backend_data;
@@ -3790,6 +4586,13 @@ read_dir_reply (GVfsBackendSftp *backend,
       /* Ignore all error, including the expected END OF FILE.
        * Real errors are expected in open_dir anyway */
 
+      if (reply_type == SSH_FXP_STATUS &&
+          read_status_code (reply) == SSH_FX_EOF)
+        {
+          dir_cache_insert (backend, enum_job->filename, data->names);
+          data->names = NULL;
+        }
+
       /* Close handle */
 
       command = new_command_stream (backend,
@@ -3803,6 +4606,9 @@ read_dir_reply (GVfsBackendSftp *backend,
       return;
     }
 
+  /* Cached infos must have all attributes, whatever was asked for */
+  matcher = backend->cache_ttl ? backend->cache_matcher : enum_job->attribute_matcher;
+
   count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
   for (i = 0; i < count; i++)
     {
@@ -3818,25 +4624,51 @@ read_dir_reply (GVfsBackendSftp *backend,
       longname = read_string (reply, NULL);
       g_free (longname);
       
-      parse_attributes (backend, info, name, reply, enum_job->attribute_matcher);
+      parse_attributes (backend, info, name, reply, matcher);
+
+      if (strcmp (".", name) == 0 ||
+          strcmp ("..", name) == 0)
+        {
+          g_object_unref (info);
+          g_free (name);
+          continue;
+        }
+
+      if (data->names)
+        g_ptr_array_add (data->names, g_strdup (name));
       
-      if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK &&
-          ! (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
+      n_commands = 0;
+      if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK)
         {
-          /* Default (at least for openssh) is for readdir to not follow symlinks.
-             This was a symlink, and follow links was requested, so we need to manually follow it */
-          command = new_command_stream (backend,
-                                        SSH_FXP_STAT);
           abs_name = g_build_filename (enum_job->filename, name, NULL);
-          put_string (command, abs_name);
-          g_free (abs_name);
+
+          /* Resolve the target and read the link at the same time */
+          if (! (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
+            {
+              command = commands[n_commands++] =
+                new_command_stream (backend, SSH_FXP_STAT);
+              put_string (command, abs_name);
+            }
+          
+          if (g_file_attribute_matcher_matches (enum_job->attribute_matcher,
+                                                G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+            {
+              command = commands[n_commands++] =
+                new_command_stream (backend, SSH_FXP_READLINK);
+              put_string (command, abs_name);
+            }
           
-          queue_command_stream_and_free (backend, command, read_dir_symlink_reply, G_VFS_JOB (job), g_object_ref (info));
+          g_free (abs_name);
+        }
+
+      if (n_commands > 0)
+        {
+          queue_command_streams_and_free (backend, commands, n_commands, read_dir_symlink_reply, G_VFS_JOB (job), g_object_ref (info));
           data->outstanding_requests ++;
         }
-      else if (strcmp (".", name) != 0 &&
-               strcmp ("..", name) != 0)
-        read_dir_got_stat_info (backend, job, info);
+      else
+        read_dir_add_info (backend, job, info,
+                           g_file_info_get_is_symlink (info) ? NULL : info);
         
       g_object_unref (info);
       g_free (name);
@@ -3914,6 +4746,48 @@ open_dir_reply (GVfsBackendSftp *backend,
   queue_command_stream_and_free (op_backend, command, read_dir_reply, G_VFS_JOB (job), NULL);
 }
 
+static gboolean
+enumerate_from_cache (GVfsBackendSftp *backend,
+                      GVfsJobEnumerate *job,
+                      const char *filename,
+                      GFileAttributeMatcher *attribute_matcher,
+                      GFileQueryInfoFlags flags)
+{
+  GPtrArray *names;
+  GFileInfo *info;
+  GList *infos;
+  char *abs_name;
+  guint i;
+
+  names = dir_cache_lookup (backend, filename);
+  if (names == NULL)
+    return FALSE;
+
+  infos = NULL;
+  for (i = 0; i < names->len; i++)
+    {
+      abs_name = g_build_filename (filename, g_ptr_array_index (names, i), NULL);
+      info = attr_cache_lookup (backend, abs_name, flags, attribute_matcher);
+      g_free (abs_name);
+
+      if (info == NULL)
+        {
+          g_list_free_full (infos, g_object_unref);
+          return FALSE;
+        }
+
+      infos = g_list_prepend (infos, g_file_info_dup (info));
+    }
+  infos = g_list_reverse (infos);
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  g_vfs_job_enumerate_add_infos (job, infos);
+  g_vfs_job_enumerate_done (job);
+  g_list_free_full (infos, g_object_unref);
+
+  return TRUE;
+}
+
 static gboolean
 try_enumerate (GVfsBackend *backend,
                GVfsJobEnumerate *job,
@@ -3925,7 +4799,12 @@ try_enumerate (GVfsBackend *backend,
   GDataOutputStream *command;
   ReadDirData *data;
 
+  if (enumerate_from_cache (op_backend, job, filename, attribute_matcher, flags))
+    return TRUE;
+
   data = g_slice_new0 (ReadDirData);
+  if (op_backend->cache_ttl)
+    data->names = g_ptr_array_new_with_free_func (g_free);
 
   g_vfs_job_set_backend_data (G_VFS_JOB (job), data, (GDestroyNotify)read_dir_data_free);
   command = new_command_stream (op_backend,
@@ -3948,6 +4827,8 @@ query_info_reply (GVfsBackendSftp *backend,
   int i;
   MultiReply *lstat_reply, *reply;
   GFileInfo *lstat_info;
+  GFileInfo *follow_info;
+  GFileAttributeMatcher *matcher;
   GVfsJobQueryInfo *op_job;
 
   op_job = G_VFS_JOB_QUERY_INFO (job);
@@ -3968,40 +4849,39 @@ query_info_reply (GVfsBackendSftp *backend,
       return;
     }
 
+  /* Cached infos must have all attributes, whatever was asked for */
+  matcher = backend->cache_ttl ? backend->cache_matcher : op_job->attribute_matcher;
+
   basename = NULL;
   if (strcmp (op_job->filename, "/") != 0)
     basename = g_path_get_basename (op_job->filename);
 
-  if (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
-    {
-      parse_attributes (backend, op_job->file_info, basename,
-                        lstat_reply->data, op_job->attribute_matcher);
-    }
-  else
+  lstat_info = g_file_info_new ();
+  parse_attributes (backend, lstat_info, basename,
+                    lstat_reply->data, matcher);
+
+  follow_info = NULL;
+  if (!g_file_info_get_is_symlink (lstat_info))
+    follow_info = g_object_ref (lstat_info);
+
+  if (! (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
     {
       /* Look at stat results */
       reply = &replies[i++];
 
-      if (reply->type == SSH_FXP_ATTRS)
-        {
-          parse_attributes (backend, op_job->file_info, basename,
-                            reply->data, op_job->attribute_matcher);
-
-          
-          lstat_info = g_file_info_new ();
-          parse_attributes (backend, lstat_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
-          if (g_file_info_get_is_symlink (lstat_info))
-            g_file_info_set_is_symlink (op_job->file_info, TRUE);
-          g_object_unref (lstat_info);
-        }
-      else
+      if (follow_info == NULL)
         {
-          /* Broken symlink, use lstat data */
-          parse_attributes (backend, op_job->file_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
+          if (reply->type == SSH_FXP_ATTRS)
+            {
+              follow_info = g_file_info_new ();
+              parse_attributes (backend, follow_info, basename,
+                                reply->data, matcher);
+              g_file_info_set_is_symlink (follow_info, TRUE);
+            }
+          else
+            /* Broken symlink, use lstat data */
+            follow_info = g_object_ref (lstat_info);
         }
-      
     }
     
   g_free (basename);
@@ -4017,11 +4897,25 @@ query_info_reply (GVfsBackendSftp *backend,
           char *symlink_target;
           
           symlink_target = read_string (reply->data, NULL);
-          g_file_info_set_symlink_target (op_job->file_info, symlink_target);
+          g_file_info_set_symlink_target (lstat_info, symlink_target);
+          if (follow_info != NULL && follow_info != lstat_info)
+            g_file_info_set_symlink_target (follow_info, symlink_target);
           g_free (symlink_target);
         }
     }
 
+  attr_cache_insert (backend, op_job->filename, lstat_info, follow_info);
+
+  if (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
+    g_file_info_copy_into (lstat_info, op_job->file_info);
+  else
+    g_file_info_copy_into (follow_info, op_job->file_info);
+  g_file_info_set_attribute_mask (op_job->file_info, op_job->attribute_matcher);
+
+  g_object_unref (lstat_info);
+  if (follow_info)
+    g_object_unref (follow_info);
+
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
@@ -4036,8 +4930,18 @@ try_query_info (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *commands[3];
   GDataOutputStream *command;
+  GFileInfo *cached_info;
   int n_commands;
 
+  cached_info = attr_cache_lookup (op_backend, filename, flags, matcher);
+  if (cached_info != NULL)
+    {
+      g_file_info_copy_into (cached_info, info);
+      g_file_info_set_attribute_mask (info, matcher);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
+
   n_commands = 0;
   
   command = commands[n_commands++] =
@@ -4128,7 +5032,7 @@ try_query_info_fstat (GVfsBackend *backend,
   data = g_slice_new (QueryInfoFStatData);
   data->info = info;
   data->attribute_matcher = attribute_matcher;
-  queue_command_stream_and_free (op_backend, command, query_info_fstat_reply, G_VFS_JOB (job), data);
+  queue_command_stream_and_free_on (op_backend, handle->connection, command, query_info_fstat_reply, G_VFS_JOB (job), data);
 
   return TRUE;
 }
@@ -4143,6 +5047,9 @@ move_reply (GVfsBackendSftp *backend,
 {
   goffset *file_size;
 
+  attr_cache_invalidate (backend, G_VFS_JOB_MOVE (job)->source, TRUE);
+  attr_cache_invalidate (backend, G_VFS_JOB_MOVE (job)->destination, TRUE);
+
   /* on any unknown error, return NOT_SUPPORTED to get the fallback implementation */
   if (reply_type == SSH_FXP_STATUS)
     {
@@ -4316,198 +5223,1382 @@ try_move (GVfsBackend *backend,
   return TRUE;
 }
 
+/* Pull, push and copy move file data directly between a local file
+ * descriptor and the server, with SFTP_MAX_READ_REQUESTS or
+ * SFTP_MAX_WRITE_REQUESTS requests in flight. Anything they don't
+ * handle (directories, symlinks, backups) fails with NOT_SUPPORTED so
+ * that gio falls back to its generic copy. */
+
+#define TRANSFER_PROGRESS_INTERVAL (100 * 1000) /* usec */
+
+typedef struct {
+  char *remote_path;
+  char *local_path;
+  GFileCopyFlags flags;
+  gboolean remove_source;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+
+  /* With G_FILE_COPY_OVERWRITE the data goes to temp_path next to
+     the destination, which is only replaced once the transfer is
+     complete. Push and copy write to the remote dest_path. */
+  char *dest_path;
+  char *temp_path;
+  int temp_count;
+
+  SftpConnection *connection;
+  DataBuffer *handle;
+  DataBuffer *dest_handle; /* Only used for copy */
+  int fd;
+  struct stat local_stat;
+  GFileInfo *info;
+
+  goffset size;
+  goffset next_offset;
+  goffset bytes_done;
+  goffset eof_offset;
+  int outstanding;
+  gint64 last_progress;
+  GError *error;
+} TransferData;
+
+typedef struct {
+  goffset offset;
+  gsize size;
+} TransferChunk;
+
 static void
-set_display_name_reply (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
-                        GVfsJob *job,
-                        gpointer user_data)
+transfer_data_free (TransferData *data)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1);
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  g_free (data->remote_path);
+  g_free (data->local_path);
+  g_free (data->dest_path);
+  g_free (data->temp_path);
+  data_buffer_free (data->handle);
+  data_buffer_free (data->dest_handle);
+  if (data->fd != -1)
+    close (data->fd);
+  if (data->info)
+    g_object_unref (data->info);
+  if (data->error)
+    g_error_free (data->error);
+  g_slice_free (TransferData, data);
+}
+
+static TransferData *
+transfer_data_new (GVfsJob *job,
+                   SftpConnection *connection,
+                   const char *remote_path,
+                   const char *local_path,
+                   GFileCopyFlags flags,
+                   gboolean remove_source,
+                   GFileProgressCallback progress_callback,
+                   gpointer progress_callback_data)
+{
+  TransferData *data;
+
+  data = g_slice_new0 (TransferData);
+  data->connection = connection;
+  data->remote_path = g_strdup (remote_path);
+  data->local_path = g_strdup (local_path);
+  data->flags = flags;
+  data->remove_source = remove_source;
+  data->progress_callback = progress_callback;
+  data->progress_callback_data = progress_callback_data;
+  data->fd = -1;
+  data->eof_offset = -1;
+
+  g_vfs_job_set_backend_data (job, data, (GDestroyNotify)transfer_data_free);
+
+  return data;
 }
 
-static gboolean
-try_set_display_name (GVfsBackend *backend,
-                      GVfsJobSetDisplayName *job,
-                      const char *filename,
-                      const char *display_name)
+static void
+transfer_report_progress (TransferData *data,
+                          gboolean force)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
-  char *dirname, *basename, *new_name;
-
-  /* We use the same setting as for local files. Can't really
-   * do better, since there is no way in this version of sftp to find out
-   * the remote charset encoding
-   */
-  
-  dirname = g_path_get_dirname (filename);
-  basename = g_filename_from_utf8 (display_name, -1, NULL, NULL, NULL);
-  if (basename == NULL)
-    basename = g_strdup (display_name);
-  new_name = g_build_filename (dirname, basename, NULL);
-  g_free (dirname);
-  g_free (basename);
+  gint64 now;
 
-  g_vfs_job_set_display_name_set_new_path (job,
-                                           new_name);
-  
-  command = new_command_stream (op_backend,
-                                SSH_FXP_RENAME);
-  put_string (command, filename);
-  put_string (command, new_name);
-  
-  queue_command_stream_and_free (op_backend, command, set_display_name_reply, G_VFS_JOB (job), NULL);
+  if (data->progress_callback == NULL)
+    return;
 
-  g_free (new_name);
+  /* Every report is a D-Bus roundtrip, don't do one per chunk */
+  now = g_get_monotonic_time ();
+  if (!force && now - data->last_progress < TRANSFER_PROGRESS_INTERVAL)
+    return;
 
-  return TRUE;
+  data->last_progress = now;
+  data->progress_callback (data->bytes_done, data->size,
+                           data->progress_callback_data);
 }
 
-
 static void
-make_symlink_reply (GVfsBackendSftp *backend,
-                    int reply_type,
-                    GDataInputStream *reply,
-                    guint32 len,
-                    GVfsJob *job,
-                    gpointer user_data)
+transfer_set_errno (TransferData *data,
+                    int errsv)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1); 
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  if (data->error == NULL)
+    g_set_error_literal (&data->error, G_IO_ERROR,
+                         g_io_error_from_errno (errsv),
+                         g_strerror (errsv));
 }
 
-static gboolean
-try_make_symlink (GVfsBackend *backend,
-                  GVfsJobMakeSymlink *job,
-                  const char *filename,
-                  const char *symlink_value)
+static void
+transfer_close_remote (GVfsBackendSftp *backend,
+                       SftpConnection *connection,
+                       DataBuffer *handle)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
-  
-  command = new_command_stream (op_backend,
-                                SSH_FXP_SYMLINK);
-  /* Note: This is the reverse order of how this is documented in
-     draft-ietf-secsh-filexfer-02.txt, but its how openssh does it. */
-  put_string (command, symlink_value);
-  put_string (command, filename);
-  
-  queue_command_stream_and_free (op_backend, command, make_symlink_reply, G_VFS_JOB (job), NULL);
 
-  return TRUE;
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, handle);
+  queue_command_stream_and_free_on (backend, connection, command, NULL, NULL, NULL);
 }
 
 static void
-mkdir_stat_reply (GVfsBackendSftp *backend,
-                  int reply_type,
-                  GDataInputStream *reply,
-                  guint32 len,
-                  GVfsJob *job,
-                  gpointer user_data)
+transfer_remove_remote (GVfsBackendSftp *backend,
+                        SftpConnection *connection,
+                        const char *path)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    /* We got some error, but lets report the original FAILURE, as
-       these extra errors are not really mkdir errors, we just wanted
-       to implement EEXISTS */
-    result_from_status_code (job, SSH_FX_FAILURE, -1, -1);
-  else if (reply_type != SSH_FXP_ATTRS)
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
-                      _("Target file exists"));
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_REMOVE);
+  put_string (command, path);
+  queue_command_stream_and_free_on (backend, connection, command, NULL, NULL, NULL);
 }
 
 static void
-make_directory_reply (GVfsBackendSftp *backend,
-                      int reply_type,
-                      GDataInputStream *reply,
-                      guint32 len,
-                      GVfsJob *job,
-                      gpointer user_data)
+transfer_not_supported (GVfsJob *job)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    {
-      gint stat_error;
-
-      stat_error = read_status_code (reply);
-      if (stat_error == SSH_FX_FAILURE)
-        {
-          /* Generic SFTP error, let's stat the target */
-          GDataOutputStream *command;
-
-          command = new_command_stream (backend,
-                                        SSH_FXP_LSTAT);
-          put_string (command, G_VFS_JOB_MAKE_DIRECTORY (job)->filename);
-          queue_command_stream_and_free (backend, command, mkdir_stat_reply, G_VFS_JOB (job), NULL);
-        }
-      else
-        result_from_status_code (job, stat_error, -1, -1);
-    }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("Operation not supported by backend"));
 }
 
 static gboolean
-try_make_directory (GVfsBackend *backend,
-                    GVfsJobMakeDirectory *job,
-                    const char *filename)
+transfer_check_source_info (GVfsJob *job,
+                            TransferData *data,
+                            int reply_type,
+                            GDataInputStream *reply,
+                            GVfsBackendSftp *backend)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      result_from_status (job, reply, -1, -1);
+      return FALSE;
+    }
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_MKDIR);
-  put_string (command, filename);
-  /* No file info - flag 0 */
-  g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      return FALSE;
+    }
 
-  queue_command_stream_and_free (op_backend, command, make_directory_reply, G_VFS_JOB (job), NULL);
+  data->info = g_file_info_new ();
+  parse_attributes (backend, data->info, NULL, reply, NULL);
+
+  /* Let gio handle directories, symlinks and special files */
+  if (g_file_info_get_file_type (data->info) != G_FILE_TYPE_REGULAR)
+    {
+      transfer_not_supported (job);
+      return FALSE;
+    }
 
+  data->size = g_file_info_get_size (data->info);
   return TRUE;
 }
 
 static void
-delete_remove_reply (GVfsBackendSftp *backend,
-                     int reply_type,
-                     GDataInputStream *reply,
-                     guint32 len,
-                     GVfsJob *job,
-                     gpointer user_data)
+transfer_put_attributes (GDataOutputStream *command,
+                         TransferData *data,
+                         gboolean has_mode,
+                         guint32 mode)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1); 
+  if (!has_mode || (data->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS))
+    g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
   else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+    {
+      g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, mode & 07777, NULL, NULL);
+    }
 }
 
 static void
-delete_rmdir_reply (GVfsBackendSftp *backend,
-                    int reply_type,
-                    GDataInputStream *reply,
-                    guint32 len,
-                    GVfsJob *job,
-                    gpointer user_data)
+transfer_set_remote_times (GVfsBackendSftp *backend,
+                           SftpConnection *connection,
+                           DataBuffer *handle,
+                           guint32 atime,
+                           guint32 mtime)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, G_IO_ERROR_NOT_EMPTY, -1); 
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  GDataOutputStream *command;
+
+  /* Like the generic copy, failing to copy the times is not an error */
+  command = new_command_stream (backend, SSH_FXP_FSETSTAT);
+  put_data_buffer (command, handle);
+  g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_ACMODTIME, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, atime, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, mtime, NULL, NULL);
+  queue_command_stream_and_free_on (backend, connection, command, NULL, NULL, NULL);
 }
 
-static void
+static char *
+transfer_temp_name (const char *path)
+{
+  char basename[] = ".giosaveXXXXXX";
+  char *dirname, *temp_name;
+
+  dirname = g_path_get_dirname (path);
+  random_text (basename + 8);
+  temp_name = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+
+  return temp_name;
+}
+
+/* Opens the remote destination of a push or copy. It's always created
+   exclusively, so on failure only what this transfer created is
+   removed, never a file that was there before. */
+static void
+transfer_open_dest (GVfsBackendSftp *backend,
+                    GVfsJob *job,
+                    TransferData *data,
+                    ReplyCallback callback)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  if (data->flags & G_FILE_COPY_OVERWRITE)
+    {
+      g_free (data->temp_path);
+      data->temp_path = transfer_temp_name (data->dest_path);
+      put_string (command, data->temp_path);
+    }
+  else
+    put_string (command, data->dest_path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL, NULL, NULL); /* open flags */
+  if (data->info != NULL)
+    transfer_put_attributes (command, data,
+                             g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_UNIX_MODE),
+                             g_file_info_get_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE));
+  else
+    transfer_put_attributes (command, data, TRUE, data->local_stat.st_mode);
+  queue_command_stream_and_free_on (backend, data->connection, command, callback, job, NULL);
+}
+
+/* Handles a status reply to transfer_open_dest(). Returns the error to
+   fail with, or NULL if another temporary name is being tried. */
+static GError *
+transfer_open_dest_status (GVfsBackendSftp *backend,
+                           GVfsJob *job,
+                           TransferData *data,
+                           GDataInputStream *reply,
+                           ReplyCallback callback)
+{
+  GError *error;
+
+  error = NULL;
+  if (error_from_status (job, reply, G_IO_ERROR_EXISTS, -1, &error))
+    /* Open should not return OK */
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+  else if (data->temp_path != NULL && error->code == G_IO_ERROR_EXISTS)
+    {
+      /* It was *probably* the EXCL flag failing on the temporary name */
+      g_clear_error (&error);
+      if (++data->temp_count < 100)
+        transfer_open_dest (backend, job, data, callback);
+      else
+        g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Unable to create temporary file"));
+    }
+
+  return error;
+}
+
+/* Removes the file a failed push or copy created */
+static void
+transfer_remove_dest (GVfsBackendSftp *backend,
+                      TransferData *data)
+{
+  attr_cache_invalidate (backend, data->dest_path, FALSE);
+  transfer_remove_remote (backend, data->connection,
+                          data->temp_path ? data->temp_path : data->dest_path);
+}
+
+static void
+transfer_remote_done (GVfsBackendSftp *backend,
+                      GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  int errsv;
+
+  if (data->remove_source && g_unlink (data->local_path) == -1)
+    {
+      errsv = errno;
+      g_vfs_job_failed (job, G_IO_ERROR, g_io_error_from_errno (errsv),
+                        _("Error deleting file: %s"), g_strerror (errsv));
+      return;
+    }
+
+  data->bytes_done = data->size;
+  transfer_report_progress (data, TRUE);
+  g_vfs_job_succeeded (job);
+}
+
+static void
+transfer_rename_temp_reply (GVfsBackendSftp *backend,
+                            int reply_type,
+                            GDataInputStream *reply,
+                            guint32 len,
+                            GVfsJob *job,
+                            gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  attr_cache_invalidate (backend, data->dest_path, FALSE);
+
+  /* On failure, don't remove the temporary file, since we removed the
+     original file */
+  if (reply_type != SSH_FXP_STATUS)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+  else if (failure_from_status (job, reply, -1, -1))
+    transfer_remote_done (backend, job);
+}
+
+static void
+transfer_remove_original_reply (GVfsBackendSftp *backend,
+                                int reply_type,
+                                GDataInputStream *reply,
+                                guint32 len,
+                                GVfsJob *job,
+                                gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  /* Ignore the result, there may have been no original file. If it
+     couldn't be removed, the rename will fail. */
+  command = new_command_stream (backend, SSH_FXP_RENAME);
+  put_string (command, data->temp_path);
+  put_string (command, data->dest_path);
+  queue_command_stream_and_free_on (backend, data->connection, command, transfer_rename_temp_reply, job, NULL);
+}
+
+/* Called once the remote destination is closed. Like replace, moves
+   the temporary file over the original. */
+static void
+transfer_commit_dest (GVfsBackendSftp *backend,
+                      GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (data->temp_path == NULL)
+    {
+      transfer_remote_done (backend, job);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_REMOVE);
+  put_string (command, data->dest_path);
+  queue_command_stream_and_free_on (backend, data->connection, command, transfer_remove_original_reply, job, NULL);
+}
+
+static void
+pull_remove_reply (GVfsBackendSftp *backend,
+                   int reply_type,
+                   GDataInputStream *reply,
+                   guint32 len,
+                   GVfsJob *job,
+                   gpointer user_data)
+{
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static void
+pull_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  /* The data is already safe locally, so ignore close errors */
+  if (data->remove_source)
+    {
+      attr_cache_invalidate (backend, data->remote_path, FALSE);
+      command = new_command_stream (backend, SSH_FXP_REMOVE);
+      put_string (command, data->remote_path);
+      queue_command_stream_and_free_on (backend, data->connection, command, pull_remove_reply, job, NULL);
+      return;
+    }
+
+  g_vfs_job_succeeded (job);
+}
+
+static void
+pull_finish (GVfsBackendSftp *backend,
+             GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+  struct timeval times[2];
+
+  if (data->error == NULL && g_vfs_job_is_cancelled (job))
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                         _("Operation was cancelled"));
+
+  if (data->error == NULL)
+    {
+      /* The file shrank while we were reading it */
+      if (data->eof_offset != -1 && data->eof_offset < data->size &&
+          ftruncate (data->fd, data->eof_offset) == -1)
+        transfer_set_errno (data, errno);
+    }
+  
+  if (data->error == NULL &&
+      !(data->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS) &&
+      g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    fchmod (data->fd, g_file_info_get_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE) & 07777);
+  
+  if (close (data->fd) == -1)
+    transfer_set_errno (data, errno);
+  data->fd = -1;
+
+  if (data->error == NULL && data->temp_path != NULL &&
+      g_rename (data->temp_path, data->local_path) == -1)
+    transfer_set_errno (data, errno);
+
+  if (data->error != NULL)
+    {
+      transfer_close_remote (backend, data->connection, data->handle);
+      /* Only what this transfer created, never the file it would replace */
+      g_unlink (data->temp_path ? data->temp_path : data->local_path);
+      g_vfs_job_failed_from_error (job, data->error);
+      return;
+    }
+
+  if ((data->flags & G_FILE_COPY_ALL_METADATA) &&
+      g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    {
+      times[0].tv_sec = g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+      times[0].tv_usec = 0;
+      times[1].tv_sec = g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+      times[1].tv_usec = 0;
+      utimes (data->local_path, times);
+    }
+
+  data->bytes_done = data->size;
+  transfer_report_progress (data, TRUE);
+
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->handle);
+  queue_command_stream_and_free_on (backend, data->connection, command, pull_close_reply, job, NULL);
+}
+
+static void pull_fill (GVfsBackendSftp *backend,
+                       GVfsJob *job);
+
+static void
+pull_send_read (GVfsBackendSftp *backend,
+                GVfsJob *job,
+                TransferChunk *chunk);
+
+static void
+pull_read_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  TransferChunk *chunk = user_data;
+  guint32 count;
+  guint32 code;
+  guchar *buffer;
+  gssize res;
+  gsize written;
+
+  data->outstanding--;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      code = read_status_code (reply);
+      if (code == SSH_FX_EOF)
+        {
+          if (data->eof_offset == -1 || chunk->offset < data->eof_offset)
+            data->eof_offset = chunk->offset;
+        }
+      else if (data->error == NULL &&
+               error_from_status_code (job, code, -1, -1, &data->error))
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+    }
+  else if (reply_type == SSH_FXP_DATA && data->error == NULL)
+    {
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+
+      /* Check the length before allocating anything for it. An empty
+         reply isn't EOF, and would leave a hole in the file. */
+      buffer = NULL;
+      if (count == 0 || count > chunk->size)
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+      else
+        buffer = g_malloc (chunk->size);
+
+      if (buffer != NULL &&
+          !g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                    buffer, count,
+                                    NULL, NULL, NULL))
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+      else if (buffer != NULL)
+        {
+          /* Chunks complete out of order, so write at their offset */
+          written = 0;
+          while (written < count)
+            {
+              res = pwrite (data->fd, buffer + written, count - written,
+                            chunk->offset + written);
+              if (res == -1 && errno == EINTR)
+                continue;
+              if (res == -1)
+                {
+                  transfer_set_errno (data, errno);
+                  break;
+                }
+              written += res;
+            }
+
+          data->bytes_done += count;
+          chunk->offset += count;
+          chunk->size -= count;
+
+          if (chunk->size > 0 && data->error == NULL)
+            {
+              g_free (buffer);
+              pull_send_read (backend, job, chunk);
+              return;
+            }
+        }
+      g_free (buffer);
+    }
+  else if (data->error == NULL)
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  g_slice_free (TransferChunk, chunk);
+
+  transfer_report_progress (data, FALSE);
+  pull_fill (backend, job);
+}
+
+static void
+pull_send_read (GVfsBackendSftp *backend,
+                GVfsJob *job,
+                TransferChunk *chunk)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_READ);
+  put_data_buffer (command, data->handle);
+  g_data_output_stream_put_uint64 (command, chunk->offset, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, chunk->size, NULL, NULL);
+  queue_command_stream_and_free_on (backend, data->connection, command, pull_read_reply, job, chunk);
+
+  data->outstanding++;
+}
+
+static void
+pull_fill (GVfsBackendSftp *backend,
+           GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  TransferChunk *chunk;
+
+  while (data->error == NULL &&
+         !g_vfs_job_is_cancelled (job) &&
+         data->eof_offset == -1 &&
+         data->next_offset < data->size &&
+         data->outstanding < SFTP_MAX_READ_REQUESTS)
+    {
+      chunk = g_slice_new (TransferChunk);
+      chunk->offset = data->next_offset;
+      chunk->size = MIN (SFTP_READ_CHUNK_SIZE, data->size - data->next_offset);
+      data->next_offset += chunk->size;
+
+      pull_send_read (backend, job, chunk);
+    }
+
+  if (data->outstanding == 0)
+    pull_finish (backend, job);
+}
+
+static void
+pull_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  struct stat statbuf;
+  int errsv;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      result_from_status (job, reply, -1, -1);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      return;
+    }
+
+  data->handle = read_data_buffer (reply);
+
+  /* Only touch the local file once the source could be opened. An
+     existing file is only replaced once the new one is complete. */
+  if (!(data->flags & G_FILE_COPY_OVERWRITE))
+    data->fd = g_open (data->local_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  else if (g_stat (data->local_path, &statbuf) == 0 && S_ISDIR (statbuf.st_mode))
+    errno = EISDIR;
+  else
+    {
+      do
+        {
+          g_free (data->temp_path);
+          data->temp_path = transfer_temp_name (data->local_path);
+          data->fd = g_open (data->temp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        }
+      while (data->fd == -1 && errno == EEXIST && ++data->temp_count < 100);
+
+      if (data->fd == -1)
+        {
+          errsv = errno;
+          g_free (data->temp_path);
+          data->temp_path = NULL;
+          errno = errsv;
+        }
+    }
+
+  if (data->fd == -1)
+    {
+      errsv = errno;
+      transfer_close_remote (backend, data->connection, data->handle);
+      g_vfs_job_failed (job, G_IO_ERROR, g_io_error_from_errno (errsv),
+                        "%s", g_strerror (errsv));
+      return;
+    }
+
+  pull_fill (backend, job);
+}
+
+static void
+pull_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (!transfer_check_source_info (job, data, reply_type, reply, backend))
+    return;
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->remote_path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  queue_command_stream_and_free_on (backend, data->connection, command, pull_open_reply, job, NULL);
+}
+
+static gboolean
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      transfer_not_supported (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  data = transfer_data_new (G_VFS_JOB (job), choose_data_connection (op_backend),
+                            source, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+
+  command = new_command_stream (op_backend,
+                                (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (command, source);
+  queue_command_stream_and_free_on (op_backend, data->connection, command, pull_stat_reply, G_VFS_JOB (job), NULL);
+
+  return TRUE;
+}
+
+static void
+push_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GError *error;
+
+  attr_cache_invalidate (backend, data->dest_path, FALSE);
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+  else
+    error_from_status (job, reply, -1, -1, &error);
+
+  if (error != NULL)
+    {
+      transfer_remove_dest (backend, data);
+      g_vfs_job_failed_from_error (job, error);
+      g_error_free (error);
+      return;
+    }
+
+  transfer_commit_dest (backend, job);
+}
+
+static void
+push_finish (GVfsBackendSftp *backend,
+             GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (data->error == NULL && g_vfs_job_is_cancelled (job))
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                         _("Operation was cancelled"));
+
+  if (data->error != NULL)
+    {
+      transfer_close_remote (backend, data->connection, data->handle);
+      transfer_remove_dest (backend, data);
+      g_vfs_job_failed_from_error (job, data->error);
+      return;
+    }
+
+  if (data->flags & G_FILE_COPY_ALL_METADATA)
+    transfer_set_remote_times (backend, data->connection, data->handle,
+                               data->local_stat.st_atime,
+                               data->local_stat.st_mtime);
+
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->handle);
+  queue_command_stream_and_free_on (backend, data->connection, command, push_close_reply, job, NULL);
+}
+
+static void push_fill (GVfsBackendSftp *backend,
+                       GVfsJob *job);
+
+static void
+push_write_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  data->outstanding--;
+
+  if (data->error == NULL)
+    {
+      if (reply_type == SSH_FXP_STATUS)
+        {
+          if (error_from_status (job, reply, -1, -1, &data->error))
+            data->bytes_done += GPOINTER_TO_SIZE (user_data);
+        }
+      else
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+    }
+
+  transfer_report_progress (data, FALSE);
+  push_fill (backend, job);
+}
+
+static void
+push_fill (GVfsBackendSftp *backend,
+           GVfsJob *job)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+  guchar *buffer;
+  gssize res;
+  gsize size;
+
+  buffer = NULL;
+  while (data->error == NULL &&
+         !g_vfs_job_is_cancelled (job) &&
+         data->next_offset < data->size &&
+         data->outstanding < SFTP_MAX_WRITE_REQUESTS)
+    {
+      size = MIN (SFTP_READ_CHUNK_SIZE, data->size - data->next_offset);
+      if (buffer == NULL)
+        buffer = g_malloc (SFTP_READ_CHUNK_SIZE);
+
+      res = pread (data->fd, buffer, size, data->next_offset);
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res == -1)
+        {
+          transfer_set_errno (data, errno);
+          break;
+        }
+      if (res == 0)
+        {
+          /* The file shrank while we were reading it */
+          data->size = data->next_offset;
+          break;
+        }
+
+      command = new_command_stream (backend, SSH_FXP_WRITE);
+      put_data_buffer (command, data->handle);
+      g_data_output_stream_put_uint64 (command, data->next_offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, res, NULL, NULL);
+      g_output_stream_write_all (G_OUTPUT_STREAM (command),
+                                 buffer, res,
+                                 NULL, NULL, NULL);
+      queue_command_stream_and_free_on (backend, data->connection, command, push_write_reply, job, GSIZE_TO_POINTER (res));
+
+      data->next_offset += res;
+      data->outstanding++;
+    }
+  g_free (buffer);
+
+  if (data->outstanding == 0)
+    push_finish (backend, job);
+}
+
+static void
+push_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GError *error;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      error = transfer_open_dest_status (backend, job, data, reply, push_open_reply);
+      if (error != NULL)
+        {
+          g_vfs_job_failed_from_error (job, error);
+          g_error_free (error);
+        }
+      return;
+    }
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      return;
+    }
+
+  data->handle = read_data_buffer (reply);
+
+  push_fill (backend, job);
+}
+
+static gboolean
+try_push (GVfsBackend *backend,
+          GVfsJobPush *job,
+          const char *destination,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+  struct stat statbuf;
+  int errsv;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      transfer_not_supported (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  if ((flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) &&
+      g_lstat (local_path, &statbuf) == 0 &&
+      S_ISLNK (statbuf.st_mode))
+    {
+      transfer_not_supported (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  data = transfer_data_new (G_VFS_JOB (job), choose_data_connection (op_backend),
+                            destination, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+
+  data->fd = g_open (local_path, O_RDONLY, 0);
+  if (data->fd == -1 || fstat (data->fd, &data->local_stat) == -1)
+    {
+      errsv = errno;
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, g_io_error_from_errno (errsv),
+                        "%s", g_strerror (errsv));
+      return TRUE;
+    }
+
+  /* Let gio handle directories and special files */
+  if (!S_ISREG (data->local_stat.st_mode))
+    {
+      transfer_not_supported (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  data->size = data->local_stat.st_size;
+  data->dest_path = g_strdup (destination);
+
+  transfer_open_dest (op_backend, G_VFS_JOB (job), data, push_open_reply);
+
+  return TRUE;
+}
+
+static void
+copy_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  attr_cache_invalidate (backend, data->dest_path, FALSE);
+
+  if (data->error == NULL)
+    {
+      if (reply_type == SSH_FXP_STATUS)
+        error_from_status (job, reply, -1, -1, &data->error);
+      else
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+    }
+
+  if (data->error != NULL)
+    {
+      transfer_remove_dest (backend, data);
+      g_vfs_job_failed_from_error (job, data->error);
+      return;
+    }
+
+  transfer_commit_dest (backend, job);
+}
+
+static void
+copy_data_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &data->error);
+  else
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (data->error == NULL &&
+      (data->flags & G_FILE_COPY_ALL_METADATA) &&
+      g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    transfer_set_remote_times (backend, data->connection, data->dest_handle,
+                               g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_ACCESS),
+                               g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+
+  transfer_close_remote (backend, data->connection, data->handle);
+
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->dest_handle);
+  queue_command_stream_and_free_on (backend, data->connection, command, copy_close_reply, job, NULL);
+}
+
+static void
+copy_open_dest_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+  GError *error;
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      if (reply_type == SSH_FXP_STATUS)
+        {
+          error = transfer_open_dest_status (backend, job, data, reply, copy_open_dest_reply);
+          if (error == NULL)
+            return;
+        }
+      else
+        error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     _("Invalid reply received"));
+
+      attr_cache_invalidate (backend, data->dest_path, FALSE);
+      transfer_close_remote (backend, data->connection, data->handle);
+      g_vfs_job_failed_from_error (job, error);
+      g_error_free (error);
+      return;
+    }
+
+  data->dest_handle = read_data_buffer (reply);
+
+  /* A read length of zero copies up to the end of the source */
+  command = new_command_stream (backend, SSH_FXP_EXTENDED);
+  put_string (command, "copy-data");
+  put_data_buffer (command, data->handle);
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* read offset */
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* read length */
+  put_data_buffer (command, data->dest_handle);
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* write offset */
+  queue_command_stream_and_free_on (backend, data->connection, command, copy_data_reply, job, NULL);
+}
+
+static void
+copy_open_source_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        GDataInputStream *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      result_from_status (job, reply, -1, -1);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      return;
+    }
+
+  data->handle = read_data_buffer (reply);
+
+  transfer_open_dest (backend, job, data, copy_open_dest_reply);
+}
+
+static void
+copy_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (!transfer_check_source_info (job, data, reply_type, reply, backend))
+    return;
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->remote_path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  queue_command_stream_and_free_on (backend, data->connection, command, copy_open_source_reply, job, NULL);
+}
+
+static gboolean
+try_copy (GVfsBackend *backend,
+          GVfsJobCopy *job,
+          const char *source,
+          const char *destination,
+          GFileCopyFlags flags,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+
+  /* Without copy-data the data would have to make a roundtrip
+     through the daemon anyway, which is what gio does */
+  if (!op_backend->has_copy_data ||
+      (flags & G_FILE_COPY_BACKUP))
+    {
+      transfer_not_supported (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  if (strcmp (source, destination) == 0)
+    {
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        _("Can't copy file over itself"));
+      return TRUE;
+    }
+
+  data = transfer_data_new (G_VFS_JOB (job), choose_data_connection (op_backend),
+                            source, NULL, flags, FALSE,
+                            progress_callback, progress_callback_data);
+  data->dest_path = g_strdup (destination);
+
+  command = new_command_stream (op_backend,
+                                (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (command, source);
+  queue_command_stream_and_free_on (op_backend, data->connection, command, copy_stat_reply, G_VFS_JOB (job), NULL);
+
+  return TRUE;
+}
+
+static void
+set_display_name_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        GDataInputStream *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  attr_cache_invalidate (backend, G_VFS_JOB_SET_DISPLAY_NAME (job)->filename, TRUE);
+  attr_cache_invalidate (backend, G_VFS_JOB_SET_DISPLAY_NAME (job)->new_path, TRUE);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static gboolean
+try_set_display_name (GVfsBackend *backend,
+                      GVfsJobSetDisplayName *job,
+                      const char *filename,
+                      const char *display_name)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  char *dirname, *basename, *new_name;
+
+  /* We use the same setting as for local files. Can't really
+   * do better, since there is no way in this version of sftp to find out
+   * the remote charset encoding
+   */
+  
+  dirname = g_path_get_dirname (filename);
+  basename = g_filename_from_utf8 (display_name, -1, NULL, NULL, NULL);
+  if (basename == NULL)
+    basename = g_strdup (display_name);
+  new_name = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+  g_free (basename);
+
+  g_vfs_job_set_display_name_set_new_path (job,
+                                           new_name);
+  
+  command = new_command_stream (op_backend,
+                                SSH_FXP_RENAME);
+  put_string (command, filename);
+  put_string (command, new_name);
+  
+  queue_command_stream_and_free (op_backend, command, set_display_name_reply, G_VFS_JOB (job), NULL);
+
+  g_free (new_name);
+
+  return TRUE;
+}
+
+
+static void
+make_symlink_reply (GVfsBackendSftp *backend,
+                    int reply_type,
+                    GDataInputStream *reply,
+                    guint32 len,
+                    GVfsJob *job,
+                    gpointer user_data)
+{
+  attr_cache_invalidate (backend, G_VFS_JOB_MAKE_SYMLINK (job)->filename, FALSE);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1); 
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static gboolean
+try_make_symlink (GVfsBackend *backend,
+                  GVfsJobMakeSymlink *job,
+                  const char *filename,
+                  const char *symlink_value)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  
+  command = new_command_stream (op_backend,
+                                SSH_FXP_SYMLINK);
+  /* Note: This is the reverse order of how this is documented in
+     draft-ietf-secsh-filexfer-02.txt, but its how openssh does it. */
+  put_string (command, symlink_value);
+  put_string (command, filename);
+  
+  queue_command_stream_and_free (op_backend, command, make_symlink_reply, G_VFS_JOB (job), NULL);
+
+  return TRUE;
+}
+
+static void
+mkdir_stat_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  if (reply_type == SSH_FXP_STATUS)
+    /* We got some error, but lets report the original FAILURE, as
+       these extra errors are not really mkdir errors, we just wanted
+       to implement EEXISTS */
+    result_from_status_code (job, SSH_FX_FAILURE, -1, -1);
+  else if (reply_type != SSH_FXP_ATTRS)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                      _("Target file exists"));
+}
+
+static void
+make_directory_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  attr_cache_invalidate (backend, G_VFS_JOB_MAKE_DIRECTORY (job)->filename, FALSE);
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      gint stat_error;
+
+      stat_error = read_status_code (reply);
+      if (stat_error == SSH_FX_FAILURE)
+        {
+          /* Generic SFTP error, let's stat the target */
+          GDataOutputStream *command;
+
+          command = new_command_stream (backend,
+                                        SSH_FXP_LSTAT);
+          put_string (command, G_VFS_JOB_MAKE_DIRECTORY (job)->filename);
+          queue_command_stream_and_free (backend, command, mkdir_stat_reply, G_VFS_JOB (job), NULL);
+        }
+      else
+        result_from_status_code (job, stat_error, -1, -1);
+    }
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static gboolean
+try_make_directory (GVfsBackend *backend,
+                    GVfsJobMakeDirectory *job,
+                    const char *filename)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+
+  command = new_command_stream (op_backend,
+                                SSH_FXP_MKDIR);
+  put_string (command, filename);
+  /* No file info - flag 0 */
+  g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
+
+  queue_command_stream_and_free (op_backend, command, make_directory_reply, G_VFS_JOB (job), NULL);
+
+  return TRUE;
+}
+
+static void
+delete_remove_reply (GVfsBackendSftp *backend,
+                     int reply_type,
+                     GDataInputStream *reply,
+                     guint32 len,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  attr_cache_invalidate (backend, G_VFS_JOB_DELETE (job)->filename, FALSE);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1); 
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static void
+delete_rmdir_reply (GVfsBackendSftp *backend,
+                    int reply_type,
+                    GDataInputStream *reply,
+                    guint32 len,
+                    GVfsJob *job,
+                    gpointer user_data)
+{
+  attr_cache_invalidate (backend, G_VFS_JOB_DELETE (job)->filename, TRUE);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, G_IO_ERROR_NOT_EMPTY, -1); 
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static void
 delete_lstat_reply (GVfsBackendSftp *backend,
                     int reply_type,
                     GDataInputStream *reply,
@@ -4593,6 +6684,10 @@ set_attribute_reply (GVfsBackendSftp *backend,
 		     GVfsJob *job,
 		     gpointer user_data)
 {
+  /* Symlinks pointing here keep their cached target attributes
+     until they expire */
+  attr_cache_invalidate (backend, G_VFS_JOB_SET_ATTRIBUTE (job)->filename, FALSE);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, -1, -1);
   else 
@@ -4667,6 +6762,9 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_write = try_write;
   backend_class->try_seek_on_write = try_seek_on_write;
   backend_class->try_move = try_move;
+  backend_class->try_copy = try_copy;
+  backend_class->try_pull = try_pull;
+  backend_class->try_push = try_push;
   backend_class->try_make_symlink = try_make_symlink;
   backend_class->try_make_directory = try_make_directory;
   backend_class->try_delete = try_delete;
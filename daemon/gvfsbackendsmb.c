@@ -130,6 +130,9 @@ g_vfs_backend_smb_init (GVfsBackendSmb *backend)
     g_free (workgroup);
 
   g_object_unref (settings);
+
+  /* libsmbclient contexts must not be used from several threads at once */
+  g_vfs_backend_set_max_threads (G_VFS_BACKEND (backend), 1);
 }
 
 /**
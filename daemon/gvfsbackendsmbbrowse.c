@@ -261,6 +261,9 @@ g_vfs_backend_smb_browse_init (GVfsBackendSmbBrowse *backend)
 
   g_object_unref (settings);
 
+  /* libsmbclient contexts must not be used from several threads at once */
+  g_vfs_backend_set_max_threads (G_VFS_BACKEND (backend), 1);
+
   DEBUG ("g_vfs_backend_smb_browse_init: default workgroup = '%s'\n", backend->default_workgroup ? backend->default_workgroup : "NULL");
 }
 
@@ -80,6 +80,13 @@ typedef struct {
   gboolean cancelled;
 } Request;
 
+/* A readahead job that was started while another job is the current
+ * one. Its reply is held back until all jobs before it were sent */
+typedef struct {
+  GVfsJob *job;
+  gboolean reply_pending;
+} ReadaheadJob;
+
 struct _GVfsChannelPrivate
 {
   GVfsBackend *backend;
@@ -95,6 +102,12 @@ struct _GVfsChannelPrivate
   guint32 current_job_seq_nr;
 
   GList *queued_requests;
+
+  /* Readahead jobs in flight after current_job, in the order they
+   * were started. Replies may arrive on i/o threads, so protected by
+   * readahead_lock */
+  GMutex readahead_lock;
+  GQueue readahead_jobs;
   
   char reply_buffer[G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE];
   int reply_buffer_pos;
@@ -125,6 +138,9 @@ g_vfs_channel_finalize (GObject *object)
   if (channel->priv->current_job)
     g_object_unref (channel->priv->current_job);
   channel->priv->current_job = NULL;
+
+  g_assert (g_queue_is_empty (&channel->priv->readahead_jobs));
+  g_mutex_clear (&channel->priv->readahead_lock);
   
   if (channel->priv->reply_stream)
     g_object_unref (channel->priv->reply_stream);
@@ -197,6 +213,8 @@ g_vfs_channel_init (GVfsChannel *channel)
 					       G_VFS_TYPE_CHANNEL,
 					       GVfsChannelPrivate);
   channel->priv->remote_fd = -1;
+  g_mutex_init (&channel->priv->readahead_lock);
+  g_queue_init (&channel->priv->readahead_jobs);
 
   ret = socketpair (AF_UNIX, SOCK_STREAM, 0, socket_fds);
   if (ret == -1) 
@@ -385,7 +403,17 @@ got_request (GVfsChannel *channel,
     {
       if (arg1 == channel->priv->current_job_seq_nr &&
 	  channel->priv->current_job != NULL)
-	g_vfs_job_cancel (channel->priv->current_job);
+	{
+	  g_vfs_job_cancel (channel->priv->current_job);
+
+	  /* The rest of a request that was split up into several jobs */
+	  for (l = channel->priv->queued_requests; l != NULL; l = l->next)
+	    {
+	      req = l->data;
+	      if (req->seq_nr == arg1)
+		req->cancelled = TRUE;
+	    }
+	}
       else
 	{
 	  for (l = channel->priv->queued_requests; l != NULL; l = l->next)
@@ -397,11 +425,9 @@ got_request (GVfsChannel *channel,
 		   be the actual operation thats replacing it */
 		req->cancelled = TRUE;
 		  
+	      /* Split up requests queue several entries with the same seq_nr */
 	      if (req->seq_nr == arg1)
-		{
-		  req->cancelled = TRUE;
-		  break;
-		}
+		req->cancelled = TRUE;
 	    }
 	}
 
@@ -425,6 +451,29 @@ got_request (GVfsChannel *channel,
   start_queued_request (channel);
 }
 
+/* Queues a request in front of everything the client sent. Channels
+ * use this to split one client request into several jobs; they all
+ * reply with the seq_nr of the original request, in order. */
+void
+g_vfs_channel_push_request (GVfsChannel *channel,
+			    guint32 command,
+			    guint32 seq_nr,
+			    guint32 arg1,
+			    guint32 arg2)
+{
+  Request *req;
+
+  req = g_new0 (Request, 1);
+  req->command = command;
+  req->arg1 = arg1;
+  req->arg2 = arg2;
+  req->seq_nr = seq_nr;
+
+  channel->priv->queued_requests =
+    g_list_prepend (channel->priv->queued_requests,
+		    req);
+}
+
 static void command_read_cb (GObject *source_object,
 			     GAsyncResult *res,
 			     gpointer user_data);
@@ -553,6 +602,115 @@ start_request_reader (GVfsChannel *channel)
 			     command_read_cb, reader);
 }
 
+/* Starts more readahead jobs behind the current one, as long as the
+ * channel class wants them. Nothing is started once the client sent
+ * a new request, as that has to wait for all readaheads to finish. */
+static void
+fill_readahead_window (GVfsChannel *channel,
+		       GVfsJob     *finished_job)
+{
+  GVfsChannelClass *class;
+  ReadaheadJob *readahead;
+  GVfsJob *job;
+
+  class = G_VFS_CHANNEL_GET_CLASS (channel);
+
+  while (channel->priv->current_job != NULL &&
+	 channel->priv->queued_requests == NULL &&
+	 !channel->priv->connection_closed &&
+	 (job = class->readahead (channel, finished_job)) != NULL)
+    {
+      readahead = g_new0 (ReadaheadJob, 1);
+      readahead->job = job;
+
+      g_mutex_lock (&channel->priv->readahead_lock);
+      g_queue_push_tail (&channel->priv->readahead_jobs, readahead);
+      g_mutex_unlock (&channel->priv->readahead_lock);
+
+      g_vfs_job_source_new_job (G_VFS_JOB_SOURCE (channel), job);
+    }
+}
+
+/* Makes the oldest readahead job in flight the current job, sending
+ * its reply if that was held back. Returns FALSE if there is none. */
+static gboolean
+start_next_readahead (GVfsChannel *channel)
+{
+  ReadaheadJob *readahead;
+  gboolean reply_pending;
+
+  g_mutex_lock (&channel->priv->readahead_lock);
+  readahead = g_queue_pop_head (&channel->priv->readahead_jobs);
+  if (readahead != NULL)
+    {
+      channel->priv->current_job = readahead->job;
+      channel->priv->current_job_seq_nr = 0;
+    }
+  g_mutex_unlock (&channel->priv->readahead_lock);
+
+  if (readahead == NULL)
+    return FALSE;
+
+  reply_pending = readahead->reply_pending;
+  g_free (readahead);
+
+  if (reply_pending)
+    g_signal_emit_by_name (channel->priv->current_job, "send-reply");
+
+  return TRUE;
+}
+
+/**
+ * g_vfs_channel_defer_reply:
+ * @channel: A #GVfsChannel.
+ * @job: the job that wants to send its reply
+ *
+ * Checks whether @job is a readahead job that has to wait for the jobs
+ * started before it. In that case the reply is sent again by the
+ * channel once @job becomes the current job, and the job should not
+ * send anything now.
+ *
+ * Might be called on an i/o thread.
+ *
+ * Returns: %TRUE if the reply of @job was deferred.
+ */
+gboolean
+g_vfs_channel_defer_reply (GVfsChannel *channel,
+			   GVfsJob     *job)
+{
+  ReadaheadJob *readahead;
+  gboolean deferred;
+  GList *l;
+
+  deferred = FALSE;
+  g_mutex_lock (&channel->priv->readahead_lock);
+  for (l = channel->priv->readahead_jobs.head; l != NULL; l = l->next)
+    {
+      readahead = l->data;
+      if (readahead->job == job)
+	{
+	  readahead->reply_pending = TRUE;
+	  deferred = TRUE;
+	  break;
+	}
+    }
+  g_mutex_unlock (&channel->priv->readahead_lock);
+
+  return deferred;
+}
+
+guint
+g_vfs_channel_get_n_readahead_jobs (GVfsChannel *channel)
+{
+  guint n;
+
+  g_mutex_lock (&channel->priv->readahead_lock);
+  n = g_queue_get_length (&channel->priv->readahead_jobs);
+  g_mutex_unlock (&channel->priv->readahead_lock);
+
+  return n;
+}
+
 static void
 send_reply_cb (GObject *source_object,
 	       GAsyncResult *res,
@@ -622,6 +780,10 @@ send_reply_cb (GObject *source_object,
       g_vfs_job_source_closed (G_VFS_JOB_SOURCE (channel));
       channel->priv->backend_handle = NULL;
     }
+  /* Readaheads in flight must be done before anything else
+     touches the backend handle, including closing it */
+  else if (start_next_readahead (channel))
+    fill_readahead_window (channel, job);
   else if (channel->priv->connection_closed)
     {
 
@@ -637,7 +799,10 @@ send_reply_cb (GObject *source_object,
       channel->priv->current_job = class->readahead (channel, job);
       channel->priv->current_job_seq_nr = 0;
       if (channel->priv->current_job)
-	g_vfs_job_source_new_job (G_VFS_JOB_SOURCE (channel), channel->priv->current_job);
+	{
+	  g_vfs_job_source_new_job (G_VFS_JOB_SOURCE (channel), channel->priv->current_job);
+	  fill_readahead_window (channel, job);
+	}
     }
 
   g_object_unref (job);
@@ -719,6 +884,53 @@ g_vfs_channel_steal_remote_fd (GVfsChannel *channel)
   return fd;
 }
 
+/* Passes fd to the client in a REPLY_FD message. This must be sent
+   before the client gets the channel, as clients only look for it
+   when the stream is created. */
+gboolean
+g_vfs_channel_send_fd (GVfsChannel *channel,
+		       int          fd)
+{
+  GVfsDaemonSocketProtocolReply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control;
+  int socket_fd;
+  ssize_t res;
+
+  reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_FD);
+  reply.seq_nr = 0;
+  reply.arg1 = 0;
+  reply.arg2 = 0;
+
+  iov.iov_base = &reply;
+  iov.iov_len = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+
+  memset (&msg, 0, sizeof (msg));
+  memset (&control, 0, sizeof (control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+
+  socket_fd = g_unix_output_stream_get_fd (G_UNIX_OUTPUT_STREAM (channel->priv->reply_stream));
+  do
+    res = sendmsg (socket_fd, &msg, 0);
+  while (res == -1 && errno == EINTR);
+
+  return res == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+}
+
 GVfsBackend *
 g_vfs_channel_get_backend (GVfsChannel  *channel)
 {
@@ -738,6 +950,18 @@ g_vfs_channel_get_backend_handle (GVfsChannel *channel)
   return channel->priv->backend_handle;
 }
 
+gboolean
+g_vfs_channel_has_job (GVfsChannel *channel)
+{
+  return channel->priv->current_job != NULL;
+}
+
+GVfsJob *
+g_vfs_channel_get_job (GVfsChannel *channel)
+{
+  return channel->priv->current_job;
+}
+
 guint32
 g_vfs_channel_get_current_seq_nr (GVfsChannel *channel)
 {
@@ -759,6 +983,15 @@ free_queued_requests (gpointer data)
   g_free (req);
 }
 
+static void
+cancel_readahead_job (gpointer data,
+		      gpointer user_data)
+{
+  ReadaheadJob *readahead = data;
+
+  g_vfs_job_cancel (readahead->job);
+}
+
 void
 g_vfs_channel_force_close (GVfsChannel *channel)
 {
@@ -774,6 +1007,11 @@ g_vfs_channel_force_close (GVfsChannel *channel)
   if (job)
     g_vfs_job_cancel (job);
 
+  /* The readahead jobs still finish, with their replies going nowhere */
+  g_mutex_lock (&channel->priv->readahead_lock);
+  g_queue_foreach (&channel->priv->readahead_jobs, cancel_readahead_job, NULL);
+  g_mutex_unlock (&channel->priv->readahead_lock);
+
   g_list_free_full (channel->priv->queued_requests, free_queued_requests);
   channel->priv->queued_requests = NULL;
 
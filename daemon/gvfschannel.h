@@ -68,6 +68,8 @@ struct _GVfsChannelClass
 GType g_vfs_channel_get_type (void) G_GNUC_CONST;
 
 int               g_vfs_channel_steal_remote_fd    (GVfsChannel                   *channel);
+gboolean          g_vfs_channel_send_fd            (GVfsChannel                   *channel,
+						    int                            fd);
 GVfsBackend    *  g_vfs_channel_get_backend        (GVfsChannel                   *channel);
 GVfsBackendHandle g_vfs_channel_get_backend_handle (GVfsChannel                   *channel);
 void              g_vfs_channel_set_backend_handle (GVfsChannel                   *channel,
@@ -84,6 +86,14 @@ void              g_vfs_channel_send_reply         (GVfsChannel
 						    gsize                          data_len);
 guint32           g_vfs_channel_get_current_seq_nr (GVfsChannel                   *channel);
 GPid              g_vfs_channel_get_actual_consumer (GVfsChannel                  *channel);
+gboolean          g_vfs_channel_defer_reply        (GVfsChannel                   *channel,
+						    GVfsJob                       *job);
+void              g_vfs_channel_push_request       (GVfsChannel                   *channel,
+						    guint32                        command,
+						    guint32                        seq_nr,
+						    guint32                        arg1,
+						    guint32                        arg2);
+guint             g_vfs_channel_get_n_readahead_jobs (GVfsChannel                 *channel);
 void              g_vfs_channel_force_close        (GVfsChannel                   *channel);
 /* TODO: i/o priority? */
 
@@ -41,6 +41,10 @@
 #include <gvfsjobmount.h>
 #include <gvfsjobopenforread.h>
 #include <gvfsjobopenforwrite.h>
+#include <gvfsjobunmount.h>
+#include <gvfsjobpull.h>
+#include <gvfsjobpush.h>
+#include <gvfsjobcopy.h>
 
 enum {
   PROP_0
@@ -54,6 +58,40 @@ typedef struct {
   GHashTable *client_skeletons;
 } RegisteredPath;
 
+/* Jobs that are pushed to the worker threads are ordered first by
+ * priority, then in the order they were queued. Bulk transfers get a
+ * lower priority so that short metadata operations are not stuck
+ * behind them when all threads are busy. */
+typedef enum {
+  JOB_PRIORITY_HIGH,
+  JOB_PRIORITY_NORMAL,
+  JOB_PRIORITY_LOW
+} JobPriority;
+
+typedef struct {
+  GVfsJob *job;
+  GVfsBackend *backend;
+  JobPriority priority;
+  guint64 seq_nr;
+  gboolean holds_backend_thread;
+} QueuedJob;
+
+/* Entry of the job table. Jobs started by a D-Bus method call are
+ * also indexed by their connection and message serial, so cancelling
+ * a single job or all jobs of a vanished peer needs no full walk. */
+typedef struct {
+  GVfsJob *job;
+  GDBusConnection *connection;
+  guint32 serial;
+} RegisteredJob;
+
+/* Per-backend bookkeeping for backends that limit the number of
+ * worker threads they can use, see g_vfs_backend_set_max_threads() */
+typedef struct {
+  int running;
+  GQueue waiting;
+} BackendThreads;
+
 struct _GVfsDaemon
 {
   GObject parent_instance;
@@ -62,11 +100,20 @@ struct _GVfsDaemon
   gboolean main_daemon;
 
   GThreadPool *thread_pool;
+  guint64 thread_job_seq_nr;
+  GHashTable *backend_threads;
   GHashTable *registered_paths;
   GHashTable *client_connections;
-  GList *jobs;
   GList *job_sources;
 
+  /* Protected by jobs_lock */
+  GMutex jobs_lock;
+  GHashTable *jobs;
+  GHashTable *connection_jobs;
+  guint64 n_jobs_finished;
+
+  gint n_jobs_queued; /* atomic */
+
   guint exit_tag;
   
   gint mount_counter;
@@ -139,7 +186,7 @@ g_vfs_daemon_finalize (GObject *object)
 
   daemon = G_VFS_DAEMON (object);
 
-  g_assert (daemon->jobs == NULL);
+  g_assert (g_hash_table_size (daemon->jobs) == 0);
 
   if (daemon->name_watcher)
     g_bus_unwatch_name (daemon->name_watcher);
@@ -159,6 +206,10 @@ g_vfs_daemon_finalize (GObject *object)
   
   g_hash_table_destroy (daemon->registered_paths);
   g_hash_table_destroy (daemon->client_connections);
+  g_hash_table_destroy (daemon->backend_threads);
+  g_hash_table_destroy (daemon->jobs);
+  g_hash_table_destroy (daemon->connection_jobs);
+  g_mutex_clear (&daemon->jobs_lock);
   g_mutex_clear (&daemon->lock);
 
   if (G_OBJECT_CLASS (g_vfs_daemon_parent_class)->finalize)
@@ -175,13 +226,180 @@ g_vfs_daemon_class_init (GVfsDaemonClass *klass)
   gobject_class->get_property = g_vfs_daemon_get_property;
 }
 
+static JobPriority
+job_get_priority (GVfsJob *job)
+{
+  if (G_VFS_IS_JOB_MOUNT (job) ||
+      G_VFS_IS_JOB_UNMOUNT (job))
+    return JOB_PRIORITY_HIGH;
+
+  if (G_VFS_IS_JOB_PULL (job) ||
+      G_VFS_IS_JOB_PUSH (job) ||
+      G_VFS_IS_JOB_COPY (job))
+    return JOB_PRIORITY_LOW;
+
+  return JOB_PRIORITY_NORMAL;
+}
+
+static gint
+queued_job_compare (gconstpointer a,
+                    gconstpointer b,
+                    gpointer      user_data)
+{
+  const QueuedJob *queued_a = a;
+  const QueuedJob *queued_b = b;
+
+  if (queued_a->priority != queued_b->priority)
+    return queued_a->priority < queued_b->priority ? -1 : 1;
+
+  if (queued_a->seq_nr != queued_b->seq_nr)
+    return queued_a->seq_nr < queued_b->seq_nr ? -1 : 1;
+
+  return 0;
+}
+
+static void
+queued_job_free (QueuedJob *queued)
+{
+  g_object_unref (queued->job);
+  if (queued->backend)
+    g_object_unref (queued->backend);
+  g_free (queued);
+}
+
+static void
+backend_threads_free (BackendThreads *threads)
+{
+  g_queue_foreach (&threads->waiting, (GFunc)queued_job_free, NULL);
+  g_queue_clear (&threads->waiting);
+  g_free (threads);
+}
+
+/* Called when @queued is done with the thread slot of its backend.
+ * Returns the next job of the backend that waited for a slot, which
+ * now holds it, or NULL. */
+static QueuedJob *
+daemon_release_backend_thread (GVfsDaemon *daemon,
+                               QueuedJob  *queued)
+{
+  BackendThreads *threads;
+  QueuedJob *next;
+
+  next = NULL;
+  g_mutex_lock (&daemon->lock);
+  threads = g_hash_table_lookup (daemon->backend_threads, queued->backend);
+  if (threads != NULL)
+    {
+      next = g_queue_pop_head (&threads->waiting);
+      if (next == NULL && --threads->running == 0)
+        g_hash_table_remove (daemon->backend_threads, queued->backend);
+    }
+  g_mutex_unlock (&daemon->lock);
+
+  return next;
+}
+
+/* Pushes @queued to the worker threads. If that fails the job fails
+ * with the error, and its thread slot goes to the next waiting job. */
+static void
+daemon_push_queued_job (GVfsDaemon *daemon,
+                        QueuedJob  *queued)
+{
+  GError *error;
+  QueuedJob *next;
+
+  while (queued != NULL)
+    {
+      error = NULL;
+      if (daemon->thread_pool == NULL)
+        g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("No worker threads available"));
+      else if (g_thread_pool_push (daemon->thread_pool, queued, &error))
+        return;
+
+      g_warning ("Failed to run job %p in a thread: %s\n", queued->job, error->message);
+      g_atomic_int_add (&daemon->n_jobs_queued, -1);
+      g_vfs_job_failed_from_error (queued->job, error);
+      g_error_free (error);
+
+      next = NULL;
+      if (queued->holds_backend_thread)
+        next = daemon_release_backend_thread (daemon, queued);
+      queued_job_free (queued);
+      queued = next;
+    }
+}
+
+/* Hands the job to the worker threads, unless its backend already
+ * uses all the threads it allows. In that case the job waits until
+ * one of the backend's running jobs returns. */
+static void
+daemon_push_job_to_thread (GVfsDaemon  *daemon,
+                           GVfsJob     *job,
+                           GVfsBackend *backend)
+{
+  QueuedJob *queued;
+  BackendThreads *threads;
+  int max_threads;
+
+  queued = g_new0 (QueuedJob, 1);
+  queued->job = g_object_ref (job);
+  queued->backend = backend ? g_object_ref (backend) : NULL;
+  queued->priority = job_get_priority (job);
+
+  g_mutex_lock (&daemon->lock);
+  queued->seq_nr = daemon->thread_job_seq_nr++;
+
+  max_threads = backend ? g_vfs_backend_get_max_threads (backend) : 0;
+  if (max_threads > 0)
+    {
+      threads = g_hash_table_lookup (daemon->backend_threads, backend);
+      if (threads == NULL)
+        {
+          threads = g_new0 (BackendThreads, 1);
+          g_queue_init (&threads->waiting);
+          g_hash_table_insert (daemon->backend_threads, backend, threads);
+        }
+
+      if (threads->running >= max_threads)
+        {
+          queued->holds_backend_thread = TRUE;
+          g_queue_insert_sorted (&threads->waiting, queued, queued_job_compare, NULL);
+          g_mutex_unlock (&daemon->lock);
+          g_atomic_int_inc (&daemon->n_jobs_queued);
+          return;
+        }
+
+      threads->running++;
+      queued->holds_backend_thread = TRUE;
+    }
+  g_mutex_unlock (&daemon->lock);
+
+  g_atomic_int_inc (&daemon->n_jobs_queued);
+  daemon_push_queued_job (daemon, queued);
+}
+
 static void
 job_handler_callback (gpointer       data,
 		      gpointer       user_data)
 {
-  GVfsJob *job = G_VFS_JOB (data);
+  GVfsDaemon *daemon = G_VFS_DAEMON (user_data);
+  QueuedJob *queued = data;
+  QueuedJob *next;
+
+  g_atomic_int_add (&daemon->n_jobs_queued, -1);
+  g_vfs_job_run (queued->job);
 
-  g_vfs_job_run (job);
+  next = NULL;
+  if (queued->holds_backend_thread)
+    next = daemon_release_backend_thread (daemon, queued);
+
+  /* The thread we used is passed on to the next waiting job of the
+   * same backend, so its running count stays the same */
+  if (next)
+    daemon_push_queued_job (daemon, next);
+
+  queued_job_free (queued);
 }
 
 static void
@@ -216,20 +434,41 @@ static void
 g_vfs_daemon_init (GVfsDaemon *daemon)
 {
   GError *error;
-  gint max_threads = 1; /* TODO: handle max threads */
+  /* Raised by the daemon main to the number of threads the backend
+   * executable allows, see g_vfs_daemon_set_max_threads() */
+  gint max_threads = 1;
 
+  error = NULL;
   daemon->thread_pool = g_thread_pool_new (job_handler_callback,
 					   daemon,
 					   max_threads,
-					   FALSE, NULL);
-  /* TODO: verify thread_pool != NULL in a nicer way */
-  g_assert (daemon->thread_pool != NULL);
+					   FALSE, &error);
+  /* Without a pool only the try_ jobs can run, the others fail */
+  if (daemon->thread_pool == NULL)
+    {
+      g_warning ("Failed to create job thread pool: %s\n", error->message);
+      g_error_free (error);
+    }
+  else
+    g_thread_pool_set_sort_function (daemon->thread_pool, queued_job_compare, NULL);
+
+  daemon->backend_threads =
+    g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			   NULL, (GDestroyNotify)backend_threads_free);
 
   g_mutex_init (&daemon->lock);
+  g_mutex_init (&daemon->jobs_lock);
 
   daemon->mount_counter = 0;
   
-  daemon->jobs = NULL;
+  daemon->jobs =
+    g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			   NULL, g_free);
+  /* Maps a connection to a table of message serial -> GSList of jobs.
+   * A list as serials are only unique per sender on the session bus */
+  daemon->connection_jobs =
+    g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			   NULL, (GDestroyNotify)g_hash_table_destroy);
   daemon->registered_paths =
     g_hash_table_new_full (g_str_hash, g_str_equal,
 			   g_free, (GDestroyNotify)registered_path_free);
@@ -340,7 +579,27 @@ void
 g_vfs_daemon_set_max_threads (GVfsDaemon                    *daemon,
 			      gint                           max_threads)
 {
-  g_thread_pool_set_max_threads (daemon->thread_pool, max_threads, NULL);
+  GError *error;
+
+  if (daemon->thread_pool == NULL)
+    return;
+
+  g_debug ("Setting max job threads to %d\n", max_threads);
+  error = NULL;
+  if (!g_thread_pool_set_max_threads (daemon->thread_pool, max_threads, &error))
+    {
+      g_warning ("Failed to set max job threads to %d: %s\n", max_threads, error->message);
+      g_error_free (error);
+    }
+}
+
+gint
+g_vfs_daemon_get_max_threads (GVfsDaemon                    *daemon)
+{
+  if (daemon->thread_pool == NULL)
+    return 0;
+
+  return g_thread_pool_get_max_threads (daemon->thread_pool);
 }
 
 static gboolean
@@ -367,12 +626,24 @@ daemon_schedule_exit (GVfsDaemon *daemon)
     daemon->exit_tag = g_timeout_add_seconds (1, exit_at_idle, daemon);
 }
 
+static void daemon_queue_job (GVfsDaemon  *daemon,
+                              GVfsJob     *job,
+                              GVfsBackend *backend);
+
 static void
 job_source_new_job_callback (GVfsJobSource *job_source,
 			     GVfsJob *job,
 			     GVfsDaemon *daemon)
 {
-  g_vfs_daemon_queue_job (daemon, job);
+  GVfsBackend *backend;
+
+  backend = NULL;
+  if (G_VFS_IS_BACKEND (job_source))
+    backend = G_VFS_BACKEND (job_source);
+  else if (G_VFS_IS_CHANNEL (job_source))
+    backend = g_vfs_channel_get_backend (G_VFS_CHANNEL (job_source));
+
+  daemon_queue_job (daemon, job, backend);
 }
 
 static void
@@ -536,6 +807,106 @@ job_new_source_callback (GVfsJob *job,
   g_vfs_daemon_add_job_source (daemon, job_source);
 }
 
+static void
+daemon_register_job (GVfsDaemon *daemon,
+                     GVfsJob    *job)
+{
+  RegisteredJob *reg_job;
+  GDBusMethodInvocation *invocation;
+  GHashTable *serials;
+  GSList *list;
+
+  reg_job = g_new0 (RegisteredJob, 1);
+  reg_job->job = job;
+
+  if (G_VFS_IS_JOB_DBUS (job) &&
+      G_VFS_JOB_DBUS (job)->invocation != NULL)
+    {
+      invocation = G_VFS_JOB_DBUS (job)->invocation;
+      reg_job->connection = g_dbus_method_invocation_get_connection (invocation);
+      reg_job->serial = g_dbus_message_get_serial (g_dbus_method_invocation_get_message (invocation));
+    }
+
+  g_mutex_lock (&daemon->jobs_lock);
+  g_hash_table_insert (daemon->jobs, job, reg_job);
+
+  if (reg_job->connection != NULL)
+    {
+      serials = g_hash_table_lookup (daemon->connection_jobs, reg_job->connection);
+      if (serials == NULL)
+        {
+          serials = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL, (GDestroyNotify)g_slist_free);
+          g_hash_table_insert (daemon->connection_jobs, reg_job->connection, serials);
+        }
+
+      list = g_hash_table_lookup (serials, GUINT_TO_POINTER (reg_job->serial));
+      g_hash_table_steal (serials, GUINT_TO_POINTER (reg_job->serial));
+      g_hash_table_insert (serials, GUINT_TO_POINTER (reg_job->serial),
+                           g_slist_prepend (list, job));
+    }
+  g_mutex_unlock (&daemon->jobs_lock);
+}
+
+static void
+daemon_unregister_job (GVfsDaemon *daemon,
+                       GVfsJob    *job)
+{
+  RegisteredJob *reg_job;
+  GHashTable *serials;
+  GSList *list;
+
+  g_mutex_lock (&daemon->jobs_lock);
+  reg_job = g_hash_table_lookup (daemon->jobs, job);
+  if (reg_job != NULL && reg_job->connection != NULL)
+    {
+      serials = g_hash_table_lookup (daemon->connection_jobs, reg_job->connection);
+      if (serials != NULL)
+        {
+          list = g_hash_table_lookup (serials, GUINT_TO_POINTER (reg_job->serial));
+          g_hash_table_steal (serials, GUINT_TO_POINTER (reg_job->serial));
+          list = g_slist_remove (list, job);
+          if (list != NULL)
+            g_hash_table_insert (serials, GUINT_TO_POINTER (reg_job->serial), list);
+          else if (g_hash_table_size (serials) == 0)
+            g_hash_table_remove (daemon->connection_jobs, reg_job->connection);
+        }
+    }
+  g_hash_table_remove (daemon->jobs, job);
+  daemon->n_jobs_finished++;
+  g_mutex_unlock (&daemon->jobs_lock);
+}
+
+/**
+ * g_vfs_daemon_get_job_stats:
+ * @daemon: A #GVfsDaemon.
+ * @queued: (out) (allow-none): jobs waiting for a worker thread
+ * @running: (out) (allow-none): jobs that were started but did not finish yet
+ * @finished: (out) (allow-none): jobs finished since the daemon started
+ *
+ * Gets the job counters of @daemon.
+ */
+void
+g_vfs_daemon_get_job_stats (GVfsDaemon *daemon,
+                            guint      *queued,
+                            guint      *running,
+                            guint64    *finished)
+{
+  guint n_queued, n_jobs;
+
+  g_mutex_lock (&daemon->jobs_lock);
+  n_jobs = g_hash_table_size (daemon->jobs);
+  n_queued = MIN ((guint) g_atomic_int_get (&daemon->n_jobs_queued), n_jobs);
+  if (finished)
+    *finished = daemon->n_jobs_finished;
+  g_mutex_unlock (&daemon->jobs_lock);
+
+  if (queued)
+    *queued = n_queued;
+  if (running)
+    *running = n_jobs - n_queued;
+}
+
 /* NOTE: Might be emitted on a thread */
 static void
 job_finished_callback (GVfsJob *job, 
@@ -549,16 +920,15 @@ job_finished_callback (GVfsJob *job,
 					(GCallback)job_finished_callback,
 					daemon);
 
-  g_mutex_lock (&daemon->lock);
-  daemon->jobs = g_list_remove (daemon->jobs, job);
-  g_mutex_unlock (&daemon->lock);
+  daemon_unregister_job (daemon, job);
   
   g_object_unref (job);
 }
 
-void
-g_vfs_daemon_queue_job (GVfsDaemon *daemon,
-			GVfsJob *job)
+static void
+daemon_queue_job (GVfsDaemon  *daemon,
+                  GVfsJob     *job,
+                  GVfsBackend *backend)
 {
   g_debug ("Queued new job %p (%s)\n", job, g_type_name_from_instance ((gpointer)job));
   
@@ -566,18 +936,23 @@ g_vfs_daemon_queue_job (GVfsDaemon *daemon,
   g_signal_connect (job, "finished", (GCallback)job_finished_callback, daemon);
   g_signal_connect (job, "new_source", (GCallback)job_new_source_callback, daemon);
   
-  g_mutex_lock (&daemon->lock);
-  daemon->jobs = g_list_prepend (daemon->jobs, job);
-  g_mutex_unlock (&daemon->lock);
+  daemon_register_job (daemon, job);
   
   /* Can we start the job immediately / async */
   if (!g_vfs_job_try (job))
     {
       /* Couldn't finish / run async, queue worker thread */
-      g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+      daemon_push_job_to_thread (daemon, job, backend);
     }
 }
 
+void
+g_vfs_daemon_queue_job (GVfsDaemon *daemon,
+			GVfsJob *job)
+{
+  daemon_queue_job (daemon, job, NULL);
+}
+
 static void
 new_connection_data_free (void *memory)
 {
@@ -606,20 +981,30 @@ peer_connection_closed (GDBusConnection *connection,
                         gpointer         user_data)
 {
   GVfsDaemon *daemon = G_VFS_DAEMON (user_data);
-  GList *l;
+  GHashTable *serials;
+  GHashTableIter iter;
+  gpointer value;
+  GList *jobs, *l;
+  GSList *sl;
   GVfsDBusDaemon *daemon_skeleton;
 
-  g_mutex_lock (&daemon->lock);
-  for (l = daemon->jobs; l != NULL; l = l->next)
+  /* Collect the jobs first, cancelling may finish them and
+   * thus remove them from the table */
+  jobs = NULL;
+  g_mutex_lock (&daemon->jobs_lock);
+  serials = g_hash_table_lookup (daemon->connection_jobs, connection);
+  if (serials != NULL)
     {
-      GVfsJob *job = G_VFS_JOB (l->data);
-      
-      if (G_VFS_IS_JOB_DBUS (job) &&
-          G_VFS_JOB_DBUS (job)->invocation &&
-          g_dbus_method_invocation_get_connection (G_VFS_JOB_DBUS (job)->invocation) == connection)
-        g_vfs_job_cancel (job);
+      g_hash_table_iter_init (&iter, serials);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        for (sl = value; sl != NULL; sl = sl->next)
+          jobs = g_list_prepend (jobs, g_object_ref (sl->data));
     }
-  g_mutex_unlock (&daemon->lock);
+  g_mutex_unlock (&daemon->jobs_lock);
+
+  for (l = jobs; l != NULL; l = l->next)
+    g_vfs_job_cancel (G_VFS_JOB (l->data));
+  g_list_free_full (jobs, g_object_unref);
 
 
   daemon_skeleton = g_object_get_data (G_OBJECT (connection), "daemon_skeleton");
@@ -885,24 +1270,31 @@ handle_cancel (GVfsDBusDaemon *object,
                gpointer user_data)
 {
   GVfsDaemon *daemon = G_VFS_DAEMON (user_data);
-  GList *l;
+  GDBusConnection *connection;
+  GHashTable *serials;
+  GSList *l;
   GVfsJob *job_to_cancel = NULL;
 
-  g_mutex_lock (&daemon->lock);
-  for (l = daemon->jobs; l != NULL; l = l->next)
+  connection = g_dbus_method_invocation_get_connection (invocation);
+
+  g_mutex_lock (&daemon->jobs_lock);
+  serials = g_hash_table_lookup (daemon->connection_jobs, connection);
+  if (serials != NULL)
     {
-      GVfsJob *job = G_VFS_JOB (l->data);
-      
-      if (G_VFS_IS_JOB_DBUS (job) &&
-          g_vfs_job_dbus_is_serial (G_VFS_JOB_DBUS (job),
-                                    g_dbus_method_invocation_get_connection (invocation),
-                                    arg_serial))
+      for (l = g_hash_table_lookup (serials, GUINT_TO_POINTER (arg_serial)); l != NULL; l = l->next)
         {
-          job_to_cancel = g_object_ref (job);
-          break;
+          GVfsJob *job = G_VFS_JOB (l->data);
+
+          /* The serial alone is ambiguous on the session bus */
+          if (g_strcmp0 (g_dbus_method_invocation_get_sender (G_VFS_JOB_DBUS (job)->invocation),
+                         g_dbus_method_invocation_get_sender (invocation)) == 0)
+            {
+              job_to_cancel = g_object_ref (job);
+              break;
+            }
         }
     }
-  g_mutex_unlock (&daemon->lock);
+  g_mutex_unlock (&daemon->jobs_lock);
 
   if (job_to_cancel)
     {
@@ -945,6 +1337,71 @@ daemon_handle_mount (GVfsDBusMountable *object,
   return TRUE;
 }
 
+static int
+get_positive_mount_option (GMountSpec *mount_spec,
+                           const char *key)
+{
+  const char *option;
+  int value;
+
+  option = g_mount_spec_get (mount_spec, key);
+  if (option == NULL)
+    return 0;
+
+  value = atoi (option);
+  if (value <= 0)
+    {
+      g_warning ("Ignoring invalid %s mount option '%s'\n", key, option);
+      return 0;
+    }
+
+  return value;
+}
+
+/* Backends with a connection pool declare how many jobs they can run
+ * concurrently. A mount uses at most as many of them as the worker pool
+ * of the executable has threads, unless the "max-threads" mount option
+ * asks for more: then the pool grows, up to the declared limit.
+ * "readahead-window" sets the number of reads in flight per read
+ * channel. Neither option can go above the limit the backend declared. */
+static void
+daemon_apply_mount_options (GVfsDaemon  *daemon,
+                            GVfsBackend *backend,
+                            GMountSpec  *mount_spec)
+{
+  int declared, pool_threads, max_threads, window;
+
+  window = get_positive_mount_option (mount_spec, "readahead-window");
+  if (window > 0)
+    g_vfs_backend_set_readahead_window (backend,
+                                        MIN ((guint) window, g_vfs_backend_get_readahead_window (backend)));
+
+  declared = g_vfs_backend_get_max_threads (backend);
+  pool_threads = g_vfs_daemon_get_max_threads (daemon);
+  max_threads = get_positive_mount_option (mount_spec, "max-threads");
+
+  if (max_threads == 0)
+    {
+      /* Nothing requested, keep the threads the executable was built with */
+      if (declared > 0 && pool_threads > 0 && pool_threads < declared)
+        g_vfs_backend_set_max_threads (backend, pool_threads);
+      return;
+    }
+
+  if (declared > 0)
+    max_threads = MIN (max_threads, declared);
+
+  g_vfs_backend_set_max_threads (backend, max_threads);
+
+  /* Backends that declared nothing may not be thread safe beyond what
+   * the executable allows, so only the declared ones grow the pool */
+  if (declared > 0 &&
+      pool_threads != -1 && pool_threads < max_threads)
+    g_vfs_daemon_set_max_threads (daemon, max_threads);
+
+  g_debug ("Backend %p limited to %d job threads\n", backend, max_threads);
+}
+
 void
 g_vfs_daemon_initiate_mount (GVfsDaemon *daemon,
 			     GMountSpec *mount_spec,
@@ -983,13 +1440,15 @@ g_vfs_daemon_initiate_mount (GVfsDaemon *daemon,
 			  "object-path", obj_path,
 			  NULL);
   g_free (obj_path);
+
+  daemon_apply_mount_options (daemon, backend, mount_spec);
   
   g_vfs_daemon_add_job_source (daemon, G_VFS_JOB_SOURCE (backend));
-  g_object_unref (backend);
 
   job = g_vfs_job_mount_new (mount_spec, mount_source, is_automount, object, invocation, backend);
-  g_vfs_daemon_queue_job (daemon, job);
+  daemon_queue_job (daemon, job, backend);
   g_object_unref (job);
+  g_object_unref (backend);
 }
 
 /**
@@ -1025,7 +1484,13 @@ void
 g_vfs_daemon_run_job_in_thread (GVfsDaemon *daemon,
 				GVfsJob    *job)
 {
-  g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+  GVfsBackend *backend;
+
+  backend = NULL;
+  if (G_VFS_IS_JOB_UNMOUNT (job))
+    backend = G_VFS_JOB_UNMOUNT (job)->backend;
+
+  daemon_push_job_to_thread (daemon, job, backend);
 }
 
 void
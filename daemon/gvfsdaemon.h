@@ -59,10 +59,15 @@ GVfsDaemon *g_vfs_daemon_new             (gboolean                       main_da
 					  gboolean                       replace);
 void        g_vfs_daemon_set_max_threads (GVfsDaemon                    *daemon,
 					  gint                           max_threads);
+gint        g_vfs_daemon_get_max_threads (GVfsDaemon                    *daemon);
 void        g_vfs_daemon_add_job_source  (GVfsDaemon                    *daemon,
 					  GVfsJobSource                 *job_source);
 void        g_vfs_daemon_queue_job       (GVfsDaemon                    *daemon,
 					  GVfsJob                       *job);
+void        g_vfs_daemon_get_job_stats   (GVfsDaemon                    *daemon,
+					  guint                         *queued,
+					  guint                         *running,
+					  guint64                       *finished);
 void        g_vfs_daemon_register_path   (GVfsDaemon                    *daemon,
                                           const char                    *obj_path,
                                           GVfsRegisterPathCallback       callback,
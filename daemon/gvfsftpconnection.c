@@ -44,6 +44,7 @@ struct _GVfsFtpConnection
   GIOStream *        	data;                   /* ftp data stream or NULL if not in use */
 
   int                   debug_id;               /* unique id for debugging purposes */
+  gint64                last_reply;             /* monotonic time of the last reply from the server */
 };
 
 static void
@@ -90,6 +91,7 @@ g_vfs_ftp_connection_new (GSocketConnectable *addr,
   g_data_input_stream_set_newline_type (conn->commands_in, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
   /* The first thing that needs to happen is receiving the welcome message */
   conn->waiting_for_reply = TRUE;
+  conn->last_reply = g_get_monotonic_time ();
 
   return conn;
 }
@@ -233,6 +235,7 @@ g_vfs_ftp_connection_receive (GVfsFtpConnection *conn,
    */
   if (response >= 200)
     conn->waiting_for_reply = FALSE;
+  conn->last_reply = g_get_monotonic_time ();
 
   return response;
 
@@ -439,6 +442,23 @@ g_vfs_ftp_connection_get_debug_id (GVfsFtpConnection *conn)
   return conn->debug_id;
 }
 
+/**
+ * g_vfs_ftp_connection_get_idle_time:
+ * @conn: the connection
+ *
+ * Gets the time since the server last replied on this connection. Servers
+ * close control connections that have been idle for too long.
+ *
+ * Returns: the idle time in microseconds
+ **/
+gint64
+g_vfs_ftp_connection_get_idle_time (GVfsFtpConnection *conn)
+{
+  g_return_val_if_fail (conn != NULL, 0);
+
+  return g_get_monotonic_time () - conn->last_reply;
+}
+
 /**
  * g_vfs_ftp_connection_get_data_stream:
  * @conn: a connection
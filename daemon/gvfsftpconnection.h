@@ -49,6 +49,7 @@ gboolean                g_vfs_ftp_connection_is_usable        (GVfsFtpConnection
 GSocketAddress *        g_vfs_ftp_connection_get_address      (GVfsFtpConnection *      conn,
                                                                GError **                error);
 guint                   g_vfs_ftp_connection_get_debug_id     (GVfsFtpConnection *      conn);
+gint64                  g_vfs_ftp_connection_get_idle_time    (GVfsFtpConnection *      conn);
 
 gboolean                g_vfs_ftp_connection_open_data_connection
                                                               (GVfsFtpConnection *      conn,
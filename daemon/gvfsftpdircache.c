@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <config.h>
@@ -31,11 +32,18 @@
 
 /*** CACHE ENTRY ***/
 
+/* rough guess of the memory used by a cached file besides its names */
+#define G_VFS_FTP_DIR_CACHE_FILE_OVERHEAD 512
+
 struct _GVfsFtpDirCacheEntry
 {
   GHashTable *          files;          /* GVfsFtpFile => GFileInfo mapping */
   guint                 stamp;          /* cache's stamp when this entry was created */
   volatile int          refcount;       /* need to refount this struct for thread safety */
+  GVfsFtpFile *         dir;            /* key of this entry in the cache or NULL if not cached */
+  GList                 link;           /* link in the stripe's LRU queue */
+  gsize                 size;           /* estimated memory used by the entry */
+  gint64                expires;        /* monotonic time when the entry becomes invalid */
 };
 
 static GVfsFtpDirCacheEntry *
@@ -50,6 +58,8 @@ g_vfs_ftp_dir_cache_entry_new (guint stamp)
                                         g_object_unref);
   entry->stamp = stamp;
   entry->refcount = 1;
+  entry->link.data = entry;
+  entry->size = sizeof (GVfsFtpDirCacheEntry);
 
   return entry;
 }
@@ -89,47 +99,257 @@ g_vfs_ftp_dir_cache_entry_add (GVfsFtpDirCacheEntry *entry, GVfsFtpFile *file, G
   g_return_if_fail (file != NULL);
   g_return_if_fail (G_IS_FILE_INFO (info));
 
+  entry->size += G_VFS_FTP_DIR_CACHE_FILE_OVERHEAD +
+                 strlen (g_vfs_ftp_file_get_ftp_path (file)) +
+                 strlen (g_vfs_ftp_file_get_gvfs_path (file));
   g_hash_table_insert (entry->files, file, info);
 }
 
 /*** CACHE ***/
 
+/* Directories are spread over stripes by hash, so tasks working in
+ * different directories don't wait for each other. Each stripe has its
+ * own share of the memory budget. */
+#define G_VFS_FTP_DIR_CACHE_N_STRIPES 16
+
+/* When single files can be queried, a directory is listed once this many
+ * of its files were looked up one by one, as those results aren't cached.
+ * Each stripe counts this for up to G_VFS_FTP_DIR_CACHE_MAX_COUNTED_DIRS
+ * directories. */
+#define G_VFS_FTP_DIR_CACHE_MAX_EXACT_LOOKUPS 3
+#define G_VFS_FTP_DIR_CACHE_MAX_COUNTED_DIRS 256
+
+typedef struct {
+  GMutex                lock;           /* mutex for thread safety of the following */
+  GHashTable *          directories;    /* GVfsFtpFile of directory => GVfsFtpDirCacheEntry mapping */
+  GHashTable *          exact_lookups;  /* GVfsFtpFile of uncached directory => number of single file lookups */
+  GQueue                lru;            /* entries, most recently used first */
+  gsize                 size;           /* summed size of all entries */
+} GVfsFtpDirCacheStripe;
+
 struct _GVfsFtpDirCache
 {
-  GHashTable *          directories;    /* GVfsFtpFile of directory => GVfsFtpDirCacheEntry mapping */
-  guint                 stamp;          /* used to identify validity of cache when flushing */
-  GMutex                lock;           /* mutex for thread safety of stamp and hash table */
+  GVfsFtpDirCacheStripe stripes[G_VFS_FTP_DIR_CACHE_N_STRIPES];
+  volatile int          stamp;          /* used to identify validity of cache when flushing */
+  gsize                 max_size;       /* memory budget of each stripe, 0 for unlimited */
+  gint64                ttl;            /* time in microseconds entries stay valid, 0 for forever */
   const GVfsFtpDirFuncs *funcs;         /* functions to call */
+
+  /* statistics */
+  volatile int          hits;
+  volatile int          misses;
+  volatile int          expirations;
+  volatile int          evictions;
 };
 
+/**
+ * g_vfs_ftp_dir_cache_new:
+ * @funcs: the functions used to list directories
+ * @max_size: the memory budget in bytes, 0 for unlimited
+ * @ttl: the time in seconds directory listings stay valid, 0 for forever
+ *
+ * Creates a new directory cache.
+ *
+ * Returns: the new cache
+ **/
 GVfsFtpDirCache *
-g_vfs_ftp_dir_cache_new (const GVfsFtpDirFuncs *funcs)
+g_vfs_ftp_dir_cache_new (const GVfsFtpDirFuncs *funcs,
+                         gsize                  max_size,
+                         guint                  ttl)
 {
   GVfsFtpDirCache *cache;
+  guint i;
 
   g_return_val_if_fail (funcs != NULL, NULL);
 
   cache = g_slice_new0 (GVfsFtpDirCache);
-  cache->directories = g_hash_table_new_full (g_vfs_ftp_file_hash,
-                                              g_vfs_ftp_file_equal,
-                                              (GDestroyNotify) g_vfs_ftp_file_free,
-                                              (GDestroyNotify) g_vfs_ftp_dir_cache_entry_unref);
-  g_mutex_init (&cache->lock);
+  for (i = 0; i < G_VFS_FTP_DIR_CACHE_N_STRIPES; i++)
+    {
+      GVfsFtpDirCacheStripe *stripe = &cache->stripes[i];
+
+      g_mutex_init (&stripe->lock);
+      stripe->directories = g_hash_table_new_full (g_vfs_ftp_file_hash,
+                                                   g_vfs_ftp_file_equal,
+                                                   (GDestroyNotify) g_vfs_ftp_file_free,
+                                                   (GDestroyNotify) g_vfs_ftp_dir_cache_entry_unref);
+      stripe->exact_lookups = g_hash_table_new_full (g_vfs_ftp_file_hash,
+                                                     g_vfs_ftp_file_equal,
+                                                     (GDestroyNotify) g_vfs_ftp_file_free,
+                                                     NULL);
+      g_queue_init (&stripe->lru);
+    }
+  cache->max_size = (max_size + G_VFS_FTP_DIR_CACHE_N_STRIPES - 1) / G_VFS_FTP_DIR_CACHE_N_STRIPES;
+  cache->ttl = (gint64) ttl * G_USEC_PER_SEC;
   cache->funcs = funcs;
 
   return cache;
 }
 
+static void
+g_vfs_ftp_dir_cache_print_stats (GVfsFtpDirCache *cache)
+{
+  gsize size = 0;
+  guint i, n_dirs = 0;
+
+  for (i = 0; i < G_VFS_FTP_DIR_CACHE_N_STRIPES; i++)
+    {
+      g_mutex_lock (&cache->stripes[i].lock);
+      size += cache->stripes[i].size;
+      n_dirs += g_queue_get_length (&cache->stripes[i].lru);
+      g_mutex_unlock (&cache->stripes[i].lock);
+    }
+
+  g_debug ("# dir cache: %u dirs, %" G_GSIZE_FORMAT " bytes, "
+           "%d hits, %d misses, %d expired, %d evicted\n",
+           n_dirs, size,
+           g_atomic_int_get (&cache->hits),
+           g_atomic_int_get (&cache->misses),
+           g_atomic_int_get (&cache->expirations),
+           g_atomic_int_get (&cache->evictions));
+}
+
 void
 g_vfs_ftp_dir_cache_free (GVfsFtpDirCache *cache)
 {
+  guint i;
+
   g_return_if_fail (cache != NULL);
 
-  g_hash_table_destroy (cache->directories);
-  g_mutex_clear (&cache->lock);
+  g_vfs_ftp_dir_cache_print_stats (cache);
+
+  for (i = 0; i < G_VFS_FTP_DIR_CACHE_N_STRIPES; i++)
+    {
+      g_hash_table_destroy (cache->stripes[i].directories);
+      g_hash_table_destroy (cache->stripes[i].exact_lookups);
+      g_mutex_clear (&cache->stripes[i].lock);
+    }
   g_slice_free (GVfsFtpDirCache, cache);
 }
 
+static GVfsFtpDirCacheStripe *
+g_vfs_ftp_dir_cache_get_stripe (GVfsFtpDirCache *  cache,
+                                const GVfsFtpFile *dir)
+{
+  return &cache->stripes[g_vfs_ftp_file_hash (dir) % G_VFS_FTP_DIR_CACHE_N_STRIPES];
+}
+
+/* must be called with the stripe's lock held */
+static void
+g_vfs_ftp_dir_cache_stripe_remove (GVfsFtpDirCacheStripe *stripe,
+                                   GVfsFtpDirCacheEntry * entry)
+{
+  GVfsFtpFile *dir = entry->dir;
+
+  g_queue_unlink (&stripe->lru, &entry->link);
+  stripe->size -= entry->size;
+  entry->dir = NULL;
+  /* drops the cache's reference to entry */
+  g_hash_table_remove (stripe->directories, dir);
+}
+
+static void
+g_vfs_ftp_dir_cache_insert_entry (GVfsFtpDirCache *      cache,
+                                  const GVfsFtpFile *    dir,
+                                  GVfsFtpDirCacheEntry * entry)
+{
+  GVfsFtpDirCacheStripe *stripe = g_vfs_ftp_dir_cache_get_stripe (cache, dir);
+  GVfsFtpDirCacheEntry *old;
+  guint evicted = 0;
+
+  g_mutex_lock (&stripe->lock);
+
+  old = g_hash_table_lookup (stripe->directories, dir);
+  if (old)
+    g_vfs_ftp_dir_cache_stripe_remove (stripe, old);
+
+  entry->dir = g_vfs_ftp_file_copy (dir);
+  if (cache->ttl)
+    entry->expires = g_get_monotonic_time () + cache->ttl;
+  g_hash_table_insert (stripe->directories,
+                       entry->dir,
+                       g_vfs_ftp_dir_cache_entry_ref (entry));
+  g_queue_push_head_link (&stripe->lru, &entry->link);
+  stripe->size += entry->size;
+  g_hash_table_remove (stripe->exact_lookups, dir);
+
+  /* evict least recently used entries, but always keep the new one */
+  while (cache->max_size && stripe->size > cache->max_size &&
+         stripe->lru.tail != &entry->link)
+    {
+      g_vfs_ftp_dir_cache_stripe_remove (stripe, stripe->lru.tail->data);
+      evicted++;
+    }
+
+  g_mutex_unlock (&stripe->lock);
+
+  if (evicted)
+    {
+      g_atomic_int_add (&cache->evictions, evicted);
+      g_debug ("# dir cache: evicted %u dirs\n", evicted);
+    }
+}
+
+static GVfsFtpDirCacheEntry *
+g_vfs_ftp_dir_cache_lookup_cached_entry (GVfsFtpDirCache *  cache,
+                                         const GVfsFtpFile *dir,
+                                         guint              stamp)
+{
+  GVfsFtpDirCacheStripe *stripe = g_vfs_ftp_dir_cache_get_stripe (cache, dir);
+  GVfsFtpDirCacheEntry *entry;
+
+  g_mutex_lock (&stripe->lock);
+  entry = g_hash_table_lookup (stripe->directories, dir);
+  if (entry && entry->stamp < stamp)
+    entry = NULL;
+  else if (entry && entry->expires && entry->expires <= g_get_monotonic_time ())
+    {
+      g_vfs_ftp_dir_cache_stripe_remove (stripe, entry);
+      g_atomic_int_inc (&cache->expirations);
+      entry = NULL;
+    }
+  else if (entry)
+    {
+      g_queue_unlink (&stripe->lru, &entry->link);
+      g_queue_push_head_link (&stripe->lru, &entry->link);
+      g_vfs_ftp_dir_cache_entry_ref (entry);
+    }
+  g_mutex_unlock (&stripe->lock);
+
+  if (entry)
+    g_atomic_int_inc (&cache->hits);
+  else if ((g_atomic_int_add (&cache->misses, 1) + 1) % 1000 == 0)
+    g_vfs_ftp_dir_cache_print_stats (cache);
+
+  return entry;
+}
+
+/* Counts a lookup of a single file in @dir that missed the cache.
+ * Returns TRUE if @dir should be listed instead. */
+static gboolean
+g_vfs_ftp_dir_cache_count_exact_lookup (GVfsFtpDirCache *  cache,
+                                        const GVfsFtpFile *dir)
+{
+  GVfsFtpDirCacheStripe *stripe = g_vfs_ftp_dir_cache_get_stripe (cache, dir);
+  guint n;
+
+  g_mutex_lock (&stripe->lock);
+  n = GPOINTER_TO_UINT (g_hash_table_lookup (stripe->exact_lookups, dir)) + 1;
+  if (n >= G_VFS_FTP_DIR_CACHE_MAX_EXACT_LOOKUPS)
+    g_hash_table_remove (stripe->exact_lookups, dir);
+  else
+    {
+      if (n == 1 &&
+          g_hash_table_size (stripe->exact_lookups) >= G_VFS_FTP_DIR_CACHE_MAX_COUNTED_DIRS)
+        g_hash_table_remove_all (stripe->exact_lookups);
+      g_hash_table_insert (stripe->exact_lookups,
+                           g_vfs_ftp_file_copy (dir),
+                           GUINT_TO_POINTER (n));
+    }
+  g_mutex_unlock (&stripe->lock);
+
+  return n >= G_VFS_FTP_DIR_CACHE_MAX_EXACT_LOOKUPS;
+}
+
 static GVfsFtpDirCacheEntry *
 g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
                                   GVfsFtpTask *      task,
@@ -138,14 +358,8 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
 {
   GVfsFtpDirCacheEntry *entry;
 
-  g_mutex_lock (&cache->lock);
-  entry = g_hash_table_lookup (cache->directories, dir);
+  entry = g_vfs_ftp_dir_cache_lookup_cached_entry (cache, dir, stamp);
   if (entry)
-    g_vfs_ftp_dir_cache_entry_ref (entry);
-  g_mutex_unlock (&cache->lock);
-  if (entry && entry->stamp < stamp)
-    g_vfs_ftp_dir_cache_entry_unref (entry);
-  else if (entry)
     return entry;
 
   if (g_vfs_ftp_task_send (task,
@@ -178,11 +392,7 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
       g_vfs_ftp_dir_cache_entry_unref (entry);
       return NULL;
     }
-  g_mutex_lock (&cache->lock);
-  g_hash_table_insert (cache->directories,
-                       g_vfs_ftp_file_copy (dir),
-                       g_vfs_ftp_dir_cache_entry_ref (entry));
-  g_mutex_unlock (&cache->lock);
+  g_vfs_ftp_dir_cache_insert_entry (cache, dir, entry);
   return entry;
 }
 
@@ -202,10 +412,29 @@ g_vfs_ftp_dir_cache_lookup_file_internal (GVfsFtpDirCache *  cache,
   if (!g_vfs_ftp_file_is_root (file))
     {
       dir = g_vfs_ftp_file_new_parent (file);
-      entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
+      /* don't list a whole directory if a single file can be queried,
+       * unless its files keep getting looked up */
+      if (cache->funcs->lookup_is_exact)
+        {
+          entry = g_vfs_ftp_dir_cache_lookup_cached_entry (cache, dir, stamp);
+          if (entry == NULL &&
+              g_vfs_ftp_dir_cache_count_exact_lookup (cache, dir))
+            {
+              entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
+              /* the directory may not be listable, the file can still be queried */
+              if (entry == NULL)
+                g_vfs_ftp_task_clear_error (task);
+            }
+        }
+      else
+        entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
       g_vfs_ftp_file_free (dir);
       if (entry == NULL)
-        return NULL;
+        {
+          if (cache->funcs->lookup_is_exact)
+            return cache->funcs->lookup_uncached (task, file);
+          return NULL;
+        }
 
       info = g_hash_table_lookup (entry->files, file);
       if (info != NULL)
@@ -357,10 +586,8 @@ g_vfs_ftp_dir_cache_lookup_dir (GVfsFtpDirCache *  cache,
 
   if (flush)
     {
-      g_mutex_lock (&cache->lock);
-      g_assert (cache->stamp != G_MAXUINT);
-      stamp = ++cache->stamp;
-      g_mutex_unlock (&cache->lock);
+      stamp = g_atomic_int_add (&cache->stamp, 1) + 1;
+      g_assert (stamp != 0);
     }
   else
     stamp = 0;
@@ -387,12 +614,18 @@ void
 g_vfs_ftp_dir_cache_purge_dir (GVfsFtpDirCache *  cache,
                                const GVfsFtpFile *dir)
 {
+  GVfsFtpDirCacheStripe *stripe;
+  GVfsFtpDirCacheEntry *entry;
+
   g_return_if_fail (cache != NULL);
   g_return_if_fail (dir != NULL);
 
-  g_mutex_lock (&cache->lock);
-  g_hash_table_remove (cache->directories, dir);
-  g_mutex_unlock (&cache->lock);
+  stripe = g_vfs_ftp_dir_cache_get_stripe (cache, dir);
+  g_mutex_lock (&stripe->lock);
+  entry = g_hash_table_lookup (stripe->directories, dir);
+  if (entry)
+    g_vfs_ftp_dir_cache_stripe_remove (stripe, entry);
+  g_mutex_unlock (&stripe->lock);
 }
 
 void
@@ -805,12 +1038,244 @@ const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix = {
   "LIST -a",
   g_vfs_ftp_dir_cache_funcs_process_unix,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
-  g_vfs_ftp_dir_cache_funcs_resolve_default
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  FALSE
 };
 
 const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default = {
   "LIST",
   g_vfs_ftp_dir_cache_funcs_process_default,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
-  g_vfs_ftp_dir_cache_funcs_resolve_default
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  FALSE
+};
+
+/*** MLSD ***/
+
+/* Parses the facts of a MLSD or MLST line according to RFC 3659, like
+ * "type=file;size=1024;modify=20090101120000; name".
+ * Returns %NULL for lines that don't describe a file or that describe
+ * the listed directory or its parent. */
+static GFileInfo *
+g_vfs_ftp_dir_cache_parse_mlsx (const GVfsFtpFile *file,
+                                const char *       line)
+{
+  GFileInfo *info;
+  GFileType file_type = G_FILE_TYPE_UNKNOWN;
+  char **facts, *name, *s;
+  char *symlink = NULL;
+  guint i;
+
+  name = strchr (line, ' ');
+  if (name == NULL)
+    {
+      g_debug ("# invalid MLSx line: %s\n", line);
+      return NULL;
+    }
+
+  info = g_file_info_new ();
+
+  s = g_path_get_basename (g_vfs_ftp_file_get_gvfs_path (file));
+  g_file_info_set_name (info, s);
+  g_free (s);
+
+  s = g_strndup (line, name - line);
+  facts = g_strsplit (s, ";", -1);
+  g_free (s);
+
+  for (i = 0; facts[i]; i++)
+    {
+      char *value = strchr (facts[i], '=');
+
+      if (value == NULL)
+        continue;
+      *value++ = '\0';
+
+      if (g_ascii_strcasecmp (facts[i], "type") == 0)
+        {
+          if (g_ascii_strcasecmp (value, "file") == 0)
+            file_type = G_FILE_TYPE_REGULAR;
+          else if (g_ascii_strcasecmp (value, "dir") == 0)
+            file_type = G_FILE_TYPE_DIRECTORY;
+          else if (g_ascii_strcasecmp (value, "cdir") == 0 ||
+                   g_ascii_strcasecmp (value, "pdir") == 0)
+            {
+              g_strfreev (facts);
+              g_free (symlink);
+              g_object_unref (info);
+              return NULL;
+            }
+          /* proftpd: "OS.unix=slink:/target" or "OS.unix=symlink" */
+          else if (g_ascii_strncasecmp (value, "OS.unix=slink:", 14) == 0)
+            {
+              file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+              g_free (symlink);
+              symlink = g_strdup (value + 14);
+            }
+          else
+            file_type = G_FILE_TYPE_SPECIAL;
+        }
+      else if (g_ascii_strcasecmp (facts[i], "size") == 0 ||
+               g_ascii_strcasecmp (facts[i], "sizd") == 0)
+        g_file_info_set_size (info, g_ascii_strtoull (value, NULL, 10));
+      else if (g_ascii_strcasecmp (facts[i], "modify") == 0)
+        {
+          int year, month, day, hour, minute, second;
+
+          /* YYYYMMDDHHMMSS[.sss], always in UTC */
+          if (sscanf (value, "%4d%2d%2d%2d%2d%2d",
+                      &year, &month, &day, &hour, &minute, &second) == 6)
+            {
+              GDateTime *date;
+
+              date = g_date_time_new_utc (year, month, day, hour, minute, second);
+              if (date)
+                {
+                  GTimeVal tv = { g_date_time_to_unix (date), 0 };
+
+                  g_file_info_set_modification_time (info, &tv);
+                  g_date_time_unref (date);
+                }
+            }
+        }
+      else if (g_ascii_strcasecmp (facts[i], "UNIX.mode") == 0)
+        g_file_info_set_attribute_uint32 (info,
+                                          G_FILE_ATTRIBUTE_UNIX_MODE,
+                                          g_ascii_strtoull (value, NULL, 8));
+      else if (g_ascii_strcasecmp (facts[i], "UNIX.owner") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_USER, value);
+      else if (g_ascii_strcasecmp (facts[i], "UNIX.group") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_GROUP, value);
+    }
+  g_strfreev (facts);
+
+  if (file_type == G_FILE_TYPE_UNKNOWN)
+    file_type = G_FILE_TYPE_REGULAR;
+
+  /* UNIX.mode has no type bits, add them so it looks like a stat() mode */
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    {
+      guint32 mode = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE);
+
+      mode |= file_type == G_FILE_TYPE_DIRECTORY ? S_IFDIR :
+              file_type == G_FILE_TYPE_SYMBOLIC_LINK ? S_IFLNK :
+              file_type == G_FILE_TYPE_REGULAR ? S_IFREG : 0;
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mode);
+    }
+
+  if (symlink)
+    {
+      g_file_info_set_symlink_target (info, symlink);
+      g_file_info_set_is_symlink (info, TRUE);
+      g_free (symlink);
+    }
+
+  gvfs_file_info_populate_default (info,
+                                   g_vfs_ftp_file_get_gvfs_path (file),
+                                   file_type);
+
+  g_file_info_set_is_hidden (info, g_file_info_get_name (info)[0] == '.');
+
+  return info;
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd (GInputStream *        stream,
+                                        int                   debug_id,
+                                        const GVfsFtpFile *   dir,
+                                        GVfsFtpDirCacheEntry *entry,
+                                        GCancellable *        cancellable,
+                                        GError **             error)
+{
+  GDataInputStream *data;
+  GFileInfo *info;
+  GVfsFtpFile *file;
+  char *line, *name;
+  gsize length;
+
+  g_assert (error != NULL);
+  g_assert (*error == NULL);
+
+  data = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (data, G_DATA_STREAM_NEWLINE_TYPE_LF);
+  while ((line = g_data_input_stream_read_line (data, &length, cancellable, error)))
+    {
+      if (length > 0 && line[length - 1] == '\r')
+        line[--length] = '\0';
+
+      g_debug ("<<%2d <<  %s\n", debug_id, line);
+
+      /* the name is everything after the first space, and may contain
+       * spaces and semicolons itself */
+      name = strchr (line, ' ');
+      if (name == NULL || name[1] == '\0' ||
+          strcmp (name + 1, ".") == 0 || strcmp (name + 1, "..") == 0)
+        {
+          g_free (line);
+          continue;
+        }
+
+      file = g_vfs_ftp_file_new_child (dir, name + 1, NULL);
+      if (file == NULL)
+        {
+          g_debug ("# invalid filename, skipping");
+          g_free (line);
+          continue;
+        }
+
+      info = g_vfs_ftp_dir_cache_parse_mlsx (file, line);
+      if (info)
+        g_vfs_ftp_dir_cache_entry_add (entry, file, info);
+      else
+        g_vfs_ftp_file_free (file);
+      g_free (line);
+    }
+
+  g_object_unref (data);
+  return *error != NULL;
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst (GVfsFtpTask *      task,
+                                       const GVfsFtpFile *file)
+{
+  GFileInfo *info;
+  char **reply;
+  guint i;
+
+  if (g_vfs_ftp_file_is_root (file))
+    return create_root_file_info (task->backend);
+
+  if (!g_vfs_ftp_task_send_and_check (task,
+                                      G_VFS_FTP_PASS_500,
+                                      NULL,
+                                      NULL,
+                                      &reply,
+                                      "MLST %s", g_vfs_ftp_file_get_ftp_path (file)))
+    return NULL;
+
+  /* 250-Listing file
+   *  type=file;size=1024; /path/to/file
+   * 250 End */
+  info = NULL;
+  if (reply[0][0] == '2')
+    {
+      for (i = 1; reply[i] && info == NULL; i++)
+        {
+          if (reply[i][0] != ' ')
+            continue;
+          info = g_vfs_ftp_dir_cache_parse_mlsx (file, reply[i] + 1);
+        }
+    }
+  g_strfreev (reply);
+
+  return info;
+}
+
+const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd = {
+  "MLSD",
+  g_vfs_ftp_dir_cache_funcs_process_mlsd,
+  g_vfs_ftp_dir_cache_funcs_lookup_mlst,
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  TRUE
 };
@@ -46,12 +46,16 @@ struct _GVfsFtpDirFuncs {
   GVfsFtpFile *         (* resolve_symlink)                     (GVfsFtpTask *          task,
                                                                  const GVfsFtpFile *    file,
                                                                  const char *           target);
+  gboolean              lookup_is_exact;                        /* lookup_uncached is as good as a listing */
 };
 
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix;
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default;
+extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd;
 
-GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs);
+GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs,
+                                                                 gsize                  max_size,
+                                                                 guint                  ttl);
 void                    g_vfs_ftp_dir_cache_free                (GVfsFtpDirCache *      cache);
 
 GFileInfo *             g_vfs_ftp_dir_cache_lookup_file         (GVfsFtpDirCache *      cache,
@@ -152,6 +152,14 @@ g_vfs_ftp_task_setup_connection (GVfsFtpTask *task)
       if (!g_vfs_ftp_task_send (task, 0, "OPTS UTF8 ON"))
         g_vfs_ftp_task_clear_error (task);
     }
+
+  /* ask for all the facts the directory cache uses, servers only have to
+   * send a default set */
+  if (g_vfs_backend_ftp_has_feature (task->backend, G_VFS_FTP_FEATURE_MLST))
+    {
+      if (!g_vfs_ftp_task_send (task, 0, "OPTS MLST type;size;modify;UNIX.mode;UNIX.owner;UNIX.group;"))
+        g_vfs_ftp_task_clear_error (task);
+    }
 }
 
 
@@ -161,6 +169,46 @@ do_broadcast (GCancellable *cancellable, GCond *cond)
   g_cond_broadcast (cond);
 }
 
+/* Opens a new connection for @task, logs in and sets it up, and records
+ * how long that took. The caller must have counted the connection in
+ * the backend's connections already. */
+static gboolean
+g_vfs_ftp_task_open_connection (GVfsFtpTask *task)
+{
+  GVfsBackendFtp *ftp = task->backend;
+  gint64 start, elapsed;
+  guint n_setups;
+
+  start = g_get_monotonic_time ();
+  task->conn = g_vfs_ftp_connection_new (ftp->addr, task->cancellable, &task->error);
+  if (G_UNLIKELY (task->conn == NULL))
+    return FALSE;
+
+  g_vfs_ftp_task_receive (task, 0, NULL);
+  g_vfs_ftp_task_login (task, ftp->user, ftp->password);
+  /* features, system and default location were found out on mount */
+  g_vfs_ftp_task_setup_connection (task);
+  if (G_UNLIKELY (g_vfs_ftp_task_is_in_error (task)))
+    {
+      g_vfs_ftp_connection_free (task->conn);
+      task->conn = NULL;
+      return FALSE;
+    }
+
+  elapsed = g_get_monotonic_time () - start;
+  g_mutex_lock (&ftp->mutex);
+  n_setups = ++ftp->n_connection_setups;
+  ftp->connection_setup_time += elapsed;
+  g_mutex_unlock (&ftp->mutex);
+  g_debug ("# connection %u set up in %" G_GINT64_FORMAT " ms (%u so far, %" G_GINT64_FORMAT " ms average)\n",
+           g_vfs_ftp_connection_get_debug_id (task->conn),
+           elapsed / 1000,
+           n_setups,
+           ftp->connection_setup_time / n_setups / 1000);
+
+  return TRUE;
+}
+
 /**
  * g_vfs_ftp_task_acquire_connection:
  * @task: a task without an associated connection
@@ -219,18 +267,9 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
           ftp->connections++;
           last_thread = g_thread_self ();
           g_mutex_unlock (&ftp->mutex);
-          task->conn = g_vfs_ftp_connection_new (ftp->addr, task->cancellable, &task->error);
-          if (G_LIKELY (task->conn != NULL))
-            {
-              g_vfs_ftp_task_receive (task, 0, NULL);
-              g_vfs_ftp_task_login (task, ftp->user, ftp->password);
-              g_vfs_ftp_task_setup_connection (task);
-              if (G_LIKELY (!g_vfs_ftp_task_is_in_error (task)))
-                break;
-            }
+          if (G_LIKELY (g_vfs_ftp_task_open_connection (task)))
+            break;
 
-          g_vfs_ftp_connection_free (task->conn);
-          task->conn = NULL;
           g_mutex_lock (&ftp->mutex);
           ftp->connections--;
           /* If this value is still equal to our thread it means there were no races 
@@ -301,6 +340,86 @@ g_vfs_ftp_task_release_connection (GVfsFtpTask *task)
   task->conn = NULL;
 }
 
+/**
+ * g_vfs_ftp_task_keep_alive:
+ * @ftp: the backend
+ * @max_idle: time in microseconds after which idle connections get pinged
+ *
+ * Maintains the backend's connection pool so jobs find logged-in
+ * connections: Sends a NOOP on every pooled connection that has been idle
+ * for longer than @max_idle, so the server doesn't drop it, and drops
+ * the ones that don't answer. Then opens new connections until there are
+ * min_connections. This function blocks, so call it from a thread that
+ * doesn't run jobs.
+ **/
+void
+g_vfs_ftp_task_keep_alive (GVfsBackendFtp *ftp,
+                           gint64          max_idle)
+{
+  GVfsFtpTask task = { ftp, NULL, NULL, };
+  GQueue idle = G_QUEUE_INIT;
+  GVfsFtpConnection *conn;
+  guint i, n;
+
+  g_return_if_fail (G_VFS_IS_BACKEND_FTP (ftp));
+
+  /* take out the connections to ping, so no job gets them meanwhile */
+  g_mutex_lock (&ftp->mutex);
+  n = ftp->queue ? g_queue_get_length (ftp->queue) : 0;
+  for (i = 0; i < n; i++)
+    {
+      conn = g_queue_pop_head (ftp->queue);
+      if (g_vfs_ftp_connection_get_idle_time (conn) >= max_idle)
+        g_queue_push_tail (&idle, conn);
+      else
+        g_queue_push_tail (ftp->queue, conn);
+    }
+  g_mutex_unlock (&ftp->mutex);
+
+  while ((task.conn = g_queue_pop_head (&idle)))
+    {
+      if (!g_vfs_ftp_task_send (&task, 0, "NOOP"))
+        {
+          g_debug ("# dropping idle connection %u: %s\n",
+                   g_vfs_ftp_connection_get_debug_id (task.conn),
+                   task.error->message);
+          g_vfs_ftp_task_clear_error (&task);
+          g_mutex_lock (&ftp->mutex);
+          ftp->connections--;
+          g_mutex_unlock (&ftp->mutex);
+          g_vfs_ftp_connection_free (task.conn);
+          task.conn = NULL;
+          continue;
+        }
+      g_vfs_ftp_task_release_connection (&task);
+    }
+
+  /* pre-warm: open the connections jobs would otherwise have to open */
+  g_mutex_lock (&ftp->mutex);
+  while (ftp->queue &&
+         ftp->connections < ftp->min_connections &&
+         ftp->connections < ftp->max_connections)
+    {
+      ftp->connections++;
+      g_mutex_unlock (&ftp->mutex);
+
+      if (!g_vfs_ftp_task_open_connection (&task))
+        {
+          g_debug ("# could not open spare connection: %s\n", task.error->message);
+          g_vfs_ftp_task_clear_error (&task);
+          g_mutex_lock (&ftp->mutex);
+          ftp->connections--;
+          /* Try again next time. Only jobs lower max_connections, a
+           * failure here may just be transient. */
+          break;
+        }
+      g_vfs_ftp_task_release_connection (&task);
+
+      g_mutex_lock (&ftp->mutex);
+    }
+  g_mutex_unlock (&ftp->mutex);
+}
+
 /**
  * g_vfs_ftp_task_done:
  * @task: the task to finalize
@@ -92,6 +92,8 @@ gboolean                g_vfs_ftp_task_login                    (GVfsFtpTask *
                                                                  const char *           username,
                                                                  const char *           password);
 void                    g_vfs_ftp_task_setup_connection         (GVfsFtpTask *          task);
+void                    g_vfs_ftp_task_keep_alive               (GVfsBackendFtp *       ftp,
+                                                                 gint64                 max_idle);
 
 
 G_END_DECLS
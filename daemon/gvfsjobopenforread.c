@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -78,6 +79,7 @@ g_vfs_job_open_for_read_class_init (GVfsJobOpenForReadClass *klass)
 static void
 g_vfs_job_open_for_read_init (GVfsJobOpenForRead *job)
 {
+  job->file_fd = -1;
 }
 
 gboolean
@@ -155,6 +157,16 @@ g_vfs_job_open_for_read_set_can_seek (GVfsJobOpenForRead *job,
   job->can_seek = can_seek;
 }
 
+/* Backends reading from a local file can let the client read the
+   file directly. The fd is only borrowed and must stay open until the
+   job has replied, e.g. by belonging to the backend handle. */
+void
+g_vfs_job_open_for_read_set_file_fd (GVfsJobOpenForRead *job,
+				     int                 fd)
+{
+  job->file_fd = fd;
+}
+
 /* Might be called on an i/o thread */
 static void
 create_reply (GVfsJob *job,
@@ -174,6 +186,12 @@ create_reply (GVfsJob *job,
                                     open_job->pid);
 
   remote_fd = g_vfs_channel_steal_remote_fd (G_VFS_CHANNEL (channel));
+
+  /* Queued before the D-Bus reply, so the client finds it as soon
+     as it has the channel */
+  if (open_job->file_fd != -1 &&
+      !g_vfs_channel_send_fd (G_VFS_CHANNEL (channel), open_job->file_fd))
+    g_warning ("create_reply: unable to pass file descriptor: %s\n", g_strerror (errno));
   
   fd_list = g_unix_fd_list_new ();
   error = NULL;
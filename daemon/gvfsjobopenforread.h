@@ -46,6 +46,7 @@ struct _GVfsJobOpenForRead
   GVfsBackend *backend;
   GVfsBackendHandle backend_handle;
   gboolean can_seek;
+  int file_fd;
   GVfsReadChannel *read_channel;
   gboolean read_icon;
 
@@ -69,6 +70,8 @@ void             g_vfs_job_open_for_read_set_handle    (GVfsJobOpenForRead *job,
 							GVfsBackendHandle   handle);
 void             g_vfs_job_open_for_read_set_can_seek  (GVfsJobOpenForRead *job,
 							gboolean            can_seek);
+void             g_vfs_job_open_for_read_set_file_fd   (GVfsJobOpenForRead *job,
+							int                 fd);
 GPid             g_vfs_job_open_for_read_get_pid       (GVfsJobOpenForRead *job);
 
 G_END_DECLS
@@ -35,10 +35,82 @@
 
 G_DEFINE_TYPE (GVfsJobRead, g_vfs_job_read, G_VFS_TYPE_JOB)
 
+/* Read buffers are recycled through a small pool, per power of two
+   size between 4 kB and 512 kB. Larger requests are not pooled. */
+#define BUFFER_POOL_MIN_SHIFT 12
+#define BUFFER_POOL_MAX_SHIFT 19
+#define BUFFER_POOL_N_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_DEPTH 16
+
+G_LOCK_DEFINE_STATIC (buffer_pool);
+static GTrashStack *buffer_pool[BUFFER_POOL_N_CLASSES];
+static guint buffer_pool_len[BUFFER_POOL_N_CLASSES];
+
 static void     run        (GVfsJob *job);
 static gboolean try        (GVfsJob *job);
 static void     send_reply (GVfsJob *job);
 
+static int
+buffer_pool_class (gsize size)
+{
+  int shift;
+
+  for (shift = BUFFER_POOL_MIN_SHIFT; shift <= BUFFER_POOL_MAX_SHIFT; shift++)
+    if (size <= ((gsize)1 << shift))
+      return shift - BUFFER_POOL_MIN_SHIFT;
+
+  return -1;
+}
+
+/* Might be called on an i/o thread */
+static char *
+buffer_pool_alloc (gsize size, gsize *allocated)
+{
+  int class;
+  char *buffer;
+
+  class = buffer_pool_class (size);
+  if (class == -1)
+    {
+      *allocated = size;
+      return g_malloc (size);
+    }
+
+  *allocated = (gsize)1 << (class + BUFFER_POOL_MIN_SHIFT);
+
+  G_LOCK (buffer_pool);
+  buffer = g_trash_stack_pop (&buffer_pool[class]);
+  if (buffer != NULL)
+    buffer_pool_len[class]--;
+  G_UNLOCK (buffer_pool);
+
+  if (buffer == NULL)
+    buffer = g_malloc (*allocated);
+
+  return buffer;
+}
+
+static void
+buffer_pool_free (char *buffer, gsize allocated)
+{
+  int class;
+
+  class = buffer_pool_class (allocated);
+  if (class != -1)
+    {
+      G_LOCK (buffer_pool);
+      if (buffer_pool_len[class] < BUFFER_POOL_DEPTH)
+        {
+          g_trash_stack_push (&buffer_pool[class], buffer);
+          buffer_pool_len[class]++;
+          buffer = NULL;
+        }
+      G_UNLOCK (buffer_pool);
+    }
+
+  g_free (buffer);
+}
+
 static void
 g_vfs_job_read_finalize (GObject *object)
 {
@@ -47,7 +119,7 @@ g_vfs_job_read_finalize (GObject *object)
   job = G_VFS_JOB_READ (object);
 
   g_object_unref (job->channel);
-  g_free (job->buffer);
+  buffer_pool_free (job->buffer, job->buffer_size);
   
   if (G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize) (object);
@@ -85,7 +157,7 @@ g_vfs_job_read_new (GVfsReadChannel *channel,
   job->backend = backend;
   job->channel = g_object_ref (channel);
   job->handle = handle;
-  job->buffer = g_malloc (bytes_requested);
+  job->buffer = buffer_pool_alloc (bytes_requested, &job->buffer_size);
   job->bytes_requested = bytes_requested;
   
   return G_VFS_JOB (job);
@@ -96,6 +168,11 @@ static void
 send_reply (GVfsJob *job)
 {
   GVfsJobRead *op_job = G_VFS_JOB_READ (job);
+
+  /* Readaheads started behind other jobs must reply in order */
+  if (g_vfs_channel_defer_reply (G_VFS_CHANNEL (op_job->channel), job))
+    return;
+
   g_debug ("job_read send reply, %"G_GSIZE_FORMAT" bytes\n", op_job->data_count);
 
   if (job->failed)
@@ -47,6 +47,7 @@ struct _GVfsJobRead
   GVfsBackendHandle handle;
   gsize bytes_requested;
   char *buffer;
+  gsize buffer_size; /* Allocated size, at least bytes_requested */
   gsize data_count;
 };
 
@@ -41,12 +41,29 @@
 #include <gvfsjobcloseread.h>
 #include <gvfsfileinfo.h>
 
+/* Readahead throughput is measured over this many bytes before the
+   readahead window is adapted */
+#define READAHEAD_MEASURE_BYTES (1024 * 1024)
+
+/* Internal requests a pread_v request is split up into. These never
+   come from the client. */
+#define READ_CHANNEL_REQUEST_EXTENT_SEEK 0x10000
+#define READ_CHANNEL_REQUEST_EXTENT_READ 0x10001
+#define READ_CHANNEL_REQUEST_RESTORE_SEEK 0x10002
+
 struct _GVfsReadChannel
 {
   GVfsChannel parent_instance;
 
   guint read_count;
   int seek_generation;
+
+  /* Number of readahead jobs allowed in flight, at most what the
+     backend supports */
+  guint readahead_window;
+  gint64 measure_start;
+  gsize measure_bytes;
+  gdouble last_rate;
 };
 
 G_DEFINE_TYPE (GVfsReadChannel, g_vfs_read_channel, G_VFS_TYPE_CHANNEL)
@@ -85,6 +102,7 @@ g_vfs_read_channel_class_init (GVfsReadChannelClass *klass)
 static void
 g_vfs_read_channel_init (GVfsReadChannel *channel)
 {
+  channel->readahead_window = 1;
 }
 
 static GVfsJob *
@@ -121,6 +139,69 @@ modify_read_size (GVfsReadChannel *channel,
   return real_size;
 }
 
+/* Queues the seeks and reads of all extents in front of the other
+   requests and returns the job for the first one */
+static GVfsJob *
+start_pread_v (GVfsReadChannel *read_channel,
+	       guint32 seq_nr,
+	       guint32 arg1,
+	       guint32 arg2,
+	       gpointer data,
+	       gsize data_len,
+	       GError **error)
+{
+  GVfsChannel *channel;
+  guint32 *extents;
+  guint32 size;
+  goffset offset;
+  gsize n_extents;
+  gssize i;
+
+  channel = G_VFS_CHANNEL (read_channel);
+  n_extents = data_len / G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_EXTENT_SIZE;
+
+  if (n_extents == 0 ||
+      n_extents > G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_EXTENTS ||
+      data_len % G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_EXTENT_SIZE != 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR,
+			   G_IO_ERROR_INVALID_ARGUMENT,
+			   "Invalid pread_v request");
+      return NULL;
+    }
+
+  read_channel->read_count = 0;
+  read_channel->seek_generation++;
+  read_channel->measure_start = 0;
+  read_channel->measure_bytes = 0;
+
+  /* Pushed in reverse, so they end up in order */
+  extents = data;
+  g_vfs_channel_push_request (channel,
+			      READ_CHANNEL_REQUEST_RESTORE_SEEK,
+			      seq_nr, arg1, arg2);
+  for (i = n_extents - 1; i >= 0; i--)
+    {
+      size = g_ntohl (extents[i * 3 + 2]);
+      g_vfs_channel_push_request (channel,
+				  READ_CHANNEL_REQUEST_EXTENT_READ,
+				  seq_nr, size, 0);
+      if (i > 0)
+	g_vfs_channel_push_request (channel,
+				    READ_CHANNEL_REQUEST_EXTENT_SEEK,
+				    seq_nr,
+				    g_ntohl (extents[i * 3]),
+				    g_ntohl (extents[i * 3 + 1]));
+    }
+
+  offset = ((goffset)g_ntohl (extents[0])) | (((goffset)g_ntohl (extents[1])) << 32);
+  return g_vfs_job_seek_read_new (read_channel,
+				  g_vfs_channel_get_backend_handle (channel),
+				  G_SEEK_SET,
+				  offset,
+				  g_vfs_channel_get_backend (channel));
+}
+
 static GVfsJob *
 read_channel_handle_request (GVfsChannel *channel,
 			     guint32 command,
@@ -165,6 +246,8 @@ read_channel_handle_request (GVfsChannel *channel,
       
       read_channel->read_count = 0;
       read_channel->seek_generation++;
+      read_channel->measure_start = 0;
+      read_channel->measure_bytes = 0;
       job = g_vfs_job_seek_read_new (read_channel,
 				     backend_handle,
 				     seek_type,
@@ -172,6 +255,29 @@ read_channel_handle_request (GVfsChannel *channel,
 				     backend);
       break;
 
+    case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_PREAD_V:
+      job = start_pread_v (read_channel, seq_nr, arg1, arg2,
+			   data, data_len, error);
+      break;
+
+    case READ_CHANNEL_REQUEST_EXTENT_SEEK:
+    case READ_CHANNEL_REQUEST_RESTORE_SEEK:
+      /* Part of a pread_v, the seek_generation was already bumped */
+      job = g_vfs_job_seek_read_new (read_channel,
+				     backend_handle,
+				     G_SEEK_SET,
+				     ((goffset)arg1) | (((goffset)arg2) << 32),
+				     backend);
+      break;
+
+    case READ_CHANNEL_REQUEST_EXTENT_READ:
+      /* Exactly the extent size, this is not a sequential read */
+      job = g_vfs_job_read_new (read_channel,
+				backend_handle,
+				MIN (arg1, G_VFS_DAEMON_SOCKET_PROTOCOL_PREAD_V_MAX_SIZE),
+				backend);
+      break;
+
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_QUERY_INFO:
       attrs = g_strndup (data, data_len);
       job = g_vfs_job_query_info_read_new (read_channel,
@@ -194,6 +300,54 @@ read_channel_handle_request (GVfsChannel *channel,
   return job;
 }
 
+/* Grows the readahead window while that makes sequential reads
+   faster and shrinks it again when it does not. Called for all
+   data sent to the client. */
+static void
+update_readahead_window (GVfsReadChannel *read_channel,
+			 gsize            data_count)
+{
+  GVfsBackend *backend;
+  guint max_window;
+  gint64 now;
+  gdouble rate;
+
+  backend = g_vfs_channel_get_backend (G_VFS_CHANNEL (read_channel));
+  max_window = g_vfs_backend_get_readahead_window (backend);
+  if (max_window <= 1)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (read_channel->measure_start == 0)
+    {
+      read_channel->measure_start = now;
+      read_channel->measure_bytes = 0;
+      return;
+    }
+
+  read_channel->measure_bytes += data_count;
+  if (read_channel->measure_bytes < READAHEAD_MEASURE_BYTES ||
+      now <= read_channel->measure_start)
+    return;
+
+  rate = (gdouble) read_channel->measure_bytes / (now - read_channel->measure_start);
+
+  if (rate > read_channel->last_rate * 1.1)
+    read_channel->readahead_window = MIN (read_channel->readahead_window * 2, max_window);
+  else if (rate < read_channel->last_rate * 0.9)
+    read_channel->readahead_window = MAX (read_channel->readahead_window / 2, 1);
+
+  g_debug ("readahead: %.0f bytes/s, window %u\n", rate * G_USEC_PER_SEC,
+	   read_channel->readahead_window);
+
+  read_channel->last_rate = rate;
+  read_channel->measure_start = now;
+  read_channel->measure_bytes = 0;
+}
+
+/* Called with the job that just finished. When the backend supports a
+   readahead window this is called repeatedly for the same job, until
+   the window is full. */
 static GVfsJob *
 read_channel_readahead (GVfsChannel  *channel,
 			GVfsJob       *job)
@@ -201,6 +355,7 @@ read_channel_readahead (GVfsChannel  *channel,
   GVfsJob *readahead_job;
   GVfsReadChannel *read_channel;
   GVfsJobRead *read_job;
+  guint n_readahead;
 
   readahead_job = NULL;
   if (!job->failed &&
@@ -209,7 +364,13 @@ read_channel_readahead (GVfsChannel  *channel,
       read_job = G_VFS_JOB_READ (job);
       read_channel = G_VFS_READ_CHANNEL (channel);
 
-      if (read_job->data_count != 0)
+      /* The current job counts against the window too */
+      n_readahead = g_vfs_channel_get_n_readahead_jobs (channel);
+      if (g_vfs_channel_get_job (channel) != NULL)
+	n_readahead++;
+
+      if (read_job->data_count != 0 &&
+	  n_readahead < read_channel->readahead_window)
 	{
 	  read_channel->read_count++;
 	  readahead_job = g_vfs_job_read_new (read_channel,
@@ -272,6 +433,8 @@ g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
 
   channel = G_VFS_CHANNEL (read_channel);
 
+  update_readahead_window (read_channel, count);
+
   reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA);
   reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
   reply.arg1 = g_htonl (count);
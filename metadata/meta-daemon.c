@@ -58,12 +58,22 @@ writeout_timeout (gpointer data)
 {
   TreeInfo *info = data;
 
-  meta_tree_flush (info->tree);
+  meta_tree_flush_in_background (info->tree);
   info->writeout_timeout = 0;
 
   return FALSE;
 }
 
+static void
+tree_info_flush (gpointer key,
+		 gpointer value,
+		 gpointer user_data)
+{
+  TreeInfo *info = value;
+
+  meta_tree_flush (info->tree);
+}
+
 static void
 tree_info_schedule_writeout (TreeInfo *info)
 {
@@ -108,86 +118,130 @@ tree_info_lookup (const char *filename)
   return info;
 }
 
-static gboolean
-handle_set (GVfsMetadata *object,
-            GDBusMethodInvocation *invocation,
-            const gchar *arg_treefile,
-            const gchar *arg_path,
-            GVariant *arg_data,
-            GVfsMetadata *daemon)
+static void
+batch_add_data (MetaTreeBatch *batch,
+		const char *path,
+		GVariant *data)
 {
-  TreeInfo *info;
   const gchar *str;
   const gchar **strv;
   const gchar *key;
-  GError *error;
   GVariantIter iter;
   GVariant *value;
 
-  info = tree_info_lookup (arg_treefile);
-  if (info == NULL)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             G_IO_ERROR,
-                                             G_IO_ERROR_NOT_FOUND,
-                                             _("Can't find metadata file %s"),
-                                             arg_treefile);
-      return TRUE;
-    }
-
-  error = NULL;
-
-  g_variant_iter_init (&iter, arg_data);
+  g_variant_iter_init (&iter, data);
   while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
     {
       if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING_ARRAY))
 	{
 	  /* stringv */
           strv = g_variant_get_strv (value, NULL);
-	  if (!meta_tree_set_stringv (info->tree, arg_path, key, (gchar **) strv))
-	    {
-	      g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                  _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_stringv (batch, path, key, (gchar **) strv);
 	  g_free (strv);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
 	{
 	  /* string */
           str = g_variant_get_string (value, NULL);
-	  if (!meta_tree_set_string (info->tree, arg_path, key, str))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_string (batch, path, key, str);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
 	{
 	  /* Unset */
-	  if (!meta_tree_unset (info->tree, arg_path, key))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to unset metadata key"));
-	    }
+	  meta_tree_batch_unset (batch, path, key);
 	}
       g_variant_unref (value);
     }
+}
+
+static gboolean
+apply_batch (TreeInfo *info,
+	     MetaTreeBatch *batch,
+	     GDBusMethodInvocation *invocation)
+{
+  gboolean res;
+
+  res = meta_tree_apply_batch (info->tree, batch);
+  meta_tree_batch_free (batch);
 
   tree_info_schedule_writeout (info);
 
-  if (error)
+  if (!res)
+    g_dbus_method_invocation_return_error_literal (invocation,
+                                                   G_IO_ERROR,
+                                                   G_IO_ERROR_FAILED,
+                                                   _("Unable to set metadata key"));
+  return res;
+}
+
+static gboolean
+handle_set (GVfsMetadata *object,
+            GDBusMethodInvocation *invocation,
+            const gchar *arg_treefile,
+            const gchar *arg_path,
+            GVariant *arg_data,
+            GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  else
+
+  /* All keys go into the journal at once */
+  batch = meta_tree_batch_new ();
+  batch_add_data (batch, arg_path, arg_data);
+
+  if (apply_batch (info, batch, invocation))
+    gvfs_metadata_complete_set (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_many (GVfsMetadata *object,
+                 GDBusMethodInvocation *invocation,
+                 const gchar *arg_treefile,
+                 GVariant *arg_data,
+                 GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  const gchar *path;
+  GVariantIter iter;
+  GVariant *data;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      gvfs_metadata_complete_set (object, invocation);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  
+
+  batch = meta_tree_batch_new ();
+
+  g_variant_iter_init (&iter, arg_data);
+  while (g_variant_iter_next (&iter, "(^&ay@a{sv})", &path, &data))
+    {
+      batch_add_data (batch, path, data);
+      g_variant_unref (data);
+    }
+
+  if (apply_batch (info, batch, invocation))
+    gvfs_metadata_complete_set_many (object, invocation);
+
   return TRUE;
 }
 
@@ -404,6 +458,7 @@ on_name_acquired (GDBusConnection *connection,
   skeleton = gvfs_metadata_skeleton_new ();
   
   g_signal_connect (skeleton, "handle-set", G_CALLBACK (handle_set), skeleton);
+  g_signal_connect (skeleton, "handle-set-many", G_CALLBACK (handle_set_many), skeleton);
   g_signal_connect (skeleton, "handle-unset", G_CALLBACK (handle_unset), skeleton);
   g_signal_connect (skeleton, "handle-get", G_CALLBACK (handle_get), skeleton);
   g_signal_connect (skeleton, "handle-remove", G_CALLBACK (handle_remove), skeleton);
@@ -511,6 +566,9 @@ main (int argc, char *argv[])
 				      (GDestroyNotify)tree_info_free);
 
   g_main_loop_run (loop);
+
+  /* Wait for background writeouts, and write out the rest */
+  g_hash_table_foreach (tree_infos, tree_info_flush, NULL);
   
   if (skeleton)
     g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (skeleton));
@@ -5,11 +5,13 @@
 static char *treename = NULL;
 static char *treefilename = NULL;
 static gboolean recursive = FALSE;
+static int benchmark = 0;
 static GOptionEntry entries[] =
 {
   { "tree", 't', 0, G_OPTION_ARG_STRING, &treename, "Tree", NULL},
   { "file", 'f', 0, G_OPTION_ARG_STRING, &treefilename, "Tree file", NULL},
   { "recursive", 'r', 0, G_OPTION_ARG_NONE, &recursive, "Recursive", NULL},
+  { "benchmark", 'b', 0, G_OPTION_ARG_INT, &benchmark, "Time N silent lookups", "N"},
   { NULL }
 };
 
@@ -88,6 +90,95 @@ enum_keys (MetaTree *tree, char *path,
     }
 }
 
+static gboolean
+count_key (const char *key,
+	   MetaKeyType type,
+	   gpointer value,
+	   gpointer user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+  return TRUE;
+}
+
+static guint
+bench_keys (MetaTree *tree, char *path,
+	    gboolean recurse)
+{
+  GList *children, *l;
+  char *child_path;
+  guint count;
+
+  count = 0;
+  meta_tree_enumerate_keys (tree, path, count_key, &count);
+
+  if (recurse)
+    {
+      children = NULL;
+      meta_tree_enumerate_dir (tree, path,
+			       prepend_name,
+			       &children);
+      for (l = children; l != NULL; l = l->next)
+	{
+	  child_path = g_build_filename (path, l->data, NULL);
+	  count += bench_keys (tree, child_path, recurse);
+	  g_free (child_path);
+	}
+      g_list_free_full (children, g_free);
+    }
+
+  return count;
+}
+
+/* Repeats the lookups without printing, to time the tree and
+   journal lookup paths */
+static void
+run_benchmark (MetaTree *tree, const char *tree_path,
+	       char **keys, int n_keys)
+{
+  GTimer *timer;
+  char **strings;
+  gdouble elapsed;
+  guint count, read_waits, write_waits;
+  int i, j;
+
+  count = 0;
+  timer = g_timer_new ();
+  for (i = 0; i < benchmark; i++)
+    {
+      if (n_keys == 0)
+	count += bench_keys (tree, (char *)tree_path, recursive);
+
+      for (j = 0; j < n_keys; j++)
+	{
+	  switch (meta_tree_lookup_key_type (tree, tree_path, keys[j]))
+	    {
+	    case META_KEY_TYPE_STRING:
+	      g_free (meta_tree_lookup_string (tree, tree_path, keys[j]));
+	      count++;
+	      break;
+	    case META_KEY_TYPE_STRINGV:
+	      strings = meta_tree_lookup_stringv (tree, tree_path, keys[j]);
+	      g_strfreev (strings);
+	      count++;
+	      break;
+	    default:
+	      break;
+	    }
+	}
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_print ("%d iterations, %u keys found, %.3f s, %.1f us per iteration\n",
+	   benchmark, count, elapsed, elapsed * 1e6 / benchmark);
+
+  meta_tree_get_lock_contention (tree, &read_waits, &write_waits);
+  g_print ("lock contention: %u read waits, %u write waits\n",
+	   read_waits, write_waits);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -164,6 +255,12 @@ main (int argc,
 	}
     }
 
+  if (benchmark > 0)
+    {
+      run_benchmark (tree, tree_path, argv + 2, argc - 2);
+      return 0;
+    }
+
   if (argc > 2)
     {
       for (i = 2; i < argc; i++)
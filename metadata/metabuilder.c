@@ -12,20 +12,38 @@
 #define MINOR_VERSION 0
 #define MAJOR_JOURNAL_VERSION 1
 #define MINOR_JOURNAL_VERSION 0
-#define NEW_JOURNAL_SIZE (32*1024)
 
 #define RANDOM_TAG_OFFSET 12
 #define ROTATED_OFFSET 8
 
 #define KEY_IS_LIST_MASK (1<<31)
 
+/* Nodes come from the slice allocator and all strings live in the
+   builder's string chunk, so a builder is freed in one go and copies
+   can share strings. Strings replaced or removed while building are
+   only reclaimed then. */
+
+static MetaFile *
+metafile_alloc (MetaBuilder *builder,
+		const char *name)
+{
+  MetaFile *f;
+
+  f = g_slice_new0 (MetaFile);
+  f->builder = builder;
+  f->name = g_string_chunk_insert (builder->strings, name);
+
+  return f;
+}
+
 MetaBuilder *
 meta_builder_new (void)
 {
   MetaBuilder *builder;
 
   builder = g_new0 (MetaBuilder, 1);
-  builder->root = metafile_new ("/", NULL);
+  builder->strings = g_string_chunk_new (64 * 1024);
+  builder->root = metafile_alloc (builder, "/");
 
   return builder;
 }
@@ -35,29 +53,89 @@ meta_builder_free (MetaBuilder *builder)
 {
   if (builder->root)
     metafile_free (builder->root);
+  g_string_chunk_free (builder->strings);
   g_free (builder);
 }
 
 static gint
-compare_metafile (gconstpointer  a,
+compare_metadata (gconstpointer  a,
 		  gconstpointer  b)
 {
-  const MetaFile *aa, *bb;
+  const MetaData *aa, *bb;
 
   aa = a;
   bb = b;
-  return strcmp (aa->name, bb->name);
+  return strcmp (aa->key, bb->key);
 }
 
-static gint
-compare_metadata (gconstpointer  a,
-		  gconstpointer  b)
+/* Binary search in the sorted children, returns the index of the
+   child or where it would be inserted */
+static guint
+metafile_find_child (MetaFile *file,
+		     const char *name,
+		     gboolean *found)
 {
-  const MetaData *aa, *bb;
+  MetaFile *child;
+  guint low, high, mid;
+  int cmp;
 
-  aa = a;
-  bb = b;
-  return strcmp (aa->key, bb->key);
+  *found = FALSE;
+  if (file->children == NULL)
+    return 0;
+
+  /* Children are mostly added in order, e.g. when copying a tree */
+  low = 0;
+  high = file->children->len;
+  if (high > 0)
+    {
+      child = g_ptr_array_index (file->children, high - 1);
+      cmp = strcmp (name, child->name);
+      if (cmp > 0)
+	return high;
+      if (cmp == 0)
+	{
+	  *found = TRUE;
+	  return high - 1;
+	}
+    }
+
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      child = g_ptr_array_index (file->children, mid);
+      cmp = strcmp (name, child->name);
+      if (cmp == 0)
+	{
+	  *found = TRUE;
+	  return mid;
+	}
+      if (cmp < 0)
+	high = mid;
+      else
+	low = mid + 1;
+    }
+
+  return low;
+}
+
+static void
+metafile_insert_child (MetaFile *parent,
+		       MetaFile *child,
+		       guint index)
+{
+  GPtrArray *children;
+
+  if (parent->children == NULL)
+    parent->children = g_ptr_array_new ();
+  children = parent->children;
+
+  g_ptr_array_add (children, child);
+  if (index < children->len - 1)
+    {
+      memmove (&children->pdata[index + 1], &children->pdata[index],
+	       (children->len - 1 - index) * sizeof (gpointer));
+      children->pdata[index] = child;
+    }
 }
 
 MetaFile *
@@ -65,12 +143,14 @@ metafile_new (const char *name,
 	      MetaFile *parent)
 {
   MetaFile *f;
+  gboolean found;
+  guint index;
 
-  f = g_new0 (MetaFile, 1);
-  f->name = g_strdup (name);
-  if (parent)
-    parent->children = g_list_insert_sorted (parent->children, f,
-					     compare_metafile);
+  g_return_val_if_fail (parent != NULL, NULL);
+
+  f = metafile_alloc (parent->builder, name);
+  index = metafile_find_child (parent, name, &found);
+  metafile_insert_child (parent, f, index);
 
   return f;
 }
@@ -81,11 +161,10 @@ metadata_new (const char *key,
 {
   MetaData *data;
 
-  data = g_new0 (MetaData, 1);
-  data->key = g_strdup (key);
+  data = g_slice_new0 (MetaData);
+  data->key = g_string_chunk_insert_const (file->builder->strings, key);
 
-  if (file)
-    file->data = g_list_insert_sorted (file->data, data, compare_metadata);
+  file->data = g_list_insert_sorted (file->data, data, compare_metadata);
 
   return data;
 }
@@ -95,20 +174,15 @@ metadata_dup (MetaFile *file,
 	      MetaData *data)
 {
   MetaData *new_data;
-  GList *l;
 
   new_data = metadata_new (data->key, file);
 
+  /* Strings are shared within the builder */
   new_data->is_list = data->is_list;
   if (data->is_list)
-    {
-      for (l = data->values; l != NULL; l = l->next)
-	new_data->values =
-	  g_list_prepend (new_data->values, g_strdup (l->data));
-      new_data->values = g_list_reverse (new_data->values);
-    }
+    new_data->values = g_list_copy (data->values);
   else
-    new_data->value = g_strdup (data->value);
+    new_data->value = data->value;
 
   return new_data;
 }
@@ -116,27 +190,33 @@ metadata_dup (MetaFile *file,
 static void
 metadata_free (MetaData *data)
 {
-  g_free (data->key);
   if (data->is_list)
-    {
-      g_list_foreach (data->values, (GFunc)g_free, NULL);
-      g_list_free (data->values);
-    }
-  else
-    g_free (data->value);
+    g_list_free (data->values);
 
-  g_free (data);
+  g_slice_free (MetaData, data);
+}
+
+static void
+metafile_free_children (MetaFile *file)
+{
+  guint i;
+
+  if (file->children == NULL)
+    return;
+
+  for (i = 0; i < file->children->len; i++)
+    metafile_free (g_ptr_array_index (file->children, i));
+  g_ptr_array_free (file->children, TRUE);
+  file->children = NULL;
 }
 
 void
 metafile_free (MetaFile *file)
 {
-  g_free (file->name);
-  g_list_foreach (file->children, (GFunc)metafile_free, NULL);
-  g_list_free (file->children);
+  metafile_free_children (file);
   g_list_foreach (file->data, (GFunc)metadata_free, NULL);
   g_list_free (file->data);
-  g_free (file);
+  g_slice_free (MetaFile, file);
 }
 
 MetaFile *
@@ -144,18 +224,20 @@ metafile_lookup_child (MetaFile *metafile,
 		       const char *name,
 		       gboolean create)
 {
-  GList *l;
   MetaFile *child;
+  gboolean found;
+  guint index;
+
+  index = metafile_find_child (metafile, name, &found);
+  if (found)
+    return g_ptr_array_index (metafile->children, index);
 
-  for (l = metafile->children; l != NULL; l = l->next)
-    {
-      child = l->data;
-      if (strcmp (child->name, name) == 0)
-	return child;
-    }
   child = NULL;
   if (create)
-    child = metafile_new (name, metafile);
+    {
+      child = metafile_alloc (metafile->builder, name);
+      metafile_insert_child (metafile, child, index);
+    }
   return child;
 }
 
@@ -210,6 +292,8 @@ meta_builder_remove (MetaBuilder *builder,
 		     guint64 mtime)
 {
   MetaFile *f, *parent;
+  gboolean found;
+  guint index;
 
   f = meta_builder_lookup_with_parent (builder, path, FALSE, &parent);
 
@@ -218,7 +302,14 @@ meta_builder_remove (MetaBuilder *builder,
 
   if (parent != NULL)
     {
-      parent->children = g_list_remove (parent->children, f);
+      index = metafile_find_child (parent, f->name, &found);
+      g_assert (found);
+      g_ptr_array_remove_index (parent->children, index);
+      if (parent->children->len == 0)
+	{
+	  g_ptr_array_free (parent->children, TRUE);
+	  parent->children = NULL;
+	}
       metafile_free (f);
       if (mtime)
 	parent->last_changed = mtime;
@@ -226,9 +317,7 @@ meta_builder_remove (MetaBuilder *builder,
   else
     {
       /* Removing root not allowed, just remove children */
-      g_list_foreach (f->children, (GFunc)metafile_free, NULL);
-      g_list_free (f->children);
-      f->children = NULL;
+      metafile_free_children (f);
       if (mtime)
 	f->last_changed = mtime;
     }
@@ -242,6 +331,7 @@ meta_file_copy_into (MetaFile *src,
 {
   MetaFile *src_child, *dest_child;
   GList *l;
+  guint i;
 
   if (mtime)
     dest->last_changed = mtime;
@@ -251,9 +341,12 @@ meta_file_copy_into (MetaFile *src,
   for (l = src->data; l != NULL; l = l->next)
     metadata_dup (dest, l->data);
 
-  for (l = src->children; l != NULL; l = l->next)
+  if (src->children == NULL)
+    return;
+
+  for (i = 0; i < src->children->len; i++)
     {
-      src_child = l->data;
+      src_child = g_ptr_array_index (src->children, i);
       dest_child = metafile_new (src_child->name, dest);
       meta_file_copy_into (src_child, dest_child, mtime);
     }
@@ -312,14 +405,11 @@ metadata_clear (MetaData *data)
 {
   if (data->is_list)
     {
-      g_list_foreach (data->values, (GFunc)g_free, NULL);
       g_list_free (data->values);
       data->values = NULL;
     }
   else
-    {
-      g_free (data->value);
-    }
+    data->value = NULL;
 }
 
 void
@@ -346,7 +436,7 @@ metafile_key_set_value (MetaFile *metafile,
   data = metafile_key_lookup (metafile, key, TRUE);
   metadata_clear (data);
   data->is_list = FALSE;
-  data->value = g_strdup (value);
+  data->value = g_string_chunk_insert_const (metafile->builder->strings, value);
 }
 
 void
@@ -356,14 +446,8 @@ metafile_key_list_set (MetaFile    *metafile,
   MetaData *data;
 
   data = metafile_key_lookup (metafile, key, TRUE);
-  if (!data->is_list)
-    {
-      metadata_clear (data);
-      data->is_list = TRUE;
-    }
-  g_list_foreach (data->values, (GFunc)g_free, NULL);
-  g_list_free (data->values);
-  data->values = NULL;
+  metadata_clear (data);
+  data->is_list = TRUE;
 }
 
 void
@@ -380,7 +464,9 @@ metafile_key_list_add (MetaFile *metafile,
       data->is_list = TRUE;
     }
 
-  data->values = g_list_append (data->values, g_strdup (value));
+  data->values = g_list_append (data->values,
+				g_string_chunk_insert_const (metafile->builder->strings,
+							     value));
 }
 
 static void
@@ -389,6 +475,7 @@ metafile_print (MetaFile *file, int indent, char *parent)
   GList *l, *v;
   MetaData *data;
   char *dir;
+  guint i;
 
   if (parent)
     dir = g_strconcat (parent, "/", file->name, NULL);
@@ -418,10 +505,9 @@ metafile_print (MetaFile *file, int indent, char *parent)
 	g_print ("%s", data->value);
       g_print ("\n");
     }
-  for (l = file->children; l != NULL; l = l->next)
-    {
-      metafile_print (l->data, indent, dir);
-    }
+  if (file->children)
+    for (i = 0; i < file->children->len; i++)
+      metafile_print (g_ptr_array_index (file->children, i), indent, dir);
 
   g_free (dir);
 }
@@ -492,13 +578,20 @@ append_int64 (GString *s, gint64 val)
   return s;
 }
 
+/* Gathers the key names and the mtime range in one walk, and resets
+   the pointers the writeout fills in */
 static void
-metafile_collect_times (MetaFile *file,
-			gint64 *time_t_min,
-			gint64 *time_t_max)
+metafile_collect (MetaFile *file,
+		  GHashTable *key_hash,
+		  gint64 *time_t_min,
+		  gint64 *time_t_max)
 {
   GList *l;
-  MetaFile *child;
+  MetaData *data;
+  guint i;
+
+  file->metadata_pointer = 0;
+  file->children_pointer = 0;
 
   if (*time_t_min == 0)
     *time_t_min = file->last_changed;
@@ -508,35 +601,16 @@ metafile_collect_times (MetaFile *file,
   if (file->last_changed > *time_t_max)
     *time_t_max = file->last_changed;
 
-  for (l = file->children; l != NULL; l = l->next)
-    {
-      child = l->data;
-      metafile_collect_times (child, time_t_min, time_t_max);
-    }
-}
-
-static void
-metafile_collect_keywords (MetaFile *file,
-			   GHashTable *hash)
-{
-  GList *l;
-  MetaData *data;
-  MetaFile *child;
-
-  file->metadata_pointer = 0;
-  file->children_pointer = 0;
-
   for (l = file->data; l != NULL; l = l->next)
     {
       data = l->data;
-      g_hash_table_insert (hash, data->key, GINT_TO_POINTER (1));
+      g_hash_table_insert (key_hash, data->key, GINT_TO_POINTER (1));
     }
 
-  for (l = file->children; l != NULL; l = l->next)
-    {
-      child = l->data;
-      metafile_collect_keywords (child, hash);
-    }
+  if (file->children)
+    for (i = 0; i < file->children->len; i++)
+      metafile_collect (g_ptr_array_index (file->children, i),
+			key_hash, time_t_min, time_t_max);
 }
 
 static GHashTable *
@@ -555,18 +629,10 @@ append_string (GString *out,
 
   append_uint32 (out, 0xdeaddead, &offset);
 
-  if (g_hash_table_lookup_extended (string_block,
-				    string, NULL,
-				    (gpointer *)&offsets))
-    {
-      offsets = g_list_append (offsets, GUINT_TO_POINTER (offset));
-    }
-  else
-    {
-      g_hash_table_insert (string_block,
-			   (char *)string,
-			   g_list_prepend (NULL, GUINT_TO_POINTER (offset)));
-    }
+  offsets = g_hash_table_lookup (string_block, string);
+  g_hash_table_insert (string_block,
+		       (char *)string,
+		       g_list_prepend (offsets, GUINT_TO_POINTER (offset)));
 }
 
 static void
@@ -662,22 +728,30 @@ stringv_block_end (GString *out,
     g_string_append_c (out, 0);
 }
 
+/* No mtime, children or metadata, no need for this
+   to be in the file */
+static gboolean
+metafile_is_empty (MetaFile *file)
+{
+  return
+    file->last_changed == 0 &&
+    file->children == NULL &&
+    file->data == NULL;
+}
+
 static void
 write_children (GString *out,
 		MetaBuilder *builder)
 {
   GHashTable *strings;
   MetaFile *child, *file;
-  GList *l;
-  GList *files;
+  GQueue files = G_QUEUE_INIT;
+  guint i, num_children;
 
-  files = g_list_prepend (NULL, builder->root);
+  g_queue_push_tail (&files, builder->root);
 
-  while (files != NULL)
+  while ((file = g_queue_pop_head (&files)) != NULL)
     {
-      file = files->data;
-      files = g_list_delete_link (files, files);
-
       if (file->children == NULL)
 	continue; /* No children, skip file */
 
@@ -686,17 +760,18 @@ write_children (GString *out,
       if (file->children_pointer != 0)
 	set_uint32 (out, file->children_pointer, out->len);
 
-      append_uint32 (out, g_list_length (file->children), NULL);
+      num_children = 0;
+      for (i = 0; i < file->children->len; i++)
+	if (!metafile_is_empty (g_ptr_array_index (file->children, i)))
+	  num_children++;
+
+      append_uint32 (out, num_children, NULL);
 
-      for (l = file->children; l != NULL; l = l->next)
+      for (i = 0; i < file->children->len; i++)
 	{
-	  child = l->data;
+	  child = g_ptr_array_index (file->children, i);
 
-	  /* No mtime, children or metadata, no need for this
-	     to be in the file */
-	  if (child->last_changed == 0 &&
-	      child->children == NULL &&
-	      child->data == NULL)
+	  if (metafile_is_empty (child))
 	    continue;
 
 	  append_string (out, child->name, strings);
@@ -704,8 +779,8 @@ write_children (GString *out,
 	  append_uint32 (out, 0, &child->metadata_pointer);
 	  append_time_t (out, child->last_changed, builder);
 
-	  if (file->children)
-	    files = g_list_append (files, child);
+	  if (child->children)
+	    g_queue_push_tail (&files, child);
 	}
 
       string_block_end (out, strings);
@@ -751,8 +826,8 @@ write_metadata (GString *out,
   GHashTable *strings;
   GList *stringvs;
   MetaFile *child, *file;
-  GList *l;
-  GList *files;
+  GQueue files = G_QUEUE_INIT;
+  guint i;
 
   /* Root metadata */
   if (builder->root->data != NULL)
@@ -767,28 +842,25 @@ write_metadata (GString *out,
 
   /* the rest, breadth first with all files in one
      dir sharing string block */
-  files = g_list_prepend (NULL, builder->root);
-  while (files != NULL)
+  g_queue_push_tail (&files, builder->root);
+  while ((file = g_queue_pop_head (&files)) != NULL)
     {
-      file = files->data;
-      files = g_list_delete_link (files, files);
-
       if (file->children == NULL)
 	continue; /* No children, skip file */
 
       strings = string_block_begin ();
       stringvs = stringv_block_begin ();
 
-      for (l = file->children; l != NULL; l = l->next)
+      for (i = 0; i < file->children->len; i++)
 	{
-	  child = l->data;
+	  child = g_ptr_array_index (file->children, i);
 
 	  if (child->data != NULL)
 	    write_metadata_for_file (out, child,
 				     &stringvs, strings, key_hash);
 
 	  if (child->children != NULL)
-	    files = g_list_append (files, child);
+	    g_queue_push_tail (&files, child);
 	}
 
       stringv_block_end (out, strings, stringvs);
@@ -851,8 +923,15 @@ get_journal_filename (const char *filename, guint32 random_tag)
   return g_strconcat (filename, "-", tag, ".log", NULL);
 }
 
-static gboolean
-create_new_journal (const char *filename, guint32 random_tag)
+/* Creates the journal of the tree with random_tag. It starts out with
+   the num_entries journal entries in entries, if any. */
+gboolean
+meta_builder_create_journal (const char *filename,
+			     guint32     random_tag,
+			     gsize       size,
+			     const char *entries,
+			     gsize       entries_len,
+			     guint32     num_entries)
 {
   char *journal_name;
   guint32 size_offset;
@@ -878,11 +957,14 @@ create_new_journal (const char *filename, guint32 random_tag)
 
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &size_offset);
-  append_uint32 (out, 0, NULL); /* Num entries, none so far */
+  append_uint32 (out, num_entries, NULL);
+
+  if (entries_len > 0)
+    g_string_append_len (out, entries, entries_len);
 
   pos = out->len;
 
-  g_string_set_size (out, NEW_JOURNAL_SIZE);
+  g_string_set_size (out, MAX (size, pos));
   memset (out->str + pos, 0, out->len - pos);
 
   set_uint32 (out, size_offset, out->len);
@@ -899,7 +981,7 @@ create_new_journal (const char *filename, guint32 random_tag)
 
 static GString *
 metadata_create_static (MetaBuilder *builder,
-			guint32 *random_tag_out)
+			guint32 random_tag)
 {
   GString *out;
   GHashTable *hash, *key_hash;
@@ -911,7 +993,7 @@ metadata_create_static (MetaBuilder *builder,
   guint32 attributes_pointer;
   gint64 time_t_min;
   gint64 time_t_max;
-  guint32 random_tag, root_name;
+  guint32 root_name;
 
   out = g_string_new (NULL);
 
@@ -928,15 +1010,14 @@ metadata_create_static (MetaBuilder *builder,
   g_string_append_c (out, MINOR_VERSION);
 
   append_uint32 (out, 0, NULL); /* Rotated */
-  random_tag = g_random_int ();
-  *random_tag_out = random_tag;
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &builder->root_pointer);
   append_uint32 (out, 0, &attributes_pointer);
 
+  hash = g_hash_table_new (g_str_hash, g_str_equal);
   time_t_min = 0;
   time_t_max = 0;
-  metafile_collect_times (builder->root, &time_t_min, &time_t_max);
+  metafile_collect (builder->root, hash, &time_t_min, &time_t_max);
 
   /* Store the base as the min value in use minus one so that
      0 is free to mean "not defined" */
@@ -950,9 +1031,7 @@ metadata_create_static (MetaBuilder *builder,
   builder->time_t_base = time_t_min;
   append_int64 (out, builder->time_t_base);
 
-  /* Collect and sort all used keys */
-  hash = g_hash_table_new (g_str_hash, g_str_equal);
-  metafile_collect_keywords (builder->root, hash);
+  /* Sort all used keys */
   g_hash_table_iter_init (&iter, hash);
   keys = NULL;
   while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
@@ -1005,16 +1084,19 @@ metadata_create_static (MetaBuilder *builder,
   return out;
 }
 
-gboolean
-meta_builder_write (MetaBuilder *builder,
-		    const char *filename)
+/* Writes the tree to a temporary file next to filename, to be put in
+   place with meta_builder_finish_write(). Returns the name of the
+   temporary file, or NULL on error. */
+char *
+meta_builder_start_write (MetaBuilder *builder,
+			  const char  *filename,
+			  guint32      random_tag)
 {
   GString *out;
-  guint32 random_tag;
-  int fd, fd2, fd_dir;
-  char *tmp_name, *dirname;
+  int fd;
+  char *tmp_name;
 
-  out = metadata_create_static (builder, &random_tag);
+  out = metadata_create_static (builder, random_tag);
 
   tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
   fd = g_mkstemp (tmp_name);
@@ -1022,10 +1104,29 @@ meta_builder_write (MetaBuilder *builder,
     goto out;
 
   if (!write_all_data_and_close (fd, out->str, out->len))
-    goto out;
+    {
+      g_unlink (tmp_name);
+      goto out;
+    }
 
-  if (!create_new_journal (filename, random_tag))
-    goto out;
+  g_string_free (out, TRUE);
+  return tmp_name;
+
+ out:
+  g_string_free (out, TRUE);
+  g_free (tmp_name);
+  return NULL;
+}
+
+/* Renames the tree written by meta_builder_start_write() into place
+   and rotates the old one. Its journal must exist by now. The
+   temporary file is removed on error. */
+gboolean
+meta_builder_finish_write (const char *filename,
+			   const char *tmp_name)
+{
+  int fd2, fd_dir;
+  char *dirname;
 
   /* Open old file so we can set it rotated */
   fd2 = open (filename, O_RDWR);
@@ -1033,7 +1134,8 @@ meta_builder_write (MetaBuilder *builder,
     {
       if (fd2 != -1)
 	close (fd2);
-      goto out;
+      g_unlink (tmp_name);
+      return FALSE;
     }
 
   /* Sync the directory to make sure that the entry in the directory containing
@@ -1069,14 +1171,33 @@ meta_builder_write (MetaBuilder *builder,
 	}
     }
 
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
   return TRUE;
+}
 
- out:
-  if (fd != -1)
-    g_unlink (tmp_name);
-  g_string_free (out, TRUE);
+gboolean
+meta_builder_write (MetaBuilder *builder,
+		    const char *filename)
+{
+  guint32 random_tag;
+  char *tmp_name;
+  gboolean res;
+
+  random_tag = g_random_int ();
+
+  tmp_name = meta_builder_start_write (builder, filename, random_tag);
+  if (tmp_name == NULL)
+    return FALSE;
+
+  if (!meta_builder_create_journal (filename, random_tag,
+				    META_JOURNAL_DEFAULT_SIZE, NULL, 0, 0))
+    {
+      g_unlink (tmp_name);
+      g_free (tmp_name);
+      return FALSE;
+    }
+
+  res = meta_builder_finish_write (filename, tmp_name);
   g_free (tmp_name);
-  return FALSE;
+
+  return res;
 }
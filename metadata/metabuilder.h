@@ -25,20 +25,24 @@
 
 #include <glib.h>
 
+#define META_JOURNAL_DEFAULT_SIZE (32*1024)
+
 typedef struct _MetaBuilder MetaBuilder;
 typedef struct _MetaFile MetaFile;
 typedef struct _MetaData MetaData;
 
 struct _MetaBuilder {
   MetaFile *root;
+  GStringChunk *strings;
 
   guint32 root_pointer;
   gint64 time_t_base;
 };
 
 struct _MetaFile {
+  MetaBuilder *builder;
   char *name;
-  GList *children;
+  GPtrArray *children; /* sorted by name, NULL if none */
   gint64 last_changed;
   GList *data;
 
@@ -68,6 +72,17 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     guint64      mtime);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+char *       meta_builder_start_write    (MetaBuilder *builder,
+					  const char  *filename,
+					  guint32      random_tag);
+gboolean     meta_builder_create_journal (const char  *filename,
+					  guint32      random_tag,
+					  gsize        size,
+					  const char  *entries,
+					  gsize        entries_len,
+					  guint32      num_entries);
+gboolean     meta_builder_finish_write   (const char  *filename,
+					  const char  *tmp_name);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
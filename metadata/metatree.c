@@ -68,7 +68,11 @@
 
 #define KEY_IS_LIST_MASK (1<<31)
 
-static GRWLock metatree_lock;
+/* The journal size adapts to how fast it fills up */
+#define JOURNAL_MIN_SIZE META_JOURNAL_DEFAULT_SIZE
+#define JOURNAL_MAX_SIZE (1024*1024)
+#define JOURNAL_FAST_FILL (60 * G_USEC_PER_SEC)
+#define JOURNAL_SLOW_FILL (10 * 60 * G_USEC_PER_SEC)
 
 typedef enum {
   JOURNAL_OP_SET_KEY,
@@ -145,6 +149,11 @@ typedef struct {
   MetaJournalEntry *last_entry;
 
   gboolean journal_valid; /* True if all entries validated on open */
+
+  /* Index of the validated entries, as offsets into data in journal order */
+  GHashTable *key_entries;   /* path -> set/setv/unset entries on path */
+  GHashTable *child_entries; /* dir -> set/setv/unset entries below dir */
+  GArray *path_entries;      /* all copy/remove entries */
 } MetaJournal;
 
 struct _MetaTree {
@@ -153,6 +162,11 @@ struct _MetaTree {
   gboolean for_write;
   gboolean on_nfs;
 
+  /* Guards everything below, so unrelated trees don't block each other */
+  GRWLock lock;
+  volatile guint read_contended;
+  volatile guint write_contended;
+
   int fd;
   char *data;
   gsize len;
@@ -167,6 +181,21 @@ struct _MetaTree {
   char **attributes;
 
   MetaJournal *journal;
+
+  /* Background compaction: compact_thread rewrites the tree with the
+     journal entries up to compact_end. New entries still go to the
+     journal meanwhile, the ones after compact_end are copied to the
+     journal of the new tree before it is renamed into place. */
+  GThread *compact_thread;
+  volatile gint compact_done;
+  guint32 compact_tag;
+  MetaJournal *compact_source;
+  MetaJournalEntry *compact_end;
+  guint compact_num_entries;
+  gboolean compact_failed; /* Don't retry until the journal is full */
+
+  gsize journal_size;
+  gint64 journal_started;
 };
 
 static void         meta_tree_refresh_locked   (MetaTree    *tree);
@@ -176,6 +205,28 @@ static MetaJournal *meta_journal_open          (MetaTree    *tree,
 						guint32      tag);
 static void         meta_journal_free          (MetaJournal *journal);
 static void         meta_journal_validate_more (MetaJournal *journal);
+static gboolean     meta_tree_finish_compaction_locked (MetaTree *tree);
+static void         meta_tree_drop_compaction_locked   (MetaTree *tree);
+
+static void
+meta_tree_read_lock (MetaTree *tree)
+{
+  if (!g_rw_lock_reader_trylock (&tree->lock))
+    {
+      g_atomic_int_inc ((int *)&tree->read_contended);
+      g_rw_lock_reader_lock (&tree->lock);
+    }
+}
+
+static void
+meta_tree_write_lock (MetaTree *tree)
+{
+  if (!g_rw_lock_writer_trylock (&tree->lock))
+    {
+      g_atomic_int_inc ((int *)&tree->write_contended);
+      g_rw_lock_writer_lock (&tree->lock);
+    }
+}
 
 static gpointer
 verify_block_pointer (MetaTree *tree, guint32 pos, guint32 len)
@@ -530,6 +581,8 @@ meta_tree_open (const char *filename,
   tree->filename = g_strdup (filename);
   tree->for_write = for_write;
   tree->fd = -1;
+  tree->journal_started = g_get_monotonic_time ();
+  g_rw_lock_init (&tree->lock);
 
   meta_tree_init (tree);
 
@@ -548,6 +601,16 @@ meta_tree_exists (MetaTree *tree)
   return tree->fd != -1;
 }
 
+/* Number of times a reader or writer had to wait for the lock */
+void
+meta_tree_get_lock_contention (MetaTree *tree,
+			       guint    *read_waits,
+			       guint    *write_waits)
+{
+  *read_waits = g_atomic_int_get ((int *)&tree->read_contended);
+  *write_waits = g_atomic_int_get ((int *)&tree->write_contended);
+}
+
 static GHashTable *cached_trees = NULL;
 G_LOCK_DEFINE_STATIC (cached_trees);
 
@@ -603,7 +666,9 @@ meta_tree_unref (MetaTree *tree)
   is_zero = g_atomic_int_dec_and_test ((int *)&tree->ref_count);
   if (is_zero)
     {
+      meta_tree_finish_compaction_locked (tree);
       meta_tree_clear (tree);
+      g_rw_lock_clear (&tree->lock);
       g_free (tree->filename);
       g_free (tree);
     }
@@ -659,9 +724,11 @@ meta_tree_refresh_locked (MetaTree *tree)
   /* Needs to recheck since we dropped read lock */
   if (meta_tree_needs_rereading (tree))
     {
+      meta_tree_drop_compaction_locked (tree);
       if (tree->header)
 	meta_tree_clear (tree);
       meta_tree_init (tree);
+      tree->compact_failed = FALSE;
     }
   else if (meta_tree_has_new_journal_entries (tree))
     meta_journal_validate_more (tree->journal);
@@ -672,17 +739,20 @@ meta_tree_refresh (MetaTree *tree)
 {
   gboolean needs_refresh;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
   needs_refresh =
     meta_tree_needs_rereading (tree) ||
-    meta_tree_has_new_journal_entries (tree);
-  g_rw_lock_reader_unlock (&metatree_lock);
+    meta_tree_has_new_journal_entries (tree) ||
+    g_atomic_int_get (&tree->compact_done);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   if (needs_refresh)
     {
-      g_rw_lock_writer_lock (&metatree_lock);
+      meta_tree_write_lock (tree);
+      if (g_atomic_int_get (&tree->compact_done))
+	meta_tree_finish_compaction_locked (tree);
       meta_tree_refresh_locked (tree);
-      g_rw_lock_writer_unlock (&metatree_lock);
+      g_rw_lock_writer_unlock (&tree->lock);
     }
 }
 
@@ -861,6 +931,9 @@ get_journal_filename (const char *filename, guint32 random_tag)
 static void
 meta_journal_free (MetaJournal *journal)
 {
+  g_hash_table_destroy (journal->key_entries);
+  g_hash_table_destroy (journal->child_entries);
+  g_array_free (journal->path_entries, TRUE);
   g_free (journal->filename);
   munmap(journal->data, journal->len);
   close (journal->fd);
@@ -914,6 +987,76 @@ verify_journal_entry (MetaJournal *journal,
   return (MetaJournalEntry *)(journal->data + offset + entry_len);
 }
 
+static gboolean journal_entry_is_key_type  (MetaJournalEntry *entry);
+static gboolean journal_entry_is_path_type (MetaJournalEntry *entry);
+
+static void
+journal_index_append (GHashTable *index,
+		      const char *path,
+		      gboolean    copy_path,
+		      guint32     offset)
+{
+  GArray *entries;
+
+  entries = g_hash_table_lookup (index, path);
+  if (entries == NULL)
+    {
+      entries = g_array_new (FALSE, FALSE, sizeof (guint32));
+      g_hash_table_insert (index,
+			   copy_path ? g_strdup (path) : (char *)path,
+			   entries);
+    }
+  g_array_append_val (entries, offset);
+}
+
+/* Adds the entry to every dir it is a child of, keyed on the dir
+   path without trailing slashes, which is what get_prefix_match()
+   compares against */
+static void
+journal_index_children (MetaJournal *journal,
+			const char *path,
+			guint32 offset)
+{
+  const char *p;
+  char *dir;
+
+  for (p = path; *p != 0; p++)
+    {
+      if (*p != '/' ||
+	  (p > path && *(p - 1) == '/'))
+	continue;
+
+      /* Only true children, i.e. not the path with a trailing slash */
+      if (p[strspn (p, "/")] == 0)
+	break;
+
+      dir = g_strndup (path, p - path);
+      journal_index_append (journal->child_entries, dir, TRUE, offset);
+      g_free (dir);
+    }
+}
+
+static void
+meta_journal_index_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry)
+{
+  guint32 offset;
+
+  offset = (char *)entry - journal->data;
+
+  /* The path lives in the mmap:ed journal as long as the index does */
+  if (journal_entry_is_key_type (entry))
+    {
+      journal_index_append (journal->key_entries, &entry->path[0],
+			    FALSE, offset);
+      journal_index_children (journal, &entry->path[0], offset);
+    }
+  else if (journal_entry_is_path_type (entry))
+    g_array_append_val (journal->path_entries, offset);
+  else
+    g_warning ("Unknown journal entry type %d\n", entry->entry_type);
+}
+
 /* Try to validate more entries, call with writer lock */
 static void
 meta_journal_validate_more (MetaJournal *journal)
@@ -939,6 +1082,7 @@ meta_journal_validate_more (MetaJournal *journal)
 	  break;
 	}
 
+      meta_journal_index_entry (journal, entry);
       entry = next_entry;
       i++;
     }
@@ -1108,8 +1252,9 @@ meta_journal_entry_new_unset (guint64 mtime,
 
 /* Call with writer lock held */
 static gboolean
-meta_journal_add_entry (MetaJournal *journal,
-			GString *entry)
+meta_journal_add_entries (MetaJournal *journal,
+			  GString *entries,
+			  guint num_entries)
 {
   char *ptr;
   guint32 offset;
@@ -1119,13 +1264,14 @@ meta_journal_add_entry (MetaJournal *journal,
   ptr = (char *)journal->last_entry;
   offset =  ptr - journal->data;
 
-  /* Does the entry fit? */
-  if (entry->len > journal->len - offset)
+  /* Do the entries fit? */
+  if (entries->len > journal->len - offset)
     return FALSE;
 
-  memcpy (ptr, entry->str, entry->len);
+  memcpy (ptr, entries->str, entries->len);
 
-  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + 1);
+  /* Readers only see the entries once they are all counted */
+  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + num_entries);
   meta_journal_validate_more (journal);
   g_assert (journal->journal_valid);
 
@@ -1182,6 +1328,13 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
   journal->first_entry = (MetaJournalEntry *)(data + sizeof (MetaJournalHeader));
   journal->last_entry = journal->first_entry;
   journal->last_entry_num = 0;
+  journal->key_entries =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   NULL, (GDestroyNotify)g_array_unref);
+  journal->child_entries =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   g_free, (GDestroyNotify)g_array_unref);
+  journal->path_entries = g_array_new (FALSE, FALSE, sizeof (guint32));
 
   if (memcmp (journal->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
     goto err;
@@ -1275,15 +1428,72 @@ typedef gboolean (*journal_path_callback) (MetaJournal *journal,
 					   char **iter_path,
 					   gpointer user_data);
 
+typedef enum {
+  JOURNAL_KEYS_AT_PATH,   /* key entries on the iterated path itself */
+  JOURNAL_KEYS_BELOW_PATH /* key entries on true children of it */
+} JournalKeyScope;
+
+static GArray *
+meta_journal_lookup_keys (MetaJournal *journal,
+			  const char *path,
+			  JournalKeyScope key_scope)
+{
+  GArray *entries;
+  gsize len;
+  char *dir;
+
+  if (key_scope == JOURNAL_KEYS_AT_PATH)
+    return g_hash_table_lookup (journal->key_entries, path);
+
+  len = strlen (path);
+  while (len > 0 && path[len-1] == '/')
+    len--;
+
+  if (path[len] == 0)
+    return g_hash_table_lookup (journal->child_entries, path);
+
+  dir = g_strndup (path, len);
+  entries = g_hash_table_lookup (journal->child_entries, dir);
+  g_free (dir);
+  return entries;
+}
+
+/* Returns the number of entries older than offset */
+static guint
+journal_entries_before (GArray *entries,
+			guint32 offset)
+{
+  guint low, high, mid;
+
+  low = 0;
+  high = entries->len;
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      if (g_array_index (entries, guint32, mid) < offset)
+	low = mid + 1;
+      else
+	high = mid;
+    }
+  return low;
+}
+
+/* Calls the callbacks on the entries that may affect path, newest
+   first. Rather than scanning the whole journal, this merges the
+   indexed key entries for the current path with the copy/remove
+   entries, and switches key chain when a copy changes the path. */
 static char *
 meta_journal_iterate (MetaJournal *journal,
 		      const char *path,
+		      JournalKeyScope key_scope,
 		      journal_key_callback key_callback,
 		      journal_path_callback path_callback,
 		      gpointer user_data)
 {
   MetaJournalEntry *entry;
-  guint32 *sizep;
+  GArray *keys, *paths;
+  guint key_i, path_i;
+  guint32 key_offset, path_offset;
   char *journal_path, *journal_key, *source_path;
   char *path_copy, *value;
   gboolean res;
@@ -1294,22 +1504,32 @@ meta_journal_iterate (MetaJournal *journal,
   if (journal == NULL)
     return path_copy;
 
-  entry = journal->last_entry;
-  while (entry > journal->first_entry)
-    {
-      sizep = (guint32 *)entry;
-      entry = (MetaJournalEntry *)((char *)entry - GUINT32_FROM_BE (*(sizep-1)));
+  keys = NULL;
+  if (key_callback)
+    keys = meta_journal_lookup_keys (journal, path_copy, key_scope);
+  key_i = keys ? keys->len : 0;
 
-      mtime = GUINT64_FROM_BE (entry->mtime);
-      journal_path = &entry->path[0];
+  paths = journal->path_entries;
+  path_i = path_callback ? paths->len : 0;
+
+  while (key_i > 0 || path_i > 0)
+    {
+      key_offset = 0;
+      if (key_i > 0)
+	key_offset = g_array_index (keys, guint32, key_i - 1);
+      path_offset = 0;
+      if (path_i > 0)
+	path_offset = g_array_index (paths, guint32, path_i - 1);
 
-      if (journal_entry_is_key_type (entry) &&
-	  key_callback) /* set, setv or unset */
+      if (key_offset > path_offset) /* set, setv or unset */
 	{
+	  key_i--;
+	  entry = (MetaJournalEntry *)(journal->data + key_offset);
+	  mtime = GUINT64_FROM_BE (entry->mtime);
+	  journal_path = &entry->path[0];
 	  journal_key = get_next_arg (journal_path);
 	  value = get_next_arg (journal_key);
 
-	  /* Only affects is path is exactly the same */
 	  res = key_callback (journal, entry->entry_type,
 			      journal_path, mtime, journal_key,
 			      value,
@@ -1320,9 +1540,13 @@ meta_journal_iterate (MetaJournal *journal,
 	      return NULL;
 	    }
 	}
-      else if (journal_entry_is_path_type (entry) &&
-	       path_callback) /* copy or remove */
+      else /* copy or remove */
 	{
+	  path_i--;
+	  entry = (MetaJournalEntry *)(journal->data + path_offset);
+	  mtime = GUINT64_FROM_BE (entry->mtime);
+	  journal_path = &entry->path[0];
+
 	  source_path = NULL;
 	  if (entry->entry_type == JOURNAL_OP_COPY_PATH)
 	    source_path = get_next_arg (journal_path);
@@ -1335,9 +1559,15 @@ meta_journal_iterate (MetaJournal *journal,
 	      g_free (path_copy);
 	      return NULL;
 	    }
+
+	  /* A copy may have changed the path, continue on the key
+	     entries of the new path that are older than the copy */
+	  if (source_path != NULL && key_callback)
+	    {
+	      keys = meta_journal_lookup_keys (journal, path_copy, key_scope);
+	      key_i = keys ? journal_entries_before (keys, path_offset) : 0;
+	    }
 	}
-      else
-	g_warning ("Unknown journal entry type %d\n", entry->entry_type);
     }
 
   return path_copy;
@@ -1434,19 +1664,20 @@ journal_iter_path (MetaJournal *journal,
 }
 
 static char *
-meta_journal_reverse_map_path_and_key (MetaJournal *journal,
-				       const char *path,
-				       const char *key,
-				       MetaKeyType *type,
-				       guint64 *mtime,
-				       gpointer *value)
+meta_tree_reverse_map_path_and_key (MetaTree *tree,
+				    const char *path,
+				    const char *key,
+				    MetaKeyType *type,
+				    guint64 *mtime,
+				    gpointer *value)
 {
   PathKeyData data = {NULL};
   char *res_path;
 
   data.key = key;
-  res_path = meta_journal_iterate (journal,
+  res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   JOURNAL_KEYS_AT_PATH,
 				   journal_iter_key,
 				   journal_iter_path,
 				   &data);
@@ -1468,12 +1699,12 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
   MetaKeyType type;
   gpointer value;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
-						    path,
-						    key,
-						    &type, NULL, &value);
+  new_path = meta_tree_reverse_map_path_and_key (tree,
+						 path,
+						 key,
+						 &type, NULL, &value);
   if (new_path == NULL)
     goto out; /* type is set */
 
@@ -1492,7 +1723,7 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
     type = META_KEY_TYPE_STRING;
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
   return type;
 }
 
@@ -1506,12 +1737,12 @@ meta_tree_get_last_changed (MetaTree *tree,
   gpointer value;
   guint64 res, mtime;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
-						    path,
-						    NULL,
-						    &type, &mtime, &value);
+  new_path = meta_tree_reverse_map_path_and_key (tree,
+						 path,
+						 NULL,
+						 &type, &mtime, &value);
   if (new_path == NULL)
     {
       res = mtime;
@@ -1526,7 +1757,7 @@ meta_tree_get_last_changed (MetaTree *tree,
   g_free (new_path);
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1543,12 +1774,12 @@ meta_tree_lookup_string (MetaTree   *tree,
   char *new_path;
   char *res;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
-						    path,
-						    key,
-						    &type, NULL, &value);
+  new_path = meta_tree_reverse_map_path_and_key (tree,
+						 path,
+						 key,
+						 &type, NULL, &value);
   if (new_path == NULL)
     {
       res = NULL;
@@ -1572,7 +1803,7 @@ meta_tree_lookup_string (MetaTree   *tree,
     res = g_strdup (verify_string (tree, ent->value));
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1621,12 +1852,12 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
   char **res;
   guint32 num_strings, i;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
-						    path,
-						    key,
-						    &type, NULL, &value);
+  new_path = meta_tree_reverse_map_path_and_key (tree,
+						 path,
+						 key,
+						 &type, NULL, &value);
   if (new_path == NULL)
     {
       res = NULL;
@@ -1658,7 +1889,7 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
     }
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1876,7 +2107,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
   MetaFileDir *dir;
   char *res_path;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
   data.children = children =
     g_hash_table_new_full (g_str_hash,
@@ -1887,6 +2118,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   JOURNAL_KEYS_BELOW_PATH,
 				   enum_dir_iter_key,
 				   enum_dir_iter_path,
 				   &data);
@@ -1922,7 +2154,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (children);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 }
 
 typedef struct {
@@ -2116,7 +2348,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
   GHashTableIter iter;
   char *res_path;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  meta_tree_read_lock (tree);
 
   keydata.keys = keys =
     g_hash_table_new_full (g_str_hash,
@@ -2127,6 +2359,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   JOURNAL_KEYS_AT_PATH,
 				   enum_keys_iter_key,
 				   enum_keys_iter_path,
 				   &keydata);
@@ -2170,7 +2403,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (keys);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 }
 
 
@@ -2265,11 +2498,12 @@ copy_tree_to_builder (MetaTree *tree,
     }
 }
 
+/* Applies the entries of journal before end */
 static void
-apply_journal_to_builder (MetaTree *tree,
+apply_journal_to_builder (MetaJournal *journal,
+			  MetaJournalEntry *end,
 			  MetaBuilder *builder)
 {
-  MetaJournal *journal;
   MetaJournalEntry *entry;
   guint32 *sizep;
   guint64 mtime;
@@ -2279,10 +2513,8 @@ apply_journal_to_builder (MetaTree *tree,
   MetaFile *file;
   int i;
 
-  journal = tree->journal;
-
   entry = journal->first_entry;
-  while (entry < journal->last_entry)
+  while (entry < end)
     {
       mtime = GUINT64_FROM_BE (entry->mtime);
       journal_path = &entry->path[0];
@@ -2344,7 +2576,7 @@ apply_journal_to_builder (MetaTree *tree,
 
 /* Needs write lock */
 static gboolean
-meta_tree_flush_locked (MetaTree *tree)
+meta_tree_flush_sync_locked (MetaTree *tree)
 {
   MetaBuilder *builder;
   gboolean res;
@@ -2354,7 +2586,7 @@ meta_tree_flush_locked (MetaTree *tree)
   copy_tree_to_builder (tree, tree->root, builder->root);
 
   if (tree->journal)
-    apply_journal_to_builder (tree, builder);
+    apply_journal_to_builder (tree->journal, tree->journal->last_entry, builder);
 
   res = meta_builder_write (builder,
 			    meta_tree_get_filename (tree));
@@ -2366,17 +2598,255 @@ meta_tree_flush_locked (MetaTree *tree)
   return res;
 }
 
+/* Runs without the lock. Nothing unmaps the tree or its journal
+   while this reads them: they are only replaced once the new tree
+   is renamed into place by meta_tree_compaction_done_locked(), and
+   both rereading the tree and the last unref join this thread
+   first. Entries are only appended
+   to the journal after compact_end meanwhile.
+   Returns the name of the temporary file the tree was written to. */
+static gpointer
+meta_tree_compact_thread (gpointer data)
+{
+  MetaTree *tree = data;
+  MetaBuilder *builder;
+  char *tmp_name;
+
+  builder = meta_builder_new ();
+
+  copy_tree_to_builder (tree, tree->root, builder->root);
+  apply_journal_to_builder (tree->compact_source, tree->compact_end, builder);
+
+  tmp_name = meta_builder_start_write (builder,
+				       tree->filename,
+				       tree->compact_tag);
+  meta_builder_free (builder);
+
+  g_atomic_int_set (&tree->compact_done, TRUE);
+
+  return tmp_name;
+}
+
+/* Needs write lock, or the last ref. Puts the tree written by the
+   compaction thread into place. The journal entries added since it
+   started go to the journal of the new tree first, so none of them
+   are lost and readers keep seeing them. If anything fails, the old
+   tree and its journal still hold everything. */
+static gboolean
+meta_tree_compaction_done_locked (MetaTree *tree,
+				  char *tmp_name)
+{
+  MetaJournal *journal;
+  char *journal_filename;
+  gsize tail_len;
+  gboolean res;
+
+  tree->compact_thread = NULL;
+  g_atomic_int_set (&tree->compact_done, FALSE);
+  tree->compact_failed = TRUE;
+
+  journal = tree->compact_source;
+  tree->compact_source = NULL;
+
+  if (tmp_name == NULL)
+    return FALSE;
+
+  if (journal == NULL)
+    {
+      /* The tree is being reread, the rewrite is stale */
+      g_unlink (tmp_name);
+      g_free (tmp_name);
+      return FALSE;
+    }
+
+  tail_len = (char *)journal->last_entry - (char *)tree->compact_end;
+
+  res = FALSE;
+  if (meta_builder_create_journal (tree->filename, tree->compact_tag,
+				   tree->journal_size + tail_len,
+				   (char *)tree->compact_end, tail_len,
+				   journal->last_entry_num - tree->compact_num_entries))
+    {
+      res = meta_builder_finish_write (tree->filename, tmp_name);
+      if (!res)
+	{
+	  journal_filename = get_journal_filename (tree->filename,
+						   tree->compact_tag);
+	  g_unlink (journal_filename);
+	  g_free (journal_filename);
+	}
+    }
+  else
+    g_unlink (tmp_name);
+  g_free (tmp_name);
+
+  /* Switches to the new tree and its journal */
+  if (res)
+    meta_tree_refresh_locked (tree);
+
+  return res;
+}
+
+/* Needs write lock. Waits for a running compaction and throws away
+   what it wrote, for when the tree it read is about to be unmapped. */
+static void
+meta_tree_drop_compaction_locked (MetaTree *tree)
+{
+  gpointer res;
+
+  if (tree->compact_thread == NULL)
+    return;
+
+  res = g_thread_join (tree->compact_thread);
+  /* Makes meta_tree_compaction_done_locked() see it as stale */
+  tree->compact_source = NULL;
+  meta_tree_compaction_done_locked (tree, res);
+}
+
+/* Needs write lock, or the last ref. Returns whether a compaction
+   ran and its tree is now in place. */
+static gboolean
+meta_tree_finish_compaction_locked (MetaTree *tree)
+{
+  gpointer res;
+
+  if (tree->compact_thread == NULL)
+    return FALSE;
+
+  res = g_thread_join (tree->compact_thread);
+  return meta_tree_compaction_done_locked (tree, res);
+}
+
+static gsize
+meta_tree_next_journal_size (MetaTree *tree,
+			     gboolean journal_full,
+			     gint64 now)
+{
+  gsize size;
+
+  size = tree->journal_size;
+  if (size == 0)
+    size = MAX (tree->journal->len, JOURNAL_MIN_SIZE);
+
+  /* Grow the journal when it fills up quickly, so that busy trees
+     are rewritten less often, and shrink it back when idle */
+  if (journal_full)
+    {
+      if (now - tree->journal_started < JOURNAL_FAST_FILL)
+	size = MIN (size * 2, JOURNAL_MAX_SIZE);
+      else if (now - tree->journal_started > JOURNAL_SLOW_FILL)
+	size = MAX (size / 2, JOURNAL_MIN_SIZE);
+    }
+
+  return size;
+}
+
+/* Needs write lock. Starts rewriting the tree with its journal on a
+   thread, while writes continue to go to the journal. Returns FALSE
+   if the rewrite could not be done. */
+static gboolean
+meta_tree_start_compaction_locked (MetaTree *tree,
+				   gboolean journal_full)
+{
+  gint64 now;
+  guint32 tag;
+
+  if (tree->compact_thread != NULL)
+    return TRUE;
+
+  if (tree->journal == NULL ||
+      !tree->journal->journal_valid)
+    return FALSE;
+
+  if (tree->journal->last_entry_num == 0)
+    return TRUE; /* Nothing to compact */
+
+  now = g_get_monotonic_time ();
+  tree->journal_size = meta_tree_next_journal_size (tree, journal_full, now);
+  tree->journal_started = now;
+
+  do
+    tag = g_random_int ();
+  while (tag == tree->tag);
+
+  tree->compact_tag = tag;
+  tree->compact_source = tree->journal;
+  tree->compact_end = tree->journal->last_entry;
+  tree->compact_num_entries = tree->journal->last_entry_num;
+
+  tree->compact_thread = g_thread_try_new ("metadata compaction",
+					   meta_tree_compact_thread,
+					   tree, NULL);
+  if (tree->compact_thread == NULL)
+    return meta_tree_compaction_done_locked (tree,
+					     meta_tree_compact_thread (tree));
+
+  return TRUE;
+}
+
+/* Needs write lock. Makes room for more journal entries. */
+static gboolean
+meta_tree_flush_locked (MetaTree *tree)
+{
+  /* A running rewrite has room for the entries made meanwhile in
+     the journal of the new tree */
+  if (meta_tree_finish_compaction_locked (tree))
+    return TRUE;
+
+  return meta_tree_flush_sync_locked (tree);
+}
+
+/* Needs write lock */
+static gboolean
+meta_tree_add_journal_entries_locked (MetaTree *tree,
+				      GString *entries,
+				      guint num_entries)
+{
+  MetaJournal *journal;
+
+  if (g_atomic_int_get (&tree->compact_done))
+    meta_tree_finish_compaction_locked (tree);
+
+  journal = tree->journal;
+  if (!meta_journal_add_entries (journal, entries, num_entries))
+    return FALSE;
+
+  /* Rewrite the tree in the background once the journal is half
+     full, so that it is usually done before the journal fills up */
+  if (tree->compact_thread == NULL &&
+      !tree->compact_failed &&
+      (gsize) ((char *)journal->last_entry - journal->data) > journal->len / 2)
+    meta_tree_start_compaction_locked (tree, TRUE);
+
+  return TRUE;
+}
+
 gboolean
 meta_tree_flush (MetaTree *tree)
 {
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
-  res = meta_tree_flush_locked (tree);
-  g_rw_lock_writer_unlock (&metatree_lock);
+  meta_tree_write_lock (tree);
+  meta_tree_finish_compaction_locked (tree);
+  res = meta_tree_flush_sync_locked (tree);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
+/* Like meta_tree_flush(), but rewrites the tree in the background,
+   without blocking readers and writers meanwhile */
+void
+meta_tree_flush_in_background (MetaTree *tree)
+{
+  meta_tree_write_lock (tree);
+  if (g_atomic_int_get (&tree->compact_done))
+    meta_tree_finish_compaction_locked (tree);
+
+  if (!meta_tree_start_compaction_locked (tree, FALSE))
+    meta_tree_flush_sync_locked (tree);
+  g_rw_lock_writer_unlock (&tree->lock);
+}
+
 gboolean
 meta_tree_unset (MetaTree                         *tree,
 		 const char                       *path,
@@ -2386,7 +2856,7 @@ meta_tree_unset (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_write_lock (tree);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2401,7 +2871,7 @@ meta_tree_unset (MetaTree                         *tree,
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
     {
       if (meta_tree_flush_locked (tree))
 	goto retry;
@@ -2412,7 +2882,7 @@ meta_tree_unset (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2426,7 +2896,7 @@ meta_tree_set_string (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_write_lock (tree);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2441,7 +2911,7 @@ meta_tree_set_string (MetaTree                         *tree,
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
     {
       if (meta_tree_flush_locked (tree))
 	goto retry;
@@ -2452,7 +2922,7 @@ meta_tree_set_string (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2466,7 +2936,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_write_lock (tree);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2481,7 +2951,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
     {
       if (meta_tree_flush_locked (tree))
 	goto retry;
@@ -2492,7 +2962,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2504,7 +2974,7 @@ meta_tree_remove (MetaTree *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_write_lock (tree);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2519,7 +2989,7 @@ meta_tree_remove (MetaTree *tree,
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
     {
       if (meta_tree_flush_locked (tree))
 	goto retry;
@@ -2530,7 +3000,7 @@ meta_tree_remove (MetaTree *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2543,7 +3013,7 @@ meta_tree_copy (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_write_lock (tree);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2558,7 +3028,7 @@ meta_tree_copy (MetaTree                         *tree,
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
     {
       if (meta_tree_flush_locked (tree))
 	goto retry;
@@ -2569,7 +3039,138 @@ meta_tree_copy (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
+  return res;
+}
+
+struct _MetaTreeBatch {
+  guint64 mtime;
+  GString *entries;
+  guint num_entries;
+};
+
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
+
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->mtime = time (NULL);
+  batch->entries = g_string_new (NULL);
+
+  return batch;
+}
+
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
+{
+  g_string_free (batch->entries, TRUE);
+  g_free (batch);
+}
+
+static void
+meta_tree_batch_append (MetaTreeBatch *batch,
+			GString *entry)
+{
+  g_string_append_len (batch->entries, entry->str, entry->len);
+  batch->num_entries++;
+  g_string_free (entry, TRUE);
+}
+
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char *path,
+			    const char *key,
+			    const char *value)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_set (batch->mtime, path,
+						      key, value));
+}
+
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char *path,
+			     const char *key,
+			     char **value)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_setv (batch->mtime, path,
+						       key, value));
+}
+
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char *path,
+		       const char *key)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_unset (batch->mtime, path,
+							key));
+}
+
+/* Needs write lock. For batches that don't fit in an empty journal. */
+static gboolean
+meta_tree_apply_batch_piecewise_locked (MetaTree *tree,
+					MetaTreeBatch *batch)
+{
+  GString *entry;
+  guint32 offset, len;
+  gboolean res;
+
+  res = TRUE;
+  offset = 0;
+  while (res && offset < batch->entries->len)
+    {
+      len = GUINT32_FROM_BE (*(guint32 *)(batch->entries->str + offset));
+      entry = g_string_new_len (batch->entries->str + offset, len);
+
+      if (!meta_tree_add_journal_entries_locked (tree, entry, 1))
+	res =
+	  meta_tree_flush_locked (tree) &&
+	  meta_tree_add_journal_entries_locked (tree, entry, 1);
+
+      g_string_free (entry, TRUE);
+      offset += len;
+    }
+
+  return res;
+}
+
+/* Adds all the changes in the batch with a single journal update, so
+   readers see either none or all of them */
+gboolean
+meta_tree_apply_batch (MetaTree *tree,
+		       MetaTreeBatch *batch)
+{
+  gboolean res;
+
+  if (batch->num_entries == 0)
+    return TRUE;
+
+  meta_tree_write_lock (tree);
+
+  if (tree->journal == NULL ||
+      !tree->journal->journal_valid)
+    {
+      res = FALSE;
+      goto out;
+    }
+
+  res = TRUE;
+  if (!meta_tree_add_journal_entries_locked (tree, batch->entries,
+					     batch->num_entries))
+    {
+      if (meta_tree_flush_locked (tree) &&
+	  meta_tree_add_journal_entries_locked (tree, batch->entries,
+						batch->num_entries))
+	goto out;
+
+      res = meta_tree_apply_batch_piecewise_locked (tree, batch);
+    }
+
+ out:
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
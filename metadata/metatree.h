@@ -27,6 +27,7 @@
 
 typedef struct _MetaTree MetaTree;
 typedef struct _MetaLookupCache MetaLookupCache;
+typedef struct _MetaTreeBatch MetaTreeBatch;
 
 typedef enum {
   META_KEY_TYPE_NONE,
@@ -34,8 +35,8 @@ typedef enum {
   META_KEY_TYPE_STRINGV
 } MetaKeyType;
 
-/* Note: These are called with the read-lock held, so
-   don't call any MetaTree operations */
+/* Note: These are called with the read-lock of the tree held, so
+   don't call any operations on the same tree */
 typedef gboolean (*meta_tree_dir_enumerate_callback) (const char *entry,
 						      guint64 last_changed,
 						      gboolean has_children,
@@ -66,6 +67,9 @@ void        meta_tree_unref          (MetaTree   *tree);
 void        meta_tree_refresh        (MetaTree   *tree);
 const char *meta_tree_get_filename   (MetaTree   *tree);
 gboolean    meta_tree_exists         (MetaTree   *tree);
+void        meta_tree_get_lock_contention (MetaTree *tree,
+					   guint    *read_waits,
+					   guint    *write_waits);
 
 MetaKeyType meta_tree_lookup_key_type  (MetaTree                         *tree,
 					const char                       *path,
@@ -87,6 +91,7 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+void        meta_tree_flush_in_background (MetaTree                      *tree);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -103,4 +108,22 @@ gboolean    meta_tree_remove           (MetaTree                         *tree,
 gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
+
+/* Changes applied to a tree as a single journal update */
+MetaTreeBatch *meta_tree_batch_new         (void);
+void           meta_tree_batch_free        (MetaTreeBatch *batch);
+void           meta_tree_batch_set_string  (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    const char    *value);
+void           meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    char         **value);
+void           meta_tree_batch_unset       (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key);
+gboolean       meta_tree_apply_batch       (MetaTree      *tree,
+					    MetaTreeBatch *batch);
+
 #endif /* __META_TREE_H__ */
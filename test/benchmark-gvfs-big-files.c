@@ -36,9 +36,31 @@
 
 #include "benchmark-common.c"
 
+/* Writes a scratch file and reads it back a few times, printing the
+ * throughput of each pass. To measure gvfs-fuse, give it a directory
+ * below the fuse mount and a buffer size, e.g.
+ *
+ *   benchmark-gvfs-big-files $XDG_RUNTIME_DIR/gvfs/<mount>/<dir> 131072
+ *
+ * and compare the output for two builds of gvfsd-fuse against the same
+ * server. Each read pass opens the file again, so the passes after the
+ * first show whether the kernel kept the file in its page cache. */
+
 #define FILE_SIZE      (1024 * 1024 * 50)  /* 50 MiB */
 #define BUFFER_SIZE    4096
 #define ITERATIONS_NUM 1
+#define READ_PASSES    3
+
+static gsize buffer_size = BUFFER_SIZE;
+
+static void
+print_throughput (const gchar *pass, GTimer *timer)
+{
+  gdouble seconds = g_timer_elapsed (timer, NULL);
+
+  g_print ("%-10s %8.2f s %10.2f MiB/s\n", pass, seconds,
+           FILE_SIZE / (1024.0 * 1024.0) / MAX (seconds, 1e-6));
+}
 
 static gboolean
 is_dir (GFile *file)
@@ -61,7 +83,8 @@ create_file (GFile *base_dir)
   GOutputStream *output_stream;
   gint           pid;
   GError        *error = NULL;
-  gchar          buffer [BUFFER_SIZE];
+  gchar         *buffer;
+  GTimer        *timer;
   gint           i;
 
   pid = getpid ();
@@ -80,54 +103,82 @@ create_file (GFile *base_dir)
       return NULL;
     }
 
-  memset (buffer, 0xaa, BUFFER_SIZE);
+  buffer = g_malloc (buffer_size);
+  memset (buffer, 0xaa, buffer_size);
 
-  for (i = 0; i < FILE_SIZE; i += BUFFER_SIZE)
+  timer = g_timer_new ();
+
+  for (i = 0; i < FILE_SIZE; i += buffer_size)
     {
-      if (g_output_stream_write (output_stream, buffer, BUFFER_SIZE, NULL, &error) < BUFFER_SIZE)
+      gsize bytes_written;
+
+      if (!g_output_stream_write_all (output_stream, buffer, MIN (buffer_size, FILE_SIZE - i),
+                                      &bytes_written, NULL, &error))
         {
           g_printerr ("Failed to populate scratch file: %s\n", error->message);
           g_output_stream_close (output_stream, NULL, NULL);
           g_object_unref (output_stream);
           g_object_unref (scratch_file);
+          g_timer_destroy (timer);
+          g_free (buffer);
           return NULL;
         }
     }
 
   g_output_stream_close (output_stream, NULL, NULL);
   g_object_unref (output_stream);
+
+  print_throughput ("write", timer);
+  g_timer_destroy (timer);
+  g_free (buffer);
+
   return scratch_file;
 }
 
 static void
-read_file (GFile *scratch_file)
+read_file (GFile *scratch_file, const gchar *pass)
 {
   GInputStream *input_stream;
   GError       *error = NULL;
+  gchar        *buffer;
+  GTimer       *timer;
   gint          i;
 
+  timer = g_timer_new ();
+
   input_stream = (GInputStream *) g_file_read (scratch_file, NULL, &error);
   if (!input_stream)
     {
       g_printerr ("Failed to open scratch file: %s\n", error->message);
+      g_timer_destroy (timer);
       return;
     }
 
-  for (i = 0; i < FILE_SIZE; i += BUFFER_SIZE)
+  buffer = g_malloc (buffer_size);
+
+  for (i = 0; i < FILE_SIZE; i += buffer_size)
     {
-      gchar buffer [BUFFER_SIZE];
+      gsize to_read = MIN (buffer_size, FILE_SIZE - i);
       gsize bytes_read;
 
-      if (!g_input_stream_read_all (input_stream, buffer, BUFFER_SIZE, &bytes_read, NULL, &error) ||
-          bytes_read < BUFFER_SIZE)
+      if (!g_input_stream_read_all (input_stream, buffer, to_read, &bytes_read, NULL, &error) ||
+          bytes_read < to_read)
         {
-          g_printerr ("Failed to read back scratch file: %s\n", error->message);
-          g_input_stream_close (input_stream, NULL, NULL);
-          g_object_unref (input_stream);
+          g_printerr ("Failed to read back scratch file: %s\n",
+                      error ? error->message : "Short read");
+          g_clear_error (&error);
+          break;
         }
     }
 
+  g_input_stream_close (input_stream, NULL, NULL);
   g_object_unref (input_stream);
+
+  if (i >= FILE_SIZE)
+    print_throughput (pass, timer);
+
+  g_timer_destroy (timer);
+  g_free (buffer);
 }
 
 static void
@@ -150,7 +201,7 @@ benchmark_run (gint argc, gchar *argv [])
 {
   GFile *base_dir;
   GFile *scratch_file;
-  gint   i;
+  gint   i, j;
   
   setlocale (LC_ALL, "");
 
@@ -158,10 +209,13 @@ benchmark_run (gint argc, gchar *argv [])
   
   if (argc < 2)
     {
-      g_printerr ("Usage: %s <scratch URI>\n", argv [0]);
+      g_printerr ("Usage: %s <scratch URI> [buffer size]\n", argv [0]);
       return 1;
     }
 
+  if (argc > 2)
+    buffer_size = MAX (g_ascii_strtoull (argv [2], NULL, 10), 1);
+
   base_dir = g_file_new_for_commandline_arg (argv [1]);
 
   if (!is_dir (base_dir))
@@ -180,7 +234,14 @@ benchmark_run (gint argc, gchar *argv [])
           return 1;
         }
 
-      read_file (scratch_file);
+      for (j = 0; j < READ_PASSES; j++)
+        {
+          gchar *pass = g_strdup_printf ("read %d", j + 1);
+
+          read_file (scratch_file, pass);
+          g_free (pass);
+        }
+
       delete_file (scratch_file);
 
       g_object_unref (scratch_file);
@@ -0,0 +1,260 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-metadata-set"
+
+#include "benchmark-common.c"
+
+/* Sets metadata keys on a number of scratch files, first with one
+ * blocking call per key, like a file manager positioning icons one by
+ * one, and then with all the sets issued at once through
+ * g_file_set_attributes_async(), which the client batches into SetMany
+ * calls to the metadata daemon. Prints the sets per second of both.
+ *
+ * The scratch directory has to be a URI on a gvfs mount, such as
+ * sftp:// or smb://, since local files take a different path to the
+ * metadata daemon.
+ *
+ *   benchmark-gvfs-metadata-set <scratch URI> [number of files]
+ */
+
+#define NUM_FILES      1000
+#define NUM_KEYS       4
+
+static gint num_files = NUM_FILES;
+static gint outstanding;
+static gint failed;
+
+static gboolean
+is_dir (GFile *file)
+{
+  GFileInfo *info;
+  gboolean res;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, NULL);
+  res = info && g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+  if (info)
+    g_object_unref (info);
+  return res;
+}
+
+static GFile **
+create_files (GFile *base_dir)
+{
+  GFileOutputStream *output_stream;
+  GFile            **files;
+  gchar             *scratch_name;
+  GError            *error = NULL;
+  gint               pid;
+  gint               i;
+
+  pid = getpid ();
+  files = g_new0 (GFile *, num_files + 1);
+
+  for (i = 0; i < num_files; i++)
+    {
+      scratch_name = g_strdup_printf ("gvfs-benchmark-scratch-%d-%d", pid, i);
+      files [i] = g_file_resolve_relative_path (base_dir, scratch_name);
+      g_free (scratch_name);
+
+      output_stream = g_file_replace (files [i], NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
+      if (!output_stream)
+        {
+          g_printerr ("Failed to create scratch file: %s\n", error->message);
+          g_error_free (error);
+          g_object_unref (files [i]);
+          files [i] = NULL;
+          return files;
+        }
+
+      g_output_stream_close (G_OUTPUT_STREAM (output_stream), NULL, NULL);
+      g_object_unref (output_stream);
+    }
+
+  return files;
+}
+
+static void
+delete_files (GFile **files)
+{
+  gint i;
+
+  for (i = 0; files [i] != NULL; i++)
+    {
+      g_file_delete (files [i], NULL, NULL);
+      g_object_unref (files [i]);
+    }
+
+  g_free (files);
+}
+
+static gchar *
+key_name (gint key)
+{
+  return g_strdup_printf ("metadata::gvfs-benchmark-%d", key);
+}
+
+static void
+print_rate (const gchar *pass, GTimer *timer)
+{
+  gdouble seconds = g_timer_elapsed (timer, NULL);
+  gint    n_sets = num_files * NUM_KEYS;
+
+  g_print ("%-10s %d sets in %.3f s, %.0f sets/s%s\n",
+           pass, n_sets, seconds, n_sets / seconds,
+           failed ? " (some failed)" : "");
+}
+
+static void
+set_per_call (GFile **files)
+{
+  GTimer *timer;
+  GError *error = NULL;
+  gchar  *key, *value;
+  gint    i, j;
+
+  failed = 0;
+  timer = g_timer_new ();
+
+  for (i = 0; i < num_files; i++)
+    for (j = 0; j < NUM_KEYS; j++)
+      {
+        key = key_name (j);
+        value = g_strdup_printf ("%d,%d", i, j);
+        if (!g_file_set_attribute_string (files [i], key, value, 0, NULL, &error))
+          {
+            if (!failed)
+              g_printerr ("Failed to set metadata: %s\n", error->message);
+            g_clear_error (&error);
+            failed++;
+          }
+        g_free (key);
+        g_free (value);
+      }
+
+  print_rate ("per call", timer);
+  g_timer_destroy (timer);
+}
+
+static void
+set_attributes_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GFileInfo *info = NULL;
+
+  if (!g_file_set_attributes_finish (G_FILE (source), res, &info, NULL))
+    failed++;
+  if (info)
+    g_object_unref (info);
+
+  if (--outstanding == 0)
+    benchmark_quit_main_loop ();
+}
+
+static void
+set_batched (GFile **files)
+{
+  GFileInfo *info;
+  GTimer    *timer;
+  gchar     *key, *value;
+  gint       i, j;
+
+  failed = 0;
+  outstanding = num_files * NUM_KEYS;
+  timer = g_timer_new ();
+
+  for (i = 0; i < num_files; i++)
+    for (j = 0; j < NUM_KEYS; j++)
+      {
+        key = key_name (j);
+        value = g_strdup_printf ("%d,%d", j, i);
+
+        info = g_file_info_new ();
+        g_file_info_set_attribute_string (info, key, value);
+        g_file_set_attributes_async (files [i], info, 0, G_PRIORITY_DEFAULT,
+                                     NULL, set_attributes_cb, NULL);
+        g_object_unref (info);
+
+        g_free (key);
+        g_free (value);
+      }
+
+  benchmark_run_main_loop ();
+
+  print_rate ("batched", timer);
+  g_timer_destroy (timer);
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile  *base_dir;
+  GFile **files;
+
+  setlocale (LC_ALL, "");
+
+  g_type_init ();
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch URI> [number of files]\n", argv [0]);
+      return 1;
+    }
+
+  if (argc > 2)
+    num_files = MAX (g_ascii_strtoull (argv [2], NULL, 10), 1);
+
+  base_dir = g_file_new_for_commandline_arg (argv [1]);
+
+  if (g_file_is_native (base_dir))
+    {
+      g_printerr ("Scratch URI %s is a local path, use a URI on a gvfs mount\n", argv [1]);
+      g_object_unref (base_dir);
+      return 1;
+    }
+
+  if (!is_dir (base_dir))
+    {
+      g_printerr ("Scratch URI %s is not a directory\n", argv [1]);
+      g_object_unref (base_dir);
+      return 1;
+    }
+
+  files = create_files (base_dir);
+  if (files [num_files - 1] != NULL)
+    {
+      set_per_call (files);
+      set_batched (files);
+    }
+
+  delete_files (files);
+
+  g_object_unref (base_dir);
+  return 0;
+}